@@ -42,6 +42,12 @@
 #include <ctype.h>
 #include <algorithm>
 #include <iterator>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 namespace cv { namespace hsaml {
 
@@ -50,11 +56,532 @@ static const int VAR_MISSED = VAR_ORDERED;
 
 TrainData::~TrainData() {}
 
+/* A read-only view of a whole file: mapped into memory where mmap() is available,
+   read into a buffer otherwise. */
+class MappedFile
+{
+public:
+    MappedFile() : data(0), size(0), mapped(false) {}
+    ~MappedFile() { close(); }
+
+    bool open( const String& filename, bool readIfNotMapped=true )
+    {
+        close();
+#ifndef _WIN32
+        int fd = ::open( filename.c_str(), O_RDONLY );
+        if( fd < 0 )
+            return false;
+        struct stat st;
+        if( fstat(fd, &st) == 0 && st.st_size > 0 )
+        {
+            void* addr = mmap( 0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if( addr != MAP_FAILED )
+            {
+                data = (const char*)addr;
+                size = (size_t)st.st_size;
+                mapped = true;
+                madvise( addr, size, MADV_SEQUENTIAL );
+            }
+        }
+        ::close(fd);
+        if( mapped )
+            return true;
+#endif
+        if( !readIfNotMapped )
+            return false;
+        FILE* f = fopen( filename.c_str(), "rb" );
+        if( !f )
+            return false;
+        char tmp[1 << 16];
+        size_t n;
+        while( (n = fread(tmp, 1, sizeof(tmp), f)) > 0 )
+            buf.insert(buf.end(), tmp, tmp + n);
+        fclose(f);
+        data = buf.empty() ? 0 : &buf[0];
+        size = buf.size();
+        return true;
+    }
+
+    void close()
+    {
+#ifndef _WIN32
+        if( mapped )
+            munmap( (void*)data, size );
+#endif
+        std::vector<char>().swap(buf);
+        data = 0;
+        size = 0;
+        mapped = false;
+    }
+
+    bool isMapped() const { return mapped; }
+
+    //! tells the system that the pages of [ofs, ofs + len) will be needed soon, or not any more
+    void advise( size_t ofs, size_t len, bool willNeed ) const
+    {
+#ifndef _WIN32
+        if( !mapped || ofs >= size )
+            return;
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t a = ofs/page*page, b = std::min(ofs + len, size);
+        // only the pages entirely inside the range are released
+        if( !willNeed )
+            a = alignSize(ofs, (int)page), b = b/page*page;
+        if( a < b )
+            madvise( (void*)(data + a), b - a, willNeed ? MADV_WILLNEED : MADV_DONTNEED );
+#else
+        (void)ofs; (void)len; (void)willNeed;
+#endif
+    }
+
+    const char* data;
+    size_t size;
+
+protected:
+    bool mapped;
+    std::vector<char> buf;
+
+    MappedFile( const MappedFile& );
+    MappedFile& operator = ( const MappedFile& );
+};
+
+static const double pow10tab[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Parses a plain decimal number ([+-]digits[.digits][(e|E)[+-]digits]) starting at <p>.
+   The digits are accumulated into an integer mantissa and scaled once by a power of 10,
+   which is exact up to 1e22, so the loops have no calls and few branches. Returns the
+   position after the number, or 0 if the text is not such a number (names, inf, nan). */
+static const char* parseFloat( const char* p, const char* end, float& val )
+{
+    bool neg = false, any = false;
+    if( p < end && (*p == '-' || *p == '+') )
+        neg = *p++ == '-';
+
+    uint64 mant = 0;
+    int ndigits = 0, exp10 = 0;
+    for( ; p < end && (unsigned)(*p - '0') < 10u; p++ )
+    {
+        any = true;
+        if( ndigits < 19 )
+        {
+            mant = mant*10 + (*p - '0');
+            ndigits += mant != 0;
+        }
+        else
+            exp10++;
+    }
+    if( p < end && *p == '.' )
+    {
+        for( p++; p < end && (unsigned)(*p - '0') < 10u; p++ )
+        {
+            any = true;
+            if( ndigits < 19 )
+            {
+                mant = mant*10 + (*p - '0');
+                ndigits += mant != 0;
+                exp10--;
+            }
+        }
+    }
+    if( !any )
+        return 0;
+
+    if( p < end && (*p == 'e' || *p == 'E') )
+    {
+        bool eneg = false;
+        int e = 0;
+        p++;
+        if( p < end && (*p == '-' || *p == '+') )
+            eneg = *p++ == '-';
+        if( p >= end || (unsigned)(*p - '0') >= 10u )
+            return 0;
+        for( ; p < end && (unsigned)(*p - '0') < 10u; p++ )
+            e = std::min(e*10 + (*p - '0'), 1000);
+        exp10 += eneg ? -e : e;
+    }
+
+    double d = (double)mant;
+    if( exp10 != 0 && mant != 0 )
+    {
+        int ae = std::abs(exp10);
+        double scale = ae <= 22 ? pow10tab[ae] : std::pow(10., (double)ae);
+        d = exp10 < 0 ? d/scale : d*scale;
+    }
+    val = (float)(neg ? -d : d);
+    return p;
+}
+
+/* The values parsed from one line-aligned chunk of a CSV file. */
+struct CSVChunk
+{
+    CSVChunk() : begin(0), end(0), rows(0), ncols(0), stopped(false),
+                 missed(false), numeric(true), badRow(false) {}
+    const char* begin;
+    const char* end;
+    std::vector<float> values;
+    int rows;
+    int ncols;
+    //! an empty line was found, the rows after it are not read
+    bool stopped;
+    bool missed;
+    //! false if a value is not a number, the file is then read by the serial loader
+    bool numeric;
+    //! the rows do not all have the same number of values
+    bool badRow;
+};
+
+class CSVChunkParser : public ParallelLoopBody
+{
+public:
+    CSVChunkParser( std::vector<CSVChunk>& _chunks, char _delimiter, char _missch )
+        : chunks(&_chunks), delimiter(_delimiter), missch(_missch) {}
+
+    bool isDelim( char c ) const { return c == ' ' || c == delimiter; }
+
+    void operator()( const Range& range ) const
+    {
+        for( int ci = range.start; ci < range.end; ci++ )
+        {
+            CSVChunk& chunk = (*chunks)[ci];
+            const char* p = chunk.begin;
+            const char* end = chunk.end;
+
+            while( p < end && chunk.numeric && !chunk.badRow )
+            {
+                const char* eol = (const char*)memchr( p, '\n', end - p );
+                if( !eol )
+                    eol = end;
+                const char* q = p;
+                const char* lend = eol;
+                p = eol + 1;
+
+                // trim the line as the serial loader does
+                while( lend > q && isspace((uchar)lend[-1]) )
+                    lend--;
+                while( q < lend && isspace((uchar)*q) )
+                    q++;
+                if( q < lend && *q == '#' )
+                    continue;
+
+                int ncols = 0;
+                for(;;)
+                {
+                    while( q < lend && isDelim(*q) )
+                        q++;
+                    if( q >= lend )
+                        break;
+                    float val = 0.f;
+                    const char* next = parseFloat( q, lend, val );
+                    if( !next || (next < lend && !isDelim(*next)) )
+                    {
+                        // a lone <missch> is a missing value, anything else is categorical
+                        if( *q == missch && (q + 1 == lend || isDelim(q[1])) )
+                        {
+                            val = MISSED_VAL;
+                            chunk.missed = true;
+                            next = q + 1;
+                        }
+                        else
+                        {
+                            chunk.numeric = false;
+                            break;
+                        }
+                    }
+                    chunk.values.push_back(val);
+                    ncols++;
+                    q = next;
+                }
+                if( !chunk.numeric )
+                    break;
+
+                if( ncols == 0 )
+                {
+                    chunk.stopped = true;
+                    break;
+                }
+                if( chunk.rows == 0 )
+                    chunk.ncols = ncols;
+                else if( ncols != chunk.ncols )
+                    chunk.badRow = true;
+                chunk.rows++;
+            }
+        }
+    }
+
+protected:
+    std::vector<CSVChunk>* chunks;
+    char delimiter;
+    char missch;
+};
+
+/* Copies the parsed rows of the chunks into the samples and the responses, the responses
+   being the columns [ridx0, ridx1). */
+class CSVChunkMerger : public ParallelLoopBody
+{
+public:
+    CSVChunkMerger( const std::vector<CSVChunk>& _chunks, const std::vector<int>& _rowOfs,
+                    int _ridx0, int _ridx1, Mat& _samples, Mat& _responses )
+        : chunks(&_chunks), rowOfs(&_rowOfs), ridx0(_ridx0), ridx1(_ridx1),
+          samples(&_samples), responses(&_responses) {}
+
+    void operator()( const Range& range ) const
+    {
+        int nvars = samples->cols + responses->cols;
+        size_t nfirst = (ridx0 >= 0 ? ridx0 : nvars)*sizeof(float);
+        size_t nlast = (ridx0 >= 0 ? nvars - ridx1 : 0)*sizeof(float);
+        size_t nresp = responses->cols*sizeof(float);
+
+        for( int ci = range.start; ci < range.end; ci++ )
+        {
+            const CSVChunk& chunk = (*chunks)[ci];
+            int r0 = (*rowOfs)[ci], nrows = (*rowOfs)[ci+1] - r0;
+            for( int i = 0; i < nrows; i++ )
+            {
+                const float* src = &chunk.values[(size_t)i*nvars];
+                uchar* dst = samples->ptr(r0 + i);
+                memcpy( dst, src, nfirst );
+                if( ridx0 >= 0 )
+                {
+                    memcpy( dst + nfirst, src + ridx1, nlast );
+                    memcpy( responses->ptr(r0 + i), src + ridx0, nresp );
+                }
+            }
+        }
+    }
+
+protected:
+    const std::vector<CSVChunk>* chunks;
+    const std::vector<int>* rowOfs;
+    int ridx0, ridx1;
+    Mat* samples;
+    Mat* responses;
+};
+
+/* Header of the binary TrainData files (TrainData::saveBinary()). It is followed by the
+   nvars = ninputvars + noutputvars variable types (one byte each), padded to a multiple of
+   16 bytes, then by the values, variable by variable: ninputvars rows of nsamples floats
+   and then noutputvars rows of nsamples floats. The samples are thus stored in the
+   COL_SAMPLE layout and are used in place. */
+struct TrainDataFileHeader
+{
+    char magic[8];
+    int version;
+    int nsamples;
+    int ninputvars;
+    int noutputvars;
+    int haveMissing;
+    int reserved;
+};
+
+static const char trainDataMagic[8] = { 'H', 'S', 'A', 'M', 'L', 'T', 'D', '\0' };
+
+
+TrainData::SampleView::SampleView()
+{
+    data = 0;
+    sptr = vptr = 0;
+    sstep = vstep = 0;
+    nsamples = nvars = 0;
+    contiguous = false;
+}
+
+TrainData::SampleView::SampleView(const Mat& _samples, int layout, const Mat& _sidx, const Mat& _vidx)
+{
+    CV_Assert( _samples.type() == CV_32F && (layout == ROW_SAMPLE || layout == COL_SAMPLE) );
+    samples = _samples;
+    sidx = _sidx.isContinuous() ? _sidx : _sidx.clone();
+    vidx = _vidx.isContinuous() ? _vidx : _vidx.clone();
+
+    int nall = layout == ROW_SAMPLE ? samples.rows : samples.cols;
+    int nallvars = layout == ROW_SAMPLE ? samples.cols : samples.rows;
+    size_t step = samples.step/samples.elemSize();
+    sstep = layout == ROW_SAMPLE ? step : 1;
+    vstep = layout == ROW_SAMPLE ? 1 : step;
+    data = samples.ptr<float>();
+
+    nsamples = sidx.empty() ? nall : sidx.checkVector(1, CV_32S);
+    nvars = vidx.empty() ? nallvars : vidx.checkVector(1, CV_32S);
+    CV_Assert( nsamples >= 0 && nvars >= 0 );
+    sptr = sidx.empty() ? 0 : sidx.ptr<int>();
+    vptr = vidx.empty() ? 0 : vidx.ptr<int>();
+
+    // the indices are checked once here rather than at every access
+    double minVal = 0, maxVal = 0;
+    if( sptr && nsamples > 0 )
+    {
+        minMaxIdx(sidx, &minVal, &maxVal);
+        CV_Assert( 0 <= minVal && maxVal < nall );
+    }
+    if( vptr && nvars > 0 )
+    {
+        minMaxIdx(vidx, &minVal, &maxVal);
+        CV_Assert( 0 <= minVal && maxVal < nallvars );
+    }
+    contiguous = layout == ROW_SAMPLE && !vptr;
+}
+
+void TrainData::SampleView::getSample(int i, float* buf) const
+{
+    const float* src = data + (size_t)index(i)*sstep;
+    if( contiguous )
+        memcpy( buf, src, nvars*sizeof(buf[0]) );
+    else
+        for( int j = 0; j < nvars; j++ )
+            buf[j] = src[(size_t)(vptr ? vptr[j] : j)*vstep];
+}
+
+void TrainData::SampleView::copyTo(Mat& dst, int layout) const
+{
+    CV_Assert( layout == ROW_SAMPLE || layout == COL_SAMPLE );
+    if( layout == ROW_SAMPLE )
+    {
+        dst.create(nsamples, nvars, CV_32F);
+        for( int i = 0; i < nsamples; i++ )
+            getSample(i, dst.ptr<float>(i));
+        return;
+    }
+
+    dst.create(nvars, nsamples, CV_32F);
+    for( int j = 0; j < nvars; j++ )
+    {
+        const float* src = data + (size_t)(vptr ? vptr[j] : j)*vstep;
+        float* d = dst.ptr<float>(j);
+        for( int i = 0; i < nsamples; i++ )
+            d[i] = src[(size_t)index(i)*sstep];
+    }
+}
+
+SparseSamples::SparseSamples()
+{
+    cols = 0;
+}
+
+SparseSamples::SparseSamples(const Mat& _values, const Mat& _colIdx, const Mat& _rowPtr, int _cols)
+{
+    int nnz = _values.checkVector(1, CV_32F), nrows = _rowPtr.checkVector(1, CV_32S) - 1;
+    CV_Assert( nnz >= 0 && _colIdx.checkVector(1, CV_32S) == nnz && nrows >= 0 && _cols >= 0 );
+    values = _values.isContinuous() ? _values : _values.clone();
+    colIdx = _colIdx.isContinuous() ? _colIdx : _colIdx.clone();
+    rowPtr = _rowPtr.isContinuous() ? _rowPtr : _rowPtr.clone();
+    cols = _cols;
+
+    const int* cptr = colPtr();
+    const int* rptr = rowPtr.ptr<int>();
+    CV_Assert( rptr[0] == 0 && rptr[nrows] == nnz );
+    for( int i = 0; i < nrows; i++ )
+    {
+        CV_Assert( rptr[i] <= rptr[i+1] );
+        for( int k = rptr[i]; k < rptr[i+1]; k++ )
+            CV_Assert( 0 <= cptr[k] && cptr[k] < cols && (k == rptr[i] || cptr[k-1] < cptr[k]) );
+    }
+}
+
+SparseSamples::SparseSamples(const Mat& dense)
+{
+    CV_Assert( dense.type() == CV_32F );
+    int i, j, nrows = dense.rows, nnz = countNonZero(dense);
+    cols = dense.cols;
+    values.create(1, nnz, CV_32F);
+    colIdx.create(1, nnz, CV_32S);
+    rowPtr.create(1, nrows + 1, CV_32S);
+
+    float* vptr = values.ptr<float>();
+    int* cptr = colIdx.ptr<int>();
+    int* rptr = rowPtr.ptr<int>();
+    int k = 0;
+    for( i = 0; i < nrows; i++ )
+    {
+        const float* src = dense.ptr<float>(i);
+        rptr[i] = k;
+        for( j = 0; j < cols; j++ )
+            if( src[j] != 0 )
+            {
+                vptr[k] = src[j];
+                cptr[k++] = j;
+            }
+    }
+    rptr[nrows] = k;
+}
+
+float SparseSamples::at(int i, int j) const
+{
+    CV_Assert( 0 <= i && i < rows() && 0 <= j && j < cols );
+    const int* cptr = colPtr();
+    const int* pos = std::lower_bound(cptr + begin(i), cptr + end(i), j);
+    return pos < cptr + end(i) && *pos == j ? valuePtr()[pos - cptr] : 0.f;
+}
+
+SparseSamples SparseSamples::rowSubset(const Mat& idx) const
+{
+    int i, n = idx.checkVector(1, CV_32S), nrows = rows();
+    CV_Assert( n >= 0 );
+    Mat sidx = idx.isContinuous() ? idx : idx.clone();
+    const int* s = sidx.ptr<int>();
+
+    int nnz = 0;
+    for( i = 0; i < n; i++ )
+    {
+        CV_Assert( 0 <= s[i] && s[i] < nrows );
+        nnz += end(s[i]) - begin(s[i]);
+    }
+
+    SparseSamples dst;
+    dst.cols = cols;
+    dst.values.create(1, nnz, CV_32F);
+    dst.colIdx.create(1, nnz, CV_32S);
+    dst.rowPtr.create(1, n + 1, CV_32S);
+    int* rptr = dst.rowPtr.ptr<int>();
+    rptr[0] = 0;
+    for( i = 0; i < n; i++ )
+    {
+        int a = begin(s[i]), len = end(s[i]) - a;
+        memcpy( dst.values.ptr<float>() + rptr[i], valuePtr() + a, len*sizeof(float) );
+        memcpy( dst.colIdx.ptr<int>() + rptr[i], colPtr() + a, len*sizeof(int) );
+        rptr[i+1] = rptr[i] + len;
+    }
+    return dst;
+}
+
+void SparseSamples::toDense(Mat& dst) const
+{
+    int nrows = rows();
+    dst.create(nrows, cols, CV_32F);
+    dst = Scalar::all(0);
+    const float* vptr = valuePtr();
+    const int* cptr = colPtr();
+    for( int i = 0; i < nrows; i++ )
+    {
+        float* d = dst.ptr<float>(i);
+        for( int k = begin(i); k < end(i); k++ )
+            d[cptr[k]] = vptr[k];
+    }
+}
+
+template<typename _Tp> static void
+gatherRows( const Mat& vec, const int* idx, int n, int dims, Mat& subvec )
+{
+    if( dims == 1 )
+    {
+        const _Tp* src = vec.ptr<_Tp>();
+        size_t step = vec.isContinuous() || vec.rows == 1 ? 1 : vec.step/sizeof(_Tp);
+        _Tp* dst = subvec.ptr<_Tp>();
+        for( int i = 0; i < n; i++ )
+            dst[i] = src[idx[i]*step];
+    }
+    else
+        for( int i = 0; i < n; i++ )
+            memcpy( subvec.ptr(i), vec.ptr(idx[i]), dims*sizeof(_Tp) );
+}
+
 Mat TrainData::getSubVector(const Mat& vec, const Mat& idx)
 {
     if( idx.empty() )
         return vec;
-    int i, j, n = idx.checkVector(1, CV_32S);
+    int n = idx.checkVector(1, CV_32S);
     int type = vec.type();
     CV_Assert( type == CV_32S || type == CV_32F || type == CV_64F );
     int dims = 1, m;
@@ -76,39 +603,21 @@ Mat TrainData::getSubVector(const Mat& vec, const Mat& idx)
         subvec.create(dims, n, type);
     else
         subvec.create(n, dims, type);
+    if( n == 0 )
+        return subvec;
+
+    double minVal = 0, maxVal = 0;
+    Mat cidx = idx.isContinuous() ? idx : idx.clone();
+    minMaxIdx(cidx, &minVal, &maxVal);
+    CV_Assert( 0 <= minVal && maxVal < m );
+    const int* iptr = cidx.ptr<int>();
+
     if( type == CV_32S )
-        for( i = 0; i < n; i++ )
-        {
-            int k = idx.at<int>(i);
-            CV_Assert( 0 <= k && k < m );
-            if( dims == 1 )
-                subvec.at<int>(i) = vec.at<int>(k);
-            else
-                for( j = 0; j < dims; j++ )
-                    subvec.at<int>(i, j) = vec.at<int>(k, j);
-        }
+        gatherRows<int>(vec, iptr, n, dims, subvec);
     else if( type == CV_32F )
-        for( i = 0; i < n; i++ )
-        {
-            int k = idx.at<int>(i);
-            CV_Assert( 0 <= k && k < m );
-            if( dims == 1 )
-                subvec.at<float>(i) = vec.at<float>(k);
-            else
-                for( j = 0; j < dims; j++ )
-                    subvec.at<float>(i, j) = vec.at<float>(k, j);
-        }
+        gatherRows<float>(vec, iptr, n, dims, subvec);
     else
-        for( i = 0; i < n; i++ )
-        {
-            int k = idx.at<int>(i);
-            CV_Assert( 0 <= k && k < m );
-            if( dims == 1 )
-                subvec.at<double>(i) = vec.at<double>(k);
-            else
-                for( j = 0; j < dims; j++ )
-                    subvec.at<double>(i, j) = vec.at<double>(k, j);
-        }
+        gatherRows<double>(vec, iptr, n, dims, subvec);
     return subvec;
 }
 
@@ -129,6 +638,7 @@ public:
     int getNSamples() const
     {
         return !sampleIdx.empty() ? (int)sampleIdx.total() :
+               !sparse.empty() ? sparse.rows() :
                layout == ROW_SAMPLE ? samples.rows : samples.cols;
     }
     int getNTrainSamples() const
@@ -145,10 +655,57 @@ public:
     }
     int getNAllVars() const
     {
-        return layout == ROW_SAMPLE ? samples.cols : samples.rows;
+        return !sparse.empty() ? sparse.cols : layout == ROW_SAMPLE ? samples.cols : samples.rows;
     }
 
-    Mat getSamples() const { return samples; }
+    Mat getSamples() const
+    {
+        if( sparse.empty() )
+            return samples;
+        AutoLock lock(denseMutex);
+        if( denseSamples.empty() )
+            sparse.toDense(denseSamples);
+        return denseSamples;
+    }
+
+    // the values of the variable <vi> of the stored samples s[0], ..., s[n-1] (0, ..., n-1 if
+    // <s> is 0) of the sparse data: from the dense copy if there is one, else found in the CSR rows
+    void getSparseValues( int vi, const int* s, int n, float* values ) const
+    {
+        Mat dense;
+        {
+            AutoLock lock(denseMutex);
+            dense = denseSamples;
+        }
+        int i;
+        if( !dense.empty() )
+        {
+            const float* src = dense.ptr<float>() + vi;
+            size_t step = dense.step/sizeof(float);
+            for( i = 0; i < n; i++ )
+                values[i] = src[(s ? s[i] : i)*step];
+            return;
+        }
+
+        const int* rptr = sparse.rowPtr.ptr<int>();
+        const int* cptr = sparse.colPtr();
+        const float* vptr = sparse.valuePtr();
+        for( i = 0; i < n; i++ )
+        {
+            int r = s ? s[i] : i;
+            const int* a = cptr + rptr[r];
+            const int* b = cptr + rptr[r+1];
+            const int* pos = std::lower_bound(a, b, vi);
+            values[i] = pos < b && *pos == vi ? vptr[pos - cptr] : 0.f;
+        }
+    }
+    bool isSparse() const { return !sparse.empty(); }
+    SparseSamples getSparseSamples() const { return sparse; }
+    SparseSamples getTrainSparseSamples() const
+    {
+        Mat idx = getTrainSampleIdx();
+        return idx.empty() || sparse.empty() ? sparse : sparse.rowSubset(idx);
+    }
     Mat getResponses() const { return responses; }
     Mat getMissing() const { return missing; }
     Mat getVarIdx() const { return varIdx; }
@@ -210,7 +767,14 @@ public:
     void clear()
     {
         closeFile();
+        mapping.release();
+        presortedValues.release();
+        presortedIdx.release();
+        binnedValues.release();
+        binThresholds.release();
         samples.release();
+        sparse = SparseSamples();
+        denseSamples.release();
         missing.release();
         varType.release();
         responses.release();
@@ -230,11 +794,14 @@ public:
 
     void setData(InputArray _samples, int _layout, InputArray _responses,
                  InputArray _varIdx, InputArray _sampleIdx, InputArray _sampleWeights,
-                 InputArray _varType, InputArray _missing)
+                 InputArray _varType, InputArray _missing, const SparseSamples* _sparse=0)
     {
         clear();
 
         CV_Assert(_layout == ROW_SAMPLE || _layout == COL_SAMPLE );
+        CV_Assert( !_sparse || (_samples.empty() && _layout == ROW_SAMPLE && _missing.empty()) );
+        if( _sparse )
+            sparse = *_sparse;
         samples = _samples.getMat();
         layout = _layout;
         responses = _responses.getMat();
@@ -244,11 +811,11 @@ public:
         varType = _varType.getMat();
         missing = _missing.getMat();
 
-        int nsamples = layout == ROW_SAMPLE ? samples.rows : samples.cols;
-        int ninputvars = layout == ROW_SAMPLE ? samples.cols : samples.rows;
+        int nsamples = _sparse ? sparse.rows() : layout == ROW_SAMPLE ? samples.rows : samples.cols;
+        int ninputvars = _sparse ? sparse.cols : layout == ROW_SAMPLE ? samples.cols : samples.rows;
         int i, noutputvars = 0;
 
-        CV_Assert( samples.type() == CV_32F || samples.type() == CV_32S );
+        CV_Assert( _sparse || samples.type() == CV_32F || samples.type() == CV_32S );
 
         if( !sampleIdx.empty() )
         {
@@ -340,10 +907,11 @@ public:
         // maps for different variables if they are identical
         for( i = 0; i < ninputvars; i++ )
         {
-            Mat values_i = layout == ROW_SAMPLE ? samples.col(i) : samples.row(i);
-
             if( varType.at<uchar>(i) == VAR_CATEGORICAL )
             {
+                if( _sparse )
+                    CV_Error( CV_StsBadArg, "The sparse input variables must be ordered" );
+                Mat values_i = layout == ROW_SAMPLE ? samples.col(i) : samples.row(i);
                 preprocessCategorical(values_i, 0, labels, 0, sortbuf);
                 missingSubst.at<float>(i) = -1.f;
                 int j, m = (int)labels.size();
@@ -495,10 +1063,211 @@ public:
             counters->at(clslabel) = i - previdx;
     }
 
+    /*
+     Reads a numeric CSV file in parallel: the file is mapped into memory, split into
+     line-aligned chunks that are parsed concurrently, and the rows of the chunks are then
+     copied into the samples and the responses. Returns 1 on success, 0 if there is no data,
+     and -1 if the file has categorical (non-numeric) values, which the serial loader
+     handles since it numbers the category names in the file order.
+    */
+    int loadCSVParallel(const String& filename, int headerLines,
+                        int responseStartIdx, int responseEndIdx,
+                        const String& varTypeSpec, char delimiter, char missch)
+    {
+        MappedFile mf;
+        if( !mf.open(filename) )
+            return 0;
+
+        const char* ptr = mf.data;
+        const char* end = mf.data + mf.size;
+        int i, lineno;
+
+        // skip header lines
+        for( lineno = 0; lineno < headerLines && ptr < end; lineno++ )
+        {
+            const char* eol = (const char*)memchr( ptr, '\n', end - ptr );
+            ptr = eol ? eol + 1 : end;
+        }
+
+        const size_t minChunkSize = 1 << 20;
+        int nchunks = (int)std::min((size_t)std::max(getNumThreads(), 1)*4,
+                                    (size_t)(end - ptr)/minChunkSize + 1);
+        std::vector<CSVChunk> chunks(nchunks);
+        for( i = 0; i < nchunks; i++ )
+        {
+            const char* b = i == 0 ? ptr : chunks[i-1].end;
+            const char* e = i == nchunks-1 ? end : ptr + (end - ptr)*(i+1)/nchunks;
+            if( e < b )
+                e = b;
+            if( e < end )
+            {
+                const char* eol = (const char*)memchr( e, '\n', end - e );
+                e = eol ? eol + 1 : end;
+            }
+            chunks[i].begin = b;
+            chunks[i].end = e;
+        }
+
+        parallel_for_(Range(0, nchunks), CSVChunkParser(chunks, delimiter, missch));
+
+        // the rows are read up to the first empty line, as in the serial loader
+        int nvars = 0, nsamples = 0;
+        bool haveMissed = false;
+        std::vector<int> rowOfs(1, 0);
+        for( i = 0; i < nchunks; i++ )
+        {
+            const CSVChunk& chunk = chunks[i];
+            if( !chunk.numeric )
+                return -1;
+            if( chunk.rows > 0 )
+            {
+                if( nvars == 0 )
+                    nvars = chunk.ncols;
+                if( chunk.badRow || chunk.ncols != nvars )
+                    CV_Error(CV_StsBadArg, "invalid CSV format; the rows have different numbers of values");
+            }
+            haveMissed |= chunk.missed;
+            nsamples += chunk.rows;
+            rowOfs.push_back(nsamples);
+            if( chunk.stopped )
+                break;
+        }
+        nchunks = (int)rowOfs.size() - 1;
+
+        if( nsamples == 0 )
+            return 0;
+
+        std::vector<uchar> vtypes;
+        bool varTypesSet = false;
+        if( !varTypeSpec.empty() )
+        {
+            setVarTypes(varTypeSpec, nvars, vtypes);
+            varTypesSet = true;
+        }
+        else
+            vtypes.assign(nvars, (uchar)VAR_ORDERED);
+
+        int ridx0 = responseStartIdx, ridx1 = responseEndIdx;
+        ridx0 = ridx0 >= 0 ? ridx0 : ridx0 == -1 ? nvars - 1 : -1;
+        ridx1 = ridx1 >= 0 ? ridx1 : ridx0 >= 0 ? ridx0+1 : -1;
+        CV_Assert(ridx1 > ridx0);
+        int noutputvars = ridx0 >= 0 ? ridx1 - ridx0 : 0;
+
+        Mat tempSamples(nsamples, nvars - noutputvars, CV_32F), tempResponses;
+        if( noutputvars > 0 )
+            tempResponses.create(nsamples, noutputvars, CV_32F);
+        parallel_for_(Range(0, nchunks), CSVChunkMerger(chunks, rowOfs, ridx0, ridx1,
+                                                        tempSamples, tempResponses));
+        mf.close();
+
+        MapType tempNameMap;
+        return setCSVData(tempSamples, tempResponses, vtypes, varTypesSet, haveMissed,
+                          nvars, ridx0, ridx1, tempNameMap) ? 1 : 0;
+    }
+
+    /*
+     Opens a file written by saveBinary(). The file is mapped into memory and the samples
+     and the responses point into the mapping (COL_SAMPLE layout), so nothing is parsed or
+     copied; the mapping lives as long as this TrainData.
+    */
+    bool loadBinary(const String& filename)
+    {
+        clear();
+
+        Ptr<MappedFile> mf = makePtr<MappedFile>();
+        if( !mf->open(filename) || mf->size < sizeof(TrainDataFileHeader) )
+            return false;
+
+        TrainDataFileHeader hdr;
+        memcpy( &hdr, mf->data, sizeof(hdr) );
+        if( memcmp(hdr.magic, trainDataMagic, sizeof(hdr.magic)) != 0 || hdr.version != 1 )
+            CV_Error(CV_StsBadArg, "not a binary TrainData file");
+
+        int nsamples = hdr.nsamples, ninputvars = hdr.ninputvars, noutputvars = hdr.noutputvars;
+        int nvars = ninputvars + noutputvars;
+        size_t typesOfs = sizeof(hdr);
+        size_t dataOfs = alignSize(typesOfs + nvars, 16);
+        if( nsamples <= 0 || ninputvars <= 0 || noutputvars < 0 ||
+            mf->size < dataOfs + (size_t)nvars*nsamples*sizeof(float) )
+            CV_Error(CV_StsBadArg, "the binary TrainData file is truncated or corrupted");
+
+        float* values = (float*)(mf->data + dataOfs);
+        Mat tempSamples(ninputvars, nsamples, CV_32F, values);
+        Mat tempResponses;
+        if( noutputvars > 0 )
+            tempResponses = Mat(noutputvars, nsamples, CV_32F, values + (size_t)ninputvars*nsamples);
+        Mat vtypes(1, nvars, CV_8U, (void*)(mf->data + typesOfs));
+        Mat tempMissing;
+        if( hdr.haveMissing )
+            compare(tempSamples, MISSED_VAL, tempMissing, CMP_EQ);
+
+        setData(tempSamples, COL_SAMPLE, tempResponses, noArray(), noArray(),
+                noArray(), vtypes.clone(), tempMissing);
+        if( samples.empty() )
+            return false;
+        mapping = mf;
+        return true;
+    }
+
+    bool saveBinary(const String& filename) const
+    {
+        if( !sparse.empty() )
+            CV_Error( CV_StsNotImplemented, "The binary format stores dense samples only" );
+        int nsamples = layout == ROW_SAMPLE ? samples.rows : samples.cols;
+        int ninputvars = getNAllVars();
+        int noutputvars = responses.empty() ? 0 : (int)responses.total()/nsamples;
+        int i, nvars = ninputvars + noutputvars;
+        CV_Assert( nsamples > 0 && varType.total() == (size_t)nvars );
+
+        FILE* f = fopen( filename.c_str(), "wb" );
+        if( !f )
+            return false;
+
+        TrainDataFileHeader hdr;
+        memset( &hdr, 0, sizeof(hdr) );
+        memcpy( hdr.magic, trainDataMagic, sizeof(hdr.magic) );
+        hdr.version = 1;
+        hdr.nsamples = nsamples;
+        hdr.ninputvars = ninputvars;
+        hdr.noutputvars = noutputvars;
+        hdr.haveMissing = !missing.empty() && countNonZero(missing) > 0;
+
+        std::vector<char> types(alignSize(sizeof(hdr) + nvars, 16) - sizeof(hdr), 0);
+        memcpy( &types[0], varType.ptr(), nvars );
+
+        bool ok = fwrite( &hdr, sizeof(hdr), 1, f ) == 1 &&
+                  fwrite( &types[0], 1, types.size(), f ) == types.size();
+
+        // variable by variable, as floats
+        Mat col;
+        Mat s = layout == ROW_SAMPLE ? samples.t() : samples;
+        for( i = 0; ok && i < ninputvars; i++ )
+        {
+            s.row(i).convertTo(col, CV_32F);
+            ok = fwrite( col.ptr(), sizeof(float), nsamples, f ) == (size_t)nsamples;
+        }
+        // the responses are kept with one row per sample (see setData())
+        Mat r = responses.reshape(1, nsamples).t();
+        for( i = 0; ok && i < noutputvars; i++ )
+        {
+            r.row(i).convertTo(col, CV_32F);
+            ok = fwrite( col.ptr(), sizeof(float), nsamples, f ) == (size_t)nsamples;
+        }
+
+        fclose(f);
+        return ok;
+    }
+
     bool loadCSV(const String& filename, int headerLines,
                  int responseStartIdx, int responseEndIdx,
                  const String& varTypeSpec, char delimiter, char missch)
     {
+        clear();
+        int result = loadCSVParallel(filename, headerLines, responseStartIdx, responseEndIdx,
+                                     varTypeSpec, delimiter, missch);
+        if( result >= 0 )
+            return result > 0;
+
         const int M = 1000000;
         const char delimiters[3] = { ' ', delimiter, '\0' };
         int nvars = 0;
@@ -521,7 +1290,7 @@ public:
         int i, ridx0 = responseStartIdx, ridx1 = responseEndIdx;
         int ninputvars = 0, noutputvars = 0;
 
-        Mat tempSamples, tempMissing, tempResponses;
+        Mat tempSamples, tempResponses;
         MapType tempNameMap;
         int catCounter = 1;
 
@@ -569,7 +1338,7 @@ public:
                 if( rowvals.empty() )
                     CV_Error(CV_StsBadArg, "invalid CSV format; no data found");
                 nvars = (int)rowvals.size();
-                if( !varTypeSpec.empty() && varTypeSpec.size() > 0 )
+                if( !varTypeSpec.empty() )
                 {
                     setVarTypes(varTypeSpec, nvars, vtypes);
                     varTypesSet = true;
@@ -607,7 +1376,23 @@ public:
 
         closeFile();
 
-        int nsamples = tempSamples.rows;
+        if( noutputvars > 0 && !allresponses.empty() )
+            Mat((int)allresponses.size()/noutputvars, noutputvars, CV_32F, &allresponses[0]).copyTo(tempResponses);
+        return setCSVData(tempSamples, tempResponses, vtypes, varTypesSet, haveMissed,
+                          nvars, ridx0, ridx1, tempNameMap);
+    }
+
+    // the part of loadCSV() that follows the parsing; <tempSamples> has the input variables
+    // and <tempResponses> the output ones, <vtypes> the types of the columns in the file order
+    bool setCSVData( Mat& tempSamples, Mat& tempResponses, std::vector<uchar>& vtypes,
+                     bool varTypesSet, bool haveMissed, int nvars, int ridx0, int ridx1,
+                     MapType& tempNameMap )
+    {
+        int i, nsamples = tempSamples.rows;
+        int noutputvars = ridx0 >= 0 ? ridx1 - ridx0 : 0;
+        int ninputvars = nvars - noutputvars;
+        Mat tempMissing;
+
         if( nsamples == 0 )
             return false;
 
@@ -629,14 +1414,14 @@ public:
 
         if( !varTypesSet && noutputvars == 1 && vtypes[ninputvars] == VAR_ORDERED )
         {
+            const float* r = tempResponses.ptr<float>();
             for( i = 0; i < nsamples; i++ )
-                if( allresponses[i] != cvRound(allresponses[i]) )
+                if( r[i] != cvRound(r[i]) )
                     break;
             if( i == nsamples )
                 vtypes[ninputvars] = VAR_CATEGORICAL;
         }
 
-        Mat(nsamples, noutputvars, CV_32F, &allresponses[0]).copyTo(tempResponses);
         setData(tempSamples, ROW_SAMPLE, tempResponses, noArray(), noArray(),
                 noArray(), Mat(vtypes).clone(), tempMissing);
         bool ok = !samples.empty();
@@ -820,6 +1605,17 @@ public:
                         bool compressSamples,
                         bool compressVars) const
     {
+        if( !sparse.empty() )
+        {
+            // a view of the dense copy, which is only copied again for a subset or another layout
+            Mat sidx = compressSamples ? getTrainSampleIdx() : Mat(), dsamples;
+            Mat vidx = compressVars ? getVarIdx() : Mat();
+            if( sidx.empty() && vidx.empty() && _layout == ROW_SAMPLE )
+                return getSamples();
+            SampleView(getSamples(), ROW_SAMPLE, sidx, vidx).copyTo(dsamples, _layout);
+            return dsamples;
+        }
+
         if( samples.empty() )
             return samples;
 
@@ -828,34 +1624,195 @@ public:
             layout == _layout )
             return samples;
 
-        int drows = getNTrainSamples(), dcols = getNVars();
-        Mat sidx = getTrainSampleIdx(), vidx = getVarIdx();
-        const float* src0 = samples.ptr<float>();
-        const int* sptr = !sidx.empty() ? sidx.ptr<int>() : 0;
-        const int* vptr = !vidx.empty() ? vidx.ptr<int>() : 0;
-        size_t sstep0 = samples.step/samples.elemSize();
-        size_t sstep = layout == ROW_SAMPLE ? sstep0 : 1;
-        size_t vstep = layout == ROW_SAMPLE ? 1 : sstep0;
+        Mat dsamples;
+        SampleView view(samples, layout, compressSamples ? getTrainSampleIdx() : Mat(),
+                        compressVars ? getVarIdx() : Mat());
+        view.copyTo(dsamples, _layout);
+        return dsamples;
+    }
 
-        if( _layout == COL_SAMPLE )
+    void presort()
+    {
+        int nvars = getNAllVars();
+        int nallsamples = !sparse.empty() ? sparse.rows() : layout == ROW_SAMPLE ? samples.rows : samples.cols;
+        CV_Assert( nvars > 0 && nallsamples > 0 );
+        presortedValues.create(nvars, nallsamples, CV_32F);
+        presortedIdx.create(nvars, nallsamples, CV_32S);
+        if( !sparse.empty() )
         {
-            std::swap(drows, dcols);
-            std::swap(sptr, vptr);
-            std::swap(sstep, vstep);
+            // the sparse samples are transposed in one pass over the non-zero elements
+            presortedValues = Scalar::all(0);
+            const float* vptr = sparse.valuePtr();
+            const int* cptr = sparse.colPtr();
+            for( int i = 0; i < nallsamples; i++ )
+                for( int k = sparse.begin(i); k < sparse.end(i); k++ )
+                    presortedValues.at<float>(cptr[k], i) = vptr[k];
         }
+        parallel_for_(Range(0, nvars), PresortInvoker(this));
+    }
 
-        Mat dsamples(drows, dcols, CV_32F);
+    Mat getPresortedValues() const { return presortedValues; }
+    Mat getPresortedIdx() const { return presortedIdx; }
 
-        for( int i = 0; i < drows; i++ )
+    void quantize(int maxBins)
+    {
+        calcBins(maxBins, binnedValues, binThresholds);
+    }
+
+    void calcBins(int maxBins, OutputArray _binnedValues, OutputArray _binThresholds) const
+    {
+        if( maxBins < 2 || maxBins > 256 )
+            CV_Error( CV_StsOutOfRange, "maxBins should be between 2 and 256" );
+        int nvars = getNAllVars();
+        int nallsamples = !sparse.empty() ? sparse.rows() : layout == ROW_SAMPLE ? samples.rows : samples.cols;
+        CV_Assert( nvars > 0 && nallsamples > 0 );
+        _binnedValues.create(nvars, nallsamples, CV_8U);
+        _binThresholds.create(nvars, maxBins - 1, CV_32F);
+        Mat bins = _binnedValues.getMat(), thresholds = _binThresholds.getMat();
+        bins = Scalar::all(0);
+        thresholds = Scalar::all(FLT_MAX);
+        parallel_for_(Range(0, nvars), QuantizeInvoker(this, maxBins, bins, thresholds));
+    }
+
+    Mat getBinnedValues() const { return binnedValues; }
+    Mat getBinThresholds() const { return binThresholds; }
+
+    // the values of the variable <vi> for all the stored samples, with the missing ones substituted
+    void getStoredValues( int vi, float* values ) const
+    {
+        int i, n = !sparse.empty() ? sparse.rows() : layout == ROW_SAMPLE ? samples.rows : samples.cols;
+        float subst = missingSubst.at<float>(vi);
+        if( !sparse.empty() )
+        {
+            getSparseValues(vi, 0, n, values);
+            return;
+        }
+        size_t step = samples.step/samples.elemSize();
+        size_t sstep = layout == ROW_SAMPLE ? step : 1;
+        size_t vstep = layout == ROW_SAMPLE ? 1 : step;
+        const float* src = samples.ptr<float>() + vi*vstep;
+        for( i = 0; i < n; i++ )
+        {
+            float val = src[i*sstep];
+            values[i] = val == MISSED_VAL ? subst : val;
+        }
+    }
+
+    /*
+     Bins of about n/maxBins samples each, cut between distinct values only, so that every
+     value falls into one bin; with at most maxBins distinct values each one gets its own
+     bin. The presorted order is reused if there is one.
+    */
+    class QuantizeInvoker : public ParallelLoopBody
+    {
+    public:
+        QuantizeInvoker( const TrainDataImpl* _data, int _maxBins, Mat& _bins, Mat& _thresholds )
+            : data(_data), maxBins(_maxBins), binnedValues(&_bins), binThresholds(&_thresholds) {}
+
+        void operator()( const Range& range ) const
+        {
+            int i, n = binnedValues->cols;
+            bool presorted = !data->presortedIdx.empty();
+            AutoBuffer<float> vbuf(presorted ? 0 : n);
+            AutoBuffer<int> ibuf(presorted ? 0 : n);
+
+            for( int vi = range.start; vi < range.end; vi++ )
+            {
+                if( data->varType.at<uchar>(vi) == VAR_CATEGORICAL )
+                    continue;
+
+                const float* values = vbuf;
+                const int* order = ibuf;
+                if( presorted )
+                {
+                    values = data->presortedValues.ptr<float>(vi);
+                    order = data->presortedIdx.ptr<int>(vi);
+                }
+                else
+                {
+                    data->getStoredValues(vi, vbuf);
+                    for( i = 0; i < n; i++ )
+                        ibuf[i] = i;
+                    std::sort((int*)ibuf, (int*)ibuf + n, cmp_lt_idx<float>(vbuf));
+                }
+
+                int ndistinct = 1;
+                for( i = 0; i < n - 1; i++ )
+                    ndistinct += values[order[i]] < values[order[i+1]];
+
+                uchar* bins = binnedValues->ptr<uchar>(vi);
+                float* thresholds = binThresholds->ptr<float>(vi);
+                int b = 0, start = 0;
+                for( i = 0; i < n; i++ )
+                {
+                    bins[order[i]] = (uchar)b;
+                    if( i == n - 1 || b == maxBins - 1 )
+                        continue;
+                    float v0 = values[order[i]], v1 = values[order[i+1]];
+                    if( v0 < v1 && (ndistinct <= maxBins ||
+                        (double)(i + 1 - start)*(maxBins - b) >= n - start) )
+                    {
+                        float c = (v0 + v1)*0.5f;
+                        // v <= c goes to the left, as in the splits
+                        thresholds[b++] = c < v1 ? c : v0;
+                        start = i + 1;
+                    }
+                }
+            }
+        }
+
+        const TrainDataImpl* data;
+        int maxBins;
+        Mat* binnedValues;
+        Mat* binThresholds;
+    };
+
+    class PresortInvoker : public ParallelLoopBody
+    {
+    public:
+        PresortInvoker( TrainDataImpl* _data ) : data(_data) {}
+
+        void operator()( const Range& range ) const
         {
-            const float* src = src0 + (sptr ? sptr[i] : i)*sstep;
-            float* dst = dsamples.ptr<float>(i);
+            const Mat& samples = data->samples;
+            int n = data->presortedValues.cols;
+            size_t step = samples.step/samples.elemSize();
+            size_t sstep = data->layout == ROW_SAMPLE ? step : 1;
+            size_t vstep = data->layout == ROW_SAMPLE ? 1 : step;
 
-            for( int j = 0; j < dcols; j++ )
-                dst[j] = src[(vptr ? vptr[j] : j)*vstep];
+            for( int vi = range.start; vi < range.end; vi++ )
+            {
+                float* values = data->presortedValues.ptr<float>(vi);
+                int* sidx = data->presortedIdx.ptr<int>(vi);
+                float subst = data->missingSubst.at<float>(vi);
+                // the values of the sparse samples have been filled by presort()
+                const float* src = data->sparse.empty() ? samples.ptr<float>() + vi*vstep : values;
+                size_t srcstep = data->sparse.empty() ? sstep : 1;
+                for( int i = 0; i < n; i++ )
+                {
+                    float val = src[i*srcstep];
+                    values[i] = val == MISSED_VAL ? subst : val;
+                    sidx[i] = i;
+                }
+                // the categorical variables are not split on sorted values
+                if( data->varType.at<uchar>(vi) != VAR_CATEGORICAL )
+                    std::sort(sidx, sidx + n, cmp_lt_idx<float>(values));
+            }
         }
 
-        return dsamples;
+        TrainDataImpl* data;
+    };
+
+    SampleView getTrainSampleView() const
+    {
+        // the view of sparse samples refers to their cached dense copy
+        return SampleView(getSamples(), layout, getTrainSampleIdx(), getVarIdx());
+    }
+
+    SampleView getSampleView(InputArray _sidx) const
+    {
+        Mat sidx = _sidx.getMat();
+        return SampleView(getSamples(), layout, sidx.empty() ? sampleIdx : sidx, getVarIdx());
     }
 
     void getValues( int vi, InputArray _sidx, float* values ) const
@@ -864,28 +1821,50 @@ public:
         int i, n = sidx.checkVector(1, CV_32S), nsamples = getNSamples();
         CV_Assert( 0 <= vi && vi < getNAllVars() );
         CV_Assert( n >= 0 );
+        if( n > 0 && !sidx.isContinuous() )
+            sidx = sidx.clone();
         const int* s = n > 0 ? sidx.ptr<int>() : 0;
         if( n == 0 )
             n = nsamples;
+        else
+        {
+            // check the indices once instead of at every element
+            int smin = INT_MAX, smax = INT_MIN;
+            for( i = 0; i < n; i++ )
+            {
+                smin = std::min(smin, s[i]);
+                smax = std::max(smax, s[i]);
+            }
+            CV_Assert( 0 <= smin && smax < nsamples );
+        }
+
+        if( !sparse.empty() )
+        {
+            // the sparse samples have no missing values
+            getSparseValues(vi, s, n, values);
+            return;
+        }
 
         size_t step = samples.step/samples.elemSize();
         size_t sstep = layout == ROW_SAMPLE ? step : 1;
         size_t vstep = layout == ROW_SAMPLE ? 1 : step;
 
         const float* src = samples.ptr<float>() + vi*vstep;
+        if( !s && sstep == 1 )
+            memcpy( values, src, n*sizeof(values[0]) );
+        else if( !s )
+            for( i = 0; i < n; i++ )
+                values[i] = src[i*sstep];
+        else if( sstep == 1 )
+            for( i = 0; i < n; i++ )
+                values[i] = src[s[i]];
+        else
+            for( i = 0; i < n; i++ )
+                values[i] = src[s[i]*sstep];
+
         float subst = missingSubst.at<float>(vi);
         for( i = 0; i < n; i++ )
-        {
-            int j = i;
-            if( s )
-            {
-                j = s[i];
-                CV_Assert( 0 <= j && j < nsamples );
-            }
-            values[i] = src[j*sstep];
-            if( values[i] == MISSED_VAL )
-                values[i] = subst;
-        }
+            values[i] = values[i] == MISSED_VAL ? subst : values[i];
     }
 
     void getNormCatValues( int vi, InputArray _sidx, int* values ) const
@@ -944,6 +1923,27 @@ public:
         if( n == 0 )
             n = nvars;
 
+        if( !sparse.empty() )
+        {
+            const float* values = sparse.valuePtr();
+            const int* cols = sparse.colPtr();
+            int k0 = sparse.begin(sidx), k1 = sparse.end(sidx);
+            if( !vptr )
+            {
+                memset( buf, 0, n*sizeof(buf[0]) );
+                for( int k = k0; k < k1; k++ )
+                    buf[cols[k]] = values[k];
+                return;
+            }
+            for( i = 0; i < n; i++ )
+            {
+                CV_Assert( 0 <= vptr[i] && vptr[i] < nvars );
+                const int* pos = std::lower_bound(cols + k0, cols + k1, vptr[i]);
+                buf[i] = pos < cols + k1 && *pos == vptr[i] ? values[pos - cols] : 0.f;
+            }
+            return;
+        }
+
         size_t step = samples.step/samples.elemSize();
         size_t sstep = layout == ROW_SAMPLE ? step : 1;
         size_t vstep = layout == ROW_SAMPLE ? 1 : step;
@@ -968,6 +1968,15 @@ public:
     Mat sampleWeights, catMap, catOfs;
     Mat normCatResponses, classLabels, classCounters;
     MapType nameMap;
+    //! the file the samples point into, see loadBinary()
+    Ptr<MappedFile> mapping;
+    Mat presortedValues, presortedIdx;
+    Mat binnedValues, binThresholds;
+    //! the samples given to the sparse create(); <samples> is empty then
+    SparseSamples sparse;
+    //! the dense copy of <sparse>, made by the first getSamples() and kept with the data
+    mutable Mat denseSamples;
+    mutable Mutex denseMutex;
 };
 
 Ptr<TrainData> TrainData::loadFromCSV(const String& filename,
@@ -983,6 +1992,14 @@ Ptr<TrainData> TrainData::loadFromCSV(const String& filename,
     return td;
 }
 
+Ptr<TrainData> TrainData::loadFromBinary(const String& filename)
+{
+    Ptr<TrainDataImpl> td = makePtr<TrainDataImpl>();
+    if(!td->loadBinary(filename))
+        td.release();
+    return td;
+}
+
 Ptr<TrainData> TrainData::create(InputArray samples, int layout, InputArray responses,
                                  InputArray varIdx, InputArray sampleIdx, InputArray sampleWeights,
                                  InputArray varType)
@@ -992,6 +2009,276 @@ Ptr<TrainData> TrainData::create(InputArray samples, int layout, InputArray resp
     return td;
 }
 
+Ptr<TrainData> TrainData::create(const SparseSamples& samples, InputArray responses,
+                                 InputArray sampleIdx, InputArray sampleWeights, InputArray varType)
+{
+    CV_Assert( !samples.empty() );
+    Ptr<TrainDataImpl> td = makePtr<TrainDataImpl>();
+    td->setData(noArray(), ROW_SAMPLE, responses, noArray(), sampleIdx, sampleWeights,
+                varType, noArray(), &samples);
+    return td;
+}
+
+ChunkedTrainData::~ChunkedTrainData() {}
+
+/* The file of ChunkedTrainData: a ChunkedFileHeader padded to 64 bytes, then the blocks.
+   Block b holds rows = min(blockSize, nsamples - b*blockSize) samples, stored as a
+   rows x ninputvars CV_32F matrix followed by the rows x noutputvars responses; all the
+   blocks but the last one have the same size, so the offset of a block is known. */
+struct ChunkedFileHeader
+{
+    char magic[8];
+    int version;
+    int nsamples;
+    int ninputvars;
+    int noutputvars;
+    int responseType;
+    int blockSize;
+};
+
+static const char chunkedDataMagic[8] = { 'H', 'S', 'A', 'M', 'L', 'C', 'D', '\0' };
+static const size_t chunkedDataOfs = 64;
+
+class ChunkedTrainDataImpl : public ChunkedTrainData
+{
+public:
+    ChunkedTrainDataImpl()
+    {
+        wfile = rfile = 0;
+        memset( &hdr, 0, sizeof(hdr) );
+        wcount = 0;
+        maxResident = 2;
+    }
+
+    virtual ~ChunkedTrainDataImpl() { close(); closeRead(); }
+
+    int getNSamples() const { return hdr.nsamples; }
+    int getNVars() const { return hdr.ninputvars; }
+    int getNOutputVars() const { return hdr.noutputvars; }
+    int getResponseType() const { return hdr.responseType; }
+    int getBlockSize() const { return hdr.blockSize; }
+    int getNBlocks() const { return (hdr.nsamples + hdr.blockSize - 1)/hdr.blockSize; }
+
+    bool create( const String& filename, int nvars, int noutputvars, int responseType, int blockSize )
+    {
+        CV_Assert( nvars > 0 && noutputvars >= 0 && blockSize > 0 );
+        CV_Assert( responseType == VAR_ORDERED || responseType == VAR_CATEGORICAL );
+        wfile = fopen( filename.c_str(), "wb" );
+        if( !wfile )
+            return false;
+
+        memcpy( hdr.magic, chunkedDataMagic, sizeof(hdr.magic) );
+        hdr.version = 1;
+        hdr.ninputvars = nvars;
+        hdr.noutputvars = noutputvars;
+        hdr.responseType = responseType;
+        hdr.blockSize = blockSize;
+        wsamples.create(blockSize, nvars, CV_32F);
+        if( noutputvars > 0 )
+            wresponses.create(blockSize, noutputvars, CV_32F);
+        wcount = 0;
+        return writeHeader();
+    }
+
+    bool open( const String& filename, int maxResidentBlocks )
+    {
+        CV_Assert( maxResidentBlocks >= 1 );
+        maxResident = maxResidentBlocks;
+        size_t fileSize = 0;
+
+        if( mf.open(filename, false) )
+        {
+            if( mf.size < chunkedDataOfs )
+                CV_Error(CV_StsBadArg, "not a chunked TrainData file");
+            memcpy( &hdr, mf.data, sizeof(hdr) );
+            fileSize = mf.size;
+        }
+        else
+        {
+            // no mmap(); the blocks are read into buffers instead
+            rfile = fopen( filename.c_str(), "rb" );
+            if( !rfile )
+                return false;
+            if( fread( &hdr, sizeof(hdr), 1, rfile ) != 1 )
+                CV_Error(CV_StsBadArg, "not a chunked TrainData file");
+            fseek( rfile, 0, SEEK_END );
+            fileSize = (size_t)ftell( rfile );
+        }
+
+        if( memcmp(hdr.magic, chunkedDataMagic, sizeof(hdr.magic)) != 0 || hdr.version != 1 )
+            CV_Error(CV_StsBadArg, "not a chunked TrainData file");
+        if( hdr.nsamples < 0 || hdr.ninputvars <= 0 || hdr.noutputvars < 0 || hdr.blockSize <= 0 ||
+            fileSize < blockOfs(getNBlocks()) )
+            CV_Error(CV_StsBadArg, "the chunked TrainData file is truncated or corrupted");
+
+        slots.resize(maxResident);
+        for( int i = 0; i < maxResident; i++ )
+            slots[i] = -1;
+        return true;
+    }
+
+    void append( InputArray _samples, InputArray _responses )
+    {
+        if( !wfile )
+            CV_Error(CV_StsError, "the data is not opened for writing");
+        Mat samples = _samples.getMat(), responses = _responses.getMat();
+        int i, n = samples.rows, nout = hdr.noutputvars;
+        CV_Assert( samples.cols == hdr.ninputvars );
+        CV_Assert( (nout == 0 && responses.empty()) ||
+                   (responses.rows == n && responses.cols == nout) ||
+                   (nout == 1 && (int)responses.total() == n) );
+        if( nout > 0 )
+            responses = responses.reshape(1, n);
+
+        for( i = 0; i < n; )
+        {
+            int count = std::min(n - i, hdr.blockSize - wcount);
+            samples.rowRange(i, i + count).convertTo(wsamples.rowRange(wcount, wcount + count), CV_32F);
+            if( nout > 0 )
+                responses.rowRange(i, i + count).convertTo(wresponses.rowRange(wcount, wcount + count), CV_32F);
+            wcount += count;
+            i += count;
+            if( wcount == hdr.blockSize )
+                writeBlock();
+        }
+    }
+
+    void close()
+    {
+        if( !wfile )
+            return;
+        if( wcount > 0 )
+            writeBlock();
+        bool ok = writeHeader();
+        fclose( wfile );
+        wfile = 0;
+        if( !ok )
+            CV_Error(CV_StsError, "could not write the chunked TrainData file");
+    }
+
+    void getBlock( int b, Mat& samples, Mat& responses )
+    {
+        int nblocks = getNBlocks();
+        CV_Assert( 0 <= b && b < nblocks && !wfile );
+        int rows = blockRows(b), nvars = hdr.ninputvars, nout = hdr.noutputvars;
+        size_t ofs = blockOfs(b), size = blockOfs(b+1) - ofs;
+
+        if( mf.isMapped() )
+        {
+            float* data = (float*)(mf.data + ofs);
+            samples = Mat(rows, nvars, CV_32F, data);
+            responses = nout > 0 ? Mat(rows, nout, CV_32F, data + (size_t)rows*nvars) : Mat();
+
+            // read the next block ahead and release the oldest one
+            if( b+1 < nblocks )
+                mf.advise( blockOfs(b+1), blockOfs(b+2) - blockOfs(b+1), true );
+            int old = slots[b % maxResident];
+            if( old >= 0 && old != b )
+                mf.advise( blockOfs(old), blockOfs(old+1) - blockOfs(old), false );
+            slots[b % maxResident] = b;
+            return;
+        }
+
+        // each resident block has its own buffer, so the last <maxResident> blocks stay valid
+        int k = b % maxResident;
+        if( slots[k] != b )
+        {
+            buffers.resize(maxResident);
+            buffers[k].create(1, (int)(size/sizeof(float)), CV_32F);
+            if( fseek( rfile, (long)ofs, SEEK_SET ) != 0 ||
+                fread( buffers[k].ptr(), 1, size, rfile ) != size )
+                CV_Error(CV_StsError, "could not read the chunked TrainData file");
+            slots[k] = b;
+        }
+        float* data = buffers[k].ptr<float>();
+        samples = Mat(rows, nvars, CV_32F, data);
+        responses = nout > 0 ? Mat(rows, nout, CV_32F, data + (size_t)rows*nvars) : Mat();
+    }
+
+    Ptr<TrainData> getBlockData( int b )
+    {
+        Mat samples, responses;
+        getBlock(b, samples, responses);
+        std::vector<uchar> varType(hdr.ninputvars + hdr.noutputvars, (uchar)VAR_ORDERED);
+        if( hdr.noutputvars > 0 )
+            varType.back() = (uchar)hdr.responseType;
+        return TrainData::create(samples, ROW_SAMPLE, responses, noArray(), noArray(),
+                                 noArray(), Mat(varType));
+    }
+
+protected:
+    int blockRows( int b ) const
+    {
+        return std::min(hdr.blockSize, hdr.nsamples - b*hdr.blockSize);
+    }
+
+    size_t blockOfs( int b ) const
+    {
+        size_t rowSize = (hdr.ninputvars + hdr.noutputvars)*sizeof(float);
+        size_t n = std::min((size_t)b*hdr.blockSize, (size_t)hdr.nsamples);
+        return chunkedDataOfs + n*rowSize;
+    }
+
+    bool writeHeader()
+    {
+        char buf[chunkedDataOfs];
+        memset( buf, 0, sizeof(buf) );
+        memcpy( buf, &hdr, sizeof(hdr) );
+        long pos = ftell( wfile );
+        bool ok = fseek( wfile, 0, SEEK_SET ) == 0 &&
+                  fwrite( buf, 1, sizeof(buf), wfile ) == sizeof(buf);
+        if( pos > (long)chunkedDataOfs )
+            fseek( wfile, pos, SEEK_SET );
+        return ok;
+    }
+
+    void writeBlock()
+    {
+        size_t n1 = (size_t)wcount*hdr.ninputvars, n2 = (size_t)wcount*hdr.noutputvars;
+        if( fwrite( wsamples.ptr(), sizeof(float), n1, wfile ) != n1 ||
+            (n2 > 0 && fwrite( wresponses.ptr(), sizeof(float), n2, wfile ) != n2) )
+            CV_Error(CV_StsError, "could not write the chunked TrainData file");
+        hdr.nsamples += wcount;
+        wcount = 0;
+    }
+
+    void closeRead()
+    {
+        mf.close();
+        if( rfile )
+            fclose( rfile );
+        rfile = 0;
+    }
+
+    ChunkedFileHeader hdr;
+    FILE* wfile;
+    FILE* rfile;
+    Mat wsamples, wresponses;
+    int wcount;
+    MappedFile mf;
+    int maxResident;
+    //! the block held by every resident slot
+    std::vector<int> slots;
+    std::vector<Mat> buffers;
+};
+
+Ptr<ChunkedTrainData> ChunkedTrainData::create(const String& filename, int nvars, int noutputvars,
+                                               int responseType, int blockSize)
+{
+    Ptr<ChunkedTrainDataImpl> td = makePtr<ChunkedTrainDataImpl>();
+    if(!td->create(filename, nvars, noutputvars, responseType, blockSize))
+        td.release();
+    return td;
+}
+
+Ptr<ChunkedTrainData> ChunkedTrainData::open(const String& filename, int maxResidentBlocks)
+{
+    Ptr<ChunkedTrainDataImpl> td = makePtr<ChunkedTrainDataImpl>();
+    if(!td->open(filename, maxResidentBlocks))
+        td.release();
+    return td;
+}
+
 }}
 
 /* End of file. */
@@ -1,1365 +1,623 @@
-
 #include "precomp.hpp"
-#include <time.h>
-
-#if 0
-
-#define pCvSeq CvSeq*
-#define pCvDTreeNode CvDTreeNode*
 
-//===========================================================================
-//----------------------------- CvGBTreesParams -----------------------------
-//===========================================================================
+namespace cv { namespace hsaml {
 
-CvGBTreesParams::CvGBTreesParams()
-            : CvDTreeParams( 3, 10, 0, false, 10, 0, false, false, 0 )
+GBTrees::Params::Params()
+    : DTrees::Params( 3, 10, 0, false, 10, 0, false, false, Mat() )
 {
-    weak_count = 200;
-    loss_function_type = CvGBTrees::SQUARED_LOSS;
-    subsample_portion = 0.8f;
+    weakCount = 200;
+    lossFunctionType = GBTrees::SQUARED_LOSS;
+    subsamplePortion = 0.8f;
     shrinkage = 0.01f;
+    validationPortion = 0.f;
+    earlyStoppingRounds = 10;
 }
 
-//===========================================================================
-
-CvGBTreesParams::CvGBTreesParams( int _loss_function_type, int _weak_count,
-                         float _shrinkage, float _subsample_portion,
-                         int _max_depth, bool _use_surrogates )
-            : CvDTreeParams( 3, 10, 0, false, 10, 0, false, false, 0 )
+GBTrees::Params::Params( int _lossFunctionType, int _weakCount, float _shrinkage,
+                         float _subsamplePortion, int _maxDepth, bool _useSurrogates )
+    : DTrees::Params( _maxDepth, 10, 0, _useSurrogates, 10, 0, false, false, Mat() )
 {
-    loss_function_type = _loss_function_type;
-    weak_count = _weak_count;
+    lossFunctionType = _lossFunctionType;
+    weakCount = _weakCount;
     shrinkage = _shrinkage;
-    subsample_portion = _subsample_portion;
-    max_depth = _max_depth;
-    use_surrogates = _use_surrogates;
+    subsamplePortion = _subsamplePortion;
+    validationPortion = 0.f;
+    earlyStoppingRounds = 10;
 }
 
-//===========================================================================
-//------------------------------- CvGBTrees ---------------------------------
-//===========================================================================
 
-CvGBTrees::CvGBTrees()
-{
-    data = 0;
-    weak = 0;
-    default_model_name = "my_boost_tree";
-    orig_response = sum_response = sum_response_tmp = 0;
-    subsample_train = subsample_test = 0;
-    missing = sample_idx = 0;
-    class_labels = 0;
-    class_count = 1;
-    delta = 0.0f;
-
-    clear();
-}
-
-//===========================================================================
-
-int CvGBTrees::get_len(const CvMat* mat) const
+/*
+ The negative gradient of the loss at the samples sidx[range] (the responses the next tree is
+ fitted to), for the class <k> with DEVIANCE_LOSS. <scores> holds the current ensemble output
+ of every sample, <nall> values per class.
+*/
+class GBTGradientInvoker : public ParallelLoopBody
 {
-    return (mat->cols > mat->rows) ? mat->cols : mat->rows;
-}
-
-//===========================================================================
+public:
+    GBTGradientInvoker( int _loss, int _k, int _nclasses, double _delta, const int* _sidx,
+                        const double* _responses, const int* _labels, const double* _scores,
+                        int _nall, double* _grad )
+        : loss(_loss), k(_k), nclasses(_nclasses), delta(_delta), sidx(_sidx),
+          responses(_responses), labels(_labels), scores(_scores), nall(_nall), grad(_grad) {}
 
-void CvGBTrees::clear()
-{
-    if( weak )
+    void operator()( const Range& range ) const
     {
-        CvSeqReader reader;
-        CvSlice slice = CV_WHOLE_SEQ;
-        CvDTree* tree;
-
-        //data->shared = false;
-        for (int i=0; i<class_count; ++i)
+        for( int i = range.start; i < range.end; i++ )
         {
-            int weak_count = cvSliceLength( slice, weak[i] );
-            if ((weak[i]) && (weak_count))
+            int j, si = sidx[i];
+            double r, g;
+
+            switch( loss )
             {
-                cvStartReadSeq( weak[i], &reader );
-                cvSetSeqReaderPos( &reader, slice.start_index );
-                for (int j=0; j<weak_count; ++j)
+            case GBTrees::SQUARED_LOSS:
+                g = responses[si] - scores[si];
+                break;
+            case GBTrees::ABSOLUTE_LOSS:
+                r = responses[si] - scores[si];
+                g = r > 0 ? 1 : r < 0 ? -1 : 0;
+                break;
+            case GBTrees::HUBER_LOSS:
+                r = responses[si] - scores[si];
+                g = std::abs(r) <= delta ? r : r > 0 ? delta : -delta;
+                break;
+            default:
                 {
-                    CV_READ_SEQ_ELEM( tree, reader );
-                    //tree->clear();
-                    delete tree;
-                    tree = 0;
+                    // 1(y == k) - softmax(F)_k
+                    double fmax = scores[si], esum = 0, ek = 0;
+                    for( j = 1; j < nclasses; j++ )
+                        fmax = std::max(fmax, scores[(size_t)j*nall + si]);
+                    for( j = 0; j < nclasses; j++ )
+                    {
+                        double e = std::exp(scores[(size_t)j*nall + si] - fmax);
+                        esum += e;
+                        if( j == k )
+                            ek = e;
+                    }
+                    g = (labels[si] == k) - ek/esum;
                 }
             }
+            grad[si] = g;
         }
-        for (int i=0; i<class_count; ++i)
-            if (weak[i]) cvReleaseMemStorage( &(weak[i]->storage) );
-        delete[] weak;
-    }
-    if (data)
-    {
-        data->shared = false;
-        delete data;
     }
-    weak = 0;
-    data = 0;
-    delta = 0.0f;
-    cvReleaseMat( &orig_response );
-    cvReleaseMat( &sum_response );
-    cvReleaseMat( &sum_response_tmp );
-    cvReleaseMat( &subsample_train );
-    cvReleaseMat( &subsample_test );
-    cvReleaseMat( &sample_idx );
-    cvReleaseMat( &missing );
-    cvReleaseMat( &class_labels );
-}
 
-//===========================================================================
+    int loss, k, nclasses;
+    double delta;
+    const int* sidx;
+    const double* responses;
+    const int* labels;
+    const double* scores;
+    int nall;
+    double* grad;
+};
 
-CvGBTrees::~CvGBTrees()
-{
-    clear();
-}
-
-//===========================================================================
 
-CvGBTrees::CvGBTrees( const CvMat* _train_data, int _tflag,
-                  const CvMat* _responses, const CvMat* _var_idx,
-                  const CvMat* _sample_idx, const CvMat* _var_type,
-                  const CvMat* _missing_mask, CvGBTreesParams _params )
+class DTreesImplForGBT : public DTreesImpl
 {
-    weak = 0;
-    data = 0;
-    default_model_name = "my_boost_tree";
-    orig_response = sum_response = sum_response_tmp = 0;
-    subsample_train = subsample_test = 0;
-    missing = sample_idx = 0;
-    class_labels = 0;
-    class_count = 1;
-    delta = 0.0f;
-
-    train( _train_data, _tflag, _responses, _var_idx, _sample_idx,
-           _var_type, _missing_mask, _params );
-}
+public:
+    DTreesImplForGBT() : baseValue(0), delta(0), curClass(0), nall(0) {}
+    virtual ~DTreesImplForGBT() {}
 
-//===========================================================================
+    bool isClassifier() const { return gparams.lossFunctionType == GBTrees::DEVIANCE_LOSS; }
 
-bool CvGBTrees::problem_type() const
-{
-    switch (params.loss_function_type)
+    void setGParams(const GBTrees::Params& p)
     {
-    case DEVIANCE_LOSS: return false;
-    default: return true;
+        gparams = p;
     }
-}
-
-//===========================================================================
-
-bool
-CvGBTrees::train( CvMLData* _data, CvGBTreesParams _params, bool update )
-{
-    bool result;
-    result = train ( _data->get_values(), CV_ROW_SAMPLE,
-            _data->get_responses(), _data->get_var_idx(),
-            _data->get_train_sample_idx(), _data->get_var_types(),
-            _data->get_missing(), _params, update);
-                                         //update is not supported
-    return result;
-}
-
-//===========================================================================
 
-
-bool
-CvGBTrees::train( const CvMat* _train_data, int _tflag,
-              const CvMat* _responses, const CvMat* _var_idx,
-              const CvMat* _sample_idx, const CvMat* _var_type,
-              const CvMat* _missing_mask,
-              CvGBTreesParams _params, bool /*_update*/ ) //update is not supported
-{
-    CvMemStorage* storage = 0;
-
-    params = _params;
-    bool is_regression = problem_type();
-
-    clear();
-    /*
-      n - count of samples
-      m - count of variables
-    */
-    int n = _train_data->rows;
-    int m = _train_data->cols;
-    if (_tflag != CV_ROW_SAMPLE)
+    GBTrees::Params getGParams() const
     {
-        int tmp;
-        CV_SWAP(n,m,tmp);
+        return gparams;
     }
 
-    CvMat* new_responses = cvCreateMat( n, 1, CV_32F);
-    cvZero(new_responses);
-
-    data = new CvDTreeTrainData( _train_data, _tflag, new_responses, _var_idx,
-        _sample_idx, _var_type, _missing_mask, _params, true, true );
-    if (_missing_mask)
+    void clear()
     {
-        missing = cvCreateMat(_missing_mask->rows, _missing_mask->cols,
-                              _missing_mask->type);
-        cvCopy( _missing_mask, missing);
+        DTreesImpl::clear();
+        baseValue = delta = 0;
+        curClass = nall = 0;
     }
 
-    orig_response = cvCreateMat( 1, n, CV_32F );
-    int step = (_responses->cols > _responses->rows) ? 1 : _responses->step / CV_ELEM_SIZE(_responses->type);
-    switch (CV_MAT_TYPE(_responses->type))
+    int getClassCount() const
     {
-        case CV_32FC1:
-        {
-            for (int i=0; i<n; ++i)
-                orig_response->data.fl[i] = _responses->data.fl[i*step];
-        }; break;
-        case CV_32SC1:
-        {
-            for (int i=0; i<n; ++i)
-                orig_response->data.fl[i] = (float) _responses->data.i[i*step];
-        }; break;
-        default:
-            CV_Error(CV_StsUnmatchedFormats, "Response should be a 32fC1 or 32sC1 vector.");
+        return isClassifier() ? std::max((int)classLabels.size(), 1) : 1;
     }
 
-    if (!is_regression)
+    int getIterCount() const
     {
-        class_count = 0;
-        unsigned char * mask = new unsigned char[n];
-        memset(mask, 0, n);
-        // compute the count of different output classes
-        for (int i=0; i<n; ++i)
-            if (!mask[i])
-            {
-                class_count++;
-                for (int j=i; j<n; ++j)
-                    if (int(orig_response->data.fl[j]) == int(orig_response->data.fl[i]))
-                        mask[j] = 1;
-            }
-        delete[] mask;
-
-        class_labels = cvCreateMat(1, class_count, CV_32S);
-        class_labels->data.i[0] = int(orig_response->data.fl[0]);
-        int j = 1;
-        for (int i=1; i<n; ++i)
-        {
-            int k = 0;
-            while ((int(orig_response->data.fl[i]) - class_labels->data.i[k]) && (k<j))
-                k++;
-            if (k == j)
-            {
-                class_labels->data.i[k] = int(orig_response->data.fl[i]);
-                j++;
-            }
-        }
+        return (int)roots.size()/getClassCount();
     }
 
-    // inside gbt learning proccess only regression decision trees are built
-    data->is_classifier = false;
-
-    // preproccessing sample indices
-    if (_sample_idx)
+    void startTraining( const Ptr<TrainData>& trainData, int flags )
     {
-        int sample_idx_len = get_len(_sample_idx);
-
-        switch (CV_MAT_TYPE(_sample_idx->type))
+        DTreesImpl::startTraining(trainData, flags);
+        // the trees are grown on bins; those of unquantized data are kept for this training only
+        if( w->binValues.empty() )
         {
-            case CV_32SC1:
-            {
-                sample_idx = cvCreateMat( 1, sample_idx_len, CV_32S );
-                for (int i=0; i<sample_idx_len; ++i)
-                    sample_idx->data.i[i] = _sample_idx->data.i[i];
-                std::sort(sample_idx->data.i, sample_idx->data.i + sample_idx_len);
-            } break;
-            case CV_8S:
-            case CV_8U:
-            {
-                int active_samples_count = 0;
-                for (int i=0; i<sample_idx_len; ++i)
-                    active_samples_count += int( _sample_idx->data.ptr[i] );
-                sample_idx = cvCreateMat( 1, active_samples_count, CV_32S );
-                active_samples_count = 0;
-                for (int i=0; i<sample_idx_len; ++i)
-                    if (int( _sample_idx->data.ptr[i] ))
-                        sample_idx->data.i[active_samples_count++] = i;
-
-            } break;
-            default: CV_Error(CV_StsUnmatchedFormats, "_sample_idx should be a 32sC1, 8sC1 or 8uC1 vector.");
+            Mat bins, thresholds;
+            trainData->calcBins(256, bins, thresholds);
+            initBins(bins, thresholds);
         }
-    }
-    else
-    {
-        sample_idx = cvCreateMat( 1, n, CV_32S );
-        for (int i=0; i<n; ++i)
-            sample_idx->data.i[i] = i;
-    }
 
-    sum_response = cvCreateMat(class_count, n, CV_32F);
-    sum_response_tmp = cvCreateMat(class_count, n, CV_32F);
-    cvZero(sum_response);
+        bool deviance = isClassifier();
+        if( deviance != _isClassifier )
+            CV_Error( CV_StsBadArg, deviance ? "DEVIANCE_LOSS needs categorical responses" :
+                      "The regression losses need ordered responses" );
 
-    delta = 0.0f;
-    /*
-      in the case of a regression problem the initial guess (the zero term
-      in the sum) is set to the mean of all the training responses, that is
-      the best constant model
-    */
-    if (is_regression) base_value = find_optimal_value(sample_idx);
-    /*
-      in the case of a classification problem the initial guess (the zero term
-      in the sum) is set to zero for all the trees sequences
-    */
-    else base_value = 0.0f;
-    /*
-      current predicition on all training samples is set to be
-      equal to the base_value
-    */
-    cvSet( sum_response, cvScalar(base_value) );
+        // the trees are regression trees fitted to the gradients, stored in w->ord_responses
+        nall = (int)w->sample_weights.size();
+        if( deviance )
+        {
+            _isClassifier = false;
+            labels = w->cat_responses;
+            w->ord_responses.assign(nall, 0.);
+        }
+        else
+            responses = w->ord_responses;
 
-    weak = new pCvSeq[class_count];
-    for (int i=0; i<class_count; ++i)
-    {
-        storage = cvCreateMemStorage();
-        weak[i] = cvCreateSeq( 0, sizeof(CvSeq), sizeof(CvDTree*), storage );
-        storage = 0;
+        Mat missing = trainData->getMissing();
+        if( missing.empty() || countNonZero(missing) == 0 )
+            w->sampleLeaf.assign(nall, -1);
     }
 
-    // subsample params and data
-    rng = &cv::theRNG();
-
-    int samples_count = get_len(sample_idx);
-
-    params.subsample_portion = params.subsample_portion <= FLT_EPSILON ||
-        1 - params.subsample_portion <= FLT_EPSILON
-        ? 1 : params.subsample_portion;
-    int train_sample_count = cvFloor(params.subsample_portion * samples_count);
-    if (train_sample_count == 0)
-        train_sample_count = samples_count;
-    int test_sample_count = samples_count - train_sample_count;
-    int* idx_data = new int[samples_count];
-    subsample_train = cvCreateMatHeader( 1, train_sample_count, CV_32SC1 );
-    *subsample_train = cvMat( 1, train_sample_count, CV_32SC1, idx_data );
-    if (test_sample_count)
+    void endTraining()
     {
-        subsample_test  = cvCreateMatHeader( 1, test_sample_count, CV_32SC1 );
-        *subsample_test = cvMat( 1, test_sample_count, CV_32SC1,
-                                 idx_data + train_sample_count );
+        DTreesImpl::endTraining();
+        vector<double> e1, e2;
+        vector<int> e3;
+        std::swap(scores, e1);
+        std::swap(responses, e2);
+        std::swap(labels, e3);
     }
 
-    // training procedure
-
-    for ( int i=0; i < params.weak_count; ++i )
+    // the value of the median of v[0..n), that is reordered
+    static double median( double* v, int n )
     {
-        do_subsample();
-        for ( int k=0; k < class_count; ++k )
-        {
-            find_gradient(k);
-            CvDTree* tree = new CvDTree;
-            tree->train( data, subsample_train );
-            change_values(tree, k);
-
-            if (subsample_test)
-            {
-                CvMat x;
-                CvMat x_miss;
-                int* sample_data = sample_idx->data.i;
-                int* subsample_data = subsample_test->data.i;
-                int s_step = (sample_idx->cols > sample_idx->rows) ? 1
-                             : sample_idx->step/CV_ELEM_SIZE(sample_idx->type);
-                for (int j=0; j<get_len(subsample_test); ++j)
-                {
-                    int idx = *(sample_data + subsample_data[j]*s_step);
-                    float res = 0.0f;
-                    if (_tflag == CV_ROW_SAMPLE)
-                        cvGetRow( data->train_data, &x, idx);
-                    else
-                        cvGetCol( data->train_data, &x, idx);
-
-                    if (missing)
-                    {
-                        if (_tflag == CV_ROW_SAMPLE)
-                            cvGetRow( missing, &x_miss, idx);
-                        else
-                            cvGetCol( missing, &x_miss, idx);
-
-                        res = (float)tree->predict(&x, &x_miss)->value;
-                    }
-                    else
-                    {
-                        res = (float)tree->predict(&x)->value;
-                    }
-                    sum_response_tmp->data.fl[idx + k*n] =
-                                    sum_response->data.fl[idx + k*n] +
-                                    params.shrinkage * res;
-                }
-            }
-
-            cvSeqPush( weak[k], &tree );
-            tree = 0;
-        } // k=0..class_count
-    CvMat* tmp;
-    tmp = sum_response_tmp;
-    sum_response_tmp = sum_response;
-    sum_response = tmp;
-    tmp = 0;
-    } // i=0..params.weak_count
-
-    delete[] idx_data;
-    cvReleaseMat(&new_responses);
-    data->free_train_data();
-
-    return true;
-
-} // CvGBTrees::train(...)
-
-//===========================================================================
-
-inline float Sign(float x)
-  {
-  if (x<0.0f) return -1.0f;
-  else if (x>0.0f) return 1.0f;
-  return 0.0f;
-  }
-
-//===========================================================================
+        int h = n/2;
+        std::nth_element(v, v + h, v + n);
+        double m = v[h];
+        if( n % 2 == 0 )
+            m = (m + *std::max_element(v, v + h))*0.5;
+        return m;
+    }
 
-void CvGBTrees::find_gradient(const int k)
-{
-    int* sample_data = sample_idx->data.i;
-    int* subsample_data = subsample_train->data.i;
-    float* grad_data = data->responses->data.fl;
-    float* resp_data = orig_response->data.fl;
-    float* current_data = sum_response->data.fl;
-
-    switch (params.loss_function_type)
-    // loss_function_type in
-    // {SQUARED_LOSS, ABSOLUTE_LOSS, HUBER_LOSS, DEVIANCE_LOSS}
+    /*
+     The step minimizing the loss of the samples <_sidx> for the class <k>: the mean residual
+     for SQUARED_LOSS, the median one for ABSOLUTE_LOSS, the median plus the mean clipped
+     deviation from it for HUBER_LOSS and one Newton step for DEVIANCE_LOSS.
+    */
+    double findOptimalValue( const vector<int>& _sidx, int k ) const
     {
-        case SQUARED_LOSS:
-        {
-            for (int i=0; i<get_len(subsample_train); ++i)
-            {
-                int s_step = (sample_idx->cols > sample_idx->rows) ? 1
-                             : sample_idx->step/CV_ELEM_SIZE(sample_idx->type);
-                int idx = *(sample_data + subsample_data[i]*s_step);
-                grad_data[idx] = resp_data[idx] - current_data[idx];
-            }
-        }; break;
-
-        case ABSOLUTE_LOSS:
-        {
-            for (int i=0; i<get_len(subsample_train); ++i)
-            {
-                int s_step = (sample_idx->cols > sample_idx->rows) ? 1
-                             : sample_idx->step/CV_ELEM_SIZE(sample_idx->type);
-                int idx = *(sample_data + subsample_data[i]*s_step);
-                grad_data[idx] = Sign(resp_data[idx] - current_data[idx]);
-            }
-        }; break;
-
-        case HUBER_LOSS:
-        {
-            float alpha = 0.2f;
-            int n = get_len(subsample_train);
-            int s_step = (sample_idx->cols > sample_idx->rows) ? 1
-                         : sample_idx->step/CV_ELEM_SIZE(sample_idx->type);
-
-            float* residuals = new float[n];
-            for (int i=0; i<n; ++i)
-            {
-                int idx = *(sample_data + subsample_data[i]*s_step);
-                residuals[i] = fabs(resp_data[idx] - current_data[idx]);
-            }
-            std::sort(residuals, residuals + n);
+        int i, n = (int)_sidx.size();
+        if( n == 0 )
+            return 0.;
 
-            delta = residuals[int(ceil(n*alpha))];
+        const double* F = &scores[(size_t)k*nall];
+        double gamma = 0;
 
-            for (int i=0; i<n; ++i)
-            {
-                int idx = *(sample_data + subsample_data[i]*s_step);
-                float r = resp_data[idx] - current_data[idx];
-                grad_data[idx] = (fabs(r) > delta) ? delta*Sign(r) : r;
-            }
-            delete[] residuals;
-
-        }; break;
-
-        case DEVIANCE_LOSS:
+        if( gparams.lossFunctionType == GBTrees::DEVIANCE_LOSS )
         {
-            for (int i=0; i<get_len(subsample_train); ++i)
+            const double* g = &w->ord_responses[0];
+            double s1 = 0, s2 = 0;
+            for( i = 0; i < n; i++ )
             {
-                double exp_fk = 0;
-                double exp_sfi = 0;
-                int s_step = (sample_idx->cols > sample_idx->rows) ? 1
-                             : sample_idx->step/CV_ELEM_SIZE(sample_idx->type);
-                int idx = *(sample_data + subsample_data[i]*s_step);
-
-                for (int j=0; j<class_count; ++j)
-                {
-                    double res;
-                    res = current_data[idx + j*sum_response->cols];
-                    res = exp(res);
-                    if (j == k) exp_fk = res;
-                    exp_sfi += res;
-                }
-                int orig_label = int(resp_data[idx]);
-                /*
-                grad_data[idx] = (float)(!(k-class_labels->data.i[orig_label]+1)) -
-                                 (float)(exp_fk / exp_sfi);
-                */
-                int ensemble_label = 0;
-                while (class_labels->data.i[ensemble_label] - orig_label)
-                    ensemble_label++;
-
-                grad_data[idx] = (float)(!(k-ensemble_label)) -
-                                 (float)(exp_fk / exp_sfi);
+                double t = g[_sidx[i]];
+                s1 += t;
+                s2 += std::abs(t)*(1 - std::abs(t));
             }
-        }; break;
-
-        default: break;
-    }
-
-} // CvGBTrees::find_gradient(...)
-
-//===========================================================================
-
-void CvGBTrees::change_values(CvDTree* tree, const int _k)
-{
-    CvDTreeNode** predictions = new pCvDTreeNode[get_len(subsample_train)];
-
-    int* sample_data = sample_idx->data.i;
-    int* subsample_data = subsample_train->data.i;
-    int s_step = (sample_idx->cols > sample_idx->rows) ? 1
-                 : sample_idx->step/CV_ELEM_SIZE(sample_idx->type);
-
-    CvMat x;
-    CvMat miss_x;
-
-    for (int i=0; i<get_len(subsample_train); ++i)
-    {
-        int idx = *(sample_data + subsample_data[i]*s_step);
-        if (data->tflag == CV_ROW_SAMPLE)
-            cvGetRow( data->train_data, &x, idx);
-        else
-            cvGetCol( data->train_data, &x, idx);
-
-        if (missing)
-        {
-            if (data->tflag == CV_ROW_SAMPLE)
-                cvGetRow( missing, &miss_x, idx);
-            else
-                cvGetCol( missing, &miss_x, idx);
-
-            predictions[i] = tree->predict(&x, &miss_x);
+            if( s2 == 0 )
+                s2 = 1;
+            int K = getClassCount();
+            return (double)(K - 1)/K*(s1/s2);
         }
-        else
-            predictions[i] = tree->predict(&x);
-    }
-
-
-    CvDTreeNode** leaves;
-    int leaves_count = 0;
-    leaves = GetLeaves( tree, leaves_count);
 
-    for (int i=0; i<leaves_count; ++i)
-    {
-        int samples_in_leaf = 0;
-        for (int j=0; j<get_len(subsample_train); ++j)
+        if( gparams.lossFunctionType == GBTrees::SQUARED_LOSS )
         {
-            if (leaves[i] == predictions[j]) samples_in_leaf++;
+            for( i = 0; i < n; i++ )
+                gamma += responses[_sidx[i]] - F[_sidx[i]];
+            return gamma/n;
         }
 
-        if (!samples_in_leaf) // It should not be done anyways! but...
-        {
-            leaves[i]->value = 0.0;
-            continue;
-        }
-
-        CvMat* leaf_idx = cvCreateMat(1, samples_in_leaf, CV_32S);
-        int* leaf_idx_data = leaf_idx->data.i;
-
-        for (int j=0; j<get_len(subsample_train); ++j)
-        {
-            int idx = *(sample_data + subsample_data[j]*s_step);
-            if (leaves[i] == predictions[j])
-                *leaf_idx_data++ = idx;
-        }
-
-        float value = find_optimal_value(leaf_idx);
-        leaves[i]->value = value;
+        AutoBuffer<double> _r(n);
+        double* r = _r;
+        for( i = 0; i < n; i++ )
+            r[i] = responses[_sidx[i]] - F[_sidx[i]];
+        double rmedian = median(r, n);
 
-        leaf_idx_data = leaf_idx->data.i;
+        if( gparams.lossFunctionType == GBTrees::ABSOLUTE_LOSS )
+            return rmedian;
 
-        int len = sum_response_tmp->cols;
-        for (int j=0; j<get_len(leaf_idx); ++j)
+        for( i = 0; i < n; i++ )
         {
-            int idx = leaf_idx_data[j];
-            sum_response_tmp->data.fl[idx + _k*len] =
-                                    sum_response->data.fl[idx + _k*len] +
-                                    params.shrinkage * value;
+            double d = r[i] - rmedian;
+            gamma += std::abs(d) <= delta ? d : d > 0 ? delta : -delta;
         }
-        leaf_idx_data = 0;
-        cvReleaseMat(&leaf_idx);
+        return gamma/n + rmedian;
     }
 
-    // releasing the memory
-    for (int i=0; i<get_len(subsample_train); ++i)
+    void calcValue( int nidx, const vector<int>& _sidx )
     {
-        predictions[i] = 0;
+        DTreesImpl::calcValue(nidx, _sidx);
+        w->wnodes[nidx].value = gparams.shrinkage*findOptimalValue(_sidx, curClass);
     }
-    delete[] predictions;
 
-    for (int i=0; i<leaves_count; ++i)
-    {
-        leaves[i] = 0;
+    // the Huber loss threshold: the quantile 0.2 of the absolute residuals of <_sidx>
+    double calcHuberDelta( const vector<int>& _sidx ) const
+    {
+        const double alpha = 0.2;
+        int i, n = (int)_sidx.size();
+        if( n == 0 )
+            return 0.;
+        AutoBuffer<double> _r(n);
+        double* r = _r;
+        for( i = 0; i < n; i++ )
+            r[i] = std::abs(responses[_sidx[i]] - scores[_sidx[i]]);
+        int q = std::min(cvCeil(n*alpha), n - 1);
+        std::nth_element(r, r + q, r + n);
+        return r[q];
     }
-    delete[] leaves;
-
-}
 
-//===========================================================================
-/*
-void CvGBTrees::change_values(CvDTree* tree, const int _k)
-{
-
-    CvDTreeNode** leaves;
-    int leaves_count = 0;
-    int offset = _k*sum_response_tmp->cols;
-    CvMat leaf_idx;
-    leaf_idx.rows = 1;
-
-    leaves = GetLeaves( tree, leaves_count);
-
-    for (int i=0; i<leaves_count; ++i)
+    // the mean loss of the samples <_sidx>; the absolute error for HUBER_LOSS, whose threshold
+    // changes from one iteration to the next
+    double calcLoss( const vector<int>& _sidx ) const
     {
-        int n = leaves[i]->sample_count;
-        int* leaf_idx_data = new int[n];
-        data->get_sample_indices(leaves[i], leaf_idx_data);
-        //CvMat* leaf_idx = new CvMat();
-        //cvInitMatHeader(leaf_idx, n, 1, CV_32S, leaf_idx_data);
-        leaf_idx.cols = n;
-        leaf_idx.data.i = leaf_idx_data;
-
-        float value = find_optimal_value(&leaf_idx);
-        leaves[i]->value = value;
-        float val = params.shrinkage * value;
-
+        int i, j, n = (int)_sidx.size(), K = getClassCount();
+        double loss = 0;
 
-        for (int j=0; j<n; ++j)
+        for( i = 0; i < n; i++ )
         {
-            int idx = leaf_idx_data[j] + offset;
-            sum_response_tmp->data.fl[idx] = sum_response->data.fl[idx] + val;
+            int si = _sidx[i];
+            if( gparams.lossFunctionType == GBTrees::DEVIANCE_LOSS )
+            {
+                double fmax = scores[si], esum = 0;
+                for( j = 1; j < K; j++ )
+                    fmax = std::max(fmax, scores[(size_t)j*nall + si]);
+                for( j = 0; j < K; j++ )
+                    esum += std::exp(scores[(size_t)j*nall + si] - fmax);
+                loss += std::log(esum) + fmax - scores[(size_t)labels[si]*nall + si];
+            }
+            else
+            {
+                double r = responses[si] - scores[si];
+                loss += gparams.lossFunctionType == GBTrees::SQUARED_LOSS ? r*r : std::abs(r);
+            }
         }
-        //leaf_idx_data = 0;
-        //cvReleaseMat(&leaf_idx);
-        leaf_idx.data.i = 0;
-        //delete leaf_idx;
-        delete[] leaf_idx_data;
+        return n > 0 ? loss/n : 0.;
     }
 
-    // releasing the memory
-    for (int i=0; i<leaves_count; ++i)
-    {
-        leaves[i] = 0;
-    }
-    delete[] leaves;
-
-}    //change_values(...);
-*/
-//===========================================================================
-
-float CvGBTrees::find_optimal_value( const CvMat* _Idx )
-{
-
-    double gamma = (double)0.0;
-
-    int* idx = _Idx->data.i;
-    float* resp_data = orig_response->data.fl;
-    float* cur_data = sum_response->data.fl;
-    int n = get_len(_Idx);
-
-    switch (params.loss_function_type)
-    // SQUARED_LOSS=0, ABSOLUTE_LOSS=1, HUBER_LOSS=3, DEVIANCE_LOSS=4
-    {
-    case SQUARED_LOSS:
+    /*
+     Every iteration computes the gradients of a random subsample in parallel, grows one tree
+     per class on them and updates the scores of all the training samples with its leaf
+     values: the subsample takes them from the leaves it has been split into, the other
+     samples are sent down the tree (see DTreesImpl::evalTree()).
+    */
+    bool train( const Ptr<TrainData>& trainData, int flags )
+    {
+        int loss = gparams.lossFunctionType;
+        if( loss != GBTrees::SQUARED_LOSS && loss != GBTrees::ABSOLUTE_LOSS &&
+            loss != GBTrees::HUBER_LOSS && loss != GBTrees::DEVIANCE_LOSS )
+            CV_Error( CV_StsBadArg, "Unknown loss function" );
+        if( gparams.validationPortion < 0 || gparams.validationPortion >= 1 )
+            CV_Error( CV_StsOutOfRange, "validationPortion must be in [0, 1)" );
+
+        Params dp(gparams.maxDepth, gparams.minSampleCount, gparams.regressionAccuracy,
+                  gparams.useSurrogates, gparams.maxCategories, 0,
+                  false, false, gparams.priors);
+        setDParams(dp);
+        startTraining(trainData, flags);
+
+        RNG rng((uint64)-1);
+        int i, k, iter, K = getClassCount();
+        int n = (int)w->sidx.size(), nval = 0;
+        vector<int> fitIdx = w->sidx, valIdx;
+
+        if( gparams.validationPortion > 0 )
         {
-            for (int i=0; i<n; ++i)
-                gamma += resp_data[idx[i]] - cur_data[idx[i]];
-            gamma /= (double)n;
-        }; break;
+            for( i = 0; i < n; i++ )
+                std::swap(fitIdx[i], fitIdx[rng.uniform(i, n)]);
+            nval = std::min(std::max(cvRound(n*gparams.validationPortion), 1), n - 1);
+            valIdx.assign(fitIdx.end() - nval, fitIdx.end());
+            fitIdx.resize(n - nval);
+            std::sort(fitIdx.begin(), fitIdx.end());
+            std::sort(valIdx.begin(), valIdx.end());
+        }
 
-    case ABSOLUTE_LOSS:
-        {
-            float* residuals = new float[n];
-            for (int i=0; i<n; ++i, ++idx)
-                residuals[i] = (resp_data[*idx] - cur_data[*idx]);
-            std::sort(residuals, residuals + n);
-            if (n % 2)
-                gamma = residuals[n/2];
-            else gamma = (residuals[n/2-1] + residuals[n/2]) / 2.0f;
-            delete[] residuals;
-        }; break;
-
-    case HUBER_LOSS:
+        int nfit = (int)fitIdx.size();
+        float portion = gparams.subsamplePortion;
+        if( portion <= FLT_EPSILON || 1 - portion <= FLT_EPSILON )
+            portion = 1.f;
+        int nsub = cvFloor(portion*nfit);
+        if( nsub == 0 )
+            nsub = nfit;
+
+        // the initial guess is the best constant model for the regression and 0 otherwise
+        scores.assign((size_t)K*nall, 0.);
+        baseValue = loss == GBTrees::DEVIANCE_LOSS ? 0. : findOptimalValue(fitIdx, 0);
+        std::fill(scores.begin(), scores.end(), baseValue);
+
+        vector<int> order = fitIdx, subset = fitIdx;
+        vector<double> result((size_t)K*n + 1);
+        double bestLoss = DBL_MAX;
+        int bestIter = 0;
+        size_t bestNodes = 0, bestSplits = 0, bestSubsets = 0;
+
+        for( iter = 0; iter < gparams.weakCount; iter++ )
         {
-            float* residuals = new float[n];
-            for (int i=0; i<n; ++i, ++idx)
-                residuals[i] = (resp_data[*idx] - cur_data[*idx]);
-            std::sort(residuals, residuals + n);
-
-            int n_half = n >> 1;
-            float r_median = (n == n_half<<1) ?
-                        (residuals[n_half-1] + residuals[n_half]) / 2.0f :
-                        residuals[n_half];
-
-            for (int i=0; i<n; ++i)
+            if( nsub < nfit )
             {
-                float dif = residuals[i] - r_median;
-                gamma += (delta < fabs(dif)) ? Sign(dif)*delta : dif;
+                for( i = 0; i < nfit; i++ )
+                    std::swap(order[i], order[rng.uniform(i, nfit)]);
+                subset.assign(order.begin(), order.begin() + nsub);
+                std::sort(subset.begin(), subset.end());
             }
-            gamma /= (double)n;
-            gamma += r_median;
-            delete[] residuals;
 
-        }; break;
+            if( loss == GBTrees::HUBER_LOSS )
+                delta = calcHuberDelta(subset);
 
-    case DEVIANCE_LOSS:
-        {
-            float* grad_data = data->responses->data.fl;
-            double tmp1 = 0;
-            double tmp2 = 0;
-            double tmp  = 0;
-            for (int i=0; i<n; ++i)
-            {
-                tmp = grad_data[idx[i]];
-                tmp1 += tmp;
-                tmp2 += fabs(tmp)*(1-fabs(tmp));
-            };
-            if (tmp2 == 0)
+            // all the trees of an iteration are fitted to the scores it has started with
+            for( k = 0; k < K; k++ )
             {
-                tmp2 = 1;
+                curClass = k;
+                parallel_for_(Range(0, nsub), GBTGradientInvoker(loss, k, K, delta, &subset[0],
+                              responses.empty() ? 0 : &responses[0], labels.empty() ? 0 : &labels[0],
+                              &scores[0], nall, &w->ord_responses[0]));
+                if( addTree( subset ) < 0 )
+                    return false;
+                evalTree( (int)roots.size() - 1, w->sidx, &result[(size_t)k*n] );
             }
 
-            gamma = ((double)(class_count-1)) / (double)class_count * (tmp1/tmp2);
-        }; break;
-
-    default: break;
-    }
-
-    return float(gamma);
-
-} // CvGBTrees::find_optimal_value
-
-//===========================================================================
-
-
-void CvGBTrees::leaves_get( CvDTreeNode** leaves, int& count, CvDTreeNode* node )
-{
-    if (node->left != NULL)  leaves_get(leaves, count, node->left);
-    if (node->right != NULL) leaves_get(leaves, count, node->right);
-    if ((node->left == NULL) && (node->right == NULL))
-        leaves[count++] = node;
-}
-
-//---------------------------------------------------------------------------
-
-CvDTreeNode** CvGBTrees::GetLeaves( const CvDTree* dtree, int& len )
-{
-    len = 0;
-    CvDTreeNode** leaves = new pCvDTreeNode[(size_t)1 << params.max_depth];
-    leaves_get(leaves, len, const_cast<pCvDTreeNode>(dtree->get_root()));
-    return leaves;
-}
-
-//===========================================================================
-
-void CvGBTrees::do_subsample()
-{
-
-    int n = get_len(sample_idx);
-    int* idx = subsample_train->data.i;
-
-    for (int i = 0; i < n; i++ )
-        idx[i] = i;
-
-    if (subsample_test)
-        for (int i = 0; i < n; i++)
-        {
-            int a = (*rng)(n);
-            int b = (*rng)(n);
-            int t;
-            CV_SWAP( idx[a], idx[b], t );
-        }
-
-/*
-    int n = get_len(sample_idx);
-    if (subsample_train == 0)
-        subsample_train = cvCreateMat(1, n, CV_32S);
-    int* subsample_data = subsample_train->data.i;
-    for (int i=0; i<n; ++i)
-        subsample_data[i] = i;
-    subsample_test = 0;
-*/
-}
-
-//===========================================================================
-
-float CvGBTrees::predict_serial( const CvMat* _sample, const CvMat* _missing,
-        CvMat* weak_responses, CvSlice slice, int k) const
-{
-    float result = 0.0f;
-
-    if (!weak) return 0.0f;
-
-    CvSeqReader reader;
-    int weak_count = cvSliceLength( slice, weak[class_count-1] );
-    CvDTree* tree;
-
-    if (weak_responses)
-    {
-        if (CV_MAT_TYPE(weak_responses->type) != CV_32F)
-            return 0.0f;
-        if ((k >= 0) && (k<class_count) && (weak_responses->rows != 1))
-            return 0.0f;
-        if ((k == -1) && (weak_responses->rows != class_count))
-            return 0.0f;
-        if (weak_responses->cols != weak_count)
-            return 0.0f;
-    }
-
-    float* sum = new float[class_count];
-    memset(sum, 0, class_count*sizeof(float));
+            for( k = 0; k < K; k++ )
+            {
+                double* F = &scores[(size_t)k*nall];
+                const double* r = &result[(size_t)k*n];
+                for( i = 0; i < n; i++ )
+                    F[w->sidx[i]] += r[i];
+            }
 
-    for (int i=0; i<class_count; ++i)
-    {
-        if ((weak[i]) && (weak_count))
-        {
-            cvStartReadSeq( weak[i], &reader );
-            cvSetSeqReaderPos( &reader, slice.start_index );
-            for (int j=0; j<weak_count; ++j)
+            if( nval > 0 )
             {
-                CV_READ_SEQ_ELEM( tree, reader );
-                float p = (float)(tree->predict(_sample, _missing)->value);
-                sum[i] += params.shrinkage * p;
-                if (weak_responses)
-                    weak_responses->data.fl[i*weak_count+j] = p;
+                double vloss = calcLoss(valIdx);
+                if( vloss < bestLoss )
+                {
+                    bestLoss = vloss;
+                    bestIter = iter + 1;
+                    bestNodes = nodes.size();
+                    bestSplits = splits.size();
+                    bestSubsets = subsets.size();
+                }
+                else if( iter + 1 - bestIter >= gparams.earlyStoppingRounds )
+                    break;
             }
         }
-    }
 
-    for (int i=0; i<class_count; ++i)
-        sum[i] += base_value;
-
-    if (class_count == 1)
-    {
-        result = sum[0];
-        delete[] sum;
-        return result;
-    }
-
-    if ((k>=0) && (k<class_count))
-    {
-        result = sum[k];
-        delete[] sum;
-        return result;
-    }
-
-    float max = sum[0];
-    int class_label = 0;
-    for (int i=1; i<class_count; ++i)
-        if (sum[i] > max)
+        // only the iterations up to the best one on the validation samples are kept
+        if( nval > 0 )
         {
-            max = sum[i];
-            class_label = i;
+            roots.resize((size_t)bestIter*K);
+            nodes.resize(bestNodes);
+            splits.resize(bestSplits);
+            subsets.resize(bestSubsets);
         }
 
-    delete[] sum;
-
-    /*
-    int orig_class_label = -1;
-    for (int i=0; i<get_len(class_labels); ++i)
-        if (class_labels->data.i[i] == class_label+1)
-            orig_class_label = i;
-    */
-    int orig_class_label = class_labels->data.i[class_label];
-
-    return float(orig_class_label);
-}
-
-
-class Tree_predictor : public cv::ParallelLoopBody
-{
-private:
-    pCvSeq* weak;
-    float* sum;
-    const int k;
-    const CvMat* sample;
-    const CvMat* missing;
-    const float shrinkage;
-
-    static cv::Mutex SumMutex;
+        // the trees are stored class by class, so that every class is a range of trees
+        int niters = (int)roots.size()/K;
+        if( K > 1 )
+        {
+            vector<int> croots(roots.size());
+            for( iter = 0; iter < niters; iter++ )
+                for( k = 0; k < K; k++ )
+                    croots[k*niters + iter] = roots[iter*K + k];
+            roots.swap(croots);
+        }
 
+        endTraining();
+        return !roots.empty();
+    }
 
-public:
-    Tree_predictor() : weak(0), sum(0), k(0), sample(0), missing(0), shrinkage(1.0f) {}
-    Tree_predictor(pCvSeq* _weak, const int _k, const float _shrinkage,
-                   const CvMat* _sample, const CvMat* _missing, float* _sum ) :
-                   weak(_weak), sum(_sum), k(_k), sample(_sample),
-                   missing(_missing), shrinkage(_shrinkage)
-    {}
-
-    Tree_predictor( const Tree_predictor& p, cv::Split ) :
-            weak(p.weak), sum(p.sum), k(p.k), sample(p.sample),
-            missing(p.missing), shrinkage(p.shrinkage)
-    {}
-
-    Tree_predictor& operator=( const Tree_predictor& )
-    { return *this; }
-
-    virtual void operator()(const cv::Range& range) const
+    // the ensemble output of the sample rows <rows>: the score (regression) or the class of
+    // the highest score; <range> is all the trees here
+    void predictSamples( const Mat& samples, const Range& rows, const Range&,
+                         int flags, float* results ) const
     {
-        CvSeqReader reader;
-        int begin = range.start;
-        int end = range.end;
+        int i, k, n = rows.end - rows.start, K = getClassCount(), niters = getIterCount();
+        int sflags = (flags & ~PREDICT_MASK) | PREDICT_SUM;
+        AutoBuffer<float> _sums((size_t)n*K + 1);
+        float* sums = _sums;
 
-        int weak_count = end - begin;
-        CvDTree* tree;
+        for( k = 0; k < K; k++ )
+            DTreesImpl::predictSamples(samples, rows, Range(k*niters, (k+1)*niters),
+                                       sflags, sums + (size_t)k*n);
 
-        for (int i=0; i<k; ++i)
+        for( i = 0; i < n; i++ )
         {
-            float tmp_sum = 0.0f;
-            if ((weak[i]) && (weak_count))
-            {
-                cvStartReadSeq( weak[i], &reader );
-                cvSetSeqReaderPos( &reader, begin );
-                for (int j=0; j<weak_count; ++j)
-                {
-                    CV_READ_SEQ_ELEM( tree, reader );
-                    tmp_sum += shrinkage*(float)(tree->predict(sample, missing)->value);
-                }
-            }
-
+            if( K == 1 )
             {
-                cv::AutoLock lock(SumMutex);
-                sum[i] += tmp_sum;
+                results[i] = (float)(sums[i] + baseValue);
+                continue;
             }
+            int best = 0;
+            for( k = 1; k < K; k++ )
+                if( sums[(size_t)k*n + i] > sums[(size_t)best*n + i] )
+                    best = k;
+            results[i] = (flags & RAW_OUTPUT) ? (float)best : (float)classLabels[best];
         }
-    } // Tree_predictor::operator()
-
-    virtual ~Tree_predictor() {}
-
-}; // class Tree_predictor
-
-cv::Mutex Tree_predictor::SumMutex;
-
+    }
 
-float CvGBTrees::predict( const CvMat* _sample, const CvMat* _missing,
-            CvMat* /*weak_responses*/, CvSlice slice, int k) const
+    float predict( InputArray _samples, OutputArray _results, int flags ) const
     {
-        float result = 0.0f;
-        if (!weak) return 0.0f;
-        float* sum = new float[class_count];
-        for (int i=0; i<class_count; ++i)
-            sum[i] = 0.0f;
-        int begin = slice.start_index;
-        int end = begin + cvSliceLength( slice, weak[0] );
-
-        pCvSeq* weak_seq = weak;
-        Tree_predictor predictor = Tree_predictor(weak_seq, class_count,
-                                    params.shrinkage, _sample, _missing, sum);
-
-        cv::parallel_for_(cv::Range(begin, end), predictor);
+        CV_Assert( !roots.empty() );
+        Mat samples = _samples.getMat(), results;
+        int i, nsamples = samples.rows;
+        bool needresults = _results.needed();
 
-        for (int i=0; i<class_count; ++i)
-            sum[i] = sum[i] /** params.shrinkage*/ + base_value;
-
-        if (class_count == 1)
+        if( needresults )
         {
-            result = sum[0];
-            delete[] sum;
-            return result;
+            _results.create(nsamples, 1, CV_32F);
+            results = _results.getMat();
         }
+        else
+            nsamples = std::min(nsamples, 1);
 
-        if ((k>=0) && (k<class_count))
-        {
-            result = sum[k];
-            delete[] sum;
-            return result;
-        }
-
-        float max = sum[0];
-        int class_label = 0;
-        for (int i=1; i<class_count; ++i)
-            if (sum[i] > max)
-            {
-                max = sum[i];
-                class_label = i;
-            }
-
-        delete[] sum;
-        int orig_class_label = class_labels->data.i[class_label];
+        AutoBuffer<float> _vals(nsamples + 1);
+        float* vals = _vals;
+        predictBatch( samples.rowRange(0, nsamples), flags, vals );
 
-        return float(orig_class_label);
+        if( needresults )
+            for( i = 0; i < nsamples; i++ )
+                results.at<float>(i) = vals[i];
+        return nsamples > 0 ? vals[0] : 0.f;
     }
 
-
-//===========================================================================
-
-void CvGBTrees::write_params( CvFileStorage* fs ) const
-{
-    const char* loss_function_type_str =
-        params.loss_function_type == SQUARED_LOSS ? "SquaredLoss" :
-        params.loss_function_type == ABSOLUTE_LOSS ? "AbsoluteLoss" :
-        params.loss_function_type == HUBER_LOSS ? "HuberLoss" :
-        params.loss_function_type == DEVIANCE_LOSS ? "DevianceLoss" : 0;
-
-
-    if( loss_function_type_str )
-        cvWriteString( fs, "loss_function", loss_function_type_str );
-    else
-        cvWriteInt( fs, "loss_function", params.loss_function_type );
-
-    cvWriteInt( fs, "ensemble_length", params.weak_count );
-    cvWriteReal( fs, "shrinkage", params.shrinkage );
-    cvWriteReal( fs, "subsample_portion", params.subsample_portion );
-    //cvWriteInt( fs, "max_tree_depth", params.max_depth );
-    //cvWriteString( fs, "use_surrogate_splits", params.use_surrogates ? "true" : "false");
-    if (class_labels) cvWrite( fs, "class_labels", class_labels);
-
-    data->is_classifier = !problem_type();
-    data->write_params( fs );
-    data->is_classifier = 0;
-}
-
-
-//===========================================================================
-
-void CvGBTrees::read_params( CvFileStorage* fs, CvFileNode* fnode )
-{
-    CV_FUNCNAME( "CvGBTrees::read_params" );
-    __BEGIN__;
-
-
-    CvFileNode* temp;
-
-    if( !fnode || !CV_NODE_IS_MAP(fnode->tag) )
-        return;
-
-    data = new CvDTreeTrainData();
-    CV_CALL( data->read_params(fs, fnode));
-    data->shared = true;
-
-    params.max_depth = data->params.max_depth;
-    params.min_sample_count = data->params.min_sample_count;
-    params.max_categories = data->params.max_categories;
-    params.priors = data->params.priors;
-    params.regression_accuracy = data->params.regression_accuracy;
-    params.use_surrogates = data->params.use_surrogates;
-
-    temp = cvGetFileNodeByName( fs, fnode, "loss_function" );
-    if( !temp )
-        EXIT;
-
-    if( temp && CV_NODE_IS_STRING(temp->tag) )
-    {
-        const char* loss_function_type_str = cvReadString( temp, "" );
-        params.loss_function_type = strcmp( loss_function_type_str, "SquaredLoss" ) == 0 ? SQUARED_LOSS :
-                            strcmp( loss_function_type_str, "AbsoluteLoss" ) == 0 ? ABSOLUTE_LOSS :
-                            strcmp( loss_function_type_str, "HuberLoss" ) == 0 ? HUBER_LOSS :
-                            strcmp( loss_function_type_str, "DevianceLoss" ) == 0 ? DEVIANCE_LOSS : -1;
+    void writeTrainingParams( FileStorage& fs ) const
+    {
+        int loss = gparams.lossFunctionType;
+        fs << "loss_function" <<
+        (loss == GBTrees::SQUARED_LOSS ? "SquaredLoss" :
+        loss == GBTrees::ABSOLUTE_LOSS ? "AbsoluteLoss" :
+        loss == GBTrees::HUBER_LOSS ? "HuberLoss" :
+        loss == GBTrees::DEVIANCE_LOSS ? "DevianceLoss" : "Unknown");
+
+        DTreesImpl::writeTrainingParams(fs);
+        fs << "ensemble_length" << gparams.weakCount;
+        fs << "shrinkage" << gparams.shrinkage;
+        fs << "subsample_portion" << gparams.subsamplePortion;
+        fs << "validation_portion" << gparams.validationPortion;
+        fs << "early_stopping_rounds" << gparams.earlyStoppingRounds;
     }
-    else
-        params.loss_function_type = cvReadInt( temp, -1 );
-
-
-    if( params.loss_function_type < SQUARED_LOSS || params.loss_function_type > DEVIANCE_LOSS ||  params.loss_function_type == 2)
-        CV_ERROR( CV_StsBadArg, "Unknown loss function" );
 
-    params.weak_count = cvReadIntByName( fs, fnode, "ensemble_length" );
-    params.shrinkage = (float)cvReadRealByName( fs, fnode, "shrinkage", 0.1 );
-    params.subsample_portion = (float)cvReadRealByName( fs, fnode, "subsample_portion", 1.0 );
-
-    if (data->is_classifier)
+    void write( FileStorage& fs ) const
     {
-        class_labels = (CvMat*)cvReadByName( fs, fnode, "class_labels" );
-        if( class_labels && !CV_IS_MAT(class_labels))
-            CV_ERROR( CV_StsParseError, "class_labels must stored as a matrix");
-    }
-    data->is_classifier = 0;
-
-    __END__;
-}
-
-
-
-
-void CvGBTrees::write( CvFileStorage* fs, const char* name ) const
-{
-    CV_FUNCNAME( "CvGBTrees::write" );
-
-    __BEGIN__;
-
-    CvSeqReader reader;
-    int i;
-    cv::String s;
+        if( roots.empty() )
+            CV_Error( CV_StsBadArg, "GBTrees have not been trained" );
 
-    cvStartWriteStruct( fs, name, CV_NODE_MAP, CV_TYPE_NAME_ML_GBT );
+        writeParams(fs);
 
-    if( !weak )
-        CV_ERROR( CV_StsBadArg, "The model has not been trained yet" );
+        int k, ntrees = (int)roots.size();
 
-    write_params( fs );
-    cvWriteReal( fs, "base_value", base_value);
-    cvWriteInt( fs, "class_count", class_count);
+        fs << "base_value" << baseValue;
+        fs << "ntrees" << ntrees
+        << "trees" << "[";
 
-    for ( int j=0; j < class_count; ++j )
-    {
-        s = cv::format("trees_%d", j);
-        cvStartWriteStruct( fs, s.c_str(), CV_NODE_SEQ );
-
-        cvStartReadSeq( weak[j], &reader );
-
-        for( i = 0; i < weak[j]->total; i++ )
+        for( k = 0; k < ntrees; k++ )
         {
-            CvDTree* tree;
-            CV_READ_SEQ_ELEM( tree, reader );
-            cvStartWriteStruct( fs, 0, CV_NODE_MAP );
-            tree->write( fs );
-            cvEndWriteStruct( fs );
+            fs << "{";
+            writeTree(fs, roots[k]);
+            fs << "}";
         }
 
-        cvEndWriteStruct( fs );
+        fs << "]";
     }
 
-    cvEndWriteStruct( fs );
-
-    __END__;
-}
-
-
-//===========================================================================
-
-
-void CvGBTrees::read( CvFileStorage* fs, CvFileNode* node )
-{
-
-    CV_FUNCNAME( "CvGBTrees::read" );
-
-    __BEGIN__;
-
-    CvSeqReader reader;
-    CvFileNode* trees_fnode;
-    CvMemStorage* storage;
-    int i, ntrees;
-    cv::String s;
-
-    clear();
-    read_params( fs, node );
-
-    if( !data )
-        EXIT;
-
-    base_value = (float)cvReadRealByName( fs, node, "base_value", 0.0 );
-    class_count = cvReadIntByName( fs, node, "class_count", 1 );
-
-    weak = new pCvSeq[class_count];
-
+    void readParams( const FileNode& fn )
+    {
+        DTreesImpl::readParams(fn);
+        gparams.maxDepth = params0.maxDepth;
+        gparams.minSampleCount = params0.minSampleCount;
+        gparams.regressionAccuracy = params0.regressionAccuracy;
+        gparams.useSurrogates = params0.useSurrogates;
+        gparams.maxCategories = params0.maxCategories;
+        gparams.priors = params0.priors;
+
+        FileNode tparams_node = fn["training_params"];
+        String lts = (String)tparams_node["loss_function"];
+        gparams.lossFunctionType = (lts == "SquaredLoss" ? GBTrees::SQUARED_LOSS :
+                                    lts == "AbsoluteLoss" ? GBTrees::ABSOLUTE_LOSS :
+                                    lts == "HuberLoss" ? GBTrees::HUBER_LOSS :
+                                    lts == "DevianceLoss" ? GBTrees::DEVIANCE_LOSS : -1);
+        if( gparams.lossFunctionType < 0 )
+            CV_Error( CV_StsParseError, "Unknown loss function" );
+        gparams.weakCount = (int)tparams_node["ensemble_length"];
+        gparams.shrinkage = (float)tparams_node["shrinkage"];
+        gparams.subsamplePortion = (float)tparams_node["subsample_portion"];
+        gparams.validationPortion = (float)tparams_node["validation_portion"];
+        gparams.earlyStoppingRounds = (int)tparams_node["early_stopping_rounds"];
+    }
 
-    for (int j=0; j<class_count; ++j)
+    void read( const FileNode& fn )
     {
-        s = cv::format("trees_%d", j);
-
-        trees_fnode = cvGetFileNodeByName( fs, node, s.c_str() );
-        if( !trees_fnode || !CV_NODE_IS_SEQ(trees_fnode->tag) )
-            CV_ERROR( CV_StsParseError, "<trees_x> tag is missing" );
-
-        cvStartReadSeq( trees_fnode->data.seq, &reader );
-        ntrees = trees_fnode->data.seq->total;
+        clear();
 
-        if( ntrees != params.weak_count )
-            CV_ERROR( CV_StsUnmatchedSizes,
-            "The number of trees stored does not match <ntrees> tag value" );
+        int ntrees = (int)fn["ntrees"];
+        readParams(fn);
+        baseValue = (double)fn["base_value"];
 
-        CV_CALL( storage = cvCreateMemStorage() );
-        weak[j] = cvCreateSeq( 0, sizeof(CvSeq), sizeof(CvDTree*), storage );
+        FileNode trees_node = fn["trees"];
+        FileNodeIterator it = trees_node.begin();
+        CV_Assert( ntrees == (int)trees_node.size() && ntrees % getClassCount() == 0 );
 
-        for( i = 0; i < ntrees; i++ )
+        for( int treeidx = 0; treeidx < ntrees; treeidx++, ++it )
         {
-            CvDTree* tree = new CvDTree();
-            CV_CALL(tree->read( fs, (CvFileNode*)reader.ptr, data ));
-            CV_NEXT_SEQ_ELEM( reader.seq->elem_size, reader );
-            cvSeqPush( weak[j], &tree );
+            FileNode nfn = (*it)["nodes"];
+            readTree(nfn);
         }
     }
 
-    __END__;
-}
-
-//===========================================================================
-
-class Sample_predictor : public cv::ParallelLoopBody
+    GBTrees::Params gparams;
+    double baseValue;
+    //! the Huber loss threshold of the current iteration
+    double delta;
+    //! the class of the tree being grown
+    int curClass;
+    //! the number of samples of the training data and their ensemble outputs, class by class
+    int nall;
+    vector<double> scores;
+    //! the original responses (regression) or class indices (DEVIANCE_LOSS)
+    vector<double> responses;
+    vector<int> labels;
+};
+
+
+class GBTreesImpl : public GBTrees
 {
-private:
-    const CvGBTrees* gbt;
-    float* predictions;
-    const CvMat* samples;
-    const CvMat* missing;
-    const CvMat* idx;
-    CvSlice slice;
-
 public:
-    Sample_predictor() : gbt(0), predictions(0), samples(0), missing(0),
-                         idx(0), slice(CV_WHOLE_SEQ)
-    {}
-
-    Sample_predictor(const CvGBTrees* _gbt, float* _predictions,
-                   const CvMat* _samples, const CvMat* _missing,
-                   const CvMat* _idx, CvSlice _slice=CV_WHOLE_SEQ) :
-                   gbt(_gbt), predictions(_predictions), samples(_samples),
-                   missing(_missing), idx(_idx), slice(_slice)
-    {}
-
+    GBTreesImpl() {}
+    virtual ~GBTreesImpl() {}
 
-    Sample_predictor( const Sample_predictor& p, cv::Split ) :
-            gbt(p.gbt), predictions(p.predictions),
-            samples(p.samples), missing(p.missing), idx(p.idx),
-            slice(p.slice)
-    {}
+    String getDefaultModelName() const { return "opencv_ml_gbtrees"; }
 
-
-    virtual void operator()(const cv::Range& range) const
+    bool train( const Ptr<TrainData>& trainData, int flags )
     {
-        int begin = range.start;
-        int end = range.end;
-
-        CvMat x;
-        CvMat miss;
-
-        for (int i=begin; i<end; ++i)
-        {
-            int j = idx ? idx->data.i[i] : i;
-            cvGetRow(samples, &x, j);
-            if (!missing)
-            {
-                predictions[i] = gbt->predict_serial(&x,0,0,slice);
-            }
-            else
-            {
-                cvGetRow(missing, &miss, j);
-                predictions[i] = gbt->predict_serial(&x,&miss,0,slice);
-            }
-        }
-    } // Sample_predictor::operator()
-
-    virtual ~Sample_predictor() {}
-
-}; // class Sample_predictor
-
-
-
-// type in {CV_TRAIN_ERROR, CV_TEST_ERROR}
-float
-CvGBTrees::calc_error( CvMLData* _data, int type, std::vector<float> *resp )
-{
-
-    float err = 0.0f;
-    const CvMat* _sample_idx = (type == CV_TRAIN_ERROR) ?
-                              _data->get_train_sample_idx() :
-                              _data->get_test_sample_idx();
-    const CvMat* response = _data->get_responses();
-
-    int n = _sample_idx ? get_len(_sample_idx) : 0;
-    n = (type == CV_TRAIN_ERROR && n == 0) ? _data->get_values()->rows : n;
-
-    if (!n)
-        return -FLT_MAX;
+        return impl.train(trainData, flags);
+    }
 
-    float* pred_resp = 0;
-    if (resp)
+    float predict( InputArray samples, OutputArray results, int flags ) const
     {
-        resp->resize(n);
-        pred_resp = &((*resp)[0]);
+        return impl.predict(samples, results, flags);
     }
-    else
-        pred_resp = new float[n];
-
-    Sample_predictor predictor = Sample_predictor(this, pred_resp, _data->get_values(),
-            _data->get_missing(), _sample_idx);
 
-    cv::parallel_for_(cv::Range(0,n), predictor);
-
-    int* sidx = _sample_idx ? _sample_idx->data.i : 0;
-    int r_step = CV_IS_MAT_CONT(response->type) ?
-                1 : response->step / CV_ELEM_SIZE(response->type);
-
-
-    if ( !problem_type() )
+    void write( FileStorage& fs ) const
     {
-        for( int i = 0; i < n; i++ )
-        {
-            int si = sidx ? sidx[i] : i;
-            int d = fabs((double)pred_resp[i] - response->data.fl[si*r_step]) <= FLT_EPSILON ? 0 : 1;
-            err += d;
-        }
-        err = err / (float)n * 100.0f;
+        impl.write(fs);
     }
-    else
+
+    void read( const FileNode& fn )
     {
-        for( int i = 0; i < n; i++ )
-        {
-            int si = sidx ? sidx[i] : i;
-            float d = pred_resp[i] - response->data.fl[si*r_step];
-            err += d*d;
-        }
-        err = err / (float)n;
+        impl.read(fn);
     }
 
-    return err;
-}
+    void setGParams(const Params& p) { impl.setGParams(p); }
+    Params getGParams() const { return impl.getGParams(); }
+    int getIterCount() const { return impl.getIterCount(); }
 
+    int getVarCount() const { return impl.getVarCount(); }
 
-CvGBTrees::CvGBTrees( const cv::Mat& trainData, int tflag,
-          const cv::Mat& responses, const cv::Mat& varIdx,
-          const cv::Mat& sampleIdx, const cv::Mat& varType,
-          const cv::Mat& missingDataMask,
-          CvGBTreesParams _params )
-{
-    data = 0;
-    weak = 0;
-    default_model_name = "my_boost_tree";
-    orig_response = sum_response = sum_response_tmp = 0;
-    subsample_train = subsample_test = 0;
-    missing = sample_idx = 0;
-    class_labels = 0;
-    class_count = 1;
-    delta = 0.0f;
-
-    clear();
-
-    train(trainData, tflag, responses, varIdx, sampleIdx, varType, missingDataMask, _params, false);
-}
+    bool isTrained() const { return impl.isTrained(); }
+    bool isClassifier() const { return impl.isClassifier(); }
 
-bool CvGBTrees::train( const cv::Mat& trainData, int tflag,
-                   const cv::Mat& responses, const cv::Mat& varIdx,
-                   const cv::Mat& sampleIdx, const cv::Mat& varType,
-                   const cv::Mat& missingDataMask,
-                   CvGBTreesParams _params,
-                   bool update )
-{
-    CvMat _trainData = trainData, _responses = responses;
-    CvMat _varIdx = varIdx, _sampleIdx = sampleIdx, _varType = varType;
-    CvMat _missingDataMask = missingDataMask;
+    const vector<int>& getRoots() const { return impl.getRoots(); }
+    const vector<Node>& getNodes() const { return impl.getNodes(); }
+    const vector<Split>& getSplits() const { return impl.getSplits(); }
+    const vector<int>& getSubsets() const { return impl.getSubsets(); }
 
-    return train( &_trainData, tflag, &_responses, varIdx.empty() ? 0 : &_varIdx,
-                  sampleIdx.empty() ? 0 : &_sampleIdx, varType.empty() ? 0 : &_varType,
-                  missingDataMask.empty() ? 0 : &_missingDataMask, _params, update);
-}
+    DTreesImplForGBT impl;
+};
 
-float CvGBTrees::predict( const cv::Mat& sample, const cv::Mat& _missing,
-                          const cv::Range& slice, int k ) const
+
+Ptr<GBTrees> GBTrees::create(const Params& params)
 {
-    CvMat _sample = sample, miss = _missing;
-    return predict(&_sample, _missing.empty() ? 0 : &miss, 0,
-                   slice==cv::Range::all() ? CV_WHOLE_SEQ : cvSlice(slice.start, slice.end), k);
+    Ptr<GBTreesImpl> p = makePtr<GBTreesImpl>();
+    p->setGParams(params);
+    return p;
 }
 
-#endif
+}}
+
+/* End of file. */
@@ -0,0 +1,217 @@
+#ifndef HOGDETECT_H
+#define HOGDETECT_H
+
+#include "precomp.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/objdetect.hpp"
+
+namespace cv
+{
+namespace hsaml
+{
+
+/*!
+ HOG block histograms of a whole image.
+
+ The blocks are stored in the HOGDescriptor order (x-major, blockHistSize floats
+ per block), so the descriptor of a detection window placed at block (x, y) is the
+ winBlocks sub-grid starting at block (x, y), and each of its block columns is a
+ contiguous run of winBlocks.height*blockHistSize floats.
+*/
+struct CV_EXPORTS HOGBlockGrid
+{
+    HOGBlockGrid() : blockHistSize(0) {}
+
+    const float* block( int x, int y ) const
+    { return data.ptr<float>() + ((size_t)x*nblocks.height + y)*blockHistSize; }
+
+    //! nblocks.area()*blockHistSize floats
+    Mat data;
+    //! the same histograms in the scoring precision of the detector: CV_8S for int8,
+    //! CV_16U (half floats) for fp16, empty for fp32
+    Mat qdata;
+    Size nblocks;
+    int blockHistSize;
+};
+
+//! rejection cascade statistics for one stage length, measured on the samples given to
+//! trainCascade()
+struct CV_EXPORTS HOGCascadeStats
+{
+    //! number of blocks scored by the rejection stage
+    int length;
+    //! the stage rejects a window if its partial score is below the threshold
+    float threshold;
+    //! fraction of the positives accepted by the full detector that the stage rejects
+    double missRate;
+    //! fraction of the negatives that the stage rejects
+    double rejectRate;
+    //! estimated scoring speedup over the full dot product
+    double speedup;
+};
+
+//! parameters of groupDetections()
+struct CV_EXPORTS NMSParams
+{
+    enum { GREEDY = 0, SOFT = 1, MEANSHIFT = 2 };
+
+    NMSParams( int _method = GREEDY, double _overlap = 0.5, int _minNeighbors = 0 )
+        : method( _method ), overlap( _overlap ), sigma( 0.5 ), bandwidth( 0.125 ),
+          scoreThreshold( 0 ), softMinScore( 0.1 ), minNeighbors( _minNeighbors ) {}
+
+    int method;
+    //! greedy: IoU above which a box is suppressed; soft: IoU counted as a neighbour
+    double overlap;
+    //! soft-NMS gaussian decay, score margin *= exp(-iou^2/sigma)
+    double sigma;
+    //! mean-shift bandwidth in x and y, as a fraction of the box size
+    double bandwidth;
+    //! detection threshold: soft-NMS decays and mean-shift weights the margin above it
+    double scoreThreshold;
+    //! soft-NMS drops the boxes whose decayed margin falls below it
+    double softMinScore;
+    //! a detection is kept only if at least this number of other boxes were grouped with it
+    int minNeighbors;
+};
+
+/*!
+ Non-maximum suppression of scored detections, in place.
+
+ GREEDY keeps the best box and suppresses the ones overlapping it, SOFT decays the scores
+ of the overlapping boxes instead (soft-NMS), MEANSHIFT looks for the modes of the
+ detection density in (x, y, log scale). The boxes are processed in score order and their
+ neighbours are found through a uniform grid index, so the cost grows as n log n with the
+ number of candidates instead of n^2 as in groupRectangles().
+*/
+CV_EXPORTS void groupDetections( std::vector<Rect>& rects, std::vector<double>& scores,
+                                 const NMSParams& params = NMSParams() );
+
+/*!
+ Linear HOG-SVM detector scoring the windows on a HOGBlockGrid.
+
+ Each pyramid level is described once (HOGLinearDetector::computeGrid()), after which
+ scoring a window costs a dot product with the weight vector and no HOG computation.
+
+ The optional rejection cascade first scores the <cascadeLength> window blocks with the
+ largest weights and drops the window when this partial score is below
+ <cascadeThreshold>; the remaining blocks are only scored for the windows that pass.
+ The stage is learned by trainCascade() and saved with the model by write().
+
+ The windows can also be scored in reduced precision (setPrecision()): fp16 halves the
+ memory traffic of the grid and of the weights; int8 quarters it and uses integer dot
+ products, with one scale per weight block and a histogram scale found by calibrate().
+ The SSSE3 (int8) and F16C (fp16) dot products are selected at run time. Without F16C,
+ fp16 would be slower than fp32, so setPrecision() keeps fp32 then.
+*/
+class CV_EXPORTS HOGLinearDetector
+{
+public:
+    enum { PRECISION_FP32 = 0, PRECISION_FP16 = 1, PRECISION_INT8 = 2 };
+
+    HOGLinearDetector();
+    //! <detector> is the HOGDescriptor::setSVMDetector() vector: weights followed by the bias
+    HOGLinearDetector( const HOGDescriptor& hog, const std::vector<float>& detector );
+
+    void setDetector( const HOGDescriptor& hog, const std::vector<float>& detector );
+    bool empty() const { return weights.empty(); }
+    int getBlockCount() const { return winBlocks.area(); }
+
+    //! sets the int8 histogram scale from the values of the window descriptors <samples>
+    void calibrate( const std::vector<Mat>& samples );
+    //! quantizes the weights for one of PRECISION_*; PRECISION_FP16 needs F16C, else fp32 is used
+    void setPrecision( int precision );
+    //! scores one window descriptor in the current precision, without the cascade
+    double calcScore( const Mat& descriptor ) const;
+
+    //! computes the block histograms of <img> (converted to gray if needed)
+    void computeGrid( const Mat& img, HOGBlockGrid& grid ) const;
+    //! scores all the windows of the grid; <hits> are the window positions in blocks
+    void detect( const HOGBlockGrid& grid, std::vector<Point>& hits,
+                 std::vector<double>& scores, double hitThreshold = 0 ) const;
+    //! the raw hits are grouped by groupDetections() with <nms>, <groupThreshold> neighbours
+    //! being required per detection; groupThreshold <= 0 returns the raw hits
+    void detectMultiScale( const Mat& img, std::vector<Rect>& found, std::vector<double>& foundWeights,
+                           double hitThreshold = 0, double scale0 = 1.05, int groupThreshold = 2 ) const;
+    void detectMultiScale( const Mat& img, std::vector<Rect>& found,
+                           double hitThreshold = 0, double scale0 = 1.05, int groupThreshold = 2 ) const;
+
+    /*!
+     Learns the rejection stage from the window descriptors <samples> (computed with the
+     same HOGDescriptor) and their labels (>0 for positives). They should be held out from
+     the training of the detector, whose scores would otherwise make the miss rate optimistic. For every candidate stage
+     length the threshold is set so that at most <maxMissRate> of the positives accepted
+     by the full detector are rejected; the length giving the best estimated speedup is
+     kept. The statistics of all the candidates are returned in <report>.
+    */
+    void trainCascade( const std::vector<Mat>& samples, const std::vector<int>& labels,
+                       double maxMissRate = 0.01, std::vector<HOGCascadeStats>* report = 0 );
+
+    //! writes/reads the rejection cascade and the scoring precision
+    void write( FileStorage& fs ) const;
+    void read( const FileNode& fn );
+
+    HOGDescriptor hog;
+    //! detection window size in blocks
+    Size winBlocks;
+    int blockHistSize;
+    std::vector<float> weights;
+    float bias;
+
+    bool useCascade;
+    //! window blocks (x*winBlocks.height + y) in the scoring order, rejection stage first
+    std::vector<int> cascadeBlocks;
+    int cascadeLength;
+    float cascadeThreshold;
+
+    int precision;
+    //! int8 histogram value = saturate(value*descScale), in [0, 127]
+    float descScale;
+    //! int8 weights and, per window block, weight scale/descScale
+    std::vector<schar> qweights;
+    std::vector<float> qscales;
+    //! fp16 weights
+    std::vector<ushort> hweights;
+
+    //! grouping of the multi-scale detections
+    NMSParams nms;
+
+protected:
+    friend class HOGMultiDetector;
+
+    void quantizeGrid( HOGBlockGrid& grid ) const;
+    double scoreWindow( const HOGBlockGrid& grid, int x, int y, const int* ofs, bool cascade ) const;
+};
+
+/*!
+ Several linear HOG detectors sharing one feature pyramid.
+
+ The models must describe the image with the same HOG block parameters; their windows,
+ cascades and precisions may differ. Each pyramid level is described once and every window
+ position is scored against all the models in turn while its blocks are still in the cache,
+ so running K models costs about one feature extraction plus K dot products per window.
+*/
+class CV_EXPORTS HOGMultiDetector
+{
+public:
+    //! adds a model; its block parameters must match the ones of the models already added
+    void addModel( const HOGLinearDetector& model );
+    int getModelCount() const { return (int)models.size(); }
+
+    //! scores all the windows of a grid computed by models[0].computeGrid() against all the
+    //! models; <hits>[k] are the window positions in blocks for the k-th model
+    void detect( const HOGBlockGrid& grid, std::vector<std::vector<Point> >& hits,
+                 std::vector<std::vector<double> >& scores, double hitThreshold = 0 ) const;
+
+    //! <found>[k] and <foundWeights>[k] are the detections of the k-th model, grouped with
+    //! its nms parameters as in HOGLinearDetector::detectMultiScale()
+    void detectMultiScale( const Mat& img, std::vector<std::vector<Rect> >& found,
+                           std::vector<std::vector<double> >& foundWeights, double hitThreshold = 0,
+                           double scale0 = 1.05, int groupThreshold = 2 ) const;
+
+    std::vector<HOGLinearDetector> models;
+};
+
+}
+}
+
+#endif
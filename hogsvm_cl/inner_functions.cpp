@@ -65,7 +65,124 @@ bool StatModel::train( InputArray samples, int layout, InputArray responses )
     return train(TrainData::create(samples, layout, responses));
 }
 
+bool StatModel::trainChunked( const Ptr<ChunkedTrainData>&, int )
+{
+    CV_Error(CV_StsNotImplemented, "the model can not be trained on chunked data");
+    return false;
+}
+
+/* Accumulates the prediction error of a range of samples, and for classifiers the confusion
+   matrix, then adds them to the totals. */
+class CalcErrorInvoker : public ParallelLoopBody
+{
+public:
+    CalcErrorInvoker( const float* _pred, const float* _resp, const int* _sidx, bool _isclassifier,
+                      const Mat& _labels, double* _err, Mat& _confusion, Mutex* _mutex )
+    {
+        pred = _pred;
+        resp = _resp;
+        sidx = _sidx;
+        isclassifier = _isclassifier;
+        labels = _labels;
+        err = _err;
+        confusion = &_confusion;
+        mutex = _mutex;
+    }
+
+    int classIdx( float val ) const
+    {
+        const int* l = labels.ptr<int>();
+        int n = (int)labels.total(), v = cvRound(val);
+        const int* p = std::lower_bound(l, l + n, v);
+        return p < l + n && *p == v ? (int)(p - l) : -1;
+    }
+
+    void operator()( const Range& range ) const
+    {
+        int i, nclasses = confusion->empty() ? 0 : confusion->rows;
+        vector<int> counts(nclasses*nclasses, 0);
+        double e = 0;
+
+        for( i = range.start; i < range.end; i++ )
+        {
+            float val = pred[i];
+            float val0 = resp[sidx ? sidx[i] : i];
+
+            if( isclassifier )
+            {
+                e += fabs(val - val0) > FLT_EPSILON;
+                if( nclasses > 0 )
+                {
+                    int ci = classIdx(val0), cj = classIdx(val);
+                    if( ci >= 0 && cj >= 0 )
+                        counts[ci*nclasses + cj]++;
+                }
+            }
+            else
+                e += (val - val0)*(val - val0);
+        }
+
+        AutoLock lock(*mutex);
+        *err += e;
+        for( i = 0; i < nclasses*nclasses; i++ )
+            confusion->ptr<int>()[i] += counts[i];
+    }
+
+protected:
+    const float* pred;
+    const float* resp;
+    const int* sidx;
+    bool isclassifier;
+    Mat labels;
+    double* err;
+    Mat* confusion;
+    Mutex* mutex;
+};
+
+struct cmp_score_gt
+{
+    cmp_score_gt( const float* _score ) : score(_score) {}
+    bool operator()( int a, int b ) const { return score[a] > score[b]; }
+    const float* score;
+};
+
+/* ROC curve of the raw outputs <score> for the positive class <pos>: one (threshold, false
+   positive rate, true positive rate) row per distinct score, from the highest one down. */
+static void calcROC( const vector<float>& score, const vector<int>& positive, Mat& roc )
+{
+    int i, n = (int)score.size(), npos = 0;
+    vector<int> order(n);
+    for( i = 0; i < n; i++ )
+    {
+        order[i] = i;
+        npos += positive[i];
+    }
+    int nneg = n - npos;
+    std::sort(order.begin(), order.end(), cmp_score_gt(&score[0]));
+
+    vector<Vec3f> curve;
+    curve.push_back(Vec3f(FLT_MAX, 0.f, 0.f));
+    int tp = 0, fp = 0;
+    for( i = 0; i < n; i++ )
+    {
+        int k = order[i];
+        if( positive[k] )
+            tp++;
+        else
+            fp++;
+        if( i == n-1 || score[order[i+1]] != score[k] )
+            curve.push_back(Vec3f(score[k], nneg ? (float)fp/nneg : 0.f, npos ? (float)tp/npos : 0.f));
+    }
+    Mat((int)curve.size(), 3, CV_32F, &curve[0]).copyTo(roc);
+}
+
 float StatModel::calcError( const Ptr<TrainData>& data, bool testerr, OutputArray _resp ) const
+{
+    return calcError( data, testerr, _resp, noArray(), noArray() );
+}
+
+float StatModel::calcError( const Ptr<TrainData>& data, bool testerr, OutputArray _resp,
+                            OutputArray _confusion, OutputArray _roc ) const
 {
     Mat samples = data->getSamples();
     int layout = data->getLayout();
@@ -81,32 +198,84 @@ float StatModel::calcError( const Ptr<TrainData>& data, bool testerr, OutputArra
     if( n == 0 )
         return -FLT_MAX;
 
+    // the selected samples as one block, so that predict() is called once for all of them
+    Mat batch;
+    if( layout == ROW_SAMPLE && !sidx_ptr )
+        batch = samples;
+    else
+    {
+        batch.create(n, layout == ROW_SAMPLE ? samples.cols : samples.rows, samples.type());
+        for( i = 0; i < n; i++ )
+        {
+            int si = sidx_ptr ? sidx_ptr[i] : i;
+            if( layout == ROW_SAMPLE )
+                samples.row(si).copyTo(batch.row(i));
+            else
+                transpose(samples.col(si), batch.row(i));
+        }
+    }
+
     Mat resp;
-    if( _resp.needed() )
-        resp.create(n, 1, CV_32F);
+    predict(batch, resp);
+    CV_Assert( resp.total() == (size_t)n );
+    resp = resp.reshape(1, n);
+    if( resp.type() != CV_32F )
+        resp.convertTo(resp, CV_32F);
 
-    double err = 0;
-    for( i = 0; i < n; i++ )
+    Mat labels, confusion;
+    if( isclassifier && (_confusion.needed() || _roc.needed()) )
     {
-        int si = sidx_ptr ? sidx_ptr[i] : i;
-        Mat sample = layout == ROW_SAMPLE ? samples.row(si) : samples.col(si);
-        float val = predict(sample);
-        float val0 = responses.at<float>(si);
-
-        if( isclassifier )
-            err += fabs(val - val0) > FLT_EPSILON;
-        else
-            err += (val - val0)*(val - val0);
-        if( !resp.empty() )
-            resp.at<float>(i) = val;
-        /*if( i < 100 )
-        {
-            printf("%d. ref %.1f vs pred %.1f\n", i, val0, val);
-        }*/
+        labels = data->getClassLabels();
+        if( labels.type() != CV_32S )
+            labels.convertTo(labels, CV_32S);
     }
+    if( !labels.empty() && _confusion.needed() )
+        confusion = Mat::zeros((int)labels.total(), (int)labels.total(), CV_32S);
+
+    double err = 0;
+    Mutex mutex;
+    parallel_for_(Range(0, n), CalcErrorInvoker(resp.ptr<float>(), responses.ptr<float>(), sidx_ptr,
+                                                isclassifier, labels, &err, confusion, &mutex));
 
     if( _resp.needed() )
         resp.copyTo(_resp);
+    if( _confusion.needed() )
+        confusion.copyTo(_confusion);
+
+    // The ROC curve needs the raw outputs, so it costs a second batched call. The outputs
+    // are negated if the model gives lower ones to the samples it labels with the second class.
+    if( _roc.needed() )
+    {
+        Mat roc;
+        if( labels.total() == 2 )
+        {
+            Mat raw;
+            predict(batch, raw, RAW_OUTPUT);
+            raw = raw.reshape(1, n);
+            if( raw.type() != CV_32F )
+                raw.convertTo(raw, CV_32F);
+
+            int pos_label = labels.at<int>(1);
+            vector<float> score(n);
+            vector<int> positive(n);
+            double sum[2] = { 0, 0 };
+            int count[2] = { 0, 0 };
+            for( i = 0; i < n; i++ )
+            {
+                int si = sidx_ptr ? sidx_ptr[i] : i;
+                int k = cvRound(resp.at<float>(i)) == pos_label;
+                score[i] = raw.at<float>(i);
+                positive[i] = cvRound(responses.at<float>(si)) == pos_label;
+                sum[k] += score[i];
+                count[k]++;
+            }
+            if( count[0] > 0 && count[1] > 0 && sum[1]/count[1] < sum[0]/count[0] )
+                for( i = 0; i < n; i++ )
+                    score[i] = -score[i];
+            calcROC(score, positive, roc);
+        }
+        roc.copyTo(_roc);
+    }
 
     return (float)(err / n * (isclassifier ? 100 : 1));
 }
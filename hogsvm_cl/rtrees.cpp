@@ -54,6 +54,7 @@ RTrees::Params::Params()
     calcVarImportance = false;
     nactiveVars = 0;
     termCrit = TermCriteria(TermCriteria::EPS + TermCriteria::COUNT, 50, 0.1);
+    importanceSampleCount = 0;
 }
 
 RTrees::Params::Params( int _maxDepth, int _minSampleCount,
@@ -67,6 +68,7 @@ RTrees::Params::Params( int _maxDepth, int _minSampleCount,
     calcVarImportance = _calcVarImportance;
     nactiveVars = _nactiveVars;
     termCrit = _termCrit;
+    importanceSampleCount = 0;
 }
 
 
@@ -107,6 +109,20 @@ public:
         return activeVars;
     }
 
+    // the presorted index would be partitioned at every node for all the ordered variables,
+    // though only activeVars.size() of them are searched there, and copied to every worker;
+    // the node values of the searched variables are sorted instead when it is a subset
+    void initSortedIdx( const vector<int>& _sidx )
+    {
+        if( activeVars.size() < allVars.size() )
+        {
+            w->sortedIdx.clear();
+            w->sortedCount = w->sortedOfs = 0;
+            return;
+        }
+        DTreesImpl::initSortedIdx( _sidx );
+    }
+
     void startTraining( const Ptr<TrainData>& trainData, int flags )
     {
         DTreesImpl::startTraining(trainData, flags);
@@ -127,6 +143,346 @@ public:
         std::swap(activeVars, b);
     }
 
+    // a tree grown by a worker: its nodes, splits and subsets, indexed from 0, and the
+    // predictions of the tree for its out-of-bag samples (indices in w->sidx)
+    struct TreeResult
+    {
+        TreeResult() : root(-1) {}
+        vector<Node> nodes;
+        vector<Split> splits;
+        vector<int> subsets;
+        int root;
+        vector<int> oobidx;
+        vector<double> oobpred;
+        // the number of correct out-of-bag responses of the tree (the sum of the regression
+        // scores, see oobScore()) and, for every variable the tree splits on (permVars), the
+        // same with the values of the variable permuted
+        double oobCorrect;
+        vector<int> permVars;
+        vector<double> permCorrect;
+    };
+
+    // copies the training state of <master> so that the worker grows trees on its own
+    // workspace and random stream; the samples and the presorted/binned data are shared
+    void initWorker( const DTreesImplForRTrees& master, const Mat& samples )
+    {
+        oobSamples = samples;
+        params0 = master.params0;
+        params = master.params;
+        rparams = master.rparams;
+        varIdx = master.varIdx;
+        compVarIdx = master.compVarIdx;
+        varType = master.varType;
+        catOfs = master.catOfs;
+        catMap = master.catMap;
+        classLabels = master.classLabels;
+        missingSubst = master.missingSubst;
+        _isClassifier = master._isClassifier;
+        allVars = master.allVars;
+        activeVars = master.activeVars;
+        w = makePtr<WorkData>(*master.w);
+    }
+
+    /*
+     Grows the tree <treeidx>: bagging, growth and out-of-bag evaluation. The random stream
+     of the tree only depends on <seed> and <treeidx>, so the forest does not depend on the
+     number of threads or on the order the trees are grown in.
+    */
+    void growTree( uint64 seed, int treeidx, bool calcOOBError, TreeResult& r )
+    {
+        int i, j, k, n = (int)w->sidx.size();
+        vector<int> sidx(n);
+        vector<uchar> oobmask(n, (uchar)1);
+
+        rng = RNG(seed + (uint64)treeidx*0x9E3779B97F4A7C15ULL);
+        for( i = 0; i < n; i++ )
+        {
+            j = rng.uniform(0, n);
+            sidx[i] = w->sidx[j];
+            oobmask[j] = (uchar)0;
+        }
+
+        roots.clear();
+        nodes.clear();
+        splits.clear();
+        subsets.clear();
+        r.root = addTree( sidx );
+        r.oobidx.clear();
+        r.oobpred.clear();
+        r.oobCorrect = 0.;
+        r.permVars.clear();
+        r.permCorrect.clear();
+
+        if( r.root >= 0 && calcOOBError )
+        {
+            for( i = 0; i < n; i++ )
+            {
+                if( !oobmask[i] )
+                    r.oobidx.push_back(i);
+            }
+            int n_oob = (int)r.oobidx.size();
+            const float* psamples = oobSamples.ptr<float>();
+            size_t sstep0 = oobSamples.step1(), sstep1 = 1;
+            if( w->data->getLayout() == COL_SAMPLE )
+                std::swap(sstep0, sstep1);
+            double max_response = getMaxResponse();
+
+            // the tree is evaluated on the compiled layout, the variables it splits on being
+            // gathered once per out-of-bag sample; the worker grows many trees, so the layout
+            // of the previous one is dropped rather than checked for staleness
+            cforest.release();
+            Ptr<CompiledForest> cf = compileForest();
+            int nv = (int)cf->vars.size();
+            vector<float> xbuf((size_t)n_oob*nv + 1);
+
+            r.oobpred.resize(n_oob);
+            r.oobCorrect = 0.;
+            for( i = 0; i < n_oob; i++ )
+            {
+                int si = w->sidx[r.oobidx[i]];
+                float* x = &xbuf[(size_t)i*nv];
+                // the samples hold all the variables, hence no compVarIdx remapping
+                gatherSplitVars( *cf, psamples + sstep0*si, sstep1, COMPRESSED_INPUT, x );
+                int leaf = findLeaf( *cf, 0, x );
+                r.oobpred[i] = _isClassifier ? cf->classIdx[leaf] : (float)cf->value[leaf];
+                r.oobCorrect += oobScore( *cf, leaf, si, max_response );
+            }
+
+            // the variables the tree does not split on can not change its predictions, so
+            // only the split variables are permuted
+            if( rparams.calcVarImportance && rparams.importanceSampleCount <= 0 && n_oob > 1 )
+            {
+                vector<int> oobperm(n_oob);
+                for( i = 0; i < n_oob; i++ )
+                    oobperm[i] = i;
+                r.permVars = cf->vars;
+                r.permCorrect.assign(nv, 0.);
+
+                for( k = 0; k < nv; k++ )
+                {
+                    double ncorrect_responses_permuted = 0;
+                    for( i = 0; i < n_oob; i++ )
+                    {
+                        int i1 = rng.uniform(0, n_oob);
+                        int i2 = rng.uniform(0, n_oob);
+                        std::swap(oobperm[i1], oobperm[i2]);
+                    }
+
+                    for( i = 0; i < n_oob; i++ )
+                    {
+                        float val = xbuf[(size_t)oobperm[i]*nv + k];
+                        int leaf = findLeaf( *cf, 0, &xbuf[(size_t)i*nv], k, val );
+                        ncorrect_responses_permuted += oobScore( *cf, leaf, w->sidx[r.oobidx[i]], max_response );
+                    }
+                    r.permCorrect[k] = ncorrect_responses_permuted;
+                }
+            }
+        }
+
+        std::swap(r.nodes, nodes);
+        std::swap(r.splits, splits);
+        std::swap(r.subsets, subsets);
+        roots.clear();
+    }
+
+    double getMaxResponse() const
+    {
+        double max_response = 0.;
+        if( !_isClassifier )
+        {
+            for( size_t i = 0; i < w->sidx.size(); i++ )
+                max_response = std::max(max_response, std::abs(w->ord_responses[w->sidx[i]]));
+        }
+        return max_response;
+    }
+
+    // the score of the leaf <leaf> of <cf> for the training sample <si>: 1 if its class is
+    // right, 0 otherwise, or exp(-e*e) of the regression error e relative to <max_response>
+    double oobScore( const CompiledForest& cf, int leaf, int si, double max_response ) const
+    {
+        if( _isClassifier )
+            return cf.classIdx[leaf] == w->cat_responses[si];
+        double val = (cf.value[leaf] - w->ord_responses[si])/max_response;
+        return std::exp( -val*val );
+    }
+
+    /*
+     Permutation importance of the variables, computed once on the trained forest. Every
+     variable is handled by one task, which permutes its values over the sampled samples
+     and re-evaluates, on the samples each tree is out-of-bag for, only the trees that split
+     on the variable. The importance is the loss of score summed over these trees, as the
+     one accumulated tree by tree during the training.
+    */
+    class VarImportanceInvoker : public ParallelLoopBody
+    {
+    public:
+        VarImportanceInvoker( const DTreesImplForRTrees* _forest, const CompiledForest* _cf,
+                              const float* _xbuf, const int* _ssidx, int _nsamples,
+                              const int* _oobOfs, const int* _oobList, const double* _oobScore,
+                              const int* _varTreeOfs, const int* _varTrees,
+                              double _max_response, uint64 _seed, double* _importance )
+            : forest(_forest), cf(_cf), xbuf(_xbuf), ssidx(_ssidx), nsamples(_nsamples),
+              oobOfs(_oobOfs), oobList(_oobList), oobScore(_oobScore), varTreeOfs(_varTreeOfs),
+              varTrees(_varTrees), max_response(_max_response), seed(_seed), importance(_importance) {}
+
+        void operator()( const Range& range ) const
+        {
+            int i, nv = (int)cf->vars.size();
+            vector<int> perm(nsamples);
+
+            for( int k = range.start; k < range.end; k++ )
+            {
+                // the permutation only depends on the variable, not on the thread
+                RNG vrng(seed + (uint64)(k + 1)*0x9E3779B97F4A7C15ULL);
+                for( i = 0; i < nsamples; i++ )
+                    perm[i] = i;
+                for( i = nsamples - 1; i > 0; i-- )
+                    std::swap(perm[i], perm[vrng.uniform(0, i + 1)]);
+
+                double sum = 0;
+                for( int t = varTreeOfs[k]; t < varTreeOfs[k+1]; t++ )
+                {
+                    int treeidx = varTrees[t];
+                    for( int e = oobOfs[treeidx]; e < oobOfs[treeidx+1]; e++ )
+                    {
+                        int s = oobList[e];
+                        int leaf = forest->findLeaf( *cf, treeidx, xbuf + (size_t)s*nv, k,
+                                                     xbuf[(size_t)perm[s]*nv + k] );
+                        sum += oobScore[e] - forest->oobScore( *cf, leaf, ssidx[s], max_response );
+                    }
+                }
+                importance[k] = sum;
+            }
+        }
+
+        const DTreesImplForRTrees* forest;
+        const CompiledForest* cf;
+        const float* xbuf;
+        const int* ssidx;
+        int nsamples;
+        const int* oobOfs;
+        const int* oobList;
+        const double* oobScore;
+        const int* varTreeOfs;
+        const int* varTrees;
+        double max_response;
+        uint64 seed;
+        double* importance;
+    };
+
+    // computes varImportance on the trained forest from the sampled training samples
+    // <ssidx>; oobList[oobOfs[t]..oobOfs[t+1]) are the ones (indices in ssidx) the tree t
+    // is out-of-bag for
+    void calcSampledVarImportance( const Mat& samples, const vector<int>& ssidx,
+                                   const vector<int>& oobOfs, const vector<int>& oobList,
+                                   double max_response, uint64 seed )
+    {
+        Ptr<CompiledForest> cf = compileForest();
+        int i, k, t, nv = (int)cf->vars.size(), ntrees = (int)roots.size();
+        int m = (int)ssidx.size(), nnodes = (int)cf->var.size();
+        const float* psamples = samples.ptr<float>();
+        size_t sstep0 = samples.step1(), sstep1 = 1;
+        if( w->data->getLayout() == COL_SAMPLE )
+            std::swap(sstep0, sstep1);
+
+        vector<float> xbuf((size_t)m*nv + 1);
+        for( i = 0; i < m; i++ )
+            gatherSplitVars( *cf, psamples + sstep0*ssidx[i], sstep1, COMPRESSED_INPUT, &xbuf[(size_t)i*nv] );
+
+        vector<double> score0(oobList.size() + 1);
+        for( t = 0; t < ntrees; t++ )
+            for( int e = oobOfs[t]; e < oobOfs[t+1]; e++ )
+            {
+                int s = oobList[e];
+                int leaf = findLeaf( *cf, t, &xbuf[(size_t)s*nv] );
+                score0[e] = oobScore( *cf, leaf, ssidx[s], max_response );
+            }
+
+        // the trees splitting on every variable
+        vector<int> varTreeOfs(nv + 1, 0), varTrees, lastTree(nv, -1);
+        vector<vector<int> > treesOf(nv);
+        for( t = 0; t < ntrees; t++ )
+        {
+            int end = t + 1 < ntrees ? cf->treeOfs[t+1] : nnodes;
+            for( int nidx = cf->treeOfs[t]; nidx < end; nidx++ )
+            {
+                k = cf->var[nidx];
+                if( k >= 0 && lastTree[k] != t )
+                {
+                    lastTree[k] = t;
+                    treesOf[k].push_back(t);
+                }
+            }
+        }
+        for( k = 0; k < nv; k++ )
+        {
+            varTreeOfs[k] = (int)varTrees.size();
+            varTrees.insert(varTrees.end(), treesOf[k].begin(), treesOf[k].end());
+        }
+        varTreeOfs[nv] = (int)varTrees.size();
+        varTrees.push_back(0);
+
+        vector<double> importance(nv + 1, 0.);
+        parallel_for_(Range(0, nv), VarImportanceInvoker(this, cf.get(), &xbuf[0], &ssidx[0], m,
+                      &oobOfs[0], &oobList[0], &score0[0], &varTreeOfs[0], &varTrees[0],
+                      max_response, seed, &importance[0]));
+
+        for( k = 0; k < nv; k++ )
+            varImportance[cf->vars[k]] = (float)importance[k];
+    }
+
+    // appends a tree grown by a worker to the forest
+    void mergeTree( const TreeResult& r )
+    {
+        int nodeOfs = (int)nodes.size(), splitOfs = (int)splits.size(), subsetOfs = (int)subsets.size();
+        size_t i;
+        for( i = 0; i < r.nodes.size(); i++ )
+        {
+            Node node = r.nodes[i];
+            node.parent += node.parent >= 0 ? nodeOfs : 0;
+            node.left += node.left >= 0 ? nodeOfs : 0;
+            node.right += node.right >= 0 ? nodeOfs : 0;
+            node.split += node.split >= 0 ? splitOfs : 0;
+            nodes.push_back(node);
+        }
+        for( i = 0; i < r.splits.size(); i++ )
+        {
+            Split split = r.splits[i];
+            split.next += split.next >= 0 ? splitOfs : 0;
+            split.subsetOfs += split.subsetOfs >= 0 ? subsetOfs : 0;
+            splits.push_back(split);
+        }
+        subsets.insert(subsets.end(), r.subsets.begin(), r.subsets.end());
+        roots.push_back(r.root + nodeOfs);
+    }
+
+    class GrowTreesInvoker : public ParallelLoopBody
+    {
+    public:
+        GrowTreesInvoker( vector<Ptr<DTreesImplForRTrees> >& _workers, vector<TreeResult>& _results,
+                          uint64 _seed, int _treeidx0, bool _calcOOBError )
+            : workers(&_workers), results(&_results), seed(_seed), treeidx0(_treeidx0),
+              calcOOBError(_calcOOBError) {}
+
+        void operator()( const Range& range ) const
+        {
+            for( int k = range.start; k < range.end; k++ )
+                (*workers)[k]->growTree( seed, treeidx0 + k, calcOOBError, (*results)[k] );
+        }
+
+        vector<Ptr<DTreesImplForRTrees> >* workers;
+        vector<TreeResult>* results;
+        uint64 seed;
+        int treeidx0;
+        bool calcOOBError;
+    };
+
+    /*
+     The trees are grown in batches of one tree per thread, each by a worker with its own
+     workspace (see initWorker()), then merged into the forest in their index order. The
+     out-of-bag error and the termination on it are evaluated at the merge, tree by tree,
+     so the result is the same as when growing the trees one after another.
+    */
     bool train( const Ptr<TrainData>& trainData, int flags )
     {
         Params dp(rparams.maxDepth, rparams.minSampleCount, rparams.regressionAccuracy,
@@ -136,82 +492,90 @@ public:
         startTraining(trainData, flags);
         int treeidx, ntrees = (rparams.termCrit.type & TermCriteria::COUNT) != 0 ?
             rparams.termCrit.maxCount : 10000;
-        int i, j, k, vi, vi_, n = (int)w->sidx.size();
+        int i, j, k, vi_, n = (int)w->sidx.size();
         int nclasses = (int)classLabels.size();
         double eps = (rparams.termCrit.type & TermCriteria::EPS) != 0 &&
             rparams.termCrit.epsilon > 0 ? rparams.termCrit.epsilon : 0.;
-        vector<int> sidx(n);
-        vector<uchar> oobmask(n);
-        vector<int> oobidx;
-        vector<int> oobperm;
         vector<double> oobres(n, 0.);
         vector<int> oobcount(n, 0);
         vector<int> oobvotes(n*nclasses, 0);
-        int nvars = w->data->getNVars();
         int nallvars = w->data->getNAllVars();
-        const int* vidx = !varIdx.empty() ? &varIdx[0] : 0;
-        vector<float> samplebuf(nallvars);
-        Mat samples = w->data->getSamples();
-        float* psamples = samples.ptr<float>();
-        size_t sstep0 = samples.step1(), sstep1 = 1;
-        Mat sample0, sample(nallvars, 1, CV_32F, &samplebuf[0]);
-        int predictFlags = _isClassifier ? (PREDICT_MAX_VOTE + RAW_OUTPUT) : PREDICT_SUM;
 
         bool calcOOBError = eps > 0 || rparams.calcVarImportance;
-        double max_response = 0.;
+        double max_response = getMaxResponse();
 
-        if( w->data->getLayout() == COL_SAMPLE )
-            std::swap(sstep0, sstep1);
+        if( rparams.calcVarImportance )
+            varImportance.resize(nallvars, 0.f);
 
-        if( !_isClassifier )
+        uint64 seed = rng.state;
+
+        // sampled importance: the training samples it is computed on and, per tree, the
+        // ones (indices in ssidx) the tree is out-of-bag for
+        bool sampledImportance = rparams.calcVarImportance && rparams.importanceSampleCount > 0;
+        vector<int> ssidx, spos, oobOfs(1, 0), oobList;
+        if( sampledImportance )
         {
+            int m = std::min(rparams.importanceSampleCount, n);
+            vector<int> perm(n);
+            RNG srng(~seed);
             for( i = 0; i < n; i++ )
+                perm[i] = i;
+            for( i = 0; i < m; i++ )
+                std::swap(perm[i], perm[srng.uniform(i, n)]);
+            std::sort(perm.begin(), perm.begin() + m);
+            spos.assign(n, -1);
+            ssidx.resize(m);
+            for( i = 0; i < m; i++ )
             {
-                double val = std::abs(w->ord_responses[w->sidx[i]]);
-                max_response = std::max(max_response, val);
+                spos[perm[i]] = i;
+                ssidx[i] = w->sidx[perm[i]];
             }
         }
 
-        if( rparams.calcVarImportance )
-            varImportance.resize(nallvars, 0.f);
+        Mat samples = calcOOBError ? w->data->getSamples() : Mat();
+        int nworkers = std::max(std::min(getNumThreads(), ntrees), 1);
+        vector<Ptr<DTreesImplForRTrees> > workers(nworkers);
+        vector<TreeResult> results(nworkers);
+        for( k = 0; k < nworkers; k++ )
+        {
+            workers[k] = makePtr<DTreesImplForRTrees>();
+            workers[k]->initWorker(*this, samples);
+        }
 
-        for( treeidx = 0; treeidx < ntrees; treeidx++ )
+        bool stop = false;
+        for( treeidx = 0; treeidx < ntrees && !stop; treeidx += nworkers )
         {
-            for( i = 0; i < n; i++ )
-                oobmask[i] = (uchar)1;
+            int nbatch = std::min(nworkers, ntrees - treeidx);
+            parallel_for_(Range(0, nbatch), GrowTreesInvoker(workers, results, seed, treeidx, calcOOBError));
 
-            for( i = 0; i < n; i++ )
+            for( k = 0; k < nbatch && !stop; k++ )
             {
-                j = rng.uniform(0, n);
-                sidx[i] = w->sidx[j];
-                oobmask[j] = (uchar)0;
-            }
-            int root = addTree( sidx );
-            if( root < 0 )
-                return false;
+                const TreeResult& r = results[k];
+                if( r.root < 0 )
+                {
+                    endTraining();
+                    return false;
+                }
+                mergeTree( r );
 
-            if( calcOOBError )
-            {
-                oobidx.clear();
-                for( i = 0; i < n; i++ )
+                int n_oob = (int)r.oobidx.size();
+                if( sampledImportance )
                 {
-                    if( !oobmask[i] )
-                        oobidx.push_back(i);
+                    for( i = 0; i < n_oob; i++ )
+                        if( spos[r.oobidx[i]] >= 0 )
+                            oobList.push_back(spos[r.oobidx[i]]);
+                    oobOfs.push_back((int)oobList.size());
                 }
-                int n_oob = (int)oobidx.size();
                 // if there is no out-of-bag samples, we can not compute OOB error
                 // nor update the variable importance vector; so we proceed to the next tree
-                if( n_oob == 0 )
+                if( !calcOOBError || n_oob == 0 )
                     continue;
-                double ncorrect_responses = 0.;
 
                 oobError = 0.;
                 for( i = 0; i < n_oob; i++ )
                 {
-                    j = oobidx[i];
-                    sample = Mat( nallvars, 1, CV_32F, psamples + sstep0*w->sidx[j], sstep1*sizeof(psamples[0]) );
-
-                    double val = predictTrees(Range(treeidx, treeidx+1), sample, predictFlags);
+                    j = r.oobidx[i];
+                    double val = r.oobpred[i];
                     if( !_isClassifier )
                     {
                         oobres[j] += val;
@@ -219,8 +583,6 @@ public:
                         double true_val = w->ord_responses[w->sidx[j]];
                         double a = oobres[j]/oobcount[j] - true_val;
                         oobError += a*a;
-                        val = (val - true_val)/max_response;
-                        ncorrect_responses += std::exp( -val*val );
                     }
                     else
                     {
@@ -228,59 +590,24 @@ public:
                         int* votes = &oobvotes[j*nclasses];
                         votes[ival]++;
                         int best_class = 0;
-                        for( k = 1; k < nclasses; k++ )
-                            if( votes[best_class] < votes[k] )
-                                best_class = k;
+                        for( int c = 1; c < nclasses; c++ )
+                            if( votes[best_class] < votes[c] )
+                                best_class = c;
                         int diff = best_class != w->cat_responses[w->sidx[j]];
                         oobError += diff;
-                        ncorrect_responses += diff == 0;
                     }
                 }
 
                 oobError /= n_oob;
-                if( rparams.calcVarImportance && n_oob > 1 )
-                {
-                    oobperm.resize(n_oob);
-                    for( i = 0; i < n_oob; i++ )
-                        oobperm[i] = oobidx[i];
-
-                    for( vi_ = 0; vi_ < nvars; vi_++ )
-                    {
-                        vi = vidx ? vidx[vi_] : vi_;
-                        double ncorrect_responses_permuted = 0;
-                        for( i = 0; i < n_oob; i++ )
-                        {
-                            int i1 = rng.uniform(0, n_oob);
-                            int i2 = rng.uniform(0, n_oob);
-                            std::swap(i1, i2);
-                        }
-
-                        for( i = 0; i < n_oob; i++ )
-                        {
-                            j = oobidx[i];
-                            int vj = oobperm[i];
-                            sample0 = Mat( nallvars, 1, CV_32F, psamples + sstep0*w->sidx[j], sstep1*sizeof(psamples[0]) );
-                            for( k = 0; k < nallvars; k++ )
-                                sample.at<float>(k) = sample0.at<float>(k);
-                            sample.at<float>(vi) = psamples[sstep0*w->sidx[vj] + sstep1*vi];
-
-                            double val = predictTrees(Range(treeidx, treeidx+1), sample, predictFlags);
-                            if( !_isClassifier )
-                            {
-                                val = (val - w->ord_responses[w->sidx[j]])/max_response;
-                                ncorrect_responses_permuted += exp( -val*val );
-                            }
-                            else
-                                ncorrect_responses_permuted += cvRound(val) == w->cat_responses[w->sidx[j]];
-                        }
-                        varImportance[vi] += (float)(ncorrect_responses - ncorrect_responses_permuted);
-                    }
-                }
+                for( size_t vk = 0; vk < r.permCorrect.size(); vk++ )
+                    varImportance[r.permVars[vk]] += (float)(r.oobCorrect - r.permCorrect[vk]);
+                stop = oobError < eps;
             }
-            if( calcOOBError && oobError < eps )
-                break;
         }
 
+        if( sampledImportance && !oobList.empty() )
+            calcSampledVarImportance( samples, ssidx, oobOfs, oobList, max_response, seed );
+
         if( rparams.calcVarImportance )
         {
             for( vi_ = 0; vi_ < nallvars; vi_++ )
@@ -295,6 +622,8 @@ public:
     {
         DTreesImpl::writeTrainingParams(fs);
         fs << "nactive_vars" << rparams.nactiveVars;
+        if( rparams.importanceSampleCount > 0 )
+            fs << "importance_sample_count" << rparams.importanceSampleCount;
     }
 
     void write( FileStorage& fs ) const
@@ -335,6 +664,7 @@ public:
 
         FileNode tparams_node = fn["training_params"];
         rparams.nactiveVars = (int)tparams_node["nactive_vars"];
+        rparams.importanceSampleCount = (int)tparams_node["importance_sample_count"];
     }
 
     void read( const FileNode& fn )
@@ -366,6 +696,8 @@ public:
     vector<float> varImportance;
     vector<int> allVars, activeVars;
     RNG rng;
+    //! the samples the out-of-bag error is computed on, in a worker
+    Mat oobSamples;
 };
 
 
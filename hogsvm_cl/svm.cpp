@@ -153,7 +153,344 @@ SVM::Params::Params( int _svmType, int _kernelType,
 
 }
 
+/////////////////////////////////////// OpenCL device ///////////////////////////////////////
+/*
+ The OpenCL device of the offloaded kernels. The SVM dot products (svmlinear) and the tree
+ ensembles (forest_predict) share its context, its queue and the program built from
+ ./svmlinear.cl, which are created on the first use and live as long as the process.
+*/
+struct CLDevice
+{
+    CLDevice() : ok(false), device(0), context(0), queue(0), program(0) {}
+
+    bool ok;
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    //! serializes the kernel launches that share kernel objects or buffers
+    Mutex mutex;
+};
+
+static CLDevice& getCLDevice()
+{
+    static CLDevice dev;
+    static bool initialized = false;
+    static Mutex initMutex;
+    AutoLock lock(initMutex);
+    if( initialized )
+        return dev;
+    initialized = true;
+
+    cl_platform_id platform_id = NULL;
+    cl_uint ret_num_devices;
+    cl_uint ret_num_platforms;
+    cl_int ret;
+
+    /* Load the source code containing the kernels */
+    FILE* fp = fopen("./svmlinear.cl", "r");
+    if (!fp) {
+        fprintf(stderr, "Failed to load kernel.\n");
+        return dev;
+    }
+    char* source_str = (char*)malloc(MAX_SOURCE_SIZE);
+    size_t source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
+    fclose(fp);
+
+    /* Get Platform and Device Info */
+    ret = clGetPlatformIDs(1, &platform_id, &ret_num_platforms);
+
+#ifdef _DEBUG
+    char buffer[102];
+    clGetPlatformInfo(platform_id, CL_PLATFORM_PROFILE, 10240, buffer, NULL);
+    printf("  PROFILE = %s\n", buffer);
+    clGetPlatformInfo(platform_id, CL_PLATFORM_VERSION, 10240, buffer, NULL);
+    printf("  VERSION = %s\n", buffer);
+    clGetPlatformInfo(platform_id, CL_PLATFORM_NAME, 10240, buffer, NULL);
+    printf("  NAME = %s\n", buffer);
+    clGetPlatformInfo(platform_id, CL_PLATFORM_VENDOR, 10240, buffer, NULL);
+    printf("  VENDOR = %s\n", buffer);
+    clGetPlatformInfo(platform_id, CL_PLATFORM_EXTENSIONS, 10240, buffer, NULL);
+    printf("  EXTENSIONS = %s\n", buffer);
+#endif
+
+    clGetDeviceIDs(NULL, CL_DEVICE_TYPE_ALL, 0, NULL, &ret_num_devices);
+
+    cl_device_id* devices = (cl_device_id*)calloc(sizeof(cl_device_id), std::max(ret_num_devices, (cl_uint)1));
+    clGetDeviceIDs(NULL, CL_DEVICE_TYPE_ALL, ret_num_devices, devices, NULL);
+    ret = clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, 1, devices, &ret_num_devices);
+    if( ret != CL_SUCCESS ) {
+        cout<< getErrorString(ret)<<endl;
+        free(devices);
+        free(source_str);
+        return dev;
+    }
+
+#ifdef _DEBUG
+    printf("=== %d OpenCL device(s) found on platform:\n", ret_num_devices);
+    for (int i=0; i<(int)ret_num_devices; i++)
+    {
+        char buffer[1024]={0};
+        cl_uint buf_uint;
+        cl_ulong buf_ulong;
+        printf("  -- %d --\n", i);
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_NAME, sizeof(buffer), buffer, NULL);
+        printf("  DEVICE_NAME = %s\n", buffer);
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_VENDOR, sizeof(buffer), buffer, NULL);
+        printf("  DEVICE_VENDOR = %s\n", buffer);
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_VERSION, sizeof(buffer), buffer, NULL);
+        printf("  DEVICE_VERSION = %s\n", buffer);
+
+        clGetDeviceInfo(devices[i], CL_DRIVER_VERSION, sizeof(buffer), buffer, NULL);
+        printf("  DRIVER_VERSION = %s\n", buffer);
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(buf_uint), &buf_uint, NULL);
+        printf("  DEVICE_MAX_COMPUTE_UNITS = %u\n", (unsigned int)buf_uint);
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(buf_uint), &buf_uint, NULL);
+        printf("  DEVICE_MAX_WORK_ITEM_DIMENSIONS = %u\n", (unsigned int)buf_uint);
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_MAX_WORK_ITEM_SIZES,  sizeof(buf_uint), &buf_uint, NULL);
+        printf("  DEVICE_MAX_WORK_ITEM_SIZES= %u\n", (unsigned int)buf_uint);
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(buf_uint), &buf_uint, NULL);
+        printf("  DEVICE_MAX_CLOCK_FREQUENCY = %u\n", (unsigned int)buf_uint);
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(buf_ulong), &buf_ulong, NULL);
+        printf("  DEVICE_GLOBAL_MEM_SIZE = %llu\n", (unsigned long long)buf_ulong);
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_LOCAL_MEM_SIZE, sizeof(buf_ulong), &buf_ulong, NULL);
+        printf("  DEVICE_LOCAL_MEM_SIZE = %u\n", (unsigned long long)buf_ulong);
+
+        clGetDeviceInfo(devices[i], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(buf_ulong), &buf_ulong, NULL);
+        printf("  CL_DEVICE_MAX_WORK_GROUP_SIZE = %u\n", (unsigned long long)buf_ulong);
+
+        printf("Press any key to continue... \n");
+        getchar();
+
+    }
+#endif
+
+    dev.device = devices[0];
+    free(devices);
+
+    /* Create OpenCL context */
+    dev.context = clCreateContext(NULL, 1, &dev.device, NULL, NULL, &ret);
+
+    /* Create Command Queue */
+    dev.queue = clCreateCommandQueue(dev.context, dev.device, 0, &ret);
+
+    /* Create Kernel Program from the source */
+    dev.program = clCreateProgramWithSource(dev.context, 1, (const char **)&source_str,
+                                            (const size_t *)&source_size, &ret);
+    free(source_str);
+
+    /* Build Kernel Program */
+    ret = clBuildProgram(dev.program, 1, &dev.device, NULL, NULL, NULL);
+    if( ret != CL_SUCCESS )
+    {
+        size_t len;
+        char buffer[2048];
+        cout<<"build error code : "<<ret<<endl;
+
+        clGetProgramBuildInfo(dev.program, dev.device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
+        cout<<buffer<<endl;
+        return dev;
+    }
+
+    dev.ok = true;
+    return dev;
+}
+
+/////////////////////////////////////// Tree ensembles ///////////////////////////////////////
+
+// work-items per work-group of forest_predict, one per tree; the groups of a sample
+// leave partial votes/sums that are added up on the host
+static const int FOREST_GROUP_SIZE = 64;
+
+// a compiled forest on the device: its node arrays, uploaded once, the kernel, and the
+// sample and result buffers, which are grown as needed
+struct CLDeviceForest : public DTreesImpl::CompiledForest::DeviceCopy
+{
+    enum { TREE_OFS=0, VAR, THRESH, SUBSET_OFS, CHILD, DEFAULT_DIR, VALUE, CLASS_IDX, SUBSETS, NBUFS };
+
+    CLDeviceForest() : kernel(0), x(0), out(0), xsize(0), outsize(0)
+    {
+        for( int i = 0; i < NBUFS; i++ )
+            nodes[i] = 0;
+    }
+
+    ~CLDeviceForest()
+    {
+        for( int i = 0; i < NBUFS; i++ )
+            if( nodes[i] )
+                clReleaseMemObject(nodes[i]);
+        if( x )
+            clReleaseMemObject(x);
+        if( out )
+            clReleaseMemObject(out);
+        if( kernel )
+            clReleaseKernel(kernel);
+    }
+
+    cl_mem nodes[NBUFS];
+    cl_kernel kernel;
+    cl_mem x, out;
+    size_t xsize, outsize;
+};
+
+template<typename T> static cl_mem uploadCLBuffer( cl_context context, const vector<T>& v )
+{
+    T dummy = T();
+    cl_int ret;
+    cl_mem buf = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                std::max(v.size(), (size_t)1)*sizeof(T),
+                                v.empty() ? (void*)&dummy : (void*)&v[0], &ret);
+    if( ret != CL_SUCCESS )
+    {
+        cout<< getErrorString(ret)<<endl;
+        return 0;
+    }
+    return buf;
+}
+
+static bool reserveCLBuffer( cl_context context, cl_mem_flags flags, size_t size, cl_mem& buf, size_t& capacity )
+{
+    if( buf && capacity >= size )
+        return true;
+    if( buf )
+        clReleaseMemObject(buf);
+    cl_int ret;
+    buf = clCreateBuffer(context, flags, std::max(size, (size_t)1), NULL, &ret);
+    capacity = size;
+    if( ret != CL_SUCCESS )
+    {
+        cout<< getErrorString(ret)<<endl;
+        buf = 0;
+        capacity = 0;
+        return false;
+    }
+    return true;
+}
+
+bool haveForestDevice()
+{
+    return getCLDevice().ok;
+}
+
+bool predictForestOnDevice( const DTreesImpl::CompiledForest& cf, const vector<int>& subsets,
+                            const Range& range, const float* x, int nsamples, int nclasses,
+                            float* out )
+{
+    CLDevice& dev = getCLDevice();
+    if( !dev.ok )
+        return false;
+
+    AutoLock lock(dev.mutex);
+    cl_int ret;
+
+    if( cf.device.empty() )
+    {
+        Ptr<CLDeviceForest> d = makePtr<CLDeviceForest>();
+        vector<float> value(cf.value.begin(), cf.value.end());
+        d->nodes[CLDeviceForest::TREE_OFS] = uploadCLBuffer(dev.context, cf.treeOfs);
+        d->nodes[CLDeviceForest::VAR] = uploadCLBuffer(dev.context, cf.var);
+        d->nodes[CLDeviceForest::THRESH] = uploadCLBuffer(dev.context, cf.thresh);
+        d->nodes[CLDeviceForest::SUBSET_OFS] = uploadCLBuffer(dev.context, cf.subsetOfs);
+        d->nodes[CLDeviceForest::CHILD] = uploadCLBuffer(dev.context, cf.child);
+        d->nodes[CLDeviceForest::DEFAULT_DIR] = uploadCLBuffer(dev.context, cf.defaultDir);
+        d->nodes[CLDeviceForest::VALUE] = uploadCLBuffer(dev.context, value);
+        d->nodes[CLDeviceForest::CLASS_IDX] = uploadCLBuffer(dev.context, cf.classIdx);
+        d->nodes[CLDeviceForest::SUBSETS] = uploadCLBuffer(dev.context, subsets);
+        for( int i = 0; i < CLDeviceForest::NBUFS; i++ )
+            if( !d->nodes[i] )
+                return false;
+
+        d->kernel = clCreateKernel(dev.program, "forest_predict", &ret);
+        if( ret != CL_SUCCESS )
+        {
+            cout<< getErrorString(ret)<<endl;
+            return false;
+        }
+        cf.device = d;
+    }
+    CLDeviceForest* d = static_cast<CLDeviceForest*>(cf.device.get());
+
+    int i, g, k, ntrees = range.end - range.start, nout = std::max(nclasses, 1);
+    int lsize = 1;
+    while( lsize < ntrees && lsize < FOREST_GROUP_SIZE )
+        lsize *= 2;
+    int ngroups = (ntrees + lsize - 1)/lsize;
+    size_t xbytes = (size_t)nsamples*cf.vars.size()*sizeof(float);
+    size_t outbytes = (size_t)nsamples*ngroups*nout*sizeof(float);
+
+    if( nsamples <= 0 )
+        return true;
+    if( ntrees <= 0 )
+    {
+        memset(out, 0, (size_t)nsamples*nout*sizeof(out[0]));
+        return true;
+    }
+    if( !reserveCLBuffer(dev.context, CL_MEM_READ_ONLY, xbytes, d->x, d->xsize) ||
+        !reserveCLBuffer(dev.context, CL_MEM_WRITE_ONLY, outbytes, d->out, d->outsize) )
+        return false;
+
+    if( xbytes > 0 )
+        clEnqueueWriteBuffer(dev.queue, d->x, CL_TRUE, 0, xbytes, x, 0, NULL, NULL);
+
+    cl_uint nv2 = (cl_uint)cf.vars.size(), tree0 = (cl_uint)range.start, ntrees2 = (cl_uint)ntrees;
+    cl_uint nclasses2 = (cl_uint)nclasses;
+    for( i = 0; i < CLDeviceForest::NBUFS; i++ )
+        clSetKernelArg(d->kernel, i, sizeof(cl_mem), (void *)&d->nodes[i]);
+    clSetKernelArg(d->kernel, 9, sizeof(cl_mem), (void *)&d->x);
+    clSetKernelArg(d->kernel, 10, sizeof(cl_uint), (void *)&nv2);
+    clSetKernelArg(d->kernel, 11, sizeof(cl_uint), (void *)&tree0);
+    clSetKernelArg(d->kernel, 12, sizeof(cl_uint), (void *)&ntrees2);
+    clSetKernelArg(d->kernel, 13, sizeof(cl_uint), (void *)&nclasses2);
+    clSetKernelArg(d->kernel, 14, sizeof(cl_mem), (void *)&d->out);
+    clSetKernelArg(d->kernel, 15, lsize*sizeof(cl_float), NULL);
+    clSetKernelArg(d->kernel, 16, nout*sizeof(cl_int), NULL);
+
+    size_t global_dim[] = { (size_t)ngroups*lsize, (size_t)nsamples }, local_dim[] = { (size_t)lsize, 1 };
+    ret = clEnqueueNDRangeKernel(dev.queue, d->kernel, 2, NULL, global_dim, local_dim, 0, NULL, NULL);
+    if( ret != CL_SUCCESS )
+    {
+        cout<< getErrorString(ret)<<endl;
+        return false;
+    }
+
+    vector<float> partial((size_t)nsamples*ngroups*nout);
+    ret = clEnqueueReadBuffer(dev.queue, d->out, CL_TRUE, 0, outbytes, &partial[0], 0, NULL, NULL);
+    if( ret != CL_SUCCESS )
+    {
+        cout<< getErrorString(ret)<<endl;
+        return false;
+    }
+
+    for( i = 0; i < nsamples; i++ )
+        for( k = 0; k < nout; k++ )
+        {
+            double sum = 0;
+            for( g = 0; g < ngroups; g++ )
+                sum += partial[((size_t)i*ngroups + g)*nout + k];
+            out[(size_t)i*nout + k] = (float)sum;
+        }
+    return true;
+}
+
 /////////////////////////////////////// SVM kernel ///////////////////////////////////////
+
+// A new token naming a set of samples passed to the kernel, see SVMKernelImpl::calcSamples().
+// The owner of the samples takes one whenever it gets or rewrites them; 0 names no samples.
+static int newSamplesToken()
+{
+    static int lastToken = 0;
+    return CV_XADD(&lastToken, 1) + 1;
+}
+
 class SVMKernelImpl : public SVM::Kernel
 {
 
@@ -184,6 +521,15 @@ class SVMKernelImpl : public SVM::Kernel
 	    	size_t source_size;
 	    	bool bClMemInit=false;
 
+	    	// the token of the samples of the current calcSamples() call, and the token and the
+	    	// samples held by cm_samples; the capacity of each buffer in floats
+	    	int callToken=0, clToken=0;
+	    	const float* clVecs=NULL;
+	    	int clVcount=0, clVarCount=0;
+	    	size_t clSamplesCap=0, clAnotherCap=0, clResultsCap=0;
+	    	// the buffers and the kernel arguments are per instance, so the calls are serialized
+	    	Mutex clMutex;
+
 	    	const int id_desired=0;
 
 	    	fstream f_perm_svm;
@@ -208,13 +554,11 @@ public:
     		    	bClMemInit = false ;
 
 
+    					// the program, the queue and the context belong to getCLDevice()
     					ret = clReleaseKernel(kernel);
-    					ret = clReleaseProgram(program);
     					//ret = clReleaseMemObject(cm_vecs);
     					//ret = clReleaseMemObject(cm_another);
     					//ret = clReleaseMemObject(cm_sum_partial);
-    					ret = clReleaseCommandQueue(command_queue);
-    					ret = clReleaseContext(context);
 
 
 			cout<<"SVMKernelImpl deconstruct!"<<endl;
@@ -238,123 +582,17 @@ public:
     		exit(1);
     	}
 
-    	/* Load the source code containing the kernel*/
-    	fp = fopen("./svmlinear.cl", "r");
-    	if (!fp) {
-    		fprintf(stderr, "Failed to load kernel.\n");
+    	CLDevice& dev = getCLDevice();
+    	if( !dev.ok ) {
+    		fprintf(stderr, "Failed to set up the OpenCL device.\n");
     		exit(1);
     	}
-    	source_str = (char*)malloc(MAX_SOURCE_SIZE);
-    	source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
-    	fclose(fp);
-    	//printf("%s\n",source_str);
-
-    	/* Get Platform and Device Info */
-    	ret = clGetPlatformIDs(1, &platform_id, &ret_num_platforms);
-
-
-#ifdef _DEBUG
-    	char buffer[102];
-    	clGetPlatformInfo(platform_id, CL_PLATFORM_PROFILE, 10240, buffer, NULL);
-    	printf("  PROFILE = %s\n", buffer);
-   		clGetPlatformInfo(platform_id, CL_PLATFORM_VERSION, 10240, buffer, NULL);
-    	printf("  VERSION = %s\n", buffer);
-    	clGetPlatformInfo(platform_id, CL_PLATFORM_NAME, 10240, buffer, NULL);
-    	printf("  NAME = %s\n", buffer);
-    	clGetPlatformInfo(platform_id, CL_PLATFORM_VENDOR, 10240, buffer, NULL);
-    	printf("  VENDOR = %s\n", buffer);
-    	clGetPlatformInfo(platform_id, CL_PLATFORM_EXTENSIONS, 10240, buffer, NULL);
-    	printf("  EXTENSIONS = %s\n", buffer);
-#endif
-
-        clGetDeviceIDs(NULL, CL_DEVICE_TYPE_ALL, 0, NULL, &ret_num_devices);
-
-        devices = (cl_device_id*)calloc(sizeof(cl_device_id), ret_num_devices);
-        clGetDeviceIDs(NULL, CL_DEVICE_TYPE_ALL, ret_num_devices, devices, NULL);
-    	ret = clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, 1, devices, &ret_num_devices);
-
-#ifdef _DEBUG
-    	printf("=== %d OpenCL device(s) found on platform:\n", ret_num_devices);
-    		for (int i=0; i<ret_num_devices; i++)
-    		{
-    			char buffer[1024]={0};
-    			cl_uint buf_uint;
-    			cl_ulong buf_ulong;
-    			printf("  -- %d --\n", i);
-
-    			clGetDeviceInfo(devices[i], CL_DEVICE_NAME, sizeof(buffer), buffer, NULL);
-    			printf("  DEVICE_NAME = %s\n", buffer);
-
-    			clGetDeviceInfo(devices[i], CL_DEVICE_VENDOR, sizeof(buffer), buffer, NULL);
-    			printf("  DEVICE_VENDOR = %s\n", buffer);
-
-    			clGetDeviceInfo(devices[i], CL_DEVICE_VERSION, sizeof(buffer), buffer, NULL);
-    			printf("  DEVICE_VERSION = %s\n", buffer);
-
-    			clGetDeviceInfo(devices[i], CL_DRIVER_VERSION, sizeof(buffer), buffer, NULL);
-    			printf("  DRIVER_VERSION = %s\n", buffer);
-
-    			clGetDeviceInfo(devices[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(buf_uint), &buf_uint, NULL);
-    			printf("  DEVICE_MAX_COMPUTE_UNITS = %u\n", (unsigned int)buf_uint);
-
-    			clGetDeviceInfo(devices[i], CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, sizeof(buf_uint), &buf_uint, NULL);
-    			printf("  DEVICE_MAX_WORK_ITEM_DIMENSIONS = %u\n", (unsigned int)buf_uint);
-
-    			clGetDeviceInfo(devices[i], CL_DEVICE_MAX_WORK_ITEM_SIZES,  sizeof(buf_uint), &buf_uint, NULL);
-    			printf("  DEVICE_MAX_WORK_ITEM_SIZES= %u\n", (unsigned int)buf_uint);
-
-    			clGetDeviceInfo(devices[i], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(buf_uint), &buf_uint, NULL);
-    			printf("  DEVICE_MAX_CLOCK_FREQUENCY = %u\n", (unsigned int)buf_uint);
-
-    			clGetDeviceInfo(devices[i], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(buf_ulong), &buf_ulong, NULL);
-    			printf("  DEVICE_GLOBAL_MEM_SIZE = %llu\n", (unsigned long long)buf_ulong);
-
-    			clGetDeviceInfo(devices[i], CL_DEVICE_LOCAL_MEM_SIZE, sizeof(buf_ulong), &buf_ulong, NULL);
-    			printf("  DEVICE_LOCAL_MEM_SIZE = %u\n", (unsigned long long)buf_ulong);
-
-    			clGetDeviceInfo(devices[i], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(buf_ulong), &buf_ulong, NULL);
-    			printf("  CL_DEVICE_MAX_WORK_GROUP_SIZE = %u\n", (unsigned long long)buf_ulong);
-
-    			printf("Press any key to continue... \n");
-    			getchar();
-
-    		}
-#endif
-
-    	/* Create OpenCL context */
-    	context = clCreateContext(NULL, 1, &devices[id_desired], NULL, NULL, &ret);
-
-    	/* Create Command Queue */
-    	command_queue = clCreateCommandQueue(context, devices[id_desired], 0, &ret);
-
-
-
-    	/* Create Kernel Program from the source */
-
-
-
-    	program = clCreateProgramWithSource(context, 1, (const char **)&source_str,
-    	(const size_t *)&source_size, &ret);
-
-    	/* Build Kernel Program */
-    	ret = clBuildProgram(program, 1, &devices[id_desired], NULL, NULL, NULL);
-    	if( ret != CL_SUCCESS )
-    	{
-    		size_t len;
-    		char buffer[2048];
-    		cout<<"build error code : "<<ret<<endl;
-
-    		clGetProgramBuildInfo(program, devices[id_desired], CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
-    		cout<<buffer<<endl;
-
-    		getchar();
-            exit(0);
-    	}
-
+    	context = dev.context;
+    	command_queue = dev.queue;
+    	program = dev.program;
 
     	/// Create OpenCL Kernel
     	kernel = clCreateKernel(program, "svmlinear", &ret);
-    	free(source_str);
 
 
     	 cout<<"end of svm kernel impl construct"<<endl;
@@ -370,6 +608,16 @@ public:
         return params.kernelType;
     }
 
+    cl_mem createBuffer( size_t count )
+    {
+    	cl_mem buf = clCreateBuffer(context, CL_MEM_READ_WRITE, count*sizeof(float), NULL, &ret);
+    	if(ret != CL_SUCCESS){
+    		cout<< getErrorString(ret)<<endl;
+    		exit(0);
+    	}
+    	return buf;
+    }
+
     void calc_non_rbf_base1( int vcount, int var_count, const float* vecs,
                                 const float* another, Qfloat* results,
                                 double alpha, double beta )
@@ -421,9 +669,6 @@ public:
     	cl_uint var_count2 = (cl_uint)var_count;
 		float alpha2=(float)alpha;
 		float beta2=(float)beta;
-		cl_uint bid=0;
-		float *sum_partial=new float[var_count];
-		double sum_dotprod=0;
 
     	static int count=0;
 #ifdef _DEBUG
@@ -432,39 +677,47 @@ public:
 #ifdef _DEBUG
 			gettimeofday(&t1, NULL);
 #endif
+    	if( vcount <= 0 )
+    		return;
+    	AutoLock lock(clMutex);
 
-    	if(!bClMemInit){
-    		bClMemInit=true;
-
-			cm_samples = clCreateBuffer(context, CL_MEM_READ_WRITE, vcount2*var_count2*sizeof(float), NULL, &ret);
-			if(ret != CL_SUCCESS){
-					cout<< getErrorString(ret)<<endl;
-					exit(0);
-			}
-
-			cm_another = clCreateBuffer(context, CL_MEM_READ_WRITE, var_count2*sizeof(float), NULL, &ret);
-			if(ret != CL_SUCCESS){
-					cout<< getErrorString(ret)<<endl;
-					exit(0);
-			}
-
-			cm_results = clCreateBuffer(context, CL_MEM_READ_WRITE, vcount2*sizeof(float), NULL, &ret);
-			if(ret != CL_SUCCESS){
-				cout<< getErrorString(ret)<<endl;
-				exit(0);
-			}
-
-
-			ret = clEnqueueWriteBuffer(command_queue, cm_samples,  CL_TRUE, 0, vcount2*var_count2*sizeof(float), vecs,  0, NULL, NULL);
-			ret = clEnqueueWriteBuffer(command_queue, cm_another, CL_TRUE, 0, var_count2*sizeof(float), another, 0, NULL, NULL);
-
+    	size_t nsamples = (size_t)vcount*var_count;
+    	if( nsamples > clSamplesCap )
+    	{
+    		if( clSamplesCap > 0 )
+    			clReleaseMemObject(cm_samples);
+    		cm_samples = createBuffer(std::max(nsamples, (size_t)1));
+    		clSamplesCap = nsamples;
+    		clToken = 0;
     	}
-    	else{
-
-
-    		ret = clEnqueueWriteBuffer(command_queue, cm_another, CL_TRUE, 0, var_count2*sizeof(float), another, 0, NULL, NULL);
+    	if( (size_t)var_count > clAnotherCap )
+    	{
+    		if( clAnotherCap > 0 )
+    			clReleaseMemObject(cm_another);
+    		cm_another = createBuffer(std::max(var_count, 1));
+    		clAnotherCap = var_count;
+    	}
+    	if( (size_t)vcount > clResultsCap )
+    	{
+    		if( clResultsCap > 0 )
+    			clReleaseMemObject(cm_results);
+    		cm_results = createBuffer(std::max(vcount, 1));
+    		clResultsCap = vcount;
+    	}
+    	bClMemInit=true;
 
+    	// the samples on the device are only reused for the same token, which their owner
+    	// renews whenever it rewrites them; the calls without a token always upload them
+    	if( callToken == 0 || callToken != clToken || vecs != clVecs ||
+    	    vcount != clVcount || var_count != clVarCount )
+    	{
+    		ret = clEnqueueWriteBuffer(command_queue, cm_samples, CL_TRUE, 0, nsamples*sizeof(float), vecs, 0, NULL, NULL);
+    		clToken = callToken;
+    		clVecs = vecs;
+    		clVcount = vcount;
+    		clVarCount = var_count;
     	}
+    	ret = clEnqueueWriteBuffer(command_queue, cm_another, CL_TRUE, 0, var_count2*sizeof(float), another, 0, NULL, NULL);
 
 			ret = clSetKernelArg(kernel, 0, sizeof(cl_mem),   (void *)&cm_samples);
 			ret = clSetKernelArg(kernel, 1, sizeof(cl_mem),   (void *)&cm_another);
@@ -643,6 +896,28 @@ public:
 
     void calc( int vcount, int var_count, const float* vecs,
                const float* another, Qfloat* results )
+    {
+        calcSamples( 0, vcount, var_count, vecs, another, results );
+    }
+
+    // calc() on the samples <vecs> named by <token> (see newSamplesToken()), which the
+    // LINEAR, POLY and SIGMOID kernels then keep on the device for the next calls
+    void calcSamples( int token, int vcount, int var_count, const float* vecs,
+                      const float* another, Qfloat* results )
+    {
+        int type = params.kernelType;
+        if( type == SVM::LINEAR || type == SVM::POLY || type == SVM::SIGMOID )
+        {
+            AutoLock lock(clMutex);
+            callToken = token;
+            calcRows( vcount, var_count, vecs, another, results );
+        }
+        else
+            calcRows( vcount, var_count, vecs, another, results );
+    }
+
+    void calcRows( int vcount, int var_count, const float* vecs,
+                   const float* another, Qfloat* results )
     {
         switch( params.kernelType )
         {
@@ -743,11 +1018,284 @@ ParamGrid SVM::getDefaultGrid( int param_id )
         grid.maxVal = 4;
         grid.logStep = 7; // total iterations = 3
     }
-    else
-        cvError( CV_StsBadArg, "SVM::getDefaultGrid", "Invalid type of parameter "
-                "(use one of SVM::C, SVM::GAMMA et al.)", __FILE__, __LINE__ );
-    return grid;
-}
+    else
+        cvError( CV_StsBadArg, "SVM::getDefaultGrid", "Invalid type of parameter "
+                "(use one of SVM::C, SVM::GAMMA et al.)", __FILE__, __LINE__ );
+    return grid;
+}
+
+/*
+ Kernel shared by the concurrent trainAuto() jobs that use the same kernel parameters.
+ The LINEAR, POLY and SIGMOID kernels run on the device through one command queue and
+ keep their buffers between the calls, so their calc() calls are serialized; the other
+ kernels are computed on the host and run concurrently. The device keeps the samples
+ between the calls that name them with the same token, see calcKernel().
+*/
+class SVMSharedKernel : public SVM::Kernel
+{
+public:
+    SVMSharedKernel( const Ptr<SVM::Kernel>& _kernel, bool _serialize )
+        : kernel(_kernel), serialize(_serialize) {}
+
+    int getType() const
+    {
+        return kernel->getType();
+    }
+
+    void calc( int vcount, int n, const float* vecs, const float* another, Qfloat* results )
+    {
+        calcSamples( 0, vcount, n, vecs, another, results );
+    }
+
+    void calcSamples( int token, int vcount, int n, const float* vecs, const float* another, Qfloat* results )
+    {
+        SVMKernelImpl* k = dynamic_cast<SVMKernelImpl*>(kernel.get());
+        if( serialize )
+        {
+            AutoLock lock(mutex);
+            if( k )
+                k->calcSamples( token, vcount, n, vecs, another, results );
+            else
+                kernel->calc( vcount, n, vecs, another, results );
+        }
+        else if( k )
+            k->calcSamples( token, vcount, n, vecs, another, results );
+        else
+            kernel->calc( vcount, n, vecs, another, results );
+    }
+
+    Ptr<SVM::Kernel> kernel;
+    bool serialize;
+    Mutex mutex;
+};
+
+// kernel->calc() on the samples <vecs> named by <token> (see newSamplesToken()): the device
+// backed kernels upload them once per token instead of once per call
+static void calcKernel( const Ptr<SVM::Kernel>& kernel, int token, int vcount, int n,
+                        const float* vecs, const float* another, Qfloat* results )
+{
+    if( SVMSharedKernel* k = dynamic_cast<SVMSharedKernel*>(kernel.get()) )
+        k->calcSamples( token, vcount, n, vecs, another, results );
+    else if( SVMKernelImpl* k = dynamic_cast<SVMKernelImpl*>(kernel.get()) )
+        k->calcSamples( token, vcount, n, vecs, another, results );
+    else
+        kernel->calc( vcount, n, vecs, another, results );
+}
+
+/*
+ Kernels between sparse samples and a dense vector x, computed over the non-zero elements
+ of the samples only. The terms of the non-zero elements of x that a sample lacks are taken
+ from the totals over x found once by prepare(), so K(x, s_j) costs O(nnz(s_j)) whatever the
+ dimension:
+   RBF:   |x - s|^2 = |x|^2 + |s|^2 - 2 x.s
+   INTER: sum min(x_k, s_k) = sum min(x_k, 0) + sum_{s_k != 0} (min(x_k, s_k) - min(x_k, 0))
+   CHI2:  the same with (x_k - s_k)^2/(x_k + s_k), which is x_k for s_k = 0.
+ The kernels are symmetric, so a sparse x is scattered into a dense buffer and used the same way.
+*/
+class SVMSparseKernel
+{
+public:
+    // the totals over x: sum x_k^2, sum min(x_k, 0) and sum x_k
+    struct Query
+    {
+        const float* x;
+        double norm, neg, sum;
+    };
+
+    SVMSparseKernel( const SVM::Params& _params ) : params(_params)
+    {
+        if( params.kernelType == SVM::CUSTOM )
+            CV_Error( CV_StsNotImplemented, "The custom kernels do not support sparse samples" );
+    }
+
+    // describes the <n>-dimensional x; if <nz> is given, only its <nzcount> columns are non-zero
+    void prepare( const float* x, int n, const int* nz, int nzcount, Query& q ) const
+    {
+        q.x = x;
+        q.norm = q.neg = q.sum = 0;
+        int k, count = nz ? nzcount : n;
+        for( k = 0; k < count; k++ )
+        {
+            double v = x[nz ? nz[k] : k];
+            q.norm += v*v;
+            q.neg += std::min(v, 0.);
+            q.sum += v;
+        }
+    }
+
+    // K(x, s) for the samples idx[0], ..., idx[count-1] of <vecs> (0, ..., count-1 if <idx>
+    // is 0); <norms> are their squared norms, in the same order, used by RBF only
+    void calc( const SparseSamples& vecs, const double* norms, const int* idx, int count,
+               const Query& q, Qfloat* results ) const
+    {
+        const float* values = vecs.valuePtr();
+        const int* cols = vecs.colPtr();
+        const float* x = q.x;
+        int j, k, kernelType = params.kernelType;
+
+        for( j = 0; j < count; j++ )
+        {
+            int i = idx ? idx[j] : j, k1 = vecs.end(i);
+            double s = 0;
+            if( kernelType == SVM::INTER )
+            {
+                s = q.neg;
+                for( k = vecs.begin(i); k < k1; k++ )
+                {
+                    double a = x[cols[k]];
+                    s += std::min(a, (double)values[k]) - std::min(a, 0.);
+                }
+            }
+            else if( kernelType == SVM::CHI2 )
+            {
+                s = q.sum;
+                for( k = vecs.begin(i); k < k1; k++ )
+                {
+                    double a = x[cols[k]], d = a - values[k], devisor = a + values[k];
+                    s += (devisor != 0 ? d*d/devisor : 0.) - a;
+                }
+                s *= -params.gamma;
+            }
+            else
+            {
+                for( k = vecs.begin(i); k < k1; k++ )
+                    s += x[cols[k]]*values[k];
+                if( kernelType == SVM::RBF )
+                    s = -params.gamma*std::max(q.norm + norms[j] - 2*s, 0.);
+                else if( kernelType == SVM::POLY )
+                    s = s*params.gamma + params.coef0;
+                else if( kernelType == SVM::SIGMOID )
+                    s = s*(-2*params.gamma) - 2*params.coef0;
+            }
+            results[j] = (Qfloat)s;
+        }
+
+        // the same transforms as the dense kernels
+        Mat R( 1, count, QFLOAT_TYPE, results );
+        if( count > 0 && (kernelType == SVM::RBF || kernelType == SVM::CHI2) )
+            exp( R, R );
+        else if( count > 0 && kernelType == SVM::POLY )
+            pow( R, params.degree, R );
+        else if( kernelType == SVM::SIGMOID )
+            for( j = 0; j < count; j++ )
+            {
+                Qfloat t = results[j];
+                Qfloat e = std::exp(-std::abs(t));
+                results[j] = t > 0 ? (Qfloat)((1. - e)/(1. + e)) : (Qfloat)((e - 1.)/(e + 1.));
+            }
+
+        const Qfloat max_val = (Qfloat)(FLT_MAX*1e-3);
+        for( j = 0; j < count; j++ )
+        {
+            if( results[j] > max_val )
+                results[j] = max_val;
+        }
+    }
+
+    static void calcNorms( const SparseSamples& vecs, vector<double>& norms )
+    {
+        int i, n = vecs.rows();
+        const float* values = vecs.valuePtr();
+        norms.resize(n);
+        for( i = 0; i < n; i++ )
+        {
+            double s = 0;
+            for( int k = vecs.begin(i); k < vecs.end(i); k++ )
+                s += (double)values[k]*values[k];
+            norms[i] = s;
+        }
+    }
+
+    SVM::Params params;
+};
+
+/*
+ Rows of the kernel matrix of all the trainAuto() samples, indexed by the global sample
+ index. The folds train on different subsets of the same samples, so one instance shared
+ by all the jobs that use a kernel computes every K(x_i, x_j) once. The rows are kept
+ until <maxSize> bytes are used; the later ones are computed on demand. <kernel> is only
+ used here, always on <samples>, so a device kernel uploads them once.
+ The rows of sparse samples are computed by SVMSparseKernel, in O(nnz) per row.
+*/
+class SVMKernelRows
+{
+public:
+    enum { MAX_SIZE = (1 << 30) /* 1Gb */ };
+
+    SVMKernelRows( const Ptr<SVM::Kernel>& _kernel, const Mat& _samples, size_t maxSize )
+    {
+        kernel = _kernel;
+        samples = _samples;
+        samplesToken = newSamplesToken();
+        init( samples.rows, maxSize );
+    }
+
+    SVMKernelRows( const Ptr<SVMSparseKernel>& _skernel, const SparseSamples& _ssamples, size_t maxSize )
+    {
+        skernel = _skernel;
+        ssamples = _ssamples;
+        SVMSparseKernel::calcNorms( ssamples, norms );
+        init( ssamples.rows(), maxSize );
+    }
+
+    void init( int n, size_t maxSize )
+    {
+        nsamples = n;
+        rows.resize(nsamples);
+        size_t row_size = nsamples*sizeof(Qfloat);
+        max_rows = (int)std::min(maxSize/std::max(row_size, (size_t)1), (size_t)nsamples);
+        row_count = 0;
+    }
+
+    // the row of the <g>-th sample; the returned header keeps it valid
+    Mat row( int g )
+    {
+        {
+            AutoLock lock(mutex);
+            if( !rows[g].empty() )
+                return rows[g];
+        }
+
+        // computed outside of the lock; two jobs may compute the same row once in a while
+        Mat r(1, nsamples, QFLOAT_TYPE);
+        if( skernel )
+        {
+            int k, k0 = ssamples.begin(g), k1 = ssamples.end(g);
+            const int* cols = ssamples.colPtr();
+            AutoBuffer<float> xbuf(ssamples.cols);
+            float* x = xbuf;
+            memset( x, 0, ssamples.cols*sizeof(x[0]) );
+            for( k = k0; k < k1; k++ )
+                x[cols[k]] = ssamples.valuePtr()[k];
+            SVMSparseKernel::Query q;
+            skernel->prepare( x, ssamples.cols, cols + k0, k1 - k0, q );
+            skernel->calc( ssamples, &norms[0], 0, nsamples, q, r.ptr<Qfloat>() );
+        }
+        else
+            calcKernel( kernel, samplesToken, samples.rows, samples.cols, samples.ptr<float>(),
+                        samples.ptr<float>(g), r.ptr<Qfloat>() );
+
+        AutoLock lock(mutex);
+        if( rows[g].empty() && row_count < max_rows )
+        {
+            rows[g] = r;
+            row_count++;
+        }
+        return r;
+    }
+
+    Ptr<SVM::Kernel> kernel;
+    Mat samples;
+    int samplesToken;
+    Ptr<SVMSparseKernel> skernel;
+    SparseSamples ssamples;
+    vector<double> norms;
+    int nsamples;
+    vector<Mat> rows;
+    int max_rows;
+    int row_count;
+    Mutex mutex;
+};
 
 
 class SVMImpl : public SVM
@@ -799,12 +1347,38 @@ public:
 
         struct SolutionInfo
         {
-            SolutionInfo() { obj = rho = upper_bound_p = upper_bound_n = r = 0; }
+            SolutionInfo() { obj = rho = upper_bound_p = upper_bound_n = r = 0; iter = 0; }
             double obj;
             double rho;
             double upper_bound_p;
             double upper_bound_n;
             double r;   // for Solver_NU
+            int iter;
+        };
+
+        // LRU cache of the kernel matrix rows. It may outlive the solver, so that the next
+        // solve of the same problem (same samples and labels, another C) reuses the rows.
+        // When <matrix> is set, the missing rows are gathered from it, <index> giving the
+        // global index of every solver sample, instead of being computed.
+        struct KernelCache
+        {
+            KernelCache() { cache_size = max_cache_size = lru_first = lru_last = 0; }
+            int cache_size;
+            int max_cache_size;
+            vector<KernelRow> lru_cache;
+            int lru_first;
+            int lru_last;
+            Mat lru_cache_data;
+            Ptr<SVMKernelRows> matrix;
+            vector<int> index;
+        };
+
+        // what is kept between the solves of one problem along a path of C values:
+        // the dual variables of the last solution (C_SVC and EPS_SVR) and the kernel rows
+        struct WarmStart
+        {
+            vector<double> alpha;
+            KernelCache cache;
         };
 
         void clear()
@@ -813,7 +1387,8 @@ public:
             select_working_set_func = 0;
             calc_rho_func = 0;
             get_row_func = 0;
-            lru_cache.clear();
+            cache = &own_cache;
+            own_cache.lru_cache.clear();
         }
 
         Solver( const Mat& _samples, const vector<schar>& _y,
@@ -821,7 +1396,7 @@ public:
                 double _Cp, double _Cn,
                 const Ptr<SVM::Kernel>& _kernel, GetRow _get_row,
                 SelectWorkingSet _select_working_set, CalcRho _calc_rho,
-                TermCriteria _termCrit )
+                TermCriteria _termCrit, KernelCache* _cache = 0 )
         {
             clear();
 
@@ -854,23 +1429,39 @@ public:
             get_row_func = _get_row;
             CV_Assert(get_row_func != 0);
 
+            // the buffer of <samples> may hold the samples of a previous problem
+            samplesToken = newSamplesToken();
+
+            if( _cache )
+                cache = _cache;
+            // the rows of a previous solve are valid as long as the problem is the same
+            if( (int)cache->lru_cache.size() == sample_count+1 &&
+                cache->lru_cache_data.cols == sample_count )
+                return;
+
             // assume that for large training sets ~25% of Q matrix is used
             int64 csize = (int64)sample_count*sample_count/4;
             csize = std::max(csize, (int64)(MIN_CACHE_SIZE/sizeof(Qfloat)) );
             csize = std::min(csize, (int64)(MAX_CACHE_SIZE/sizeof(Qfloat)) );
-            max_cache_size = (int)((csize + sample_count-1)/sample_count);
-            max_cache_size = std::min(std::max(max_cache_size, 1), sample_count);
-            cache_size = 0;
-
-            lru_cache.clear();
-            lru_cache.resize(sample_count+1, KernelRow(-1, 0, 0));
-            lru_first = lru_last = 0;
-            lru_cache_data.create(max_cache_size, sample_count, QFLOAT_TYPE);
+            cache->max_cache_size = (int)((csize + sample_count-1)/sample_count);
+            cache->max_cache_size = std::min(std::max(cache->max_cache_size, 1), sample_count);
+            cache->cache_size = 0;
+
+            cache->lru_cache.clear();
+            cache->lru_cache.resize(sample_count+1, KernelRow(-1, 0, 0));
+            cache->lru_first = cache->lru_last = 0;
+            cache->lru_cache_data.create(cache->max_cache_size, sample_count, QFLOAT_TYPE);
         }
 
         Qfloat* get_row_base( int i, bool* _existed )
         {
             int i1 = i < sample_count ? i : i - sample_count;
+            vector<KernelRow>& lru_cache = cache->lru_cache;
+            int& lru_first = cache->lru_first;
+            int& lru_last = cache->lru_last;
+            int& cache_size = cache->cache_size;
+            int max_cache_size = cache->max_cache_size;
+            Mat& lru_cache_data = cache->lru_cache_data;
             KernelRow& kr = lru_cache[i1+1];
             if( _existed )
                 *_existed = kr.idx >= 0;
@@ -889,8 +1480,18 @@ public:
                     lru_cache[last.prev].next = 0;
                     lru_last = last.prev;
                 }
-                kernel->calc( sample_count, var_count, samples.ptr<float>(),
-                              samples.ptr<float>(i1), lru_cache_data.ptr<Qfloat>(kr.idx) );
+                Qfloat* dst = lru_cache_data.ptr<Qfloat>(kr.idx);
+                if( cache->matrix )
+                {
+                    const int* index = &cache->index[0];
+                    Mat mrow = cache->matrix->row(index[i1]);
+                    const Qfloat* src = mrow.ptr<Qfloat>();
+                    for( int j = 0; j < sample_count; j++ )
+                        dst[j] = src[index[j]];
+                }
+                else
+                    calcKernel( kernel, samplesToken, sample_count, var_count, samples.ptr<float>(),
+                                samples.ptr<float>(i1), dst );
             }
             else
             {
@@ -1128,6 +1729,7 @@ public:
 
             si.upper_bound_p = C[1];
             si.upper_bound_n = C[0];
+            si.iter = iter;
 
             return true;
         }
@@ -1342,24 +1944,54 @@ public:
         /*
         ///////////////////////// construct and solve various formulations ///////////////////////
         */
+        // Starts from the last solution of the same problem if there is one, or from 0.
+        // The previous alpha is scaled down if it leaves the [0, Cp/Cn] box of the new C,
+        // which keeps y^T alpha unchanged; along an increasing C path it is used as is.
+        static void init_alpha( const WarmStart* ws, const vector<schar>& _y,
+                                double _Cp, double _Cn, vector<double>& _alpha )
+        {
+            int i, alpha_count = (int)_y.size();
+            if( !ws || (int)ws->alpha.size() != alpha_count )
+            {
+                _alpha.assign(alpha_count, 0.);
+                return;
+            }
+
+            double scale = 1;
+            for( i = 0; i < alpha_count; i++ )
+            {
+                double C_i = _y[i] > 0 ? _Cp : _Cn;
+                if( ws->alpha[i] > C_i )
+                    scale = std::min(scale, C_i/ws->alpha[i]);
+            }
+
+            _alpha.resize(alpha_count);
+            for( i = 0; i < alpha_count; i++ )
+                _alpha[i] = ws->alpha[i]*scale;
+        }
+
         static bool solve_c_svc( const Mat& _samples, const vector<schar>& _y,
                                  double _Cp, double _Cn, const Ptr<SVM::Kernel>& _kernel,
-                                 vector<double>& _alpha, SolutionInfo& _si, TermCriteria termCrit )
+                                 vector<double>& _alpha, SolutionInfo& _si, TermCriteria termCrit,
+                                 WarmStart* ws = 0 )
         {
             int sample_count = _samples.rows;
 
-            _alpha.assign(sample_count, 0.);
+            init_alpha( ws, _y, _Cp, _Cn, _alpha );
             vector<double> _b(sample_count, -1.);
 
             Solver solver( _samples, _y, _alpha, _b, _Cp, _Cn, _kernel,
                            &Solver::get_row_svc,
                            &Solver::select_working_set,
                            &Solver::calc_rho,
-                           termCrit );
+                           termCrit, ws ? &ws->cache : 0 );
 
             if( !solver.solve_generic( _si ))
                 return false;
 
+            if( ws )
+                ws->alpha = _alpha;
+
             for( int i = 0; i < sample_count; i++ )
                 _alpha[i] *= _y[i];
 
@@ -1370,7 +2002,7 @@ public:
         static bool solve_nu_svc( const Mat& _samples, const vector<schar>& _y,
                                   double nu, const Ptr<SVM::Kernel>& _kernel,
                                   vector<double>& _alpha, SolutionInfo& _si,
-                                  TermCriteria termCrit )
+                                  TermCriteria termCrit, WarmStart* ws = 0 )
         {
             int sample_count = _samples.rows;
 
@@ -1400,7 +2032,7 @@ public:
                            &Solver::get_row_svc,
                            &Solver::select_working_set_nu_svm,
                            &Solver::calc_rho_nu_svm,
-                           termCrit );
+                           termCrit, ws ? &ws->cache : 0 );
 
             if( !solver.solve_generic( _si ))
                 return false;
@@ -1450,14 +2082,13 @@ public:
         static bool solve_eps_svr( const Mat& _samples, const vector<float>& _yf,
                                    double p, double C, const Ptr<SVM::Kernel>& _kernel,
                                    vector<double>& _alpha, SolutionInfo& _si,
-                                   TermCriteria termCrit )
+                                   TermCriteria termCrit, WarmStart* ws = 0 )
         {
             int sample_count = _samples.rows;
             int alpha_count = sample_count*2;
 
             CV_Assert( (int)_yf.size() == sample_count );
 
-            _alpha.assign(alpha_count, 0.);
             vector<schar> _y(alpha_count);
             vector<double> _b(alpha_count);
 
@@ -1470,15 +2101,20 @@ public:
                 _y[i+sample_count] = -1;
             }
 
+            init_alpha( ws, _y, C, C, _alpha );
+
             Solver solver( _samples, _y, _alpha, _b, C, C, _kernel,
                            &Solver::get_row_svr,
                            &Solver::select_working_set,
                            &Solver::calc_rho,
-                           termCrit );
+                           termCrit, ws ? &ws->cache : 0 );
 
             if( !solver.solve_generic( _si ))
                 return false;
 
+            if( ws )
+                ws->alpha = _alpha;
+
             for( int i = 0; i < sample_count; i++ )
                 _alpha[i] -= _alpha[i+sample_count];
 
@@ -1489,7 +2125,7 @@ public:
         static bool solve_nu_svr( const Mat& _samples, const vector<float>& _yf,
                                   double nu, double C, const Ptr<SVM::Kernel>& _kernel,
                                   vector<double>& _alpha, SolutionInfo& _si,
-                                  TermCriteria termCrit )
+                                  TermCriteria termCrit, WarmStart* ws = 0 )
         {
             int sample_count = _samples.rows;
             int alpha_count = sample_count*2;
@@ -1517,7 +2153,7 @@ public:
                            &Solver::get_row_svr,
                            &Solver::select_working_set_nu_svm,
                            &Solver::calc_rho_nu_svm,
-                           termCrit );
+                           termCrit, ws ? &ws->cache : 0 );
 
             if( !solver.solve_generic( _si ))
                 return false;
@@ -1530,14 +2166,12 @@ public:
 
         int sample_count;
         int var_count;
-        int cache_size;
-        int max_cache_size;
         Mat samples;
+        // names <samples> for the kernel, see newSamplesToken()
+        int samplesToken;
         SVM::Params params;
-        vector<KernelRow> lru_cache;
-        int lru_first;
-        int lru_last;
-        Mat lru_cache_data;
+        KernelCache own_cache;
+        KernelCache* cache;
 
         int alpha_count;
 
@@ -1562,6 +2196,7 @@ public:
     //////////////////////////////////////////////////////////////////////////////////////////
     SVMImpl()
     {
+        renewKernel = false;
         clear();
     }
 
@@ -1576,10 +2211,18 @@ public:
         df_alpha.clear();
         df_index.clear();
         sv.release();
+        sparse_sv = SparseSamples();
+        sparse_sv_norms.clear();
     }
 
     Mat getSupportVectors() const
     {
+        if( sv.empty() && !sparse_sv.empty() )
+        {
+            Mat dense;
+            sparse_sv.toDense(dense);
+            return dense;
+        }
         return sv;
     }
 
@@ -1663,7 +2306,36 @@ public:
                 (int)df_index.size()) - decision_func[i].ofs;
     }
 
-    bool do_train( const Mat& _samples, const Mat& _responses )
+    // State of a trainAuto() job that trains the same fold for increasing values of C:
+    // the C_SVC and EPS_SVR solves start from the solution of the previous C and, for a
+    // single binary problem, reuse its kernel rows. If <matrix> is set, the kernel rows
+    // come from the rows shared by all the folds, <sample_index> giving the global index
+    // of every training sample. <iterations> is the SMO iteration count of the last do_train()
+    // and <sv_index> the do_train() sample that every support vector is copied from.
+    struct TrainPath
+    {
+        TrainPath() : iterations(0) {}
+        vector<Solver::WarmStart> problems;
+        Ptr<SVMKernelRows> matrix;
+        vector<int> sample_index;
+        int64 iterations;
+        vector<int> sv_index;
+    };
+
+    // points the kernel cache of a solve at the shared kernel rows; <sidx> maps the solver
+    // samples to the do_train() samples, all of them if it is empty
+    static void set_shared_rows( Solver::WarmStart* ws, const TrainPath* path, const vector<int>& sidx )
+    {
+        if( !ws || !path->matrix )
+            return;
+        int k, n = sidx.empty() ? (int)path->sample_index.size() : (int)sidx.size();
+        ws->cache.matrix = path->matrix;
+        ws->cache.index.resize(n);
+        for( k = 0; k < n; k++ )
+            ws->cache.index[k] = path->sample_index[sidx.empty() ? k : sidx[k]];
+    }
+
+    bool do_train( const Mat& _samples, const Mat& _responses, TrainPath* path = 0 )
     {
         int svmType = params.svmType;
         int i, j, k, sample_count = _samples.rows;
@@ -1672,6 +2344,13 @@ public:
 
         CV_Assert( _samples.type() == CV_32F );
         var_count = _samples.cols;
+        sparse_sv = SparseSamples();
+        sparse_sv_norms.clear();
+        if( path )
+        {
+            path->iterations = 0;
+            path->sv_index.clear();
+        }
 
         if( svmType == ONE_CLASS || svmType == EPS_SVR || svmType == NU_SVR )
         {
@@ -1682,13 +2361,23 @@ public:
             if( !_responses.empty() )
                 _responses.convertTo(_yf, CV_32F);
 
+            Solver::WarmStart* ws = 0;
+            if( path && svmType != ONE_CLASS )
+            {
+                path->problems.resize(1);
+                ws = &path->problems[0];
+                set_shared_rows( ws, path, vector<int>() );
+            }
+
             bool ok =
             svmType == ONE_CLASS ? Solver::solve_one_class( _samples, params.nu, kernel, _alpha, sinfo, termCrit ) :
-            svmType == EPS_SVR ? Solver::solve_eps_svr( _samples, _yf, params.p, params.C, kernel, _alpha, sinfo, termCrit ) :
-            svmType == NU_SVR ? Solver::solve_nu_svr( _samples, _yf, params.nu, params.C, kernel, _alpha, sinfo, termCrit ) : false;
+            svmType == EPS_SVR ? Solver::solve_eps_svr( _samples, _yf, params.p, params.C, kernel, _alpha, sinfo, termCrit, ws ) :
+            svmType == NU_SVR ? Solver::solve_nu_svr( _samples, _yf, params.nu, params.C, kernel, _alpha, sinfo, termCrit, ws ) : false;
 
             if( !ok )
                 return false;
+            if( path )
+                path->iterations += sinfo.iter;
 
             for( i = 0; i < sample_count; i++ )
                 sv_count += fabs(_alpha[i]) > 0;
@@ -1703,7 +2392,11 @@ public:
             {
                 if( std::abs(_alpha[i]) > 0 )
                 {
-                    _samples.row(i).copyTo(sv.row(k));
+                    // the samples have no columns when the kernel rows come from sparse ones
+                    if( _samples.cols > 0 )
+                        _samples.row(i).copyTo(sv.row(k));
+                    if( path )
+                        path->sv_index.push_back(i);
                     df_alpha[k] = _alpha[i];
                     df_index[k] = k;
                     k++;
@@ -1764,6 +2457,9 @@ public:
             }
 
             size_t samplesize = _samples.cols*_samples.elemSize();
+            if( path )
+                path->problems.resize(class_count*(class_count-1)/2);
+            int problem = 0;
 
             // train n*(n-1)/2 classifiers
             for( i = 0; i < class_count; i++ )
@@ -1782,7 +2478,8 @@ public:
                     for( k = 0; k < ci+cj; k++ )
                     {
                         int idx = k < ci ? si+k : sj+k-ci;
-                        memcpy(temp_samples.ptr(k), _samples.ptr(sidx_all[idx]), samplesize);
+                        if( samplesize > 0 )
+                            memcpy(temp_samples.ptr(k), _samples.ptr(sidx_all[idx]), samplesize);
                         sidx[k] = sidx_all[idx];
                         temp_y[k] = k < ci ? 1 : -1;
                     }
@@ -1793,16 +2490,26 @@ public:
                         Cn = class_weights.at<double>(j);
                     }
 
+                    Solver::WarmStart* ws = path ? &path->problems[problem] : 0;
+                    problem++;
+                    set_shared_rows( ws, path, sidx );
+
                     DecisionFunc df;
                     bool ok = params.svmType == C_SVC ?
                                 Solver::solve_c_svc( temp_samples, temp_y, Cp, Cn,
-                                                     kernel, _alpha, sinfo, termCrit ) :
+                                                     kernel, _alpha, sinfo, termCrit, ws ) :
                               params.svmType == NU_SVC ?
                                 Solver::solve_nu_svc( temp_samples, temp_y, params.nu,
-                                                      kernel, _alpha, sinfo, termCrit ) :
+                                                      kernel, _alpha, sinfo, termCrit, ws ) :
                               false;
                     if( !ok )
                         return false;
+                    if( path )
+                        path->iterations += sinfo.iter;
+                    // with several binary problems only the warm start is kept,
+                    // holding all their kernel caches would cost too much memory
+                    if( ws && path->problems.size() > 1 )
+                        ws->cache = Solver::KernelCache();
                     df.rho = sinfo.rho;
                     df.ofs = (int)df_index.size();
                     decision_func.push_back(df);
@@ -1834,7 +2541,10 @@ public:
             {
                 if( !sv_tab[i] )
                     continue;
-                memcpy(sv.ptr(sv_tab[i]-1), _samples.ptr(i), samplesize);
+                if( samplesize > 0 )
+                    memcpy(sv.ptr(sv_tab[i]-1), _samples.ptr(i), samplesize);
+                if( path )
+                    path->sv_index.push_back(i);
             }
 
             // set sv pointers
@@ -1853,7 +2563,8 @@ public:
     void optimize_linear_svm()
     {
         // we optimize only linear SVM: compress all the support vectors into one.
-        if( params.kernelType != LINEAR )
+        // The sparse support vectors are compressed once they are set, see do_train_sparse().
+        if( params.kernelType != LINEAR || (sv.cols == 0 && sparse_sv.empty()) )
             return;
 
         int i, df_count = (int)decision_func.size();
@@ -1885,8 +2596,16 @@ public:
             const double* sv_alpha = &df_alpha[df.ofs];
             for( j = 0; j < sv_count; j++ )
             {
-                const float* src = sv.ptr<float>(sv_index[j]);
                 double a = sv_alpha[j];
+                if( !sparse_sv.empty() )
+                {
+                    const float* values = sparse_sv.valuePtr();
+                    const int* cols = sparse_sv.colPtr();
+                    for( k = sparse_sv.begin(sv_index[j]); k < sparse_sv.end(sv_index[j]); k++ )
+                        v[cols[k]] += values[k]*a;
+                    continue;
+                }
+                const float* src = sv.ptr<float>(sv_index[j]);
                 for( k = 0; k < var_count; k++ )
                     v[k] += src[k]*a;
             }
@@ -1899,14 +2618,51 @@ public:
         df_alpha.assign(df_count, 1.);
         std::swap(sv, new_sv);
         std::swap(decision_func, new_df);
+        sparse_sv = SparseSamples();
+        sparse_sv_norms.clear();
+    }
+
+    /*
+     Trains on sparse samples without densifying them: the solver takes its kernel rows from
+     an SVMKernelRows computing them in O(nnz), and the support vectors are kept sparse
+     (compressed into a dense weight vector per decision function for LINEAR). ONE_CLASS
+     is not supported, its solver does not take the rows from a TrainPath.
+    */
+    bool do_train_sparse( const SparseSamples& _samples, const Mat& _responses )
+    {
+        if( params.svmType == ONE_CLASS )
+            CV_Error( CV_StsNotImplemented, "ONE_CLASS SVM can not be trained on sparse samples" );
+
+        // no row is kept by the matrix, the solver cache does it
+        TrainPath path;
+        path.matrix = makePtr<SVMKernelRows>(makePtr<SVMSparseKernel>(params), _samples, (size_t)0);
+        setRangeVector(path.sample_index, _samples.rows());
+
+        if( !do_train( Mat(_samples.rows(), 0, CV_32F), _responses, &path ) )
+            return false;
+
+        var_count = _samples.cols;
+        sv.release();
+        sparse_sv = _samples.rowSubset(Mat(path.sv_index));
+        SVMSparseKernel::calcNorms(sparse_sv, sparse_sv_norms);
+        optimize_linear_svm();
+        return true;
     }
 
     bool train( const Ptr<TrainData>& data, int )
     {
         clear();
+        if( renewKernel )
+            setParams( params, Ptr<Kernel>() );
 
         int svmType = params.svmType;
-        Mat samples = data->getTrainSamples();
+        bool sparse = data->isSparse();
+        Mat samples;
+        SparseSamples ssamples;
+        if( sparse )
+            ssamples = data->getTrainSparseSamples();
+        else
+            samples = data->getTrainSamples();
         Mat responses;
 
         if( svmType == C_SVC || svmType == NU_SVC )
@@ -1920,7 +2676,7 @@ public:
         else
             responses = data->getTrainResponses();
 
-        if( !do_train( samples, responses ))
+        if( !(sparse ? do_train_sparse( ssamples, responses ) : do_train( samples, responses )) )
         {
             clear();
             return false;
@@ -1929,21 +2685,144 @@ public:
         return true;
     }
 
-    bool trainAuto( const Ptr<TrainData>& data, int k_fold,
-                    ParamGrid C_grid, ParamGrid gamma_grid, ParamGrid p_grid,
-                    ParamGrid nu_grid, ParamGrid coef_grid, ParamGrid degree_grid,
-                    bool balanced )
+    /*
+     Trains a two-class C_SVC on chunked data by working-set selection: the model is trained
+     on a working set that fits in memory, then the blocks are scanned for the samples that
+     violate its margin, and the model is retrained on its margin samples plus the worst
+     violators, until no sample violates the margin or MAX_ROUNDS rounds are done. At most
+     <blockSize> new samples enter the working set per round, so the memory stays bounded
+     by a few blocks. This is the hard negative mining loop of the HOG detectors.
+    */
+    bool trainChunked( const Ptr<ChunkedTrainData>& data, int flags )
     {
-        int svmType = params.svmType;
-        RNG rng((uint64)-1);
+        const int MAX_ROUNDS = 10;
+        const float MARGIN_EPS = 1e-3f;
+
+        if( params.svmType != C_SVC )
+            CV_Error( CV_StsNotImplemented, "only C_SVC can be trained on chunked data" );
+        CV_Assert( !data.empty() && data->getNSamples() > 0 && data->getNOutputVars() == 1 );
+
+        int i, b, n = data->getNSamples(), nblocks = data->getNBlocks();
+        int bsize = data->getBlockSize(), nvars = data->getNVars();
+        Mat samples, responses, ws_samples, ws_responses;
+        // the samples of the working set, as indices in <data>
+        vector<int> ws_idx;
+        vector<uchar> in_ws(n, (uchar)0);
+
+        // the first working set: the first block and, if it misses a class, up to <bsize>
+        // samples of the other classes from the next blocks
+        data->getBlock(0, samples, responses);
+        ws_samples.push_back(samples);
+        responses.convertTo(ws_responses, CV_32S);
+        for( i = 0; i < samples.rows; i++ )
+            ws_idx.push_back(i);
+        int label0 = ws_responses.at<int>(0);
+        bool single = countNonZero(ws_responses != label0) == 0;
+        for( b = 1, i = 0; single && b < nblocks && i < bsize; b++ )
+        {
+            data->getBlock(b, samples, responses);
+            for( int j = 0; j < samples.rows && i < bsize; j++ )
+            {
+                int label = cvRound(responses.at<float>(j));
+                if( label != label0 )
+                {
+                    ws_samples.push_back(samples.row(j));
+                    ws_responses.push_back(label);
+                    ws_idx.push_back(b*bsize + j);
+                    i++;
+                }
+            }
+        }
 
-        if( svmType == ONE_CLASS )
-            // current implementation of "auto" svm does not support the 1-class case.
-            return train( data, 0 );
+        bool ok = false;
+        Mat df;
+        for( int round = 0; round < MAX_ROUNDS; round++ )
+        {
+            for( i = 0; i < (int)ws_idx.size(); i++ )
+                in_ws[ws_idx[i]] = 1;
+            // the working set changes size from round to round: train it with a new kernel
+            setParams( params, Ptr<Kernel>() );
+            ok = train( TrainData::create(ws_samples, ROW_SAMPLE, ws_responses), flags );
+            if( !ok || round == MAX_ROUNDS-1 )
+                break;
+            if( class_labels.total() != 2 )
+                CV_Error( CV_StsBadArg, "chunked training needs two classes" );
+            int label_pos = class_labels.at<int>(0);
 
-        clear();
+            // the raw output is positive for the first class
+            vector<std::pair<float, int> > violators;
+            for( b = 0; b < nblocks; b++ )
+            {
+                data->getBlock(b, samples, responses);
+                predict( samples, df, RAW_OUTPUT );
+                for( int j = 0; j < samples.rows; j++ )
+                {
+                    float y = cvRound(responses.at<float>(j)) == label_pos ? 1.f : -1.f;
+                    float margin = y*df.at<float>(j);
+                    if( margin < 1 - MARGIN_EPS && !in_ws[b*bsize + j] )
+                        violators.push_back(std::make_pair(margin, b*bsize + j));
+                }
+            }
+            if( violators.empty() )
+                break;
+            if( (int)violators.size() > bsize )
+            {
+                std::nth_element(violators.begin(), violators.begin() + bsize, violators.end());
+                violators.resize(bsize);
+            }
 
-        CV_Assert( k_fold >= 2 );
+            // keep the margin samples of the working set
+            Mat next_samples(0, nvars, CV_32F), next_responses(0, 1, CV_32S);
+            vector<int> next_idx;
+            predict( ws_samples, df, RAW_OUTPUT );
+            for( i = 0; i < ws_samples.rows; i++ )
+            {
+                int label = ws_responses.at<int>(i);
+                float y = label == label_pos ? 1.f : -1.f;
+                in_ws[ws_idx[i]] = 0;
+                if( y*df.at<float>(i) < 1 + MARGIN_EPS )
+                {
+                    next_samples.push_back(ws_samples.row(i));
+                    next_responses.push_back(label);
+                    next_idx.push_back(ws_idx[i]);
+                }
+            }
+
+            // ... and add the violators, block by block
+            vector<int> vidx(violators.size());
+            for( i = 0; i < (int)vidx.size(); i++ )
+                vidx[i] = violators[i].second;
+            std::sort(vidx.begin(), vidx.end());
+            for( i = 0; i < (int)vidx.size(); )
+            {
+                b = vidx[i] / bsize;
+                data->getBlock(b, samples, responses);
+                for( ; i < (int)vidx.size() && vidx[i] / bsize == b; i++ )
+                {
+                    int j = vidx[i] - b*bsize;
+                    next_samples.push_back(samples.row(j));
+                    next_responses.push_back(cvRound(responses.at<float>(j)));
+                    next_idx.push_back(vidx[i]);
+                }
+            }
+
+            ws_samples = next_samples;
+            ws_responses = next_responses;
+            ws_idx.swap(next_idx);
+        }
+
+        return ok;
+    }
+
+    // Lists the points of the trainAuto() grid, checked and normalized by setParams().
+    // The points that only differ in C, nu or p share one kernel, and thus one device context.
+    void getGridPoints( ParamGrid C_grid, ParamGrid gamma_grid, ParamGrid p_grid,
+                        ParamGrid nu_grid, ParamGrid coef_grid, ParamGrid degree_grid,
+                        vector<Params>& points, vector<int>& point_kernel,
+                        vector<Ptr<SVMSharedKernel> >& kernels )
+    {
+        int svmType = params.svmType;
+        int i;
 
         // All the parameters except, possibly, <coef0> are positive.
         // <coef0> is nonnegative
@@ -1977,11 +2856,68 @@ public:
         if( svmType != EPS_SVR )
             p_grid.minVal = p_grid.maxVal = params.p;
 
-        Mat samples = data->getTrainSamples();
+        vector<Params> kernel_params;
+        points.clear();
+        point_kernel.clear();
+        kernels.clear();
+
+        #define FOR_IN_GRID(var, grid) \
+            for( params.var = grid.minVal; params.var == grid.minVal || params.var < grid.maxVal; params.var *= grid.logStep )
+
+        FOR_IN_GRID(C, C_grid)
+        FOR_IN_GRID(gamma, gamma_grid)
+        FOR_IN_GRID(p, p_grid)
+        FOR_IN_GRID(nu, nu_grid)
+        FOR_IN_GRID(coef0, coef_grid)
+        FOR_IN_GRID(degree, degree_grid)
+        {
+            for( i = 0; i < (int)kernel_params.size(); i++ )
+            {
+                const Params& kp = kernel_params[i];
+                if( kp.gamma == params.gamma && kp.coef0 == params.coef0 && kp.degree == params.degree )
+                    break;
+            }
+
+            // check the parameters here rather than in the jobs
+            SVMImpl svm;
+            if( i == (int)kernels.size() )
+            {
+                svm.setParams(params, Ptr<Kernel>());
+                int kt = params.kernelType;
+                kernels.push_back(makePtr<SVMSharedKernel>(svm.getKernel(),
+                                  kt == LINEAR || kt == POLY || kt == SIGMOID));
+                kernel_params.push_back(params);
+            }
+            else
+                svm.setParams(params, kernels[i]);
+
+            points.push_back(svm.getParams());
+            point_kernel.push_back(i);
+        }
+    }
+
+    bool trainAuto( const Ptr<TrainData>& data, int k_fold,
+                    ParamGrid C_grid, ParamGrid gamma_grid, ParamGrid p_grid,
+                    ParamGrid nu_grid, ParamGrid coef_grid, ParamGrid degree_grid,
+                    bool balanced )
+    {
+        int svmType = params.svmType;
+        RNG rng((uint64)-1);
+
+        if( svmType == ONE_CLASS )
+            // current implementation of "auto" svm does not support the 1-class case.
+            return train( data, 0 );
+
+        clear();
+        autoJobs.clear();
+
+        CV_Assert( k_fold >= 2 );
+
+        // the samples are only gathered once, into the fold buffer below
+        TrainData::SampleView samples = data->getTrainSampleView();
         Mat responses;
         bool is_classification = false;
-        Mat class_labels0 = class_labels;
-        int class_count = (int)class_labels.total();
+        Mat temp_class_labels;
 
         if( svmType == C_SVC || svmType == NU_SVC )
         {
@@ -1989,20 +2925,18 @@ public:
             class_labels = data->getClassLabels();
             is_classification = true;
 
-            vector<int> temp_class_labels;
-            setRangeVector(temp_class_labels, class_count);
-
-            // temporarily replace class labels with 0, 1, ..., NCLASSES-1
-            Mat(temp_class_labels).copyTo(class_labels);
+            // the jobs are trained on the class indices 0, 1, ..., NCLASSES-1
+            vector<int> class_idx;
+            setRangeVector(class_idx, (int)class_labels.total());
+            Mat(class_idx).copyTo(temp_class_labels);
         }
         else
             responses = data->getTrainResponses();
 
-        CV_Assert(samples.type() == CV_32F);
+        int class_count = (int)temp_class_labels.total();
 
-        int sample_count = samples.rows;
-        var_count = samples.cols;
-        size_t sample_size = var_count*samples.elemSize();
+        int sample_count = samples.size();
+        var_count = samples.getNVars();
 
         vector<int> sidx;
         setRangeVector(sidx, sample_count);
@@ -2053,109 +2987,340 @@ public:
             }
         }
 
-        int test_sample_count = (sample_count + k_fold/2)/k_fold;
-        int train_sample_count = sample_count - test_sample_count;
+        // The permuted samples are stored twice in a row, so that the training part
+        // [start, start + train_sample_count) and the test part that follows it are
+        // contiguous row ranges of one read-only buffer for every fold.
+        int max_start = ((k_fold-1)*sample_count + k_fold/2)/k_fold;
+        int buf_count = max_start + sample_count;
+        int rtype = responses.type();
 
-        Params best_params = params;
-        double min_error = FLT_MAX;
+        Mat fold_samples(buf_count, var_count, CV_32F);
+        Mat fold_responses(buf_count, 1, rtype);
 
-        int rtype = responses.type();
+        for( i = 0; i < buf_count; i++ )
+        {
+            j = sidx[i % sample_count];
+            samples.getSample(j, fold_samples.ptr<float>(i));
+            if( is_classification )
+                fold_responses.at<int>(i) = responses.at<int>(j);
+            else
+                fold_responses.at<float>(i) = responses.at<float>(j);
+        }
 
-        Mat temp_train_samples(train_sample_count, var_count, CV_32F);
-        Mat temp_test_samples(test_sample_count, var_count, CV_32F);
-        Mat temp_train_responses(train_sample_count, 1, rtype);
-        Mat temp_test_responses;
+        vector<Params> points;
+        vector<Ptr<SVMSharedKernel> > kernels;
+        vector<int> point_kernel;
+        getGridPoints(C_grid, gamma_grid, p_grid, nu_grid, coef_grid, degree_grid,
+                      points, point_kernel, kernels);
 
-        #define FOR_IN_GRID(var, grid) \
-            for( params.var = grid.minVal; params.var == grid.minVal || params.var < grid.maxVal; params.var *= grid.logStep )
+        int point_count = (int)points.size();
+        autoJobs.resize(point_count*k_fold);
 
-        FOR_IN_GRID(C, C_grid)
-        FOR_IN_GRID(gamma, gamma_grid)
-        FOR_IN_GRID(p, p_grid)
-        FOR_IN_GRID(nu, nu_grid)
-        FOR_IN_GRID(coef0, coef_grid)
-        FOR_IN_GRID(degree, degree_grid)
+        // The grid points that only differ in C form a regularization path; one job trains
+        // a fold along the whole path in increasing C order, each solve starting from the
+        // previous one.
+        vector<vector<int> > paths;
+        for( i = 0; i < point_count; i++ )
+        {
+            const Params& pi = points[i];
+            for( j = 0; j < (int)paths.size(); j++ )
+            {
+                const Params& pj = points[paths[j][0]];
+                if( pi.gamma == pj.gamma && pi.p == pj.p && pi.nu == pj.nu &&
+                    pi.coef0 == pj.coef0 && pi.degree == pj.degree )
+                    break;
+            }
+            if( j == (int)paths.size() )
+                paths.push_back(vector<int>());
+            paths[j].push_back(i);
+        }
+        for( j = 0; j < (int)paths.size(); j++ )
+            std::stable_sort(paths[j].begin(), paths[j].end(), cmp_param_C(points));
+
+        // The jobs of one kernel setting run together and share the rows of its kernel
+        // matrix over the first <sample_count> rows of the buffer, which are released
+        // before the next setting.
+        for( k = 0; k < (int)kernels.size(); k++ )
         {
-            // make sure we updated the kernel and other parameters
-            setParams(params, Ptr<Kernel>() );
+            vector<int> kernel_paths;
+            for( j = 0; j < (int)paths.size(); j++ )
+                if( point_kernel[paths[j][0]] == k )
+                    kernel_paths.push_back(j);
+            if( kernel_paths.empty() )
+                continue;
+
+            Ptr<SVMKernelRows> matrix = makePtr<SVMKernelRows>(kernels[k],
+                fold_samples.rowRange(0, sample_count), (size_t)SVMKernelRows::MAX_SIZE);
+
+            parallel_for_(Range(0, (int)kernel_paths.size()*k_fold),
+                          TrainAutoBody(points, paths, kernel_paths, matrix, temp_class_labels,
+                                        fold_samples, fold_responses, sample_count, k_fold, autoJobs));
+        }
 
+        int best_point = 0;
+        double min_error = FLT_MAX;
+
+        for( i = 0; i < point_count; i++ )
+        {
             double error = 0;
             for( k = 0; k < k_fold; k++ )
+                error += autoJobs[i*k_fold + k].error;
+            if( min_error > error )
             {
-                int start = (k*sample_count + k_fold/2)/k_fold;
-                for( i = 0; i < train_sample_count; i++ )
-                {
-                    j = sidx[(i+start)%sample_count];
-                    memcpy(temp_train_samples.ptr(i), samples.ptr(j), sample_size);
-                    if( is_classification )
-                        temp_train_responses.at<int>(i) = responses.at<int>(j);
-                    else if( !responses.empty() )
-                        temp_train_responses.at<float>(i) = responses.at<float>(j);
-                }
+                min_error  = error;
+                best_point = i;
+            }
+        }
 
-                // Train SVM on <train_size> samples
-                if( !do_train( temp_train_samples, temp_train_responses ))
-                    continue;
+        setParams(points[best_point], kernels[point_kernel[best_point]]->kernel);
+        // the first <sample_count> rows of the buffer hold all the samples
+        return do_train( fold_samples.rowRange(0, sample_count),
+                         fold_responses.rowRange(0, sample_count) );
+    }
 
-                for( i = 0; i < test_sample_count; i++ )
-                {
-                    j = sidx[(i+start+train_sample_count) % sample_count];
-                    memcpy(temp_train_samples.ptr(i), samples.ptr(j), sample_size);
-                }
+    bool trainAuto( const Ptr<TrainData>& data, const SuccessiveHalving::Params& search,
+                    ParamGrid C_grid, ParamGrid gamma_grid, ParamGrid p_grid,
+                    ParamGrid nu_grid, ParamGrid coef_grid, ParamGrid degree_grid,
+                    vector<SuccessiveHalving::Trial>* log, vector<Params>* gridPoints )
+    {
+        if( params.svmType == ONE_CLASS )
+            // current implementation of "auto" svm does not support the 1-class case.
+            return train( data, 0 );
+
+        clear();
+        autoJobs.clear();
+
+        vector<Params> points;
+        vector<Ptr<SVMSharedKernel> > kernels;
+        vector<int> point_kernel;
+        getGridPoints(C_grid, gamma_grid, p_grid, nu_grid, coef_grid, degree_grid,
+                      points, point_kernel, kernels);
+
+        // every round trains the candidates on a different number of samples, so each
+        // candidate takes a new kernel in every round, and so does the final training
+        int i, point_count = (int)points.size();
+        vector<Ptr<StatModel> > candidates(point_count);
+        for( i = 0; i < point_count; i++ )
+        {
+            Ptr<SVMImpl> svm = makePtr<SVMImpl>();
+            svm->setParams(points[i], kernels[point_kernel[i]]->kernel);
+            svm->renewKernel = true;
+            candidates[i] = svm;
+        }
+
+        int best = SuccessiveHalving::run(data, candidates, search, log);
+        if( gridPoints )
+            *gridPoints = points;
+
+        setParams(points[best], Ptr<Kernel>());
+        return train( data, 0 );
+    }
+
+    struct cmp_param_C
+    {
+        cmp_param_C( const vector<Params>& _points ) : points(&_points) {}
+        bool operator()( int a, int b ) const { return (*points)[a].C < (*points)[b].C; }
+        const vector<Params>* points;
+    };
+
+    /*
+     Trains and tests one fold along one C path of trainAuto() per index, recording a
+     (grid point, fold) job for every C. <path_idx> lists the paths to run, which all use the
+     kernel of <matrix>. Every job has its own SVMImpl and solver state; the samples, the
+     responses, the kernels and the kernel rows are shared.
+    */
+    struct TrainAutoBody : ParallelLoopBody
+    {
+        TrainAutoBody( const vector<Params>& _points, const vector<vector<int> >& _paths,
+                       const vector<int>& _path_idx, const Ptr<SVMKernelRows>& _matrix,
+                       const Mat& _class_labels,
+                       const Mat& _samples, const Mat& _responses, int _sample_count, int _k_fold,
+                       vector<AutoTrainJob>& _jobs )
+        {
+            points = &_points;
+            paths = &_paths;
+            path_idx = &_path_idx;
+            matrix = _matrix;
+            class_labels = _class_labels;
+            samples = &_samples;
+            responses = &_responses;
+            sample_count = _sample_count;
+            k_fold = _k_fold;
+            jobs = &_jobs;
+        }
+
+        void operator()( const Range& range ) const
+        {
+            int test_sample_count = (sample_count + k_fold/2)/k_fold;
+            int train_sample_count = sample_count - test_sample_count;
+            bool is_classification = responses->type() == CV_32S;
+
+            for( int idx = range.start; idx < range.end; idx++ )
+            {
+                const vector<int>& path = (*paths)[(*path_idx)[idx / k_fold]];
+                int k = idx % k_fold;
+                int start = (k*sample_count + k_fold/2)/k_fold;
+                TrainPath state;
+                Ptr<Kernel> job_kernel;
+
+                state.matrix = matrix;
+                state.sample_index.resize(train_sample_count);
+                for( int i = 0; i < train_sample_count; i++ )
+                    state.sample_index[i] = (start + i) % sample_count;
 
-                predict(temp_test_samples, temp_test_responses, 0);
-                for( i = 0; i < test_sample_count; i++ )
+                for( size_t step = 0; step < path.size(); step++ )
                 {
-                    float val = temp_test_responses.at<float>(i);
-                    j = sidx[(i+start+train_sample_count) % sample_count];
-                    if( is_classification )
-                        error += (float)(val != responses.at<int>(j));
-                    else
+                    int pt = path[step];
+                    int64 t = getTickCount();
+
+                    AutoTrainJob& job = (*jobs)[pt*k_fold + k];
+                    job.params = (*points)[pt];
+                    job.fold = k;
+                    job.error = 0;
+
+                    // the rows come from <matrix>, whose kernel only ever sees the fold buffer;
+                    // the test samples are scored against the support vectors by a kernel of
+                    // the job's own, which is kept along the path (the kernel does not depend on C)
+                    SVMImpl svm;
+                    svm.setParams( job.params, job_kernel );
+                    job_kernel = svm.getKernel();
+                    svm.class_labels = class_labels;
+
+                    // Train SVM on <train_size> samples
+                    job.ok = svm.do_train( samples->rowRange(start, start + train_sample_count),
+                                           responses->rowRange(start, start + train_sample_count),
+                                           &state );
+                    job.iterations = (int)state.iterations;
+                    if( job.ok )
                     {
-                        val -= responses.at<float>(j);
-                        error += val*val;
+                        Range test_range(start + train_sample_count, start + sample_count);
+                        Mat test_responses = responses->rowRange(test_range), results;
+
+                        svm.predict( samples->rowRange(test_range), results, 0 );
+                        for( int i = 0; i < test_sample_count; i++ )
+                        {
+                            float val = results.at<float>(i);
+                            if( is_classification )
+                                job.error += (float)(val != test_responses.at<int>(i));
+                            else
+                            {
+                                val -= test_responses.at<float>(i);
+                                job.error += val*val;
+                            }
+                        }
                     }
+                    job.time = (getTickCount() - t)/getTickFrequency();
                 }
             }
-            if( min_error > error )
-            {
-                min_error   = error;
-                best_params = params;
-            }
         }
 
-        params = best_params;
-        class_labels = class_labels0;
-        return do_train( samples, responses );
+        const vector<Params>* points;
+        const vector<vector<int> >* paths;
+        const vector<int>* path_idx;
+        Ptr<SVMKernelRows> matrix;
+        Mat class_labels;
+        const Mat* samples;
+        const Mat* responses;
+        int sample_count;
+        int k_fold;
+        vector<AutoTrainJob>* jobs;
+    };
+
+    void getAutoTrainJobs( vector<AutoTrainJob>& jobs ) const
+    {
+        jobs = autoJobs;
     }
 
     struct PredictBody : ParallelLoopBody
     {
-        PredictBody( const SVMImpl* _svm, const Mat& _samples, Mat& _results, bool _returnDFVal )
+        // <ssamples> replaces <samples> for sparse input; <svq> then describes the dense
+        // support vectors for SVMSparseKernel
+        PredictBody( const SVMImpl* _svm, const Mat& _samples, Mat& _results, bool _returnDFVal,
+                     const SparseSamples* _ssamples = 0, const SVMSparseKernel::Query* _svq = 0 )
         {
             svm = _svm;
+            svToken = newSamplesToken();
             results = &_results;
             samples = &_samples;
             returnDFVal = _returnDFVal;
+            ssamples = _ssamples;
+            svq = _svq;
+        }
+
+        // the kernel values between the sample <si> and all the support vectors; <xbuf>
+        // is a zeroed buffer of var_count floats, left zeroed
+        void calc_kernel( int si, const SVMSparseKernel& skernel, float* xbuf, float* buffer ) const
+        {
+            const SparseSamples& sparse_sv = svm->sparse_sv;
+            int j, k, var_count = svm->var_count;
+            int sv_total = sparse_sv.empty() ? svm->sv.rows : sparse_sv.rows();
+            SVMSparseKernel::Query q;
+
+            if( !ssamples )
+            {
+                const float* x = samples->ptr<float>(si);
+                if( sparse_sv.empty() )
+                    calcKernel( svm->kernel, svToken, sv_total, var_count, svm->sv.ptr<float>(), x, buffer );
+                else
+                {
+                    skernel.prepare( x, var_count, 0, 0, q );
+                    skernel.calc( sparse_sv, &svm->sparse_sv_norms[0], 0, sv_total, q, buffer );
+                }
+                return;
+            }
+
+            int k0 = ssamples->begin(si), k1 = ssamples->end(si);
+            const float* values = ssamples->valuePtr();
+            const int* cols = ssamples->colPtr();
+            if( sparse_sv.empty() )
+            {
+                // dense support vectors: K(sv_j, x) costs O(nnz(x)) with x as the sparse side
+                double norm = 0;
+                for( k = k0; k < k1; k++ )
+                    norm += (double)values[k]*values[k];
+                for( j = 0; j < sv_total; j++ )
+                    skernel.calc( *ssamples, &norm, &si, 1, svq[j], buffer + j );
+                return;
+            }
+
+            for( k = k0; k < k1; k++ )
+                xbuf[cols[k]] = values[k];
+            skernel.prepare( xbuf, var_count, cols + k0, k1 - k0, q );
+            skernel.calc( sparse_sv, &svm->sparse_sv_norms[0], 0, sv_total, q, buffer );
+            for( k = k0; k < k1; k++ )
+                xbuf[cols[k]] = 0.f;
         }
 
         void operator()( const Range& range ) const
         {
             int svmType = svm->params.svmType;
-            int sv_total = svm->sv.rows;
+            int sv_total = svm->sparse_sv.empty() ? svm->sv.rows : svm->sparse_sv.rows();
             int class_count = !svm->class_labels.empty() ? (int)svm->class_labels.total() : svmType == ONE_CLASS ? 1 : 0;
 
             AutoBuffer<float> _buffer(sv_total + (class_count+1)*2);
             float* buffer = _buffer;
 
+            bool sparse = ssamples || !svm->sparse_sv.empty();
+            Ptr<SVMSparseKernel> skernel;
+            AutoBuffer<float> _xbuf(sparse ? svm->var_count : 0);
+            float* xbuf = _xbuf;
+            if( sparse )
+            {
+                skernel = makePtr<SVMSparseKernel>(svm->params);
+                memset( xbuf, 0, svm->var_count*sizeof(xbuf[0]) );
+            }
+
             int i, j, dfi, k, si;
 
             if( svmType == EPS_SVR || svmType == NU_SVR || svmType == ONE_CLASS )
             {
                 for( si = range.start; si < range.end; si++ )
                 {
-                    const float* row_sample = samples->ptr<float>(si);
-                    svm->kernel->calc( sv_total, svm->var_count, svm->sv.ptr<float>(), row_sample, buffer );
+                    if( sparse )
+                        calc_kernel( si, *skernel, xbuf, buffer );
+                    else
+                        calcKernel( svm->kernel, svToken, sv_total, svm->var_count, svm->sv.ptr<float>(),
+                                    samples->ptr<float>(si), buffer );
 
                     const SVMImpl::DecisionFunc* df = &svm->decision_func[0];
                     double sum = -df->rho;
@@ -2171,8 +3336,11 @@ public:
 
                 for( si = range.start; si < range.end; si++ )
                 {
-                    svm->kernel->calc( sv_total, svm->var_count, svm->sv.ptr<float>(),
-                                       samples->ptr<float>(si), buffer );
+                    if( sparse )
+                        calc_kernel( si, *skernel, xbuf, buffer );
+                    else
+                        calcKernel( svm->kernel, svToken, sv_total, svm->var_count, svm->sv.ptr<float>(),
+                                    samples->ptr<float>(si), buffer );
                     double sum = 0.;
 
                     memset( vote, 0, class_count*sizeof(vote[0]));
@@ -2209,23 +3377,48 @@ public:
         }
 
         const SVMImpl* svm;
+        // names the support vectors for the kernel while the body is alive
+        int svToken;
         const Mat* samples;
         Mat* results;
         bool returnDFVal;
+        const SparseSamples* ssamples;
+        const SVMSparseKernel::Query* svq;
     };
 
     float predict( InputArray _samples, OutputArray _results, int flags ) const
+    {
+        Mat samples = _samples.getMat();
+        CV_Assert( samples.cols == var_count && samples.type() == CV_32F );
+        return predict_samples( samples, 0, samples.rows, _results, flags );
+    }
+
+    float predictSparse( const SparseSamples& samples, OutputArray _results, int flags ) const
+    {
+        CV_Assert( samples.cols == var_count );
+        return predict_samples( Mat(), &samples, samples.rows(), _results, flags );
+    }
+
+    float predict_samples( const Mat& samples, const SparseSamples* ssamples, int nsamples,
+                           OutputArray _results, int flags ) const
     {
         float result = 0;
-        Mat samples = _samples.getMat(), results;
-        int nsamples = samples.rows;
+        Mat results;
         bool returnDFVal = (flags & RAW_OUTPUT) != 0;
 
-        CV_Assert( samples.cols == var_count && samples.type() == CV_32F );
+        // the sparse samples are scored against dense support vectors described once here
+        vector<SVMSparseKernel::Query> svq;
+        if( ssamples && sparse_sv.empty() )
+        {
+            SVMSparseKernel skernel(params);
+            svq.resize(sv.rows);
+            for( int j = 0; j < sv.rows; j++ )
+                skernel.prepare( sv.ptr<float>(j), var_count, 0, 0, svq[j] );
+        }
 
         if( _results.needed() )
         {
-            _results.create( nsamples, 1, samples.type() );
+            _results.create( nsamples, 1, CV_32F );
             results = _results.getMat();
         }
         else
@@ -2234,7 +3427,7 @@ public:
             results = Mat(1, 1, CV_32F, &result);
         }
 
-        PredictBody invoker(this, samples, results, returnDFVal);
+        PredictBody invoker(this, samples, results, returnDFVal, ssamples, svq.empty() ? 0 : &svq[0]);
         if( nsamples < 10 )
             invoker(Range(0, nsamples));
         else
@@ -2304,7 +3497,7 @@ public:
 
     bool isTrained() const
     {
-        return !sv.empty();
+        return !sv.empty() || !sparse_sv.empty();
     }
 
     bool isClassifier() const
@@ -2344,7 +3537,8 @@ public:
                 fs << "class_weights" << params.classWeights;
         }
 
-        // write the joint collection of support vectors
+        // write the joint collection of support vectors; the sparse ones are written dense
+        Mat sv = getSupportVectors();
         int i, sv_total = sv.rows;
         fs << "sv_total" << sv_total;
         fs << "support_vectors" << "[";
@@ -2506,11 +3700,18 @@ public:
     Mat class_labels;
     int var_count;
     Mat sv;
+    //! the support vectors of a model trained on sparse samples (sv is empty then),
+    //! and their squared norms
+    SparseSamples sparse_sv;
+    vector<double> sparse_sv_norms;
     vector<DecisionFunc> decision_func;
     vector<double> df_alpha;
     vector<int> df_index;
 
     Ptr<Kernel> kernel;
+    //! replace <kernel> by a new one at the start of every train() call
+    bool renewKernel;
+    vector<AutoTrainJob> autoJobs;
 };
 
 
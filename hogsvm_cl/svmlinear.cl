@@ -42,4 +42,88 @@ __kernel void svmlinear(__global float* vecs,
 
     
 
+}
+
+/*
+ The compiled trees [tree0, tree0 + ntrees) over the gathered samples x (nv values per sample),
+ one work-item per (tree, sample) pair: the global size is (groups*local size, samples). Every
+ work-group reduces the outputs of its trees for its sample, to the vote counts of the classes
+ (nclasses > 0) or to the sum of the leaf values (nclasses == 0), into
+ out[(sample*groups + group)*max(nclasses, 1)]. The local size must be a power of two.
+*/
+__kernel void forest_predict(__global const int* treeOfs,
+                             __global const int* var,
+                             __global const float* thresh,
+                             __global const int* subsetOfs,
+                             __global const int* child,
+                             __global const char* defaultDir,
+                             __global const float* value,
+                             __global const int* classIdx,
+                             __global const int* subsets,
+                             __global const float* x,
+                             __const unsigned int nv,
+                             __const unsigned int tree0,
+                             __const unsigned int ntrees,
+                             __const unsigned int nclasses,
+                             __global float* out,
+                             __local float* lsum,
+                             __local int* lvotes
+                             )
+{
+    int t = get_global_id(0), s = get_global_id(1);
+    int lid = get_local_id(0), lsize = get_local_size(0);
+    int g = get_group_id(0), ngroups = get_num_groups(0);
+    int k;
+    float sum = 0.f;
+
+    for( k = lid; k < (int)nclasses; k += lsize )
+        lvotes[k] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if( t < (int)ntrees )
+    {
+        __global const float* xs = x + (size_t)s*nv;
+        int nidx = treeOfs[tree0 + t], vk;
+
+        while( (vk = var[nidx]) >= 0 )
+        {
+            float val = xs[vk];
+            int dir;
+            if( val == FLT_MAX )
+                dir = defaultDir[nidx];
+            else if( subsetOfs[nidx] < 0 )
+                dir = val <= thresh[nidx] ? -1 : 1;
+            else
+            {
+                unsigned int u = (unsigned int)rint(val);
+                dir = (subsets[subsetOfs[nidx] + (u >> 5)] & (1u << (u & 31))) == 0 ? 1 : -1;
+            }
+            nidx = child[nidx] + (dir >= 0);
+        }
+
+        if( nclasses > 0 )
+            atomic_inc(lvotes + classIdx[nidx]);
+        else
+            sum = value[nidx];
+    }
+
+    if( nclasses > 0 )
+    {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for( k = lid; k < (int)nclasses; k += lsize )
+            out[((size_t)s*ngroups + g)*nclasses + k] = (float)lvotes[k];
+    }
+    else
+    {
+        lsum[lid] = sum;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for( k = lsize >> 1; k > 0; k >>= 1 )
+        {
+            if( lid < k )
+                lsum[lid] += lsum[lid + k];
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+        if( lid == 0 )
+            out[(size_t)s*ngroups + g] = lsum[0];
+    }
 }
@@ -706,6 +706,121 @@ public:
         return trained;
     }
 
+    /*
+     Trains on the blocks of <data> in turn, one block in memory at a time, for up to
+     termCrit.maxCount passes over the data. BACKPROP runs one epoch on each block. RPROP makes
+     one step per pass on the gradient summed over the blocks, with its steps kept across the
+     passes, so it follows the same path as train() on all the samples. Unless UPDATE_WEIGHTS is
+     given, the scales are computed on all the samples first, as in train().
+    */
+    bool trainChunked( const Ptr<ChunkedTrainData>& data, int flags )
+    {
+        const int MAX_ITER = 1000;
+        const double DEFAULT_EPSILON = FLT_EPSILON;
+
+        CV_Assert( !data.empty() && data->getNSamples() > 0 );
+        int b, nblocks = data->getNBlocks();
+        Mat inputs, outputs, sw;
+
+        if( !(flags & UPDATE_WEIGHTS) )
+        {
+            // the output scale needs the minimum and the maximum of all the responses, which are
+            // small; the input scale is accumulated block by block
+            Mat all_outputs;
+            for( b = 0; b < nblocks; b++ )
+            {
+                data->getBlock(b, inputs, outputs);
+                all_outputs.push_back(outputs);
+            }
+            data->getBlock(0, inputs, outputs);
+            sw = Mat::ones(inputs.rows, 1, CV_64F);
+            prepare_to_train( inputs, outputs, sw, flags | NO_INPUT_SCALE );
+            calc_output_scale( all_outputs, flags );
+            if( !(flags & NO_INPUT_SCALE) )
+                calc_input_scale( *data );
+            init_weights();
+        }
+
+        int passes = std::max((params.termCrit.type & CV_TERMCRIT_ITER ? params.termCrit.maxCount : MAX_ITER), 1);
+        double epsilon = std::max((params.termCrit.type & CV_TERMCRIT_EPS ? params.termCrit.epsilon : DEFAULT_EPSILON), DBL_EPSILON);
+        int iter = 0, n = data->getNSamples();
+
+        if( params.trainMethod == Params::BACKPROP )
+        {
+            TermCriteria termcrit( TermCriteria::COUNT + TermCriteria::EPS, 1, epsilon );
+            for( int pass = 0; pass < passes; pass++ )
+            {
+                for( b = 0; b < nblocks; b++ )
+                {
+                    data->getBlock(b, inputs, outputs);
+                    sw = Mat::ones(inputs.rows, 1, CV_64F);
+                    prepare_to_train( inputs, outputs, sw, flags | UPDATE_WEIGHTS );
+                    iter += train_backprop( inputs, outputs, sw, termcrit );
+                }
+            }
+        }
+        else
+        {
+            // RPROP adapts its steps to the sign changes of the full gradient, so every pass
+            // sums the gradient over all the blocks and then makes one step, as train() does
+            RPropState st;
+            init_rprop(st);
+            double prev_E = DBL_MAX*0.5;
+            for( int pass = 0; pass < passes; pass++ )
+            {
+                double E = 0;
+                for( b = 0; b < nblocks; b++ )
+                {
+                    data->getBlock(b, inputs, outputs);
+                    sw = Mat::ones(inputs.rows, 1, CV_64F);
+                    prepare_to_train( inputs, outputs, sw, flags | UPDATE_WEIGHTS );
+                    // the weights of the block, 1/rows each, become 1/n of all the samples
+                    sw *= (double)inputs.rows/n;
+                    calc_rprop_gradient( inputs, outputs, sw, st, E );
+                }
+                update_rprop_weights( st );
+                iter++;
+                if( fabs(prev_E - E) < epsilon )
+                    break;
+                prev_E = E;
+            }
+        }
+
+        trained = iter > 0;
+        return trained;
+    }
+
+    //! the input scale of calc_input_scale(), accumulated over the blocks of <data>
+    void calc_input_scale( ChunkedTrainData& data )
+    {
+        int i, j, vcount = layer_sizes[0], count = data.getNSamples();
+        double* scale = weights[0].ptr<double>();
+        std::vector<double> s(vcount, 0.), s2(vcount, 0.);
+        Mat inputs, outputs;
+
+        for( int b = 0; b < data.getNBlocks(); b++ )
+        {
+            data.getBlock(b, inputs, outputs);
+            for( i = 0; i < inputs.rows; i++ )
+            {
+                const float* f = inputs.ptr<float>(i);
+                for( j = 0; j < vcount; j++ )
+                {
+                    double t = f[j];
+                    s[j] += t;
+                    s2[j] += t*t;
+                }
+            }
+        }
+
+        for( j = 0; j < vcount; j++ )
+        {
+            double m = s[j]/count, sigma2 = s2[j]/count - m*m;
+            scale[j*2] = sigma2 < DBL_EPSILON ? 1 : 1./sqrt(sigma2);
+            scale[j*2+1] = -m*scale[j*2];
+        }
+    }
+
     int train_backprop( const Mat& inputs, const Mat& outputs, const Mat& _sw, TermCriteria termCrit )
     {
         int i, j, k;
@@ -975,40 +1090,116 @@ public:
         }
     };
 
-    int train_rprop( const Mat& inputs, const Mat& outputs, const Mat& _sw, TermCriteria termCrit )
+    //! the per-weight steps, the gradient and the signs of the previous gradient of RPROP
+    struct RPropState
     {
-        const int max_buf_size = 1 << 16;
-        int i, iter = -1, count = inputs.rows;
-
-        double prev_E = DBL_MAX*0.5;
-
-        int max_iter = termCrit.maxCount;
-        double epsilon = termCrit.epsilon;
-        double dw_plus = params.rpDWPlus;
-        double dw_minus = params.rpDWMinus;
-        double dw_min = params.rpDWMin;
-        double dw_max = params.rpDWMax;
+        vector<Mat> dw, dEdw, prev_dEdw_sign;
+    };
 
+    void init_rprop( RPropState& st ) const
+    {
         int l_count = layer_count();
+        st.dw.resize(l_count);
+        st.dEdw.resize(l_count);
+        st.prev_dEdw_sign.resize(l_count);
+        for( int i = 0; i < l_count; i++ )
+        {
+            st.dw[i].create(weights[i].size(), CV_64F);
+            st.dw[i].setTo(Scalar::all(params.rpDW0));
+            st.prev_dEdw_sign[i] = Mat::zeros(weights[i].size(), CV_8S);
+            st.dEdw[i] = Mat::zeros(weights[i].size(), CV_64F);
+        }
+    }
 
-        // allocate buffers
-        vector<Mat> dw(l_count), dEdw(l_count), prev_dEdw_sign(l_count);
+    //! adds the gradient over <inputs> to st.dEdw and the error to <E>
+    void calc_rprop_gradient( const Mat& inputs, const Mat& outputs, const Mat& _sw,
+                              RPropState& st, double& E )
+    {
+        const int max_buf_size = 1 << 16;
+        int i, count = inputs.rows, l_count = layer_count();
 
         int total = 0;
         for( i = 0; i < l_count; i++ )
-        {
             total += layer_sizes[i];
-            dw[i].create(weights[i].size(), CV_64F);
-            dw[i].setTo(Scalar::all(params.rpDW0));
-            prev_dEdw_sign[i] = Mat::zeros(weights[i].size(), CV_8S);
-            dEdw[i] = Mat::zeros(weights[i].size(), CV_64F);
-        }
 
         int dcount0 = max_buf_size/(2*total);
         dcount0 = std::max( dcount0, 1 );
         dcount0 = std::min( dcount0, count );
         int chunk_count = (count + dcount0 - 1)/dcount0;
 
+        RPropLoop invoker(this, inputs, outputs, _sw, dcount0, st.dEdw, &E);
+        parallel_for_(Range(0, chunk_count), invoker);
+        //invoker(Range(0, chunk_count));
+    }
+
+    //! one RPROP step of the weights along st.dEdw, which is cleared
+    void update_rprop_weights( RPropState& st )
+    {
+        double dw_plus = params.rpDWPlus;
+        double dw_minus = params.rpDWMinus;
+        double dw_min = params.rpDWMin;
+        double dw_max = params.rpDWMax;
+        int l_count = layer_count();
+
+        for( int i = 1; i < l_count; i++ )
+        {
+            int n1 = layer_sizes[i-1], n2 = layer_sizes[i];
+            for( int k = 0; k <= n1; k++ )
+            {
+                CV_Assert(weights[i].size() == Size(n2, n1+1));
+                double* wk = weights[i].ptr<double>(k);
+                double* dwk = st.dw[i].ptr<double>(k);
+                double* dEdwk = st.dEdw[i].ptr<double>(k);
+                schar* prevEk = st.prev_dEdw_sign[i].ptr<schar>(k);
+
+                for( int j = 0; j < n2; j++ )
+                {
+                    double Eval = dEdwk[j];
+                    double dval = dwk[j];
+                    double wval = wk[j];
+                    int s = CV_SIGN(Eval);
+                    int ss = prevEk[j]*s;
+                    if( ss > 0 )
+                    {
+                        dval *= dw_plus;
+                        dval = std::min( dval, dw_max );
+                        dwk[j] = dval;
+                        wk[j] = wval + dval*s;
+                    }
+                    else if( ss < 0 )
+                    {
+                        dval *= dw_minus;
+                        dval = std::max( dval, dw_min );
+                        prevEk[j] = 0;
+                        dwk[j] = dval;
+                        wk[j] = wval + dval*s;
+                    }
+                    else
+                    {
+                        prevEk[j] = (schar)s;
+                        wk[j] = wval + dval*s;
+                    }
+                    dEdwk[j] = 0.;
+                }
+            }
+        }
+    }
+
+    int train_rprop( const Mat& inputs, const Mat& outputs, const Mat& _sw, TermCriteria termCrit )
+    {
+        int i, iter = -1;
+
+        double prev_E = DBL_MAX*0.5;
+
+        int max_iter = termCrit.maxCount;
+        double epsilon = termCrit.epsilon;
+
+        int l_count = layer_count();
+
+        // allocate buffers
+        RPropState st;
+        init_rprop(st);
+
         // run rprop loop
         /*
          y_i(t) = w_i(t)*x_{i-1}(t)
@@ -1031,56 +1222,13 @@ public:
             double E = 0;
 
             for( i = 0; i < l_count; i++ )
-                dEdw[i].setTo(Scalar::all(0));
+                st.dEdw[i].setTo(Scalar::all(0));
 
             // first, iterate through all the samples and compute dEdw
-            RPropLoop invoker(this, inputs, outputs, _sw, dcount0, dEdw, &E);
-            parallel_for_(Range(0, chunk_count), invoker);
-            //invoker(Range(0, chunk_count));
+            calc_rprop_gradient( inputs, outputs, _sw, st, E );
 
             // now update weights
-            for( i = 1; i < l_count; i++ )
-            {
-                int n1 = layer_sizes[i-1], n2 = layer_sizes[i];
-                for( int k = 0; k <= n1; k++ )
-                {
-                    CV_Assert(weights[i].size() == Size(n2, n1+1));
-                    double* wk = weights[i].ptr<double>(k);
-                    double* dwk = dw[i].ptr<double>(k);
-                    double* dEdwk = dEdw[i].ptr<double>(k);
-                    schar* prevEk = prev_dEdw_sign[i].ptr<schar>(k);
-
-                    for( int j = 0; j < n2; j++ )
-                    {
-                        double Eval = dEdwk[j];
-                        double dval = dwk[j];
-                        double wval = wk[j];
-                        int s = CV_SIGN(Eval);
-                        int ss = prevEk[j]*s;
-                        if( ss > 0 )
-                        {
-                            dval *= dw_plus;
-                            dval = std::min( dval, dw_max );
-                            dwk[j] = dval;
-                            wk[j] = wval + dval*s;
-                        }
-                        else if( ss < 0 )
-                        {
-                            dval *= dw_minus;
-                            dval = std::max( dval, dw_min );
-                            prevEk[j] = 0;
-                            dwk[j] = dval;
-                            wk[j] = wval + dval*s;
-                        }
-                        else
-                        {
-                            prevEk[j] = (schar)s;
-                            wk[j] = wval + dval*s;
-                        }
-                        dEdwk[j] = 0.;
-                    }
-                }
-            }
+            update_rprop_weights( st );
 
             //printf("%d. E = %g\n", iter, E);
             if( fabs(prev_E - E) < epsilon )
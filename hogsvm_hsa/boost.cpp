@@ -78,6 +78,163 @@ Boost::Params::Params( int _boostType, int _weak_count,
 }
 
 
+// the weight updates are computed in chunks of BOOST_CHUNK_SIZE samples whose sums are added
+// up in the chunk order, so that the result does not depend on the number of threads
+static const int BOOST_CHUNK_SIZE = 1 << 12;
+
+/*
+ One pass of the weight update over the training samples w->sidx, chunk by chunk. Every chunk
+ stores the sums of its two accumulators in <sums>; what they hold depends on <mode>.
+*/
+class BoostUpdateInvoker : public ParallelLoopBody
+{
+public:
+    enum
+    {
+        SUM = 0,            // s0: sum of the weights
+        NORMALIZE = 1,      // weight = weight*a + b
+        DISCRETE_ERROR = 2, // s0: sum of the weights, s1: sum of the misclassified ones
+        DISCRETE_SCALE = 3, // the misclassified weights *= a; s0: sum of the weights
+        REAL = 4,           // weight *= exp(-y*f(x)); s0: sum of the weights, s1: bad responses
+        LOGIT = 5           // LogitBoost weights and responses; s0: sum of the weights
+    };
+
+    BoostUpdateInvoker( int _mode, DTreesImpl::WorkData* _w, const double* _result,
+                        double* _sumResult, double _a, double _b, double* _sums )
+        : mode(_mode), w(_w), result(_result), sumResult(_sumResult), a(_a), b(_b), sums(_sums) {}
+
+    void operator()( const Range& range ) const
+    {
+        const double lb_weight_thresh = FLT_EPSILON;
+        const double lb_z_max = 10.;
+        int n = (int)w->sidx.size();
+        const int* sidx = &w->sidx[0];
+        double* weights = &w->sample_weights[0];
+
+        for( int c = range.start; c < range.end; c++ )
+        {
+            int i, i0 = c*BOOST_CHUNK_SIZE, i1 = std::min(i0 + BOOST_CHUNK_SIZE, n);
+            double s0 = 0, s1 = 0;
+
+            switch( mode )
+            {
+            case SUM:
+                for( i = i0; i < i1; i++ )
+                    s0 += weights[sidx[i]];
+                break;
+            case NORMALIZE:
+                for( i = i0; i < i1; i++ )
+                {
+                    double& wval = weights[sidx[i]];
+                    wval = wval*a + b;
+                }
+                break;
+            case DISCRETE_ERROR:
+                for( i = i0; i < i1; i++ )
+                {
+                    int si = sidx[i];
+                    double wval = weights[si];
+                    s0 += wval;
+                    s1 += wval*(result[i] != w->cat_responses[si]);
+                }
+                break;
+            case DISCRETE_SCALE:
+                for( i = i0; i < i1; i++ )
+                {
+                    int si = sidx[i];
+                    double wval = weights[si];
+                    if( result[i] != w->cat_responses[si] )
+                        wval *= a;
+                    s0 += wval;
+                    weights[si] = wval;
+                }
+                break;
+            case REAL:
+                for( i = i0; i < i1; i++ )
+                {
+                    int si = sidx[i];
+                    double y = w->ord_responses[si];
+                    double wval = weights[si]*std::exp(-result[i]*y);
+                    s1 += std::abs(y) != 1;
+                    s0 += wval;
+                    weights[si] = wval;
+                }
+                break;
+            case LOGIT:
+                for( i = i0; i < i1; i++ )
+                {
+                    int si = sidx[i];
+                    sumResult[i] += 0.5*result[i];
+                    double p = 1./(1 + std::exp(-2*sumResult[i]));
+                    double wval = std::max( p*(1 - p), lb_weight_thresh ), z;
+                    weights[si] = wval;
+                    s0 += wval;
+                    if( w->ord_responses[si] > 0 )
+                    {
+                        z = 1./p;
+                        w->ord_responses[si] = std::min(z, lb_z_max);
+                    }
+                    else
+                    {
+                        z = 1./(1-p);
+                        w->ord_responses[si] = -std::min(z, lb_z_max);
+                    }
+                }
+                break;
+            }
+
+            sums[c*2] = s0;
+            sums[c*2+1] = s1;
+        }
+    }
+
+    int mode;
+    DTreesImpl::WorkData* w;
+    const double* result;
+    double* sumResult;
+    double a, b;
+    double* sums;
+};
+
+/*
+ The smallest weight that is kept by the trimming: the first value of v[0..n) in ascending
+ order at which the sum of the preceding ones reaches <wsum>, DBL_MAX if there is none.
+ It is found by quickselect on the weight sums, so v is reordered.
+*/
+static double trimThreshold( double* v, int n, double wsum )
+{
+    int i, lo = 0, hi = n;
+
+    while( hi - lo > 16 && wsum > 0 )
+    {
+        int m = lo + (hi - lo)/2;
+        std::nth_element(v + lo, v + m, v + hi);
+        double s = 0;
+        for( i = lo; i < m; i++ )
+            s += v[i];
+        if( wsum - s <= 0 )
+            hi = m + 1;
+        else
+        {
+            wsum -= s + v[m];
+            lo = m + 1;
+        }
+    }
+
+    if( wsum <= 0 )
+        return lo < n ? *std::min_element(v + lo, v + hi) : DBL_MAX;
+
+    std::sort(v + lo, v + hi);
+    for( i = lo; i < hi; i++ )
+    {
+        if( wsum <= 0 )
+            return v[i];
+        wsum -= v[i];
+    }
+    return hi < n ? *std::min_element(v + hi, v + n) : DBL_MAX;
+}
+
+
 class DTreesImplForBoost : public DTreesImpl
 {
 public:
@@ -106,6 +263,12 @@ public:
         DTreesImpl::startTraining(trainData, flags);
         sumResult.assign(w->sidx.size(), 0.);
 
+        // the leaves the samples end in are reused to evaluate every new tree, unless there
+        // are missing values, that predictTrees() sends elsewhere than the training does
+        Mat missing = trainData->getMissing();
+        if( missing.empty() || countNonZero(missing) == 0 )
+            w->sampleLeaf.assign(w->sample_weights.size(), -1);
+
         if( bparams.boostType != Boost::DISCRETE )
         {
             _isClassifier = false;
@@ -124,12 +287,27 @@ public:
         normalizeWeights();
     }
 
+    // runs the BoostUpdateInvoker pass <mode> and returns the sums of its accumulators
+    Vec2d updateWeights( int mode, const double* result = 0, double a = 0, double b = 0 )
+    {
+        int c, n = (int)w->sidx.size(), nchunks = (n + BOOST_CHUNK_SIZE - 1)/BOOST_CHUNK_SIZE;
+        vector<double> sums(nchunks*2 + 2);
+        double* sumResultPtr = !sumResult.empty() ? &sumResult[0] : 0;
+        Vec2d s;
+
+        parallel_for_(Range(0, nchunks), BoostUpdateInvoker(mode, w, result, sumResultPtr,
+                                                           a, b, &sums[0]));
+        for( c = 0; c < nchunks; c++ )
+        {
+            s[0] += sums[c*2];
+            s[1] += sums[c*2+1];
+        }
+        return s;
+    }
+
     void normalizeWeights()
     {
-        int i, n = (int)w->sidx.size();
-        double sumw = 0, a, b;
-        for( i = 0; i < n; i++ )
-            sumw += w->sample_weights[w->sidx[i]];
+        double sumw = updateWeights(BoostUpdateInvoker::SUM)[0], a, b;
         if( sumw > DBL_EPSILON )
         {
             a = 1./sumw;
@@ -140,11 +318,7 @@ public:
             a = 0;
             b = 1;
         }
-        for( i = 0; i < n; i++ )
-        {
-            double& wval = w->sample_weights[w->sidx[i]];
-            wval = wval*a + b;
-        }
+        updateWeights(BoostUpdateInvoker::NORMALIZE, 0, a, b);
     }
 
     void endTraining()
@@ -218,23 +392,25 @@ public:
         return true;
     }
 
+    // the outputs of the tree <treeidx>, just trained, on all the training samples, as
+    // predictTrees() gives them
+    void calcTreeOutputs( int treeidx, double* result )
+    {
+        int i, n = (int)w->sidx.size();
+        DTreesImpl::evalTree(treeidx, w->sidx, result);
+        if( bparams.boostType == Boost::DISCRETE )
+            for( i = 0; i < n; i++ )
+                result[i] = result[i] > 0;
+    }
+
     void updateWeightsAndTrim( int treeidx, vector<int>& sidx )
     {
         int i, n = (int)w->sidx.size();
-        int nvars = (int)varIdx.size();
         double sumw = 0., C = 1.;
-        cv::AutoBuffer<double> buf(n + nvars);
+        cv::AutoBuffer<double> buf(n + 1);
         double* result = buf;
-        float* sbuf = (float*)(result + n);
-        Mat sample(1, nvars, CV_32F, sbuf);
-        int predictFlags = bparams.boostType == Boost::DISCRETE ? (PREDICT_MAX_VOTE | RAW_OUTPUT) : PREDICT_SUM;
-        predictFlags |= COMPRESSED_INPUT;
 
-        for( i = 0; i < n; i++ )
-        {
-            w->data->getSample(varIdx, w->sidx[i], sbuf );
-            result[i] = predictTrees(Range(treeidx, treeidx+1), sample, predictFlags);
-        }
+        calcTreeOutputs( treeidx, result );
 
         // now update weights and other parameters for each type of boosting
         if( bparams.boostType == Boost::DISCRETE )
@@ -244,32 +420,16 @@ public:
             //   err = sum(w_i*(f(x_i) != y_i))/sum(w_i)
             //   C = log((1-err)/err)
             //   w_i *= exp(C*(f(x_i) != y_i))
-            double err = 0.;
-
-            for( i = 0; i < n; i++ )
-            {
-                int si = w->sidx[i];
-                double wval = w->sample_weights[si];
-                sumw += wval;
-                err += wval*(result[i] != w->cat_responses[si]);
-            }
+            Vec2d s = updateWeights(BoostUpdateInvoker::DISCRETE_ERROR, result);
+            double err = s[1];
+            sumw = s[0];
 
             if( sumw != 0 )
                 err /= sumw;
             C = -log_ratio( err );
             double scale = std::exp(C);
 
-            sumw = 0;
-            for( i = 0; i < n; i++ )
-            {
-                int si = w->sidx[i];
-                double wval = w->sample_weights[si];
-                if( result[i] != w->cat_responses[si] )
-                    wval *= scale;
-                sumw += wval;
-                w->sample_weights[si] = wval;
-            }
-
+            sumw = updateWeights(BoostUpdateInvoker::DISCRETE_SCALE, result, scale)[0];
             scaleTree(roots[treeidx], C);
         }
         else if( bparams.boostType == Boost::REAL || bparams.boostType == Boost::GENTLE )
@@ -281,14 +441,9 @@ public:
             // Gentle AdaBoost:
             //   weak_eval[i] = f(x_i) in [-1,1]
             //   w_i *= exp(-y_i*f(x_i))
-            for( i = 0; i < n; i++ )
-            {
-                int si = w->sidx[i];
-                CV_Assert( std::abs(w->ord_responses[si]) == 1 );
-                double wval = w->sample_weights[si]*std::exp(-result[i]*w->ord_responses[si]);
-                sumw += wval;
-                w->sample_weights[si] = wval;
-            }
+            Vec2d s = updateWeights(BoostUpdateInvoker::REAL, result);
+            CV_Assert( s[1] == 0 );
+            sumw = s[0];
         }
         else if( bparams.boostType == Boost::LOGIT )
         {
@@ -301,28 +456,7 @@ public:
             //   w_i = p(x_i)*1(1 - p(x_i))
             //   z_i = ((y_i+1)/2 - p(x_i))/(p(x_i)*(1 - p(x_i)))
             //   store z_i to the data->data_root as the new target responses
-            const double lb_weight_thresh = FLT_EPSILON;
-            const double lb_z_max = 10.;
-
-            for( i = 0; i < n; i++ )
-            {
-                int si = w->sidx[i];
-                sumResult[i] += 0.5*result[i];
-                double p = 1./(1 + std::exp(-2*sumResult[i]));
-                double wval = std::max( p*(1 - p), lb_weight_thresh ), z;
-                w->sample_weights[si] = wval;
-                sumw += wval;
-                if( w->ord_responses[si] > 0 )
-                {
-                    z = 1./p;
-                    w->ord_responses[si] = std::min(z, lb_z_max);
-                }
-                else
-                {
-                    z = 1./(1-p);
-                    w->ord_responses[si] = -std::min(z, lb_z_max);
-                }
-            }
+            sumw = updateWeights(BoostUpdateInvoker::LOGIT, result)[0];
         }
         else
             CV_Error(CV_StsNotImplemented, "Unknown boosting type");
@@ -350,21 +484,10 @@ public:
 
         for( i = 0; i < n; i++ )
             result[i] = w->sample_weights[w->sidx[i]];
-        std::sort(result, result + n);
 
         // as weight trimming occurs immediately after updating the weights,
         // where they are renormalized, we assume that the weight sum = 1.
-        sumw = 1. - bparams.weightTrimRate;
-
-        for( i = 0; i < n; i++ )
-        {
-            double wval = result[i];
-            if( sumw <= 0 )
-                break;
-            sumw -= wval;
-        }
-
-        double threshold = i < n ? result[i] : DBL_MAX;
+        double threshold = trimThreshold(result, n, 1. - bparams.weightTrimRate);
         sidx.clear();
 
         for( i = 0; i < n; i++ )
@@ -389,6 +512,23 @@ public:
         return val;
     }
 
+    void predictSamples( const Mat& samples, const Range& rows, const Range& range,
+                         int flags0, float* results ) const
+    {
+        int flags = (flags0 & ~PREDICT_MASK) | PREDICT_SUM;
+        DTreesImpl::predictSamples(samples, rows, range, flags, results);
+        if( flags != flags0 )
+        {
+            for( int i = 0; i < rows.end - rows.start; i++ )
+            {
+                int ival = (int)(results[i] > 0);
+                if( !(flags0 & RAW_OUTPUT) )
+                    ival = classLabels[ival];
+                results[i] = (float)ival;
+            }
+        }
+    }
+
     void writeTrainingParams( FileStorage& fs ) const
     {
         fs << "boosting_type" <<
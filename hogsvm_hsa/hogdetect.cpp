@@ -0,0 +1,1232 @@
+#include "hogdetect.hpp"
+
+#include <algorithm>
+#include <map>
+#include <queue>
+
+// the SSSE3 and F16C dot products are compiled for their instruction sets whatever the build
+// flags and only called when the CPU has them (see getDotInt8(), getDotFp16())
+#if (defined __GNUC__ || defined __clang__) && (defined __x86_64__ || defined __i386__)
+#define HOG_X86_DISPATCH 1
+#include <immintrin.h>
+#include <cpuid.h>
+#else
+#define HOG_X86_DISPATCH 0
+#endif
+
+namespace cv
+{
+namespace hsaml
+{
+
+static inline float dot_prod( const float* a, const float* b, int n )
+{
+    float s0 = 0.f, s1 = 0.f, s2 = 0.f, s3 = 0.f;
+    int i = 0;
+    for( ; i <= n - 4; i += 4 )
+    {
+        s0 += a[i]*b[i]; s1 += a[i+1]*b[i+1];
+        s2 += a[i+2]*b[i+2]; s3 += a[i+3]*b[i+3];
+    }
+    for( ; i < n; i++ )
+        s0 += a[i]*b[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+typedef int (*DotInt8Func)( const schar* a, const schar* b, int n );
+typedef float (*DotFp16Func)( const ushort* a, const ushort* b, int n );
+
+static int dot_int8( const schar* a, const schar* b, int n )
+{
+    int s = 0;
+    for( int i = 0; i < n; i++ )
+        s += a[i]*b[i];
+    return s;
+}
+
+#if HOG_X86_DISPATCH
+// <a> holds the histograms, in [0, 127]: the u8*s8 pair sums of pmaddubsw cannot saturate
+__attribute__((target("ssse3")))
+static int dot_int8_ssse3( const schar* a, const schar* b, int n )
+{
+    int i = 0, s = 0;
+    __m128i ones = _mm_set1_epi16( 1 ), acc = _mm_setzero_si128();
+    for( ; i <= n - 16; i += 16 )
+    {
+        __m128i x = _mm_loadu_si128( (const __m128i*)(a + i) );
+        __m128i w = _mm_loadu_si128( (const __m128i*)(b + i) );
+        acc = _mm_add_epi32( acc, _mm_madd_epi16( _mm_maddubs_epi16( x, w ), ones ) );
+    }
+    int buf[4];
+    _mm_storeu_si128( (__m128i*)buf, acc );
+    s = (buf[0] + buf[1]) + (buf[2] + buf[3]);
+    for( ; i < n; i++ )
+        s += a[i]*b[i];
+    return s;
+}
+#endif
+
+static DotInt8Func getDotInt8()
+{
+#if HOG_X86_DISPATCH
+    static const DotInt8Func func = checkHardwareSupport( CV_CPU_SSSE3 ) ? dot_int8_ssse3 : dot_int8;
+    return func;
+#else
+    return dot_int8;
+#endif
+}
+
+static inline ushort float_to_half( float f )
+{
+    Cv32suf in;
+    in.f = f;
+    unsigned sign = (in.u >> 16) & 0x8000, m = in.u & 0x7fffff;
+    int fe = (in.u >> 23) & 0xff, e = fe - 127 + 15;
+
+    if( fe == 0xff )
+        return (ushort)(sign | 0x7c00 | (m ? 0x200 : 0));
+    if( e >= 31 )
+        return (ushort)(sign | 0x7c00);
+    if( e <= 0 )
+    {
+        // subnormal half, round to nearest even
+        if( e < -10 )
+            return (ushort)sign;
+        m |= 0x800000;
+        int shift = 14 - e;
+        unsigned h = m >> shift, rem = m & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if( rem > halfway || (rem == halfway && (h & 1)) )
+            h++;
+        return (ushort)(sign | h);
+    }
+    unsigned h = ((unsigned)e << 10) | (m >> 13), rem = m & 0x1fff;
+    if( rem > 0x1000 || (rem == 0x1000 && (h & 1)) )
+        h++;
+    return (ushort)(sign | h);
+}
+
+static inline float half_to_float( ushort h )
+{
+    Cv32suf out;
+    unsigned sign = (unsigned)(h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff;
+    if( e == 0 )
+    {
+        out.f = m*(1.f/16777216.f);
+        out.u |= sign;
+    }
+    else if( e == 31 )
+        out.u = sign | 0x7f800000 | (m << 13);
+    else
+        out.u = sign | ((e + 112) << 23) | (m << 13);
+    return out.f;
+}
+
+#if HOG_X86_DISPATCH
+__attribute__((target("f16c")))
+static float dot_fp16_f16c( const ushort* a, const ushort* b, int n )
+{
+    int i = 0;
+    float s = 0.f;
+    __m128 acc = _mm_setzero_ps();
+    for( ; i <= n - 4; i += 4 )
+    {
+        __m128 x = _mm_cvtph_ps( _mm_loadl_epi64( (const __m128i*)(a + i) ) );
+        __m128 w = _mm_cvtph_ps( _mm_loadl_epi64( (const __m128i*)(b + i) ) );
+        acc = _mm_add_ps( acc, _mm_mul_ps( x, w ) );
+    }
+    float buf[4];
+    _mm_storeu_ps( buf, acc );
+    s = (buf[0] + buf[1]) + (buf[2] + buf[3]);
+    for( ; i < n; i++ )
+        s += half_to_float( a[i] )*half_to_float( b[i] );
+    return s;
+}
+
+// F16C is VEX encoded, so the OS must also save the AVX state, which CV_CPU_AVX checks
+static bool haveF16C()
+{
+    unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+    return checkHardwareSupport( CV_CPU_AVX ) && __get_cpuid( 1, &eax, &ebx, &ecx, &edx ) &&
+           (ecx & (1u << 29)) != 0;
+}
+#endif
+
+// the fp16 scoring path, or 0 if the CPU cannot convert halves natively: the scalar
+// conversions cost more than the memory fp16 saves, so fp32 is used instead
+static DotFp16Func getDotFp16()
+{
+#if HOG_X86_DISPATCH
+    static const DotFp16Func func = haveF16C() ? dot_fp16_f16c : 0;
+    return func;
+#else
+    return 0;
+#endif
+}
+
+// grid offsets of the window blocks in the cascade order
+static void block_offsets( const HOGLinearDetector& det, int gridHeight, std::vector<int>& ofs )
+{
+    int nb = det.getBlockCount(), wbh = det.winBlocks.height, bh = det.blockHistSize;
+    ofs.resize( nb );
+    for( int k = 0; k < nb; k++ )
+    {
+        int b = det.cascadeBlocks[k];
+        ofs[k] = ((b/wbh)*gridHeight + b%wbh)*bh;
+    }
+}
+
+// sum of the block scores <k0>..<k1>-1 (cascade order) of the window starting at <base>
+static double score_blocks( const HOGLinearDetector& det, const HOGBlockGrid& grid, size_t base,
+                            const int* ofs, int k0, int k1 )
+{
+    int bh = det.blockHistSize;
+    const int* blocks = &det.cascadeBlocks[0];
+    double s = 0;
+
+    if( det.precision == HOGLinearDetector::PRECISION_INT8 )
+    {
+        const schar* x = grid.qdata.ptr<schar>() + base;
+        const schar* w = &det.qweights[0];
+        const float* ws = &det.qscales[0];
+        DotInt8Func dot = getDotInt8();
+        for( int k = k0; k < k1; k++ )
+            s += ws[blocks[k]]*dot( x + ofs[k], w + blocks[k]*bh, bh );
+    }
+    else if( det.precision == HOGLinearDetector::PRECISION_FP16 )
+    {
+        const ushort* x = grid.qdata.ptr<ushort>() + base;
+        const ushort* w = &det.hweights[0];
+        DotFp16Func dot_fp16 = getDotFp16();
+        for( int k = k0; k < k1; k++ )
+            s += dot_fp16( x + ofs[k], w + blocks[k]*bh, bh );
+    }
+    else
+    {
+        const float* x = grid.data.ptr<float>() + base;
+        const float* w = &det.weights[0];
+        for( int k = k0; k < k1; k++ )
+            s += dot_prod( x + ofs[k], w + blocks[k]*bh, bh );
+    }
+    return s;
+}
+
+HOGLinearDetector::HOGLinearDetector()
+{
+    blockHistSize = 0;
+    bias = 0.f;
+    useCascade = false;
+    cascadeLength = 0;
+    cascadeThreshold = -FLT_MAX;
+    precision = PRECISION_FP32;
+    descScale = 127.f;
+}
+
+HOGLinearDetector::HOGLinearDetector( const HOGDescriptor& _hog, const std::vector<float>& detector )
+{
+    setDetector( _hog, detector );
+}
+
+void HOGLinearDetector::setDetector( const HOGDescriptor& _hog, const std::vector<float>& detector )
+{
+    hog = _hog;
+    CV_Assert( hog.blockSize.width % hog.cellSize.width == 0 &&
+               hog.blockSize.height % hog.cellSize.height == 0 );
+    CV_Assert( (hog.winSize.width - hog.blockSize.width) % hog.blockStride.width == 0 &&
+               (hog.winSize.height - hog.blockSize.height) % hog.blockStride.height == 0 );
+
+    blockHistSize = hog.nbins*(hog.blockSize.width/hog.cellSize.width)*
+        (hog.blockSize.height/hog.cellSize.height);
+    winBlocks = Size( (hog.winSize.width - hog.blockSize.width)/hog.blockStride.width + 1,
+                      (hog.winSize.height - hog.blockSize.height)/hog.blockStride.height + 1 );
+
+    size_t n = (size_t)winBlocks.area()*blockHistSize;
+    if( detector.size() != n && detector.size() != n + 1 )
+        CV_Error( CV_StsBadArg, "The detector size does not match the HOG descriptor size" );
+    weights.assign( detector.begin(), detector.begin() + n );
+    bias = detector.size() > n ? detector[n] : 0.f;
+
+    int nb = getBlockCount();
+    cascadeBlocks.resize( nb );
+    for( int i = 0; i < nb; i++ )
+        cascadeBlocks[i] = i;
+    cascadeLength = 0;
+    cascadeThreshold = -FLT_MAX;
+    useCascade = false;
+
+    descScale = 127.f;
+    setPrecision( PRECISION_FP32 );
+}
+
+void HOGLinearDetector::calibrate( const std::vector<Mat>& samples )
+{
+    // the quantile is read from a histogram of the positive values over (0, vmax]
+    const int nbins = 4096;
+    const double q = 0.999;
+    float vmax = 0.f;
+    size_t i, j, count = 0;
+    for( i = 0; i < samples.size(); i++ )
+    {
+        CV_Assert( samples[i].type() == CV_32F && samples[i].isContinuous() );
+        const float* x = samples[i].ptr<float>();
+        for( j = 0; j < samples[i].total(); j++ )
+            vmax = std::max( vmax, x[j] );
+    }
+    if( vmax <= 0 )
+        return;
+
+    std::vector<size_t> hist( nbins, 0 );
+    double binScale = nbins/(double)vmax;
+    for( i = 0; i < samples.size(); i++ )
+    {
+        const float* x = samples[i].ptr<float>();
+        for( j = 0; j < samples[i].total(); j++ )
+            if( x[j] > 0 )
+            {
+                hist[std::min( (int)(x[j]*binScale), nbins - 1 )]++;
+                count++;
+            }
+    }
+
+    // clip the rare largest values rather than wasting the int8 range on them
+    size_t k = std::min( count - 1, (size_t)(count*q) ), sum = 0;
+    int b = 0;
+    for( ; b < nbins - 1; b++ )
+    {
+        sum += hist[b];
+        if( sum > k )
+            break;
+    }
+    float vq = (float)((b + 1)/binScale);
+    descScale = 127.f/std::max( vq, FLT_EPSILON );
+    setPrecision( precision );
+}
+
+void HOGLinearDetector::setPrecision( int _precision )
+{
+    CV_Assert( _precision == PRECISION_FP32 || _precision == PRECISION_FP16 ||
+               _precision == PRECISION_INT8 );
+    precision = _precision;
+    if( precision == PRECISION_FP16 && !getDotFp16() )
+        precision = PRECISION_FP32;
+    qweights.clear();
+    qscales.clear();
+    hweights.clear();
+
+    int nb = getBlockCount(), bh = blockHistSize;
+    if( precision == PRECISION_INT8 )
+    {
+        qweights.resize( weights.size() );
+        qscales.resize( nb );
+        for( int b = 0; b < nb; b++ )
+        {
+            const float* w = &weights[b*bh];
+            float wmax = 0.f;
+            for( int i = 0; i < bh; i++ )
+                wmax = std::max( wmax, std::abs( w[i] ) );
+            float scale = wmax > 0 ? wmax/127.f : 1.f;
+            for( int i = 0; i < bh; i++ )
+                qweights[b*bh + i] = saturate_cast<schar>( w[i]/scale );
+            qscales[b] = scale/descScale;
+        }
+    }
+    else if( precision == PRECISION_FP16 )
+    {
+        hweights.resize( weights.size() );
+        for( size_t i = 0; i < weights.size(); i++ )
+            hweights[i] = float_to_half( weights[i] );
+    }
+}
+
+void HOGLinearDetector::quantizeGrid( HOGBlockGrid& grid ) const
+{
+    if( precision == PRECISION_INT8 )
+        grid.data.convertTo( grid.qdata, CV_8S, descScale );
+    else if( precision == PRECISION_FP16 )
+    {
+        grid.qdata.create( grid.data.size(), CV_16U );
+        const float* src = grid.data.ptr<float>();
+        ushort* dst = grid.qdata.ptr<ushort>();
+        for( size_t i = 0; i < grid.data.total(); i++ )
+            dst[i] = float_to_half( src[i] );
+    }
+    else
+        grid.qdata.release();
+}
+
+double HOGLinearDetector::calcScore( const Mat& descriptor ) const
+{
+    CV_Assert( !empty() && descriptor.type() == CV_32F && descriptor.isContinuous() &&
+               descriptor.total() == weights.size() );
+
+    // a window descriptor is a grid of winBlocks blocks
+    HOGBlockGrid grid;
+    grid.data = Mat( 1, (int)descriptor.total(), CV_32F, (void*)descriptor.ptr<float>() );
+    grid.nblocks = winBlocks;
+    grid.blockHistSize = blockHistSize;
+    quantizeGrid( grid );
+
+    std::vector<int> ofs;
+    block_offsets( *this, grid.nblocks.height, ofs );
+    return scoreWindow( grid, 0, 0, &ofs[0], false );
+}
+
+double HOGLinearDetector::scoreWindow( const HOGBlockGrid& grid, int x, int y, const int* ofs, bool cascade ) const
+{
+    int nb = getBlockCount(), bh = blockHistSize;
+    size_t base = ((size_t)x*grid.nblocks.height + y)*bh;
+    double s = bias;
+
+    if( !cascade && precision == PRECISION_FP32 )
+    {
+        // the block columns of the window are contiguous
+        int colStep = grid.nblocks.height*bh, colLen = winBlocks.height*bh;
+        const float* gx = grid.data.ptr<float>() + base;
+        const float* w = &weights[0];
+        for( int i = 0; i < winBlocks.width; i++ )
+            s += dot_prod( gx + i*colStep, w + i*colLen, colLen );
+        return s;
+    }
+
+    int k = 0;
+    if( cascade )
+    {
+        s += score_blocks( *this, grid, base, ofs, 0, cascadeLength );
+        if( s < cascadeThreshold )
+            return -DBL_MAX;
+        k = cascadeLength;
+    }
+    return s + score_blocks( *this, grid, base, ofs, k, nb );
+}
+
+void HOGLinearDetector::computeGrid( const Mat& img, HOGBlockGrid& grid ) const
+{
+    Mat gray;
+    if( img.channels() == 3 )
+        cvtColor( img, gray, COLOR_BGR2GRAY );
+    else
+        gray = img;
+
+    grid.blockHistSize = blockHistSize;
+    if( gray.cols < hog.blockSize.width || gray.rows < hog.blockSize.height )
+    {
+        grid.nblocks = Size();
+        grid.data.release();
+        return;
+    }
+
+    grid.nblocks = Size( (gray.cols - hog.blockSize.width)/hog.blockStride.width + 1,
+                         (gray.rows - hog.blockSize.height)/hog.blockStride.height + 1 );
+
+    // describe the image as a single window covering all the blocks
+    HOGDescriptor whole( hog );
+    whole.winSize = Size( (grid.nblocks.width - 1)*hog.blockStride.width + hog.blockSize.width,
+                          (grid.nblocks.height - 1)*hog.blockStride.height + hog.blockSize.height );
+    std::vector<float> descriptors;
+    whole.compute( gray, descriptors, hog.blockStride, Size(), std::vector<Point>( 1, Point() ) );
+    CV_Assert( descriptors.size() == (size_t)grid.nblocks.area()*blockHistSize );
+
+    Mat( descriptors ).copyTo( grid.data );
+    quantizeGrid( grid );
+}
+
+void HOGLinearDetector::detect( const HOGBlockGrid& grid, std::vector<Point>& hits,
+                                std::vector<double>& scores, double hitThreshold ) const
+{
+    hits.clear();
+    scores.clear();
+    if( grid.nblocks.width < winBlocks.width || grid.nblocks.height < winBlocks.height )
+        return;
+
+    CV_Assert( !empty() && grid.blockHistSize == blockHistSize );
+
+    bool cascade = useCascade && cascadeLength > 0;
+    std::vector<int> ofs;
+    block_offsets( *this, grid.nblocks.height, ofs );
+
+    for( int x = 0; x <= grid.nblocks.width - winBlocks.width; x++ )
+        for( int y = 0; y <= grid.nblocks.height - winBlocks.height; y++ )
+        {
+            double s = scoreWindow( grid, x, y, &ofs[0], cascade );
+            if( s >= hitThreshold )
+            {
+                hits.push_back( Point( x, y ) );
+                scores.push_back( s );
+            }
+        }
+}
+
+class HOGLinearInvoker : public ParallelLoopBody
+{
+public:
+    HOGLinearInvoker( const HOGLinearDetector* _det, const Mat& _img, const double* _levelScale,
+                      double _hitThreshold, std::vector<Rect>* _found, std::vector<double>* _weights,
+                      Mutex* _mtx )
+    {
+        det = _det;
+        img = _img;
+        levelScale = _levelScale;
+        hitThreshold = _hitThreshold;
+        found = _found;
+        weights = _weights;
+        mtx = _mtx;
+    }
+
+    void operator()( const Range& range ) const
+    {
+        const HOGDescriptor& hog = det->hog;
+        HOGBlockGrid grid;
+        std::vector<Point> hits;
+        std::vector<double> scores;
+        Mat smallImg;
+
+        for( int i = range.start; i < range.end; i++ )
+        {
+            double scale = levelScale[i];
+            Size sz( cvRound( img.cols/scale ), cvRound( img.rows/scale ) );
+            if( sz == img.size() )
+                smallImg = img;
+            else
+                resize( img, smallImg, sz );
+
+            det->computeGrid( smallImg, grid );
+            det->detect( grid, hits, scores, hitThreshold );
+
+            Size scaledWin( cvRound( hog.winSize.width*scale ), cvRound( hog.winSize.height*scale ) );
+            AutoLock lock( *mtx );
+            for( size_t j = 0; j < hits.size(); j++ )
+            {
+                found->push_back( Rect( cvRound( hits[j].x*hog.blockStride.width*scale ),
+                                        cvRound( hits[j].y*hog.blockStride.height*scale ),
+                                        scaledWin.width, scaledWin.height ) );
+                weights->push_back( scores[j] );
+            }
+        }
+    }
+
+    const HOGLinearDetector* det;
+    Mat img;
+    const double* levelScale;
+    double hitThreshold;
+    std::vector<Rect>* found;
+    std::vector<double>* weights;
+    Mutex* mtx;
+};
+
+void HOGLinearDetector::detectMultiScale( const Mat& img, std::vector<Rect>& found,
+                                          std::vector<double>& foundWeights, double hitThreshold,
+                                          double scale0, int groupThreshold ) const
+{
+    found.clear();
+    foundWeights.clear();
+    CV_Assert( !empty() );
+
+    Mat gray;
+    if( img.channels() == 3 )
+        cvtColor( img, gray, COLOR_BGR2GRAY );
+    else
+        gray = img;
+
+    // the same pyramid as HOGDescriptor::detectMultiScale()
+    const int maxLevels = 64;
+    std::vector<double> levelScale;
+    double scale = 1.;
+    int levels = 0;
+    for( ; levels < maxLevels; levels++ )
+    {
+        levelScale.push_back( scale );
+        if( cvRound( gray.cols/scale ) < hog.winSize.width ||
+            cvRound( gray.rows/scale ) < hog.winSize.height || scale0 <= 1 )
+            break;
+        scale *= scale0;
+    }
+    levelScale.resize( std::max( levels, 1 ) );
+
+    std::vector<Rect> raw;
+    std::vector<double> rawWeights;
+    Mutex mtx;
+    parallel_for_( Range( 0, (int)levelScale.size() ),
+                   HOGLinearInvoker( this, gray, &levelScale[0], hitThreshold, &raw, &rawWeights, &mtx ) );
+
+    found = raw;
+    foundWeights = rawWeights;
+    if( groupThreshold > 0 )
+    {
+        NMSParams params = nms;
+        params.scoreThreshold = hitThreshold;
+        params.minNeighbors = groupThreshold;
+        groupDetections( found, foundWeights, params );
+    }
+}
+
+void HOGLinearDetector::detectMultiScale( const Mat& img, std::vector<Rect>& found,
+                                          double hitThreshold, double scale0, int groupThreshold ) const
+{
+    std::vector<double> foundWeights;
+    detectMultiScale( img, found, foundWeights, hitThreshold, scale0, groupThreshold );
+}
+
+/*
+ Uniform grid over the boxes: every box is registered in the cells it covers, the cells
+ being about half the median box size, so a query only visits the boxes around it.
+*/
+class RectGrid
+{
+public:
+    RectGrid( const std::vector<Rect>& _rects ) : rects( _rects )
+    {
+        int n = (int)rects.size();
+        std::vector<int> ws( n ), hs( n );
+        Rect bounds = rects[0];
+        for( int i = 0; i < n; i++ )
+        {
+            ws[i] = rects[i].width;
+            hs[i] = rects[i].height;
+            bounds |= rects[i];
+        }
+        std::nth_element( ws.begin(), ws.begin() + n/2, ws.end() );
+        std::nth_element( hs.begin(), hs.begin() + n/2, hs.end() );
+        cell = Size( std::max( ws[n/2]/2, 1 ), std::max( hs[n/2]/2, 1 ) );
+
+        // a few outliers must not blow up the number of cells
+        while( (double)(bounds.width/cell.width + 1)*(bounds.height/cell.height + 1) > 4.*n + 64 )
+            cell.width *= 2, cell.height *= 2;
+
+        origin = bounds.tl();
+        ncells = Size( bounds.width/cell.width + 1, bounds.height/cell.height + 1 );
+        cells.resize( ncells.area() );
+        for( int i = 0; i < n; i++ )
+        {
+            Rect c = cellRange( rects[i] );
+            for( int y = c.y; y < c.y + c.height; y++ )
+                for( int x = c.x; x < c.x + c.width; x++ )
+                    cells[y*ncells.width + x].push_back( i );
+        }
+        stamp.assign( n, -1 );
+        query_id = 0;
+    }
+
+    //! indices of the boxes registered in the cells overlapped by <r>, each one once
+    void query( const Rect& r, std::vector<int>& idx )
+    {
+        idx.clear();
+        Rect c = cellRange( r );
+        for( int y = c.y; y < c.y + c.height; y++ )
+            for( int x = c.x; x < c.x + c.width; x++ )
+            {
+                const std::vector<int>& bucket = cells[y*ncells.width + x];
+                for( size_t k = 0; k < bucket.size(); k++ )
+                    if( stamp[bucket[k]] != query_id )
+                    {
+                        stamp[bucket[k]] = query_id;
+                        idx.push_back( bucket[k] );
+                    }
+            }
+        query_id++;
+    }
+
+protected:
+    Rect cellRange( const Rect& r ) const
+    {
+        int x0 = std::max( (r.x - origin.x)/cell.width, 0 );
+        int y0 = std::max( (r.y - origin.y)/cell.height, 0 );
+        int x1 = std::min( (r.x + r.width - 1 - origin.x)/cell.width, ncells.width - 1 );
+        int y1 = std::min( (r.y + r.height - 1 - origin.y)/cell.height, ncells.height - 1 );
+        return x0 <= x1 && y0 <= y1 ? Rect( x0, y0, x1 - x0 + 1, y1 - y0 + 1 ) : Rect();
+    }
+
+    const std::vector<Rect>& rects;
+    Point origin;
+    Size cell, ncells;
+    std::vector<std::vector<int> > cells;
+    std::vector<int> stamp;
+    int query_id;
+};
+
+static inline double rect_iou( const Rect& a, const Rect& b )
+{
+    double inter = (a & b).area();
+    return inter > 0 ? inter/(a.area() + b.area() - inter) : 0.;
+}
+
+static void nms_greedy( const std::vector<Rect>& rects, const std::vector<double>& scores,
+                        const NMSParams& params, std::vector<int>& keep, std::vector<int>& support )
+{
+    int n = (int)rects.size();
+    std::vector<std::pair<double, int> > order( n );
+    for( int i = 0; i < n; i++ )
+        order[i] = std::make_pair( -scores[i], i );
+    std::sort( order.begin(), order.end() );
+
+    RectGrid grid( rects );
+    std::vector<uchar> done( n, 0 );
+    std::vector<int> neighbors;
+    for( int k = 0; k < n; k++ )
+    {
+        int i = order[k].second;
+        if( done[i] )
+            continue;
+        done[i] = 1;
+        keep.push_back( i );
+        support.push_back( 0 );
+
+        grid.query( rects[i], neighbors );
+        for( size_t j = 0; j < neighbors.size(); j++ )
+        {
+            int nb = neighbors[j];
+            if( !done[nb] && rect_iou( rects[i], rects[nb] ) > params.overlap )
+            {
+                done[nb] = 1;
+                support.back()++;
+            }
+        }
+    }
+}
+
+static void nms_soft( const std::vector<Rect>& rects, std::vector<double>& scores,
+                      const NMSParams& params, std::vector<int>& keep, std::vector<int>& support )
+{
+    int n = (int)rects.size();
+    double sigma = std::max( params.sigma, DBL_EPSILON );
+    std::vector<double> margin( n );
+    std::priority_queue<std::pair<double, int> > queue;
+    for( int i = 0; i < n; i++ )
+    {
+        margin[i] = std::max( scores[i] - params.scoreThreshold, 0. );
+        queue.push( std::make_pair( margin[i], i ) );
+    }
+
+    RectGrid grid( rects );
+    std::vector<uchar> done( n, 0 );
+    std::vector<int> neighbors;
+    while( !queue.empty() )
+    {
+        std::pair<double, int> top = queue.top();
+        queue.pop();
+        int i = top.second;
+        // stale entry of a box decayed since it was queued
+        if( done[i] || top.first != margin[i] )
+            continue;
+        if( margin[i] < params.softMinScore )
+            break;
+        done[i] = 1;
+        keep.push_back( i );
+        support.push_back( 0 );
+        scores[i] = params.scoreThreshold + margin[i];
+
+        grid.query( rects[i], neighbors );
+        for( size_t j = 0; j < neighbors.size(); j++ )
+        {
+            int nb = neighbors[j];
+            double iou = done[nb] ? 0. : rect_iou( rects[i], rects[nb] );
+            if( iou <= 0 )
+                continue;
+            if( iou > params.overlap )
+                support.back()++;
+            margin[nb] *= std::exp( -iou*iou/sigma );
+            queue.push( std::make_pair( margin[nb], nb ) );
+        }
+    }
+}
+
+typedef std::pair<int, std::pair<int, int> > ModeKey;
+
+/*
+ The mean-shift modes, indexed by fixed log-scale buckets <ss> wide and, within a bucket, by
+ cells one bandwidth wide at the middle height of the bucket. The grid of a bucket does not
+ depend on the point that is filed or looked up, so insertions and queries at any scale agree.
+*/
+class ModeIndex
+{
+public:
+    ModeIndex( double _sigma, double _ratio, double _ss ) : sigma(_sigma), ratio(_ratio), ss(_ss) {}
+
+    void add( const Point3d& p, int idx )
+    {
+        int bz = cvFloor( p.z/ss );
+        double cx, cy;
+        cellSize( bz, cx, cy );
+        cells[std::make_pair( bz, std::make_pair( cvFloor( p.y/cy ), cvFloor( p.x/cx ) ) )].push_back( idx );
+    }
+
+    // a mode closer to <p> than <tol> times (sx, sy, ss), or -1; <tol> <= 1
+    int find( const std::vector<Point3d>& modes, const Point3d& p, double sx, double sy, double tol ) const
+    {
+        int bz0 = cvFloor( p.z/ss );
+        for( int bz = bz0 - 1; bz <= bz0 + 1; bz++ )
+        {
+            double cx, cy;
+            cellSize( bz, cx, cy );
+            int y0 = cvFloor( (p.y - sy*tol)/cy ), y1 = cvFloor( (p.y + sy*tol)/cy );
+            int x0 = cvFloor( (p.x - sx*tol)/cx ), x1 = cvFloor( (p.x + sx*tol)/cx );
+            for( int y = y0; y <= y1; y++ )
+                for( int x = x0; x <= x1; x++ )
+                {
+                    std::map<ModeKey, std::vector<int> >::const_iterator it =
+                        cells.find( std::make_pair( bz, std::make_pair( y, x ) ) );
+                    if( it == cells.end() )
+                        continue;
+                    for( size_t k = 0; k < it->second.size(); k++ )
+                    {
+                        const Point3d& m = modes[it->second[k]];
+                        if( std::abs( m.x - p.x ) < sx*tol && std::abs( m.y - p.y ) < sy*tol &&
+                            std::abs( m.z - p.z ) < ss*tol )
+                            return it->second[k];
+                    }
+                }
+        }
+        return -1;
+    }
+
+protected:
+    void cellSize( int bz, double& cx, double& cy ) const
+    {
+        double h = std::exp( (bz + 0.5)*ss );
+        cy = std::max( sigma*h, 1. );
+        cx = std::max( sigma*h*ratio, 1. );
+    }
+
+    double sigma, ratio, ss;
+    std::map<ModeKey, std::vector<int> > cells;
+};
+
+static void nms_meanshift( std::vector<Rect>& rects, std::vector<double>& scores,
+                           const NMSParams& params, std::vector<int>& keep, std::vector<int>& support )
+{
+    const int maxIter = 20;
+    const double scaleSigma = std::log( 1.3 );
+    int n = (int)rects.size();
+    double sigma = std::max( params.bandwidth, DBL_EPSILON );
+
+    // the points are (center x, center y, log height); all the boxes share one aspect ratio
+    std::vector<Point3d> pts( n );
+    std::vector<double> w( n ), aspect( n );
+    std::vector<std::pair<double, int> > order( n );
+    for( int i = 0; i < n; i++ )
+    {
+        order[i] = std::make_pair( -scores[i], i );
+        const Rect& r = rects[i];
+        pts[i] = Point3d( r.x + r.width*0.5, r.y + r.height*0.5, std::log( (double)std::max( r.height, 1 ) ) );
+        w[i] = std::max( scores[i] - params.scoreThreshold, 0. ) + 1e-3;
+        aspect[i] = (double)r.width/std::max( r.height, 1 );
+    }
+    std::nth_element( aspect.begin(), aspect.begin() + n/2, aspect.end() );
+    double ratio = aspect[n/2];
+
+    RectGrid grid( rects );
+    std::vector<int> neighbors;
+    std::vector<Point3d> modes;
+    std::vector<double> modeScore;
+    ModeIndex modeIndex( sigma, ratio, scaleSigma );
+
+    // the strongest boxes are shifted first; a box whose path comes within one bandwidth
+    // of a known mode joins it at once, which keeps dense clusters cheap
+    std::sort( order.begin(), order.end() );
+    for( int oi = 0; oi < n; oi++ )
+    {
+        int i = order[oi].second;
+        Point3d p = pts[i];
+        double sx = 0, sy = 0;
+        int found = -1;
+        for( int iter = 0; iter < maxIter; iter++ )
+        {
+            double h = std::exp( p.z );
+            sx = sigma*h*ratio;
+            sy = sigma*h;
+            if( (found = modeIndex.find( modes, p, sx, sy, 1. )) >= 0 )
+                break;
+            grid.query( Rect( cvFloor( p.x - 3*sx ), cvFloor( p.y - 3*sy ),
+                              cvCeil( 6*sx ) + 1, cvCeil( 6*sy ) + 1 ), neighbors );
+
+            Point3d sum( 0, 0, 0 );
+            double wsum = 0;
+            for( size_t j = 0; j < neighbors.size(); j++ )
+            {
+                const Point3d& q = pts[neighbors[j]];
+                double dx = (q.x - p.x)/sx, dy = (q.y - p.y)/sy, ds = (q.z - p.z)/scaleSigma;
+                double d2 = dx*dx + dy*dy + ds*ds;
+                if( d2 > 9 )
+                    continue;
+                double k = w[neighbors[j]]*std::exp( -0.5*d2 );
+                sum += q*k;
+                wsum += k;
+            }
+            if( wsum <= 0 )
+                break;
+            Point3d np = sum*(1./wsum);
+            double shift = std::abs( np.x - p.x )/sx + std::abs( np.y - p.y )/sy + std::abs( np.z - p.z )/scaleSigma;
+            p = np;
+            if( shift < 1e-2 )
+                break;
+        }
+
+        // merge the modes closer than one bandwidth
+        if( found < 0 )
+            found = modeIndex.find( modes, p, sx, sy, 1. );
+        if( found < 0 )
+        {
+            found = (int)modes.size();
+            modes.push_back( p );
+            modeScore.push_back( scores[i] );
+            support.push_back( 0 );
+            modeIndex.add( p, found );
+        }
+        else
+        {
+            modeScore[found] = std::max( modeScore[found], scores[i] );
+            support[found]++;
+        }
+    }
+
+    rects.resize( modes.size() );
+    scores = modeScore;
+    for( size_t k = 0; k < modes.size(); k++ )
+    {
+        double h = std::exp( modes[k].z ), wd = h*ratio;
+        rects[k] = Rect( cvRound( modes[k].x - wd*0.5 ), cvRound( modes[k].y - h*0.5 ), cvRound( wd ), cvRound( h ) );
+        keep.push_back( (int)k );
+    }
+}
+
+void groupDetections( std::vector<Rect>& rects, std::vector<double>& scores, const NMSParams& params )
+{
+    CV_Assert( rects.size() == scores.size() );
+    if( rects.empty() )
+        return;
+
+    std::vector<int> keep, support;
+    if( params.method == NMSParams::GREEDY )
+        nms_greedy( rects, scores, params, keep, support );
+    else if( params.method == NMSParams::SOFT )
+        nms_soft( rects, scores, params, keep, support );
+    else if( params.method == NMSParams::MEANSHIFT )
+        nms_meanshift( rects, scores, params, keep, support );
+    else
+        CV_Error( CV_StsBadArg, "Unknown grouping method" );
+
+    std::vector<Rect> outRects;
+    std::vector<double> outScores;
+    for( size_t k = 0; k < keep.size(); k++ )
+        if( support[k] >= params.minNeighbors )
+        {
+            outRects.push_back( rects[keep[k]] );
+            outScores.push_back( scores[keep[k]] );
+        }
+    rects.swap( outRects );
+    scores.swap( outScores );
+}
+
+static bool same_blocks( const HOGDescriptor& a, const HOGDescriptor& b )
+{
+    return a.blockSize == b.blockSize && a.blockStride == b.blockStride && a.cellSize == b.cellSize &&
+           a.nbins == b.nbins && a.derivAperture == b.derivAperture && a.getWinSigma() == b.getWinSigma() &&
+           a.histogramNormType == b.histogramNormType && a.L2HysThreshold == b.L2HysThreshold &&
+           a.gammaCorrection == b.gammaCorrection;
+}
+
+void HOGMultiDetector::addModel( const HOGLinearDetector& model )
+{
+    CV_Assert( !model.empty() );
+    if( !models.empty() && !same_blocks( models[0].hog, model.hog ) )
+        CV_Error( CV_StsBadArg, "The models must share the HOG block parameters" );
+    models.push_back( model );
+}
+
+void HOGMultiDetector::detect( const HOGBlockGrid& grid, std::vector<std::vector<Point> >& hits,
+                               std::vector<std::vector<double> >& scores, double hitThreshold ) const
+{
+    int K = (int)models.size();
+    std::vector<HOGBlockGrid> grids( K );
+    std::vector<std::vector<int> > ofs( K );
+    std::vector<uchar> cascade( K );
+    hits.assign( K, std::vector<Point>() );
+    scores.assign( K, std::vector<double>() );
+
+    // <grid> comes quantized for models[0]; it is quantized again once per other precision
+    // and, for int8, per other descriptor scale
+    for( int k = 0; k < K; k++ )
+    {
+        const HOGLinearDetector& m = models[k];
+        CV_Assert( grid.blockHistSize == m.blockHistSize );
+        grids[k] = grid;
+        int j = 0;
+        for( ; j < k; j++ )
+            if( models[j].precision == m.precision &&
+                (m.precision != HOGLinearDetector::PRECISION_INT8 || models[j].descScale == m.descScale) )
+                break;
+        if( j < k )
+            grids[k].qdata = grids[j].qdata;
+        else if( k > 0 )
+        {
+            // grids[k] shares the buffers of <grid>, which quantizeGrid() would overwrite
+            // in place, so it is quantized into a buffer of its own
+            grids[k].qdata = Mat();
+            m.quantizeGrid( grids[k] );
+        }
+        block_offsets( m, grid.nblocks.height, ofs[k] );
+        cascade[k] = m.useCascade && m.cascadeLength > 0;
+    }
+
+    for( int x = 0; x < grid.nblocks.width; x++ )
+        for( int y = 0; y < grid.nblocks.height; y++ )
+            for( int k = 0; k < K; k++ )
+            {
+                const HOGLinearDetector& m = models[k];
+                if( x > grid.nblocks.width - m.winBlocks.width ||
+                    y > grid.nblocks.height - m.winBlocks.height )
+                    continue;
+                double s = m.scoreWindow( grids[k], x, y, &ofs[k][0], cascade[k] != 0 );
+                if( s >= hitThreshold )
+                {
+                    hits[k].push_back( Point( x, y ) );
+                    scores[k].push_back( s );
+                }
+            }
+}
+
+class HOGMultiInvoker : public ParallelLoopBody
+{
+public:
+    HOGMultiInvoker( const HOGMultiDetector* _det, const Mat& _img, const double* _levelScale,
+                     double _hitThreshold, std::vector<std::vector<Rect> >* _found,
+                     std::vector<std::vector<double> >* _weights, Mutex* _mtx )
+    {
+        det = _det;
+        img = _img;
+        levelScale = _levelScale;
+        hitThreshold = _hitThreshold;
+        found = _found;
+        weights = _weights;
+        mtx = _mtx;
+    }
+
+    void operator()( const Range& range ) const
+    {
+        const std::vector<HOGLinearDetector>& models = det->models;
+        int K = (int)models.size();
+        const Size stride = models[0].hog.blockStride;
+        HOGBlockGrid grid;
+        std::vector<std::vector<Point> > hits;
+        std::vector<std::vector<double> > scores;
+        Mat smallImg;
+
+        for( int i = range.start; i < range.end; i++ )
+        {
+            double scale = levelScale[i];
+            Size sz( cvRound( img.cols/scale ), cvRound( img.rows/scale ) );
+            if( sz == img.size() )
+                smallImg = img;
+            else
+                resize( img, smallImg, sz );
+
+            // one description of the level for all the models
+            models[0].computeGrid( smallImg, grid );
+            det->detect( grid, hits, scores, hitThreshold );
+
+            AutoLock lock( *mtx );
+            for( int k = 0; k < K; k++ )
+            {
+                Size win = models[k].hog.winSize;
+                Size scaledWin( cvRound( win.width*scale ), cvRound( win.height*scale ) );
+                for( size_t j = 0; j < hits[k].size(); j++ )
+                {
+                    (*found)[k].push_back( Rect( cvRound( hits[k][j].x*stride.width*scale ),
+                                                 cvRound( hits[k][j].y*stride.height*scale ),
+                                                 scaledWin.width, scaledWin.height ) );
+                    (*weights)[k].push_back( scores[k][j] );
+                }
+            }
+        }
+    }
+
+    const HOGMultiDetector* det;
+    Mat img;
+    const double* levelScale;
+    double hitThreshold;
+    std::vector<std::vector<Rect> >* found;
+    std::vector<std::vector<double> >* weights;
+    Mutex* mtx;
+};
+
+void HOGMultiDetector::detectMultiScale( const Mat& img, std::vector<std::vector<Rect> >& found,
+                                         std::vector<std::vector<double> >& foundWeights,
+                                         double hitThreshold, double scale0, int groupThreshold ) const
+{
+    int K = (int)models.size();
+    found.assign( K, std::vector<Rect>() );
+    foundWeights.assign( K, std::vector<double>() );
+    if( K == 0 )
+        return;
+
+    Mat gray;
+    if( img.channels() == 3 )
+        cvtColor( img, gray, COLOR_BGR2GRAY );
+    else
+        gray = img;
+
+    // the pyramid goes down to the smallest window
+    Size minWin = models[0].hog.winSize;
+    for( int k = 1; k < K; k++ )
+    {
+        minWin.width = std::min( minWin.width, models[k].hog.winSize.width );
+        minWin.height = std::min( minWin.height, models[k].hog.winSize.height );
+    }
+
+    const int maxLevels = 64;
+    std::vector<double> levelScale;
+    double scale = 1.;
+    int levels = 0;
+    for( ; levels < maxLevels; levels++ )
+    {
+        levelScale.push_back( scale );
+        if( cvRound( gray.cols/scale ) < minWin.width ||
+            cvRound( gray.rows/scale ) < minWin.height || scale0 <= 1 )
+            break;
+        scale *= scale0;
+    }
+    levelScale.resize( std::max( levels, 1 ) );
+
+    Mutex mtx;
+    parallel_for_( Range( 0, (int)levelScale.size() ),
+                   HOGMultiInvoker( this, gray, &levelScale[0], hitThreshold, &found, &foundWeights, &mtx ) );
+
+    if( groupThreshold > 0 )
+        for( int k = 0; k < K; k++ )
+        {
+            NMSParams params = models[k].nms;
+            params.scoreThreshold = hitThreshold;
+            params.minNeighbors = groupThreshold;
+            groupDetections( found[k], foundWeights[k], params );
+        }
+}
+
+static bool cmp_block_norm( const std::pair<double, int>& a, const std::pair<double, int>& b )
+{
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+void HOGLinearDetector::trainCascade( const std::vector<Mat>& samples, const std::vector<int>& labels,
+                                      double maxMissRate, std::vector<HOGCascadeStats>* report )
+{
+    CV_Assert( !empty() && !samples.empty() && samples.size() == labels.size() );
+    CV_Assert( 0 <= maxMissRate && maxMissRate < 1 );
+
+    int nb = getBlockCount(), bh = blockHistSize;
+    int nsamples = (int)samples.size();
+    const float* w = &weights[0];
+
+    // the blocks with the largest weights are scored first
+    std::vector<std::pair<double, int> > order( nb );
+    for( int b = 0; b < nb; b++ )
+        order[b] = std::make_pair( norm( Mat( 1, bh, CV_32F, (void*)(w + b*bh) ) ), b );
+    std::sort( order.begin(), order.end(), cmp_block_norm );
+    for( int k = 0; k < nb; k++ )
+        cascadeBlocks[k] = order[k].second;
+
+    // partial scores after each block in the cascade order
+    Mat partial( nsamples, nb, CV_64F );
+    std::vector<int> pos, neg, detected;
+    for( int i = 0; i < nsamples; i++ )
+    {
+        const Mat& sample = samples[i];
+        CV_Assert( sample.type() == CV_32F && sample.isContinuous() && sample.total() == weights.size() );
+        const float* x = sample.ptr<float>();
+        double* p = partial.ptr<double>( i );
+        double s = bias;
+        for( int k = 0; k < nb; k++ )
+        {
+            int b = cascadeBlocks[k];
+            s += dot_prod( x + b*bh, w + b*bh, bh );
+            p[k] = s;
+        }
+        if( labels[i] > 0 )
+        {
+            pos.push_back( i );
+            if( s >= 0 )
+                detected.push_back( i );
+        }
+        else
+            neg.push_back( i );
+    }
+
+    if( pos.empty() || neg.empty() )
+        CV_Error( CV_StsBadArg, "The cascade needs both positive and negative samples" );
+    // keep the decisions of the full detector; fall back to all the positives if it finds none
+    if( detected.empty() )
+        detected = pos;
+
+    std::vector<HOGCascadeStats> stats;
+    std::vector<double> ps( detected.size() );
+    for( int len = 1; len < nb; len *= 2 )
+    {
+        for( size_t i = 0; i < detected.size(); i++ )
+            ps[i] = partial.at<double>( detected[i], len - 1 );
+        std::sort( ps.begin(), ps.end() );
+
+        HOGCascadeStats st;
+        st.length = len;
+        st.threshold = (float)ps[cvFloor( maxMissRate*ps.size() )];
+        int missed = 0, rejected = 0;
+        for( size_t i = 0; i < ps.size(); i++ )
+            missed += ps[i] < st.threshold;
+        for( size_t i = 0; i < neg.size(); i++ )
+            rejected += partial.at<double>( neg[i], len - 1 ) < st.threshold;
+        st.missRate = (double)missed/ps.size();
+        st.rejectRate = (double)rejected/neg.size();
+
+        // nearly all the scanned windows are background
+        double frac = (double)len/nb;
+        st.speedup = 1./(frac + (1. - st.rejectRate)*(1. - frac));
+        stats.push_back( st );
+    }
+
+    cascadeLength = 0;
+    cascadeThreshold = -FLT_MAX;
+    double bestSpeedup = 1.;
+    for( size_t i = 0; i < stats.size(); i++ )
+        if( stats[i].speedup > bestSpeedup )
+        {
+            bestSpeedup = stats[i].speedup;
+            cascadeLength = stats[i].length;
+            cascadeThreshold = stats[i].threshold;
+        }
+    useCascade = cascadeLength > 0;
+
+    if( report )
+        *report = stats;
+}
+
+void HOGLinearDetector::write( FileStorage& fs ) const
+{
+    fs << "length" << cascadeLength;
+    fs << "threshold" << cascadeThreshold;
+    fs << "blocks" << cascadeBlocks;
+    fs << "precision" << precision;
+    fs << "desc_scale" << descScale;
+}
+
+void HOGLinearDetector::read( const FileNode& fn )
+{
+    if( fn.empty() )
+        return;
+
+    std::vector<int> blocks;
+    int length = (int)fn["length"];
+    float threshold = (float)fn["threshold"];
+    fn["blocks"] >> blocks;
+
+    int nb = getBlockCount();
+    if( (int)blocks.size() != nb || length < 0 || length > nb )
+        CV_Error( CV_StsParseError, "The cascade does not match the detection window" );
+
+    cascadeBlocks = blocks;
+    cascadeLength = length;
+    cascadeThreshold = threshold;
+    useCascade = cascadeLength > 0;
+
+    if( !fn["desc_scale"].empty() )
+        descScale = (float)fn["desc_scale"];
+    setPrecision( fn["precision"].empty() ? PRECISION_FP32 : (int)fn["precision"] );
+}
+
+}
+}
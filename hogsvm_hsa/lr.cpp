@@ -86,6 +86,7 @@ public:
     virtual ~LogisticRegressionImpl() {}
 
     virtual bool train( const Ptr<TrainData>& trainData, int=0 );
+    virtual bool trainChunked( const Ptr<ChunkedTrainData>& data, int=0 );
     virtual float predict(InputArray samples, OutputArray results, int) const;
     virtual void clear();
     virtual void write(FileStorage& fs) const;
@@ -100,6 +101,7 @@ protected:
     double compute_cost(const Mat& _data, const Mat& _labels, const Mat& _init_theta);
     Mat compute_batch_gradient(const Mat& _data, const Mat& _labels, const Mat& _init_theta);
     Mat compute_mini_batch_gradient(const Mat& _data, const Mat& _labels, const Mat& _init_theta);
+    Mat mini_batch_step(const Mat& data_d, const Mat& labels_l, const Mat& theta_p);
     bool set_label_map(const Mat& _labels_i);
     Mat remap_labels(const Mat& _labels_i, const map<int, int>& lmap) const;
 protected:
@@ -415,9 +417,6 @@ Mat LogisticRegressionImpl::compute_batch_gradient(const Mat& _data, const Mat&
 Mat LogisticRegressionImpl::compute_mini_batch_gradient(const Mat& _data, const Mat& _labels, const Mat& _init_theta)
 {
     // implements batch gradient descent
-    int lambda_l = 0;
-    double ccost;
-    int m, n;
     int j = 0;
     int size_b = this->params.mini_batch_size;
 
@@ -431,19 +430,10 @@ Mat LogisticRegressionImpl::compute_mini_batch_gradient(const Mat& _data, const
         CV_Error( CV_StsBadArg, "number of iterations cannot be zero or a negative number" );
     }
 
-    Mat pcal_a;
-    Mat pcal_b;
-    Mat pcal_ab;
-    Mat gradient;
     Mat theta_p = _init_theta.clone();
     Mat data_d;
     Mat labels_l;
 
-    if(this->params.regularized > 0)
-    {
-        lambda_l = 1;
-    }
-
     for(int i = 0;i<this->params.term_crit.maxCount;i++)
     {
         if(j+size_b<=_data.rows)
@@ -457,50 +447,133 @@ Mat LogisticRegressionImpl::compute_mini_batch_gradient(const Mat& _data, const
             labels_l = _labels(Range(j, _labels.rows),Range::all());
         }
 
-        m = data_d.rows;
-        n = data_d.cols;
+        theta_p = mini_batch_step(data_d, labels_l, theta_p);
 
-        ccost = compute_cost(data_d, labels_l, theta_p);
+        j+=this->params.mini_batch_size;
 
-        if( cvIsNaN( ccost ) == 1)
+        if(j+size_b>_data.rows)
         {
-            CV_Error( CV_StsBadArg, "check training parameters. Invalid training classifier" );
+            // if parsed through all data variables
+            break;
         }
+    }
+    return theta_p;
+}
 
-        pcal_b = calc_sigmoid((data_d*theta_p) - labels_l);
+Mat LogisticRegressionImpl::mini_batch_step(const Mat& data_d, const Mat& labels_l, const Mat& theta_p)
+{
+    // one gradient descent step on the mini batch <data_d>
+    int lambda_l = this->params.regularized > 0 ? 1 : 0;
+    int m = data_d.rows;
+    int n = data_d.cols;
+    Mat pcal_a;
+    Mat pcal_b;
+    Mat pcal_ab;
+    Mat gradient;
 
-        pcal_a = (static_cast<double>(1/m)) * data_d.t();
+    double ccost = compute_cost(data_d, labels_l, theta_p);
 
-        gradient = pcal_a * pcal_b;
+    if( cvIsNaN( ccost ) == 1)
+    {
+        CV_Error( CV_StsBadArg, "check training parameters. Invalid training classifier" );
+    }
+
+    pcal_b = calc_sigmoid((data_d*theta_p) - labels_l);
+
+    pcal_a = (static_cast<double>(1/m)) * data_d.t();
+
+    gradient = pcal_a * pcal_b;
 
-        pcal_a = calc_sigmoid(data_d*theta_p) - labels_l;
+    pcal_a = calc_sigmoid(data_d*theta_p) - labels_l;
 
-        pcal_b = data_d(Range::all(), Range(0,1));
+    pcal_b = data_d(Range::all(), Range(0,1));
 
+    multiply(pcal_a, pcal_b, pcal_ab, 1);
+
+    gradient.row(0) = ((float)1/m) * sum(pcal_ab)[0];
+
+    pcal_b = data_d(Range::all(), Range(1,n));
+
+    for(int k = 1;k<gradient.rows;k++)
+    {
+        pcal_b = data_d(Range::all(), Range(k,k+1));
         multiply(pcal_a, pcal_b, pcal_ab, 1);
+        gradient.row(k) = (1.0/m)*sum(pcal_ab)[0] + (lambda_l/m) * theta_p.row(k);
+    }
 
-        gradient.row(0) = ((float)1/m) * sum(pcal_ab)[0];
+    return theta_p - ( static_cast<double>(this->params.alpha)/m)*gradient;
+}
 
-        pcal_b = data_d(Range::all(), Range(1,n));
+bool LogisticRegressionImpl::trainChunked(const Ptr<ChunkedTrainData>& data, int)
+{
+    /* mini-batch gradient descent over the blocks of <data>, one block in memory at a time:
+       the blocks are visited in turn until term_crit.maxCount mini batches have been used.
+       The BATCH method is not available here, the mini batches are always used. */
+    clear();
+    CV_Assert( !data.empty() && data->getNSamples() > 0 && data->getNOutputVars() == 1 );
 
-        for(int k = 1;k<gradient.rows;k++)
-        {
-            pcal_b = data_d(Range::all(), Range(k,k+1));
-            multiply(pcal_a, pcal_b, pcal_ab, 1);
-            gradient.row(k) = (1.0/m)*sum(pcal_ab)[0] + (lambda_l/m) * theta_p.row(k);
-        }
+    if(this->params.mini_batch_size <= 0 || this->params.alpha == 0)
+    {
+        CV_Error( CV_StsBadArg, "check training parameters for the classifier" );
+    }
 
-        theta_p = theta_p - ( static_cast<double>(this->params.alpha)/m)*gradient;
+    int b, nblocks = data->getNBlocks();
+    Mat samples, responses, all_labels;
 
-        j+=this->params.mini_batch_size;
+    // the label map needs all the responses, which are small
+    for( b = 0; b < nblocks; b++ )
+    {
+        data->getBlock(b, samples, responses);
+        all_labels.push_back(responses);
+    }
+    set_label_map(all_labels);
+    int num_classes = (int) this->forward_mapper.size();
+    if(num_classes < 2)
+    {
+        CV_Error( CV_StsBadArg, "data should have atleast 2 classes" );
+    }
 
-        if(j+size_b>_data.rows)
+    int nthetas = num_classes == 2 ? 1 : num_classes;
+    int size_b = this->params.mini_batch_size;
+    vector<Mat> thetas(nthetas);
+    for( int c = 0; c < nthetas; c++ )
+        thetas[c] = Mat::zeros(data->getNVars()+1, 1, CV_32F);
+
+    Mat data_t, labels_l, labels_c;
+    for( int steps = 0; steps < this->params.term_crit.maxCount; )
+    {
+        for( b = 0; b < nblocks && steps < this->params.term_crit.maxCount; b++ )
         {
-            // if parsed through all data variables
-            break;
+            data->getBlock(b, samples, responses);
+
+            // add a column of ones
+            data_t.create(samples.rows, samples.cols+1, CV_32F);
+            data_t.col(0).setTo(Scalar::all(1.0));
+            samples.copyTo(data_t.colRange(1, data_t.cols));
+            labels_l = remap_labels(responses, this->forward_mapper);
+
+            for( int j = 0; j < samples.rows && steps < this->params.term_crit.maxCount; j += size_b, steps++ )
+            {
+                Range r(j, std::min(j + size_b, samples.rows));
+                for( int c = 0; c < nthetas; c++ )
+                {
+                    Mat lc = num_classes == 2 ? labels_l.rowRange(r) : (labels_l.rowRange(r) == c)/255;
+                    lc.convertTo(labels_c, CV_32F);
+                    thetas[c] = mini_batch_step(data_t.rowRange(r), labels_c, thetas[c]);
+                }
+            }
         }
     }
-    return theta_p;
+
+    Mat learnt(nthetas, data->getNVars()+1, CV_32F);
+    for( int c = 0; c < nthetas; c++ )
+        learnt.row(c) = thetas[c].t();
+    this->learnt_thetas = learnt;
+    if( cvIsNaN( (double)sum(this->learnt_thetas)[0] ) )
+    {
+        CV_Error( CV_StsBadArg, "check training parameters. Invalid training classifier" );
+    }
+    return true;
 }
 
 bool LogisticRegressionImpl::set_label_map(const Mat &_labels_i)
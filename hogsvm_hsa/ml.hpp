@@ -101,12 +101,79 @@ public:
     CV_PROP_RW double logStep;
 };
 
+/*!
+ Samples in the compressed sparse row (CSR) format: the non-zero values of the sample i
+ are values[rowPtr[i]], ..., values[rowPtr[i+1]-1], in the columns colIdx[rowPtr[i]], ...,
+ which are ascending. The storage and the cost of the dot products grow with the number of
+ non-zero elements instead of rows()*cols.
+*/
+struct CV_EXPORTS SparseSamples
+{
+    SparseSamples();
+    //! <values> CV_32F, <colIdx> CV_32S of the same size, <rowPtr> CV_32S of rows()+1 elements
+    SparseSamples(const Mat& values, const Mat& colIdx, const Mat& rowPtr, int cols);
+    //! the non-zero elements of a dense ROW_SAMPLE CV_32F matrix
+    explicit SparseSamples(const Mat& dense);
+
+    int rows() const { return rowPtr.empty() ? 0 : (int)rowPtr.total() - 1; }
+    bool empty() const { return rows() == 0; }
+    //! the range of the non-zero elements of the sample i in values and colIdx
+    int begin(int i) const { return rowPtr.ptr<int>()[i]; }
+    int end(int i) const { return rowPtr.ptr<int>()[i+1]; }
+    const float* valuePtr() const { return values.ptr<float>(); }
+    const int* colPtr() const { return colIdx.ptr<int>(); }
+    //! the value of the element (i, j), 0 if it is not stored
+    float at(int i, int j) const;
+
+    //! the samples <idx> (CV_32S), with their non-zero elements only
+    SparseSamples rowSubset(const Mat& idx) const;
+    //! a dense ROW_SAMPLE copy
+    void toDense(Mat& dst) const;
+
+    Mat values, colIdx, rowPtr;
+    int cols;
+};
+
 class CV_EXPORTS TrainData
 {
 public:
     static inline float missingValue() { return FLT_MAX; }
     virtual ~TrainData();
 
+    /*!
+     A subset of the samples and of the variables, expressed as index arrays over the
+     storage of the TrainData, so that nothing is copied. The sample i of the view is the
+     storage sample sidx[i] (i itself if sidx is empty); likewise for the variables.
+    */
+    struct CV_EXPORTS SampleView
+    {
+        SampleView();
+        SampleView(const Mat& samples, int layout, const Mat& sidx=Mat(), const Mat& vidx=Mat());
+
+        int size() const { return nsamples; }
+        int getNVars() const { return nvars; }
+        //! the storage index of the i-th sample of the view
+        int index(int i) const { return sptr ? sptr[i] : i; }
+        float at(int i, int vi) const
+        { return data[(size_t)index(i)*sstep + (size_t)(vptr ? vptr[vi] : vi)*vstep]; }
+        //! pointer to the i-th sample when it is stored contiguously (ROW_SAMPLE layout and
+        //! all the variables selected), 0 otherwise
+        const float* ptr(int i) const
+        { return contiguous ? data + (size_t)index(i)*sstep : 0; }
+        //! gathers the selected variables of the i-th sample
+        void getSample(int i, float* buf) const;
+        //! copies the view into a dense matrix
+        void copyTo(Mat& dst, int layout=ROW_SAMPLE) const;
+
+        Mat samples, sidx, vidx;
+        const float* data;
+        const int* sptr;
+        const int* vptr;
+        size_t sstep, vstep;
+        int nsamples, nvars;
+        bool contiguous;
+    };
+
     virtual int getLayout() const = 0;
     virtual int getNTrainSamples() const = 0;
     virtual int getNTestSamples() const = 0;
@@ -120,6 +187,10 @@ public:
     virtual Mat getTrainSamples(int layout=ROW_SAMPLE,
                                 bool compressSamples=true,
                                 bool compressVars=true) const = 0;
+    //! the training samples (and the active variables) without copying them
+    virtual SampleView getTrainSampleView() const = 0;
+    //! the samples <sidx> (all of them if empty) and the active variables
+    virtual SampleView getSampleView(InputArray sidx) const = 0;
     virtual Mat getTrainResponses() const = 0;
     virtual Mat getTrainNormCatResponses() const = 0;
     virtual Mat getTestResponses() const = 0;
@@ -148,6 +219,42 @@ public:
     virtual void setTrainTestSplitRatio(double ratio, bool shuffle=true) = 0;
     virtual void shuffleTrainTest() = 0;
 
+    //! keeps a feature-major copy of the samples in which the sample indices of every ordered
+    //! variable are sorted by value, so that the tree learners split the nodes without sorting
+    //! (RTrees only uses it when every variable is active at each node)
+    virtual void presort() = 0;
+    //! getNAllVars() x (number of stored samples) values, with the missing ones substituted;
+    //! empty if presort() has not been called
+    virtual Mat getPresortedValues() const = 0;
+    //! per variable, the sample indices in ascending order of getPresortedValues()
+    virtual Mat getPresortedIdx() const = 0;
+
+    //! quantizes every ordered variable into at most <maxBins> (2..256) bins holding about the
+    //! same number of samples, so that the tree learners find the splits on per-node histograms
+    //! of the bins in O(samples + bins) instead of sorting the values
+    virtual void quantize(int maxBins=256) = 0;
+    //! computes the bins of quantize() into <binnedValues> and <binThresholds> without storing
+    //! them in the data
+    virtual void calcBins(int maxBins, OutputArray binnedValues, OutputArray binThresholds) const = 0;
+    //! getNAllVars() x (number of stored samples) CV_8U bin indices, feature-major; empty if
+    //! quantize() has not been called
+    virtual Mat getBinnedValues() const = 0;
+    //! getNAllVars() x (maxBins-1) CV_32F: the value v is in the bin b if
+    //! thresholds[b-1] < v <= thresholds[b]; the thresholds past the last bin are FLT_MAX
+    virtual Mat getBinThresholds() const = 0;
+
+    //! writes the samples, the responses and the variable types in the binary column-major
+    //! format read by loadFromBinary()
+    virtual bool saveBinary(const String& filename) const = 0;
+
+    //! true for the data created from SparseSamples; getSamples(), getTrainSamples() and the
+    //! sample views then give dense copies of them
+    virtual bool isSparse() const = 0;
+    //! the samples as given to create(), empty for dense data
+    virtual SparseSamples getSparseSamples() const = 0;
+    //! the training samples, with all the variables
+    virtual SparseSamples getTrainSparseSamples() const = 0;
+
     static Mat getSubVector(const Mat& vec, const Mat& idx);
     static Ptr<TrainData> loadFromCSV(const String& filename,
                                       int headerLineCount,
@@ -156,9 +263,56 @@ public:
                                       const String& varTypeSpec=String(),
                                       char delimiter=',',
                                       char missch='?');
+    //! opens a file written by saveBinary(); the samples are used in place, without parsing
+    static Ptr<TrainData> loadFromBinary(const String& filename);
     static Ptr<TrainData> create(InputArray samples, int layout, InputArray responses,
                                  InputArray varIdx=noArray(), InputArray sampleIdx=noArray(),
                                  InputArray sampleWeights=noArray(), InputArray varType=noArray());
+    //! sparse samples; all the input variables must be ordered
+    static Ptr<TrainData> create(const SparseSamples& samples, InputArray responses,
+                                 InputArray sampleIdx=noArray(), InputArray sampleWeights=noArray(),
+                                 InputArray varType=noArray());
+};
+
+
+/*!
+ Training samples kept in a file and read by blocks of rows, for training sets that do not
+ fit in memory.
+
+ The file is written by create() and append(), and stores the blocks one after another,
+ each one as a ROW_SAMPLE CV_32F matrix of samples followed by its responses. open() maps
+ it into memory: getBlock() returns matrices pointing into the mapping, asks the system to
+ read the next block ahead and releases the pages of the blocks used more than
+ <maxResidentBlocks> blocks ago, so that the resident memory stays bounded. The matrices of
+ a released block remain valid; their pages are read again when accessed. Where mmap() is
+ not available the last <maxResidentBlocks> blocks are read into buffers instead.
+
+ The models that can learn from it implement StatModel::trainChunked().
+*/
+class CV_EXPORTS ChunkedTrainData
+{
+public:
+    virtual ~ChunkedTrainData();
+
+    virtual int getNSamples() const = 0;
+    virtual int getNVars() const = 0;
+    virtual int getNOutputVars() const = 0;
+    virtual int getResponseType() const = 0;
+    virtual int getBlockSize() const = 0;
+    virtual int getNBlocks() const = 0;
+
+    //! appends samples (and their responses) to a file opened by create()
+    virtual void append(InputArray samples, InputArray responses) = 0;
+    //! writes the last block and completes a file opened by create()
+    virtual void close() = 0;
+
+    virtual void getBlock(int b, Mat& samples, Mat& responses) = 0;
+    //! the block <b> as TrainData, with the response type of the file
+    virtual Ptr<TrainData> getBlockData(int b) = 0;
+
+    static Ptr<ChunkedTrainData> create(const String& filename, int nvars, int noutputvars=1,
+                                        int responseType=VAR_CATEGORICAL, int blockSize=4096);
+    static Ptr<ChunkedTrainData> open(const String& filename, int maxResidentBlocks=2);
 };
 
 
@@ -175,7 +329,16 @@ public:
 
     virtual bool train( const Ptr<TrainData>& trainData, int flags=0 );
     virtual bool train( InputArray samples, int layout, InputArray responses );
+    //! trains the model block by block, without loading all the samples; implemented by
+    //! SVM (two-class C_SVC), ANN_MLP and LogisticRegression
+    virtual bool trainChunked( const Ptr<ChunkedTrainData>& data, int flags=0 );
     virtual float calcError( const Ptr<TrainData>& data, bool test, OutputArray resp ) const;
+    //! also returns, for classifiers, the confusion matrix (CV_32S, true class per row and
+    //! predicted class per column, in getClassLabels() order) and, for two classes, the ROC
+    //! curve of the RAW_OUTPUT predictions (CV_32F rows of threshold, false positive rate
+    //! and true positive rate of the second class)
+    virtual float calcError( const Ptr<TrainData>& data, bool test, OutputArray resp,
+                             OutputArray confusion, OutputArray roc ) const;
     virtual float predict( InputArray samples, OutputArray results=noArray(), int flags=0 ) const = 0;
 
     template<typename _Tp> static Ptr<_Tp> load(const String& filename)
@@ -204,6 +367,56 @@ public:
     virtual String getDefaultModelName() const = 0;
 };
 
+/****************************************************************************************\
+*                              Successive-halving model selection                        *
+\****************************************************************************************/
+
+/* Picks the best of several configured models without evaluating all of them on all the
+   data. Every round trains the remaining candidates on a class-stratified subsample of the
+   training samples and measures their error on a held-out part of it; only the best
+   <keepFraction> of the candidates go on to the next round, which uses 1/keepFraction
+   times more samples. The search works on any StatModel (SVM, RTrees, Boost, ...). */
+
+class CV_EXPORTS SuccessiveHalving
+{
+public:
+    class CV_EXPORTS Params
+    {
+    public:
+        Params();
+        Params( int minSamples, double keepFraction, double maxTime );
+
+        //! training samples of the first round
+        int minSamples;
+        //! fraction of the candidates kept after each round, in (0, 1)
+        double keepFraction;
+        //! fraction of the training samples held out for the validation
+        double validationFraction;
+        //! wall-clock budget in seconds, <= 0 for none; when it runs out the best candidate
+        //! of the furthest round evaluated so far is returned
+        double maxTime;
+        //! seed of the subsampling
+        uint64 seed;
+    };
+
+    //! one evaluated configuration
+    struct CV_EXPORTS Trial
+    {
+        int candidate;
+        int round;
+        int sampleCount;
+        //! validation error: percentage of misclassified samples or mean squared error
+        double error;
+        //! training and validation time, in seconds
+        double time;
+    };
+
+    //! trains <candidates> as described above and returns the index of the best one; the
+    //! candidates are left trained on the subsample of their last round
+    static int run( const Ptr<TrainData>& data, const std::vector<Ptr<StatModel> >& candidates,
+                    const Params& params=Params(), std::vector<Trial>* log=0 );
+};
+
 /****************************************************************************************\
 *                                 Normal Bayes Classifier                                *
 \****************************************************************************************/
@@ -303,6 +516,18 @@ public:
     // SVM params type
     enum { C=0, GAMMA=1, P=2, NU=3, COEF=4, DEGREE=5 };
 
+    //! one (grid point, fold) job of trainAuto(): the validation error, the SMO iterations
+    //! and the time spent training and testing, in seconds
+    struct CV_EXPORTS AutoTrainJob
+    {
+        Params params;
+        int fold;
+        bool ok;
+        double error;
+        int iterations;
+        double time;
+    };
+
     virtual bool trainAuto( const Ptr<TrainData>& data, int kFold = 10,
                     ParamGrid Cgrid = SVM::getDefaultGrid(SVM::C),
                     ParamGrid gammaGrid  = SVM::getDefaultGrid(SVM::GAMMA),
@@ -312,7 +537,28 @@ public:
                     ParamGrid degreeGrid = SVM::getDefaultGrid(SVM::DEGREE),
                     bool balanced=false) = 0;
 
+    //! selects the grid point by successive halving (see SuccessiveHalving) instead of a
+    //! k-fold cross-validation of every point, then trains on all the samples; <log>
+    //! receives the evaluated configurations, Trial::candidate indexing <gridPoints>
+    virtual bool trainAuto( const Ptr<TrainData>& data, const SuccessiveHalving::Params& search,
+                    ParamGrid Cgrid = SVM::getDefaultGrid(SVM::C),
+                    ParamGrid gammaGrid  = SVM::getDefaultGrid(SVM::GAMMA),
+                    ParamGrid pGrid      = SVM::getDefaultGrid(SVM::P),
+                    ParamGrid nuGrid     = SVM::getDefaultGrid(SVM::NU),
+                    ParamGrid coeffGrid  = SVM::getDefaultGrid(SVM::COEF),
+                    ParamGrid degreeGrid = SVM::getDefaultGrid(SVM::DEGREE),
+                    std::vector<SuccessiveHalving::Trial>* log=0,
+                    std::vector<Params>* gridPoints=0) = 0;
+
+    //! predicts the sparse samples, as predict() does the dense ones
+    virtual float predictSparse( const SparseSamples& samples, OutputArray results=noArray(),
+                                 int flags=0 ) const = 0;
+
+    //! the support vectors; a model trained on sparse data keeps them sparse (except for the
+    //! LINEAR kernel) and this returns a dense copy
     CV_WRAP virtual Mat getSupportVectors() const = 0;
+    //! the jobs run by the last trainAuto() call, fold by fold for every grid point
+    virtual void getAutoTrainJobs( std::vector<AutoTrainJob>& jobs ) const = 0;
 
     virtual void setParams(const Params& p, const Ptr<Kernel>& customKernel=Ptr<Kernel>()) = 0;
     virtual Params getParams() const = 0;
@@ -390,7 +636,10 @@ public:
 class CV_EXPORTS_W DTrees : public StatModel
 {
 public:
-    enum { PREDICT_AUTO=0, PREDICT_SUM=(1<<8), PREDICT_MAX_VOTE=(2<<8), PREDICT_MASK=(3<<8) };
+    //! PREDICT_OFFLOAD evaluates the trees on the device of the backend (see svm.cpp) when
+    //! there is one, on the host otherwise
+    enum { PREDICT_AUTO=0, PREDICT_SUM=(1<<8), PREDICT_MAX_VOTE=(2<<8), PREDICT_MASK=(3<<8),
+           PREDICT_OFFLOAD=(1<<10) };
 
     class CV_EXPORTS_W_MAP Params
     {
@@ -471,6 +720,11 @@ public:
         CV_PROP_RW bool calcVarImportance; // true <=> RF processes variable importance
         CV_PROP_RW int nactiveVars;
         CV_PROP_RW TermCriteria termCrit;
+        //! 0: the variable importance is accumulated tree by tree during the training, on all
+        //! the out-of-bag samples; > 0: it is computed once after the training, in parallel
+        //! over the variables, on at most this number of sampled training samples, each one
+        //! with the trees it is out-of-bag for
+        CV_PROP_RW int importanceSampleCount;
     };
 
     virtual void setRParams(const Params& p) = 0;
@@ -513,7 +767,19 @@ public:
 *                                   Gradient Boosted Trees                               *
 \****************************************************************************************/
 
-/*class CV_EXPORTS_W GBTrees : public DTrees
+/*!
+ Gradient boosted regression trees. Every iteration fits one regression tree per class
+ (one in total for the regression losses) to the negative gradient of the loss on a random
+ subsample of the training samples; its leaf values are then set to the loss-optimal step and
+ scaled by the shrinkage. The trees are grown on the binned samples: the bins of
+ TrainData::quantize() if the data has them, otherwise the same bins computed for the training
+ only, without modifying the data.
+
+ With validationPortion > 0, this fraction of the training samples is held out and the
+ training stops when the validation loss has not improved for earlyStoppingRounds iterations;
+ the model keeps the iterations up to the best one.
+*/
+class CV_EXPORTS_W GBTrees : public DTrees
 {
 public:
     struct CV_EXPORTS_W_MAP Params : public DTrees::Params
@@ -522,6 +788,8 @@ public:
         CV_PROP_RW int lossFunctionType;
         CV_PROP_RW float subsamplePortion;
         CV_PROP_RW float shrinkage;
+        CV_PROP_RW float validationPortion;
+        CV_PROP_RW int earlyStoppingRounds;
 
         Params();
         Params( int lossFunctionType, int weakCount, float shrinkage,
@@ -530,13 +798,15 @@ public:
 
     enum {SQUARED_LOSS=0, ABSOLUTE_LOSS, HUBER_LOSS=3, DEVIANCE_LOSS};
 
-    virtual void setK(int k) = 0;
+    virtual void setGParams(const Params& p) = 0;
+    virtual Params getGParams() const = 0;
 
-    virtual float predictSerial( InputArray samples,
-                                 OutputArray weakResponses, int flags) const = 0;
+    //! the number of boosting iterations kept (the trees of the i-th one are the roots
+    //! k*getIterCount() + i, k being the class for DEVIANCE_LOSS and 0 otherwise)
+    virtual int getIterCount() const = 0;
 
-    static Ptr<GBTrees> create(const Params& p);
-};*/
+    static Ptr<GBTrees> create(const Params& p=Params());
+};
 
 /****************************************************************************************\
 *                              Artificial Neural Networks (ANN)                          *
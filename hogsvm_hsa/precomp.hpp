@@ -188,6 +188,67 @@ namespace hsaml
             vector<double> ord_responses;
             vector<int> sidx;
             int maxSubsetSize;
+
+            // presorted mode (see TrainData::presort()): sortedIdx holds, for every ordered
+            // active variable, the samples of the tree in ascending order of the variable;
+            // each node owns the segment [sortedOfs, sortedOfs + sample_count) of every row,
+            // which is partitioned in place between the children when the node is split.
+            Mat ordValues;
+            vector<int> sortedRow;
+            vector<int> sortedIdx;
+            vector<uchar> sampleDir;
+            int sortedCount;
+            int sortedOfs;
+
+            // binned mode (see TrainData::quantize()): the bins of every sample and, for the
+            // ordered active variables, the offset and the number of their histogram rows.
+            // A histogram row holds the class weights (classification) or the weight and the
+            // weighted response sum (regression) of the node samples in the bin. <hist> is
+            // the histogram of the node being split, over all the active variables, and
+            // <nextHist> the one of the next node to be added, found as its parent's minus
+            // its sibling's.
+            Mat binValues, binThresholds;
+            vector<int> binOfs, binCount;
+            int histRows, histStats;
+            vector<double> hist, nextHist;
+
+            // when not empty, the leaf (index in wnodes) every sample of the tree ends in
+            vector<int> sampleLeaf;
+        };
+
+        /*
+         The trees laid out for the batched prediction (see compileForest()). The nodes of
+         every tree are stored breadth-first, so that the two children of a split are adjacent,
+         in a struct of arrays holding the split variable and threshold inline. The variables
+         are renumbered to the ones the forest splits on (<vars>), so that a block of samples
+         only keeps these in the cache.
+        */
+        struct CompiledForest
+        {
+            CompiledForest() : catSplits(false), nnodes(0), nsplits(0) {}
+
+            //! the first node of every tree
+            vector<int> treeOfs;
+            //! the split variable (index in <vars>), -1 for the leaves
+            vector<int> var;
+            //! ordered splits go left if value <= thresh
+            vector<float> thresh;
+            //! subset of the categorical splits, -1 for the ordered ones
+            vector<int> subsetOfs;
+            //! the left child; the right one is child+1
+            vector<int> child;
+            vector<schar> defaultDir;
+            vector<double> value;
+            vector<int> classIdx;
+            vector<int> vars;
+            //! some split is categorical; otherwise the traversal skips the subset test
+            bool catSplits;
+            //! sizes of the forest the layout was compiled from
+            int nnodes, nsplits;
+
+            //! the copy of the layout on the offload device, made on its first use there
+            struct DeviceCopy { virtual ~DeviceCopy() {} };
+            mutable Ptr<DeviceCopy> device;
         };
 
         DTreesImpl();
@@ -204,6 +265,7 @@ namespace hsaml
         virtual void setDParams(const Params& _params);
         virtual Params getDParams() const;
         virtual void startTraining( const Ptr<TrainData>& trainData, int flags );
+        virtual void initBins( const Mat& values, const Mat& thresholds );
         virtual void endTraining();
         virtual void initCompVarIdx();
         virtual bool train( const Ptr<TrainData>& trainData, int flags );
@@ -214,21 +276,70 @@ namespace hsaml
         virtual int findBestSplit( const vector<int>& _sidx );
         virtual void calcValue( int nidx, const vector<int>& _sidx );
 
-        virtual WSplit findSplitOrdClass( int vi, const vector<int>& _sidx, double initQuality );
+        virtual void initSortedIdx( const vector<int>& _sidx );
+        virtual void partitionSortedIdx( int ofs, const vector<int>& _sleft, const vector<int>& _sright );
+        // fills <values> and <sorted_idx> (the order of <values>) for the node samples
+        // and returns the sample indices <sorted_idx> refers to
+        virtual const int* sortValues( int vi, const vector<int>& _sidx, float* values, int* sorted_idx );
+
+        // fills the histogram rows of the variable <vi> (binned mode) from the node samples
+        virtual void calcBinHist( int vi, const vector<int>& _sidx, double* hist ) const;
+        virtual WSplit findSplitBinClass( int vi, const double* hist, double initQuality );
+        virtual WSplit findSplitBinReg( int vi, const double* hist, double initQuality );
+
+        // the findSplit*() functions use <buf>, of getSplitBufSize() bytes, as scratch memory
+        // if it is given, so that the parallel search allocates one buffer per thread
+        virtual size_t getSplitBufSize( int vi, int n ) const;
+        virtual WSplit findSplitOrdClass( int vi, const vector<int>& _sidx, double initQuality, uchar* buf=0 );
 
         // simple k-means, slightly modified to take into account the "weight" (L1-norm) of each vector.
         virtual void clusterCategories( const double* vectors, int n, int m, double* csums, int k, int* labels );
-        virtual WSplit findSplitCatClass( int vi, const vector<int>& _sidx, double initQuality, int* subset );
+        virtual WSplit findSplitCatClass( int vi, const vector<int>& _sidx, double initQuality, int* subset,
+                                          uchar* buf=0 );
 
-        virtual WSplit findSplitOrdReg( int vi, const vector<int>& _sidx, double initQuality );
-        virtual WSplit findSplitCatReg( int vi, const vector<int>& _sidx, double initQuality, int* subset );
+        virtual WSplit findSplitOrdReg( int vi, const vector<int>& _sidx, double initQuality, uchar* buf=0 );
+        virtual WSplit findSplitCatReg( int vi, const vector<int>& _sidx, double initQuality, int* subset,
+                                        uchar* buf=0 );
 
         virtual int calcDir( int splitidx, const vector<int>& _sidx, vector<int>& _sleft, vector<int>& _sright );
+        // sends the samples <_sidx> down the tree being trained from its node <nidx>, as
+        // calcDir() does, and stores the leaves they end in into w->sampleLeaf
+        virtual void routeSamples( int nidx, const vector<int>& _sidx );
+        // the leaf values of the last tree added, <treeidx>, on the samples <_sidx>, while its
+        // training state is still in <w>
+        virtual void evalTree( int treeidx, const vector<int>& _sidx, double* result );
+        // the index, in the cost-complexity sequence of the tree <root>, of the pruned tree
+        // chosen by the cross-validation (its cut nodes have Tn <= index); -1 if the tree
+        // is not pruned
         virtual int pruneCV( int root );
 
-        virtual double updateTreeRNC( int root, double T, int fold );
-        virtual bool cutTree( int root, double T, int fold, double min_alpha );
+        // the pruning statistics of a fold (or of the main sequence, fold < 0) are kept in
+        // <wnodes>, so that the folds may work on their own copies of w->wnodes
+        virtual double updateTreeRNC( vector<WNode>& wnodes, int root, double T, int fold );
+        virtual bool cutTree( vector<WNode>& wnodes, int root, double T, int fold, double min_alpha );
         virtual float predictTrees( const Range& range, const Mat& sample, int flags ) const;
+        // the compiled forest, rebuilt when the trees have changed since the last call
+        virtual Ptr<CompiledForest> compileForest() const;
+        // gathers the split variables of <cf> (cf.vars) from <sample>, whose variables are
+        // <vstep> floats apart, into <x>, as predictSamples() evaluates them; returns true if
+        // some of them is missing (and has no substitute)
+        bool gatherSplitVars( const CompiledForest& cf, const float* sample, size_t vstep,
+                              int flags, float* x ) const;
+        // the leaf of the tree <treeidx> of <cf> that the gathered sample <x> ends in; the
+        // split variable <vk0>, if any, is read as <val0> instead of x[vk0]
+        int findLeaf( const CompiledForest& cf, int treeidx, const float* x,
+                      int vk0=-1, float val0=0.f ) const;
+        // predictTrees() over the trees <range> for the sample rows <rows>, evaluated on the
+        // compiled forest
+        virtual void predictSamples( const Mat& samples, const Range& rows, const Range& range,
+                                     int flags, float* results ) const;
+        // predictSamples() on the offload device (PREDICT_OFFLOAD); returns false if there is
+        // none
+        bool predictSamplesOnDevice( const Mat& samples, const Range& rows, const Range& range,
+                                     int flags, float* results ) const;
+        // predictSamples() over all the trees for every row of <samples>, the blocks of rows
+        // being spread over the threads, or all sent at once to the offload device
+        void predictBatch( const Mat& samples, int flags, float* results ) const;
         virtual float predict( InputArray inputs, OutputArray outputs, int flags ) const;
 
         virtual void writeTrainingParams( FileStorage& fs ) const;
@@ -265,8 +376,24 @@ namespace hsaml
         bool _isClassifier;
 
         Ptr<WorkData> w;
+
+        mutable Ptr<CompiledForest> cforest;
+        mutable Mutex cforestMutex;
     };
 
+    /*
+     Offload of the compiled forests to the device of the SVM kernels (see svm.cpp, which
+     implements them for the backend of the build). predictForestOnDevice() evaluates the
+     trees <range> of <cf> on the <nsamples> gathered samples <x> (cf.vars.size() values per
+     sample) and stores into <out> the vote counts of the <nclasses> classes of every sample
+     or, if nclasses == 0, the sum of its leaf values. Both return false when there is no
+     device, and the caller evaluates the forest itself.
+    */
+    bool haveForestDevice();
+    bool predictForestOnDevice( const DTreesImpl::CompiledForest& cf, const vector<int>& subsets,
+                                const Range& range, const float* x, int nsamples, int nclasses,
+                                float* out );
+
 }}
 
 #endif /* __OPENCV_ML_PRECOMP_HPP__ */
@@ -0,0 +1,225 @@
+/*M///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this license.
+//  If you do not agree to this license, do not download, install,
+//  copy or use the software.
+//
+//
+//                        Intel License Agreement
+//
+// Copyright (C) 2000, Intel Corporation, all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without modification,
+// are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of Intel Corporation may not be used to endorse or promote products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is" and
+// any express or implied warranties, including, but not limited to, the implied
+// warranties of merchantability and fitness for a particular purpose are disclaimed.
+// In no event shall the Intel Corporation or contributors be liable for any direct,
+// indirect, incidental, special, exemplary, or consequential damages
+// (including, but not limited to, procurement of substitute goods or services;
+// loss of use, data, or profits; or business interruption) however caused
+// and on any theory of liability, whether in contract, strict liability,
+// or tort (including negligence or otherwise) arising in any way out of
+// the use of this software, even if advised of the possibility of such damage.
+//
+//M*/
+
+#include "precomp.hpp"
+#include <map>
+
+namespace cv { namespace hsaml {
+
+SuccessiveHalving::Params::Params()
+{
+    minSamples = 200;
+    keepFraction = 1./3;
+    validationFraction = 0.2;
+    maxTime = 0;
+    seed = (uint64)-1;
+}
+
+SuccessiveHalving::Params::Params( int _minSamples, double _keepFraction, double _maxTime )
+{
+    minSamples = _minSamples;
+    keepFraction = _keepFraction;
+    validationFraction = 0.2;
+    maxTime = _maxTime;
+    seed = (uint64)-1;
+}
+
+struct cmp_trial_key
+{
+    cmp_trial_key( const double* _key ) : key(_key) {}
+    bool operator()( int a, int b ) const { return key[a] < key[b]; }
+    const double* key;
+};
+
+static double validationError( const StatModel& model, const Mat& samples, const Mat& responses )
+{
+    Mat results;
+    model.predict( samples, results );
+    CV_Assert( results.total() == responses.total() );
+    results = results.reshape(1, 1);
+
+    bool isclassifier = model.isClassifier();
+    int i, n = samples.rows;
+    double err = 0;
+
+    for( i = 0; i < n; i++ )
+    {
+        float val = results.at<float>(i), val0 = responses.at<float>(i);
+        if( isclassifier )
+            err += fabs(val - val0) > FLT_EPSILON;
+        else
+            err += (val - val0)*(val - val0);
+    }
+    return err / n * (isclassifier ? 100 : 1);
+}
+
+int SuccessiveHalving::run( const Ptr<TrainData>& data, const std::vector<Ptr<StatModel> >& candidates,
+                            const Params& params, std::vector<Trial>* log )
+{
+    CV_Assert( !data.empty() && !candidates.empty() );
+    if( params.keepFraction <= 0 || params.keepFraction >= 1 )
+        CV_Error( CV_StsOutOfRange, "keepFraction must be between 0 and 1" );
+    if( params.validationFraction <= 0 || params.validationFraction >= 1 )
+        CV_Error( CV_StsOutOfRange, "validationFraction must be between 0 and 1" );
+
+    int64 t0 = getTickCount();
+    double freq = getTickFrequency();
+    RNG rng(params.seed);
+
+    Mat samples = data->getSamples();
+    if( data->getLayout() == COL_SAMPLE )
+        samples = samples.t();
+    Mat responses;
+    data->getResponses().convertTo(responses, CV_32F);
+    CV_Assert( responses.total() == (size_t)samples.rows );
+    responses = responses.reshape(1, 1);
+
+    Mat tidx = data->getTrainSampleIdx();
+    int i, n = tidx.empty() ? samples.rows : (int)tidx.total();
+    vector<int> pool(n);
+    for( i = 0; i < n; i++ )
+        pool[i] = tidx.empty() ? i : tidx.at<int>(i);
+
+    for( i = 0; i < n; i++ )
+    {
+        int i1 = rng.uniform(0, n);
+        int i2 = rng.uniform(0, n);
+        std::swap(pool[i1], pool[i2]);
+    }
+
+    // Spread every class evenly over the order, so that any prefix of it (and the
+    // validation part at its end) has about the class proportions of the whole set.
+    if( data->getResponseType() == VAR_CATEGORICAL )
+    {
+        std::map<float, int> class_count, class_rank;
+        vector<double> key(n);
+        vector<int> order(n), temp(pool);
+
+        for( i = 0; i < n; i++ )
+            class_count[responses.at<float>(pool[i])]++;
+        for( i = 0; i < n; i++ )
+        {
+            float c = responses.at<float>(pool[i]);
+            key[i] = (class_rank[c]++ + 0.5)/class_count[c];
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), cmp_trial_key(&key[0]));
+        for( i = 0; i < n; i++ )
+            pool[i] = temp[order[i]];
+    }
+
+    int val_count = std::max(cvRound(n*params.validationFraction), 1);
+    int train_count = n - val_count;
+    if( train_count <= 0 )
+        CV_Error( CV_StsBadArg, "Too few training samples for the search" );
+
+    Mat val_samples(val_count, samples.cols, samples.type());
+    Mat val_responses(1, val_count, CV_32F);
+    for( i = 0; i < val_count; i++ )
+    {
+        int si = pool[train_count + i];
+        samples.row(si).copyTo(val_samples.row(i));
+        val_responses.at<float>(i) = responses.at<float>(si);
+    }
+
+    int ncandidates = (int)candidates.size();
+    vector<int> alive(ncandidates), last_round(ncandidates, -1);
+    vector<double> last_error(ncandidates, DBL_MAX);
+    for( i = 0; i < ncandidates; i++ )
+        alive[i] = i;
+
+    int count = std::min(std::max(params.minSamples, 1), train_count);
+    bool timeout = false;
+
+    for( int round = 0; ; round++ )
+    {
+        Ptr<TrainData> subset = TrainData::create(data->getSamples(), data->getLayout(),
+                                                  data->getResponses(), data->getVarIdx(),
+                                                  Mat(1, count, CV_32S, &pool[0]),
+                                                  data->getSampleWeights(), data->getVarType());
+
+        for( size_t k = 0; k < alive.size(); k++ )
+        {
+            // the first trial is always run, so that there is something to return
+            if( params.maxTime > 0 && (round > 0 || k > 0) &&
+                (getTickCount() - t0)/freq > params.maxTime )
+            {
+                timeout = true;
+                break;
+            }
+
+            int c = alive[k];
+            int64 t = getTickCount();
+            Trial trial;
+            trial.candidate = c;
+            trial.round = round;
+            trial.sampleCount = count;
+            trial.error = candidates[c]->train(subset) ?
+                validationError(*candidates[c], val_samples, val_responses) : DBL_MAX;
+            trial.time = (getTickCount() - t)/freq;
+
+            last_error[c] = trial.error;
+            last_round[c] = round;
+            if( log )
+                log->push_back(trial);
+        }
+
+        if( timeout || alive.size() == 1 || count == train_count )
+            break;
+
+        std::stable_sort(alive.begin(), alive.end(), cmp_trial_key(&last_error[0]));
+        alive.resize(std::max(cvCeil(alive.size()*params.keepFraction), 1));
+        count = std::min(cvCeil(count/params.keepFraction), train_count);
+    }
+
+    // the candidates that got the furthest were evaluated on the most samples
+    int best = -1;
+    for( i = 0; i < ncandidates; i++ )
+    {
+        if( last_round[i] < 0 )
+            continue;
+        if( best < 0 || last_round[i] > last_round[best] ||
+            (last_round[i] == last_round[best] && last_error[i] < last_error[best]) )
+            best = i;
+    }
+    return best;
+}
+
+}}
@@ -9,6 +9,7 @@
 #include <sys/time.h>
 
 #include "precomp.hpp"
+#include "hogdetect.hpp"
 /*
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
@@ -22,6 +23,28 @@ using namespace cv::hsaml;
 using namespace std;
 
 
+/*
+* Detection state kept between the frames of a video for detect_incremental().
+* The whole frame is scanned every <rescan_interval> frames or when the scene changes;
+* in between only the neighbourhood of the last detections and one of the
+* <sweep_strips> vertical strips of the frame (taken in turn) are scanned.
+* The locations are kept per model of the detector.
+*/
+struct DetectCache
+{
+    DetectCache( int _rescan_interval = 10, int _sweep_strips = 4, double _scene_thresh = 12. )
+        : rescan_interval( _rescan_interval ), sweep_strips( _sweep_strips ),
+          scene_thresh( _scene_thresh ), frame_count( 0 ), sweep_idx( 0 ) {}
+
+    int rescan_interval;
+    int sweep_strips;
+    double scene_thresh; // mean absolute difference of the gray thumbnails
+    int frame_count;
+    int sweep_idx;
+    Mat last_thumb;
+    vector< vector< Rect > > last_locations;
+};
+
 void get_svm_detector(const Ptr<SVM>& svm, vector< float > & hog_detector );
 void convert_to_ml(const std::vector< cv::Mat > & train_samples, cv::Mat& trainData );
 void load_images( const string & prefix, const string & filename, vector< Mat > & img_lst );
@@ -29,7 +52,17 @@ void sample_neg( const vector< Mat > & full_neg_lst, vector< Mat > & neg_lst, co
 Mat get_hogdescriptor_visu(const Mat& color_origImg, vector<float>& descriptorValues, const Size & size );
 void compute_hog( const vector< Mat > & img_lst, vector< Mat > & gradient_lst, const Size & size );
 void train_svm( const vector< Mat > & gradient_lst, const vector< int > & labels );
+void load_test_windows( vector< Mat > & test_lst, vector< int > & labels, vector< Mat > & full_neg_lst );
+void train_cascade( HOGLinearDetector & det, const vector< Mat > & test_lst, const vector< int > & labels,
+                    const vector< Mat > & full_neg_lst, fstream & f_perm );
+void test_precision( HOGLinearDetector & det, const vector< Mat > & gradient_lst, const vector< Mat > & test_lst,
+                     const vector< int > & labels, const vector< Mat > & full_neg_lst, fstream & f_perm );
+void train_linear_detector( const vector< Mat > & gradient_lst, const vector< Mat > & full_neg_lst,
+                            fstream & f_perm );
 void draw_locations( Mat & img, const vector< Rect > & locations, const Scalar & color );
+template< typename Detector >
+void detect_incremental( const Detector & det, const Mat & img, DetectCache & cache,
+                         vector< vector< Rect > > & locations );
 void test_it( const Size & size );
 
 void get_svm_detector(const Ptr<SVM>& svm, vector< float > & hog_detector )
@@ -367,6 +400,170 @@ void train_svm( const vector< Mat > & gradient_lst, const vector< int > & labels
     svm->save( "people_detector.yml" );
 }
 
+/*
+* Load the INRIA test set: the 96x160 window descriptors of the positives and of negatives
+* sampled from the full size test negatives, which are returned in <full_neg_lst>.
+*/
+void load_test_windows( vector< Mat > & test_lst, vector< int > & labels, vector< Mat > & full_neg_lst )
+{
+    vector< Mat > pos_lst, neg_lst;
+
+    load_images( "../data/INRIAPerson/70X134H96/Test/pos/", "pos.lst", pos_lst );
+    for( size_t i = 0; i < pos_lst.size(); i++ )
+    {
+        // the 70x134 test crops hold the same 96 pixel people as the 96x160 training ones
+        if( pos_lst[i].size() == Size( 70, 134 ) )
+            copyMakeBorder( pos_lst[i], pos_lst[i], 13, 13, 13, 13, BORDER_REFLECT_101 );
+        if( pos_lst[i].size() != Size( 96, 160 ) )
+            resize( pos_lst[i], pos_lst[i], Size( 96, 160 ) );
+    }
+    load_images( "../data/INRIAPerson/Test/neg/", "neg.lst", full_neg_lst );
+    sample_neg( full_neg_lst, neg_lst, Size( 96, 160 ) );
+
+    compute_hog( pos_lst, test_lst, Size( 96, 160 ) );
+    labels.assign( pos_lst.size(), +1 );
+    compute_hog( neg_lst, test_lst, Size( 96, 160 ) );
+    labels.insert( labels.end(), neg_lst.size(), -1 );
+}
+
+/*
+* Learn the rejection stage of the linear detector on the test windows <test_lst>, which the
+* svm was not trained on, so that the miss rate cap holds for unseen windows. The speedup/miss
+* rate trade-off of every candidate stage length and the detection time on <full_neg_lst>
+* with and without the cascade go to <f_perm>.
+*/
+void train_cascade( HOGLinearDetector & det, const vector< Mat > & test_lst, const vector< int > & labels,
+                    const vector< Mat > & full_neg_lst, fstream & f_perm )
+{
+    vector< HOGCascadeStats > report;
+    det.trainCascade( test_lst, labels, 0.01, &report );
+
+    f_perm << "cascade : length threshold miss_rate reject_rate est_speedup" << endl;
+    for( size_t i = 0; i < report.size(); i++ )
+    {
+        const HOGCascadeStats & st = report[i];
+        f_perm << "cascade : " << st.length << " " << st.threshold << " " << st.missRate << " "
+               << st.rejectRate << " " << st.speedup << endl;
+    }
+    f_perm << "cascade : selected length " << det.cascadeLength << endl;
+    cout << "cascade length " << det.cascadeLength << " of " << det.getBlockCount() << " blocks" << endl;
+
+    // measured speedup on full size images
+    if( det.useCascade )
+    {
+        timeval t1, t2;
+        double elapsed[2];
+        vector< Rect > found;
+        size_t ntest = std::min( full_neg_lst.size(), (size_t)10 );
+        for( int k = 0; k < 2; k++ )
+        {
+            det.useCascade = k == 1;
+            gettimeofday( &t1, NULL );
+            for( size_t i = 0; i < ntest; i++ )
+                det.detectMultiScale( full_neg_lst[i], found );
+            gettimeofday( &t2, NULL );
+            elapsed[k] = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1000000.0;
+        }
+        det.useCascade = true;
+        f_perm << "detectMultiScale() full : " << elapsed[0] << " s. cascade : " << elapsed[1] << " s.\n";
+    }
+}
+
+// non-interpolated average precision of the windows ranked by score
+static double average_precision( vector< pair< double, int > > & scored )
+{
+    sort( scored.begin(), scored.end(), greater< pair< double, int > >() );
+    int tp = 0;
+    double sum = 0;
+    for( size_t i = 0; i < scored.size(); i++ )
+        if( scored[i].second > 0 )
+            sum += (double)++tp/(i + 1);
+    return tp > 0 ? sum/tp : 0;
+}
+
+/*
+* Compare the fp16 and int8 scoring of <det> with fp32 on the INRIA test set: average
+* precision and miss rate at the zero threshold of the test windows <test_lst>, and detection
+* time on the full size test negatives <full_neg_lst>. The int8 scale is calibrated on
+* <gradient_lst>; the fastest precision losing at most 0.01 AP is kept.
+*/
+void test_precision( HOGLinearDetector & det, const vector< Mat > & gradient_lst, const vector< Mat > & test_lst,
+                     const vector< int > & labels, const vector< Mat > & full_neg_lst, fstream & f_perm )
+{
+    det.calibrate( gradient_lst );
+
+    const int precisions[] = { HOGLinearDetector::PRECISION_FP32, HOGLinearDetector::PRECISION_FP16,
+                               HOGLinearDetector::PRECISION_INT8 };
+    const char* names[] = { "fp32", "fp16", "int8" };
+    double ap32 = 0, miss32 = 0, best_time = DBL_MAX;
+    int best = HOGLinearDetector::PRECISION_FP32;
+    size_t ntest = std::min( full_neg_lst.size(), (size_t)10 );
+
+    f_perm << "precision : name AP miss_rate dAP dmiss_rate detect_time" << endl;
+    for( int k = 0; k < 3; k++ )
+    {
+        det.setPrecision( precisions[k] );
+
+        vector< pair< double, int > > scored;
+        int npos = 0, missed = 0;
+        for( size_t i = 0; i < test_lst.size(); i++ )
+        {
+            double score = det.calcScore( test_lst[i] );
+            scored.push_back( make_pair( score, labels[i] ) );
+            if( labels[i] > 0 )
+                npos++, missed += score < 0;
+        }
+        double ap = average_precision( scored );
+        double miss = npos > 0 ? (double)missed/npos : 0;
+
+        timeval t1, t2;
+        vector< Rect > found;
+        gettimeofday( &t1, NULL );
+        for( size_t i = 0; i < ntest; i++ )
+            det.detectMultiScale( full_neg_lst[i], found );
+        gettimeofday( &t2, NULL );
+        double elapsed = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1000000.0;
+
+        if( k == 0 )
+            ap32 = ap, miss32 = miss;
+        f_perm << "precision : " << names[k] << " " << ap << " " << miss << " " << ap - ap32 << " "
+               << miss - miss32 << " " << elapsed << " s." << endl;
+
+        if( ap32 - ap <= 0.01 && elapsed < best_time )
+            best = precisions[k], best_time = elapsed;
+    }
+
+    det.setPrecision( best );
+    cout << "scoring precision " << names[best] << endl;
+}
+
+/*
+* Build the block grid detector from the svm saved by train_svm(): learn its rejection cascade
+* and pick its scoring precision on the INRIA test windows, time the cascade on the full size
+* training negatives <full_neg_lst> and append both to people_detector.yml.
+*/
+void train_linear_detector( const vector< Mat > & gradient_lst, const vector< Mat > & full_neg_lst,
+                            fstream & f_perm )
+{
+    HOGDescriptor my_hog;
+    my_hog.winSize = Size( 96, 160 );
+    Ptr<SVM> svm = StatModel::load<SVM>( "people_detector.yml" );
+    vector< float > hog_detector;
+    get_svm_detector( svm, hog_detector );
+
+    HOGLinearDetector det( my_hog, hog_detector );
+    vector< Mat > test_windows, test_neg_lst;
+    vector< int > test_labels;
+    load_test_windows( test_windows, test_labels, test_neg_lst );
+    train_cascade( det, test_windows, test_labels, full_neg_lst, f_perm );
+    test_precision( det, gradient_lst, test_windows, test_labels, test_neg_lst, f_perm );
+
+    FileStorage fs( "people_detector.yml", FileStorage::APPEND );
+    fs << "hog_linear_detector" << "{";
+    det.write( fs );
+    fs << "}";
+}
+
 void draw_locations( Mat & img, const vector< Rect > & locations, const Scalar & color )
 {
     if( !locations.empty() )
@@ -380,6 +577,136 @@ void draw_locations( Mat & img, const vector< Rect > & locations, const Scalar &
     }
 }
 
+static bool scene_changed( const Mat & img, DetectCache & cache )
+{
+    Mat gray, thumb, diff;
+    if( img.channels() == 3 )
+        cvtColor( img, gray, COLOR_BGR2GRAY );
+    else
+        gray = img;
+    resize( gray, thumb, Size( 64, 48 ), 0, 0, INTER_AREA );
+
+    bool changed = cache.last_thumb.empty();
+    if( !changed )
+    {
+        absdiff( thumb, cache.last_thumb, diff );
+        changed = mean( diff )[0] > cache.scene_thresh;
+    }
+    cache.last_thumb = thumb;
+    return changed;
+}
+
+// add <roi> to the list, merging it with every region it overlaps
+static void add_roi( vector< Rect > & rois, Rect roi )
+{
+    for( size_t i = 0; i < rois.size(); )
+    {
+        if( (rois[i] & roi).area() > 0 )
+        {
+            roi |= rois[i];
+            rois.erase( rois.begin() + i );
+            i = 0;
+        }
+        else
+            i++;
+    }
+    rois.push_back( roi );
+}
+
+static inline Size window_size( const HOGDescriptor & hog ) { return hog.winSize; }
+static inline Size window_size( const HOGLinearDetector & det ) { return det.hog.winSize; }
+static inline Size window_size( const HOGMultiDetector & det )
+{
+    Size win;
+    for( int k = 0; k < det.getModelCount(); k++ )
+    {
+        win.width = std::max( win.width, det.models[k].hog.winSize.width );
+        win.height = std::max( win.height, det.models[k].hog.winSize.height );
+    }
+    return win;
+}
+
+// detections of every model of the detector
+static inline void detect_models( const HOGDescriptor & hog, const Mat & img, vector< vector< Rect > > & found )
+{
+    found.resize( 1 );
+    hog.detectMultiScale( img, found[0] );
+}
+static inline void detect_models( const HOGLinearDetector & det, const Mat & img, vector< vector< Rect > > & found )
+{
+    found.resize( 1 );
+    det.detectMultiScale( img, found[0] );
+}
+static inline void detect_models( const HOGMultiDetector & det, const Mat & img, vector< vector< Rect > > & found )
+{
+    vector< vector< double > > weights;
+    det.detectMultiScale( img, found, weights );
+}
+
+template< typename Detector >
+void detect_incremental( const Detector & det, const Mat & img, DetectCache & cache,
+                         vector< vector< Rect > > & locations )
+{
+    const Size win = window_size( det );
+    const Rect frame( 0, 0, img.cols, img.rows );
+    bool changed = scene_changed( img, cache );
+
+    // a frame without detections is covered by the sweep below, like any other frame: the
+    // whole frame is only scanned on the first frame, on a scene change or every N frames
+    if( changed || cache.last_locations.empty() ||
+        cache.frame_count++ % std::max( cache.rescan_interval, 1 ) == 0 )
+    {
+        detect_models( det, img, locations );
+        cache.frame_count = 1;
+        cache.last_locations = locations;
+        return;
+    }
+
+    // regions around the previous detections: people move only a few pixels per frame
+    vector< Rect > rois;
+    for( size_t k = 0; k < cache.last_locations.size(); k++ )
+    {
+        vector< Rect >::const_iterator loc = cache.last_locations[k].begin();
+        for( ; loc != cache.last_locations[k].end(); ++loc )
+        {
+            int dx = std::max( loc->width/2, win.width/2 );
+            int dy = std::max( loc->height/2, win.height/2 );
+            add_roi( rois, Rect( loc->x - dx, loc->y - dy, loc->width + dx*2, loc->height + dy*2 ) & frame );
+        }
+    }
+
+    // sparse sweep of the rest of the frame so that new people are picked up
+    int nstrips = std::max( cache.sweep_strips, 1 );
+    int strip_w = (img.cols + nstrips - 1)/nstrips;
+    int sx = cache.sweep_idx*strip_w;
+    cache.sweep_idx = (cache.sweep_idx + 1) % nstrips;
+    add_roi( rois, Rect( sx - win.width/2, 0, strip_w + win.width, img.rows ) & frame );
+
+    vector< vector< Rect > > found;
+    locations.assign( cache.last_locations.size(), vector< Rect >() );
+    for( size_t i = 0; i < rois.size(); i++ )
+    {
+        Rect roi = rois[i];
+        // grow the region up to the detection window size
+        if( roi.width < win.width )
+            roi.x -= (win.width - roi.width + 1)/2, roi.width = win.width;
+        if( roi.height < win.height )
+            roi.y -= (win.height - roi.height + 1)/2, roi.height = win.height;
+        roi.x = std::max( std::min( roi.x, img.cols - roi.width ), 0 );
+        roi.y = std::max( std::min( roi.y, img.rows - roi.height ), 0 );
+        roi &= frame;
+        if( roi.width < win.width || roi.height < win.height )
+            continue;
+
+        detect_models( det, img( roi ), found );
+        for( size_t k = 0; k < found.size() && k < locations.size(); k++ )
+            for( size_t j = 0; j < found[k].size(); j++ )
+                locations[k].push_back( found[k][j] + roi.tl() );
+    }
+
+    cache.last_locations = locations;
+}
+
 void test_it( const Size & size )
 {
     char key = 27;
@@ -391,7 +718,10 @@ void test_it( const Size & size )
     HOGDescriptor my_hog;
     my_hog.winSize = size;
     VideoCapture video;
-    vector< Rect > locations;
+    vector< vector< Rect > > locations;
+    DetectCache cache;
+    HOGLinearDetector my_det;
+    HOGMultiDetector detector;
 
     // Load the trained SVM.
 
@@ -408,8 +738,15 @@ void test_it( const Size & size )
     vector< float > hog_detector;
     get_svm_detector( svm, hog_detector );
     my_hog.setSVMDetector( hog_detector );
+    // Block grid scorer with the rejection cascade and precision stored next to the svm
+    my_det.setDetector( my_hog, hog_detector );
+    FileStorage fs( "people_detector.yml", FileStorage::READ );
+    my_det.read( fs["hog_linear_detector"] );
     // Set the people detector.
     hog.setSVMDetector( hog.getDefaultPeopleDetector() );
+    // Both models share one HOG pyramid per frame
+    detector.addModel( HOGLinearDetector( hog, hog.getDefaultPeopleDetector() ) );
+    detector.addModel( my_det );
     // Open the camera.
     video.open(0);
     if( !video.isOpened() )
@@ -427,13 +764,9 @@ void test_it( const Size & size )
 
         draw = img.clone();
 
-        locations.clear();
-        hog.detectMultiScale( img, locations );
-        draw_locations( draw, locations, reference );
-
-        locations.clear();
-        my_hog.detectMultiScale( img, locations );
-        draw_locations( draw, locations, trained );
+        detect_incremental( detector, img, cache, locations );
+        draw_locations( draw, locations[0], reference );
+        draw_locations( draw, locations[1], trained );
 
         imshow( "Video", draw );
         key = (char)waitKey( 10 );
@@ -504,6 +837,13 @@ int train_and_test()
     cout << elapsedTime << " s.\n";
     f_perm<<"train_svm() : " << elapsedTime << " s.\n";
 
+    gettimeofday(&t1, NULL);
+    train_linear_detector( gradient_lst, full_neg_lst, f_perm );
+    gettimeofday(&t2, NULL);
+    elapsedTime = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1000000.0;
+    cout << elapsedTime << " s.\n";
+    f_perm<<"train_linear_detector() : " << elapsedTime << " s.\n";
+
     f_perm.close();       //關閉檔案
 
 
@@ -124,6 +124,8 @@ DTreesImpl::WorkData::WorkData(const Ptr<TrainData>& _data)
     }
 
     maxSubsetSize = 0;
+    sortedCount = sortedOfs = 0;
+    histRows = histStats = 0;
 }
 
 DTreesImpl::DTreesImpl() {}
@@ -140,6 +142,7 @@ void DTreesImpl::clear()
     splits.clear();
     subsets.clear();
     classLabels.clear();
+    cforest.release();
 
     w.release();
     _isClassifier = false;
@@ -177,6 +180,21 @@ void DTreesImpl::startTraining( const Ptr<TrainData>& data, int )
 
     data->getSampleWeights().copyTo(w->sample_weights);
 
+    // the cross-validation fold of every training sample, the folds having equal sizes
+    if( params.CVFolds > 0 )
+    {
+        int n = (int)w->sidx.size();
+        vector<int> folds(n);
+        RNG rng((uint64)-1);
+        for( i = 0; i < n; i++ )
+            folds[i] = i % params.CVFolds;
+        for( i = 0; i < n; i++ )
+            std::swap(folds[i], folds[rng.uniform(i, n)]);
+        w->cv_labels.assign(data->getNSamples(), 0);
+        for( i = 0; i < n; i++ )
+            w->cv_labels[w->sidx[i]] = folds[i];
+    }
+
     _isClassifier = data->getResponseType() == VAR_CATEGORICAL;
 
     if( _isClassifier )
@@ -210,6 +228,49 @@ void DTreesImpl::startTraining( const Ptr<TrainData>& data, int )
     }
     else
         data->getResponses().copyTo(w->ord_responses);
+
+    w->ordValues = data->getPresortedValues();
+    if( !w->ordValues.empty() )
+    {
+        int nrows = 0;
+        w->sortedRow.assign(nallvars, -1);
+        for( i = 0; i < nvars; i++ )
+        {
+            int vi = varIdx[i];
+            if( varType[vi] != VAR_CATEGORICAL )
+                w->sortedRow[vi] = nrows++;
+        }
+        w->sampleDir.resize(w->ordValues.cols);
+    }
+
+    initBins(data->getBinnedValues(), data->getBinThresholds());
+}
+
+// the bins of TrainData::quantize() to grow the trees on, or none if <values> is empty
+void DTreesImpl::initBins( const Mat& values, const Mat& thresholds )
+{
+    int i, nvars = (int)varIdx.size(), nallvars = (int)varType.size();
+    w->binValues = values;
+    w->binThresholds = Mat();
+    if( !w->binValues.empty() )
+    {
+        w->binThresholds = thresholds;
+        w->binOfs.assign(nallvars, -1);
+        w->binCount.assign(nallvars, 0);
+        w->histRows = 0;
+        for( i = 0; i < nvars; i++ )
+        {
+            int vi = varIdx[i], nbins = 1;
+            if( varType[vi] == VAR_CATEGORICAL )
+                continue;
+            const float* t = thresholds.ptr<float>(vi);
+            while( nbins <= thresholds.cols && t[nbins-1] < FLT_MAX )
+                nbins++;
+            w->binOfs[vi] = w->histRows;
+            w->binCount[vi] = nbins;
+            w->histRows += nbins;
+        }
+    }
 }
 
 
@@ -256,6 +317,11 @@ int DTreesImpl::addTree(const vector<int>& sidx )
     w->wnodes.clear();
     w->wsplits.clear();
     w->wsubsets.clear();
+    initSortedIdx( sidx );
+    // Boost turns the classification into regression after startTraining()
+    w->histStats = _isClassifier ? (int)classLabels.size() : 2;
+    w->hist.clear();
+    w->nextHist.clear();
 
     int cv_n = params.CVFolds;
 
@@ -268,9 +334,42 @@ int DTreesImpl::addTree(const vector<int>& sidx )
 
     // build the tree recursively
     int w_root = addNodeAndTrySplit(-1, sidx);
-    int maxdepth = INT_MAX;//pruneCV(root);
 
-    int w_nidx = w_root, pidx = -1, depth = 0;
+    // the nodes cut off at or before the tree chosen by the cross-validation become leaves,
+    // so the tree is emitted already truncated; the samples that ended below them now end
+    // in them
+    int pruned_idx = pruneCV(w_root);
+    if( pruned_idx >= 0 )
+    {
+        int i, nwnodes = (int)w->wnodes.size();
+        vector<int> top(nwnodes, -1);
+        for( i = w_root; i < nwnodes; i++ )
+        {
+            const WNode& wnode = w->wnodes[i];
+            top[i] = wnode.parent >= 0 ? top[wnode.parent] : -1;
+            if( top[i] < 0 && wnode.left >= 0 && wnode.Tn <= pruned_idx )
+                top[i] = i;
+        }
+        if( !w->sampleLeaf.empty() )
+        {
+            for( i = 0; i < (int)sidx.size(); i++ )
+            {
+                int& leaf = w->sampleLeaf[sidx[i]];
+                if( leaf >= 0 && top[leaf] >= 0 )
+                    leaf = top[leaf];
+            }
+        }
+        for( i = w_root; i < nwnodes; i++ )
+        {
+            if( top[i] == i )
+            {
+                WNode& wnode = w->wnodes[i];
+                wnode.left = wnode.right = wnode.split = -1;
+            }
+        }
+    }
+
+    int w_nidx = w_root, pidx = -1;
     int root = (int)nodes.size();
 
     for(;;)
@@ -318,11 +417,10 @@ int DTreesImpl::addTree(const vector<int>& sidx )
             }
         }
 
-        if( wnode.left >= 0 && depth+1 < maxdepth )
+        if( wnode.left >= 0 )
         {
             w_nidx = wnode.left;
             pidx = nidx;
-            depth++;
         }
         else
         {
@@ -333,7 +431,6 @@ int DTreesImpl::addTree(const vector<int>& sidx )
                 w_pidx = w->wnodes[w_pidx].parent;
                 nidx = pidx;
                 pidx = nodes[pidx].parent;
-                depth--;
             }
 
             if( w_pidx < 0 )
@@ -377,6 +474,67 @@ void DTreesImpl::setDParams(const Params& _params)
         CV_Error( CV_StsOutOfRange, "params.regression_accuracy should be >= 0" );
 }
 
+// upper bound of the memory used by the histograms of the right children waiting for their left siblings
+static const size_t MAX_HIST_MEMORY = (size_t)256 << 20;
+
+class BinHistInvoker : public ParallelLoopBody
+{
+public:
+    BinHistInvoker( const DTreesImpl* _tree, const vector<int>& _sidx, double* _hist )
+        : tree(_tree), sidx(&_sidx), hist(_hist) {}
+
+    void operator()( const Range& range ) const
+    {
+        const DTreesImpl::WorkData* w = tree->w;
+        for( int i = range.start; i < range.end; i++ )
+        {
+            int vi = tree->varIdx[i];
+            if( w->binOfs[vi] >= 0 )
+                tree->calcBinHist( vi, *sidx, hist + (size_t)w->binOfs[vi]*w->histStats );
+        }
+    }
+
+    const DTreesImpl* tree;
+    const vector<int>* sidx;
+    double* hist;
+};
+
+// the histograms of all the active variables
+static void calcNodeHist( const DTreesImpl* tree, const vector<int>& _sidx, double* hist )
+{
+    parallel_for_(Range(0, (int)tree->varIdx.size()), BinHistInvoker(tree, _sidx, hist));
+}
+
+void DTreesImpl::calcBinHist( int vi, const vector<int>& _sidx, double* hist ) const
+{
+    int i, n = (int)_sidx.size(), nstats = w->histStats;
+    const int* sidx = &_sidx[0];
+    const uchar* bins = w->binValues.ptr<uchar>(vi);
+    const double* weights = &w->sample_weights[0];
+
+    memset( hist, 0, w->binCount[vi]*nstats*sizeof(hist[0]) );
+    if( _isClassifier )
+    {
+        const int* responses = &w->cat_responses[0];
+        for( i = 0; i < n; i++ )
+        {
+            int si = sidx[i];
+            hist[bins[si]*nstats + responses[si]] += weights[si];
+        }
+    }
+    else
+    {
+        const double* responses = &w->ord_responses[0];
+        for( i = 0; i < n; i++ )
+        {
+            int si = sidx[i];
+            double* h = hist + bins[si]*2;
+            h[0] += weights[si];
+            h[1] += weights[si]*responses[si];
+        }
+    }
+}
+
 int DTreesImpl::addNodeAndTrySplit( int parent, const vector<int>& sidx )
 {
     w->wnodes.push_back(WNode());
@@ -395,9 +553,14 @@ int DTreesImpl::addNodeAndTrySplit( int parent, const vector<int>& sidx )
     }
 
     int i, n = node.sample_count = (int)sidx.size();
+    int sortedOfs = w->sortedOfs;
     bool can_split = true;
     vector<int> sleft, sright;
 
+    // the histogram given by the parent, if any
+    w->hist.swap(w->nextHist);
+    w->nextHist.clear();
+
     calcValue( nidx, sidx );
 
     if( n <= params.minSampleCount || node.depth >= params.maxDepth )
@@ -430,47 +593,151 @@ int DTreesImpl::addNodeAndTrySplit( int parent, const vector<int>& sidx )
         if( params.useSurrogates )
             CV_Error( CV_StsNotImplemented, "surrogate splits are not implemented yet");
 
+        if( !w->sortedIdx.empty() )
+            partitionSortedIdx( sortedOfs, sleft, sright );
+
+        // the histogram of the smaller child is computed and the other one is the parent's
+        // minus it, as long as the histograms kept for the right children fit in memory
+        vector<double> lhist, rhist;
+        size_t j, hsize = w->hist.size();
+        if( hsize > 0 && (size_t)(node.depth + 1)*hsize*sizeof(double) <= MAX_HIST_MEMORY &&
+            node.depth + 1 < params.maxDepth &&
+            (int)std::max(sleft.size(), sright.size()) > params.minSampleCount )
+        {
+            bool leftSmaller = sleft.size() <= sright.size();
+            vector<double>& small = leftSmaller ? lhist : rhist;
+            vector<double>& large = leftSmaller ? rhist : lhist;
+            small.resize(hsize);
+            calcNodeHist( this, leftSmaller ? sleft : sright, &small[0] );
+            large.swap(w->hist);
+            for( j = 0; j < hsize; j++ )
+                large[j] -= small[j];
+        }
+        w->hist.clear();
+
+        w->sortedOfs = sortedOfs;
+        w->nextHist.swap(lhist);
         int left = addNodeAndTrySplit( nidx, sleft );
+        w->sortedOfs = sortedOfs + (int)sleft.size();
+        w->nextHist.swap(rhist);
         int right = addNodeAndTrySplit( nidx, sright );
         w->wnodes[nidx].left = left;
         w->wnodes[nidx].right = right;
         CV_Assert( w->wnodes[nidx].left > 0 && w->wnodes[nidx].right > 0 );
     }
+    else
+    {
+        w->hist.clear();
+        if( !w->sampleLeaf.empty() )
+            for( i = 0; i < n; i++ )
+                w->sampleLeaf[sidx[i]] = nidx;
+    }
 
     return nidx;
 }
 
+// below this number of (sample, variable) pairs the variables of a node are searched serially
+static const int64 MIN_PARALLEL_SPLIT_SIZE = 1 << 16;
+
+static int catClassBufSize( int m, int mi, int n, int maxCategories )
+{
+    int base_size = m*(3 + mi) + mi + 1;
+    if( m > 2 && mi > maxCategories )
+        base_size += m*std::min(maxCategories, n) + mi;
+    else
+        base_size += mi;
+    return base_size;
+}
+
+size_t DTreesImpl::getSplitBufSize( int vi, int n ) const
+{
+    int m = (int)classLabels.size(), mi = getCatCount(vi);
+    if( mi <= 0 )
+        return n*(sizeof(float) + sizeof(int)) + m*2*sizeof(double);
+    if( _isClassifier )
+        return (catClassBufSize(m, mi, n, params.maxCategories) + n)*sizeof(double);
+    return (3*mi + 3 + n)*sizeof(double);
+}
+
+/*
+ Searches the best split of every variable in <vars>. Each chunk of variables allocates one
+ scratch buffer, large enough for all its variables, instead of one per findSplit*() call.
+*/
+class FindSplitInvoker : public ParallelLoopBody
+{
+public:
+    FindSplitInvoker( DTreesImpl* _tree, const vector<int>& _vars, const vector<int>& _sidx,
+                      DTreesImpl::WSplit* _splits, int* _subsets )
+        : tree(_tree), vars(&_vars), sidx(&_sidx), splits(_splits), subsets(_subsets) {}
+
+    void operator()( const Range& range ) const
+    {
+        int i, n = (int)sidx->size(), ssize = tree->w->maxSubsetSize;
+        size_t bufsize = 0;
+        for( i = range.start; i < range.end; i++ )
+            bufsize = std::max(bufsize, tree->getSplitBufSize((*vars)[i], n));
+        AutoBuffer<double> _buf((bufsize + sizeof(double) - 1)/sizeof(double));
+        uchar* buf = (uchar*)(double*)_buf;
+
+        for( i = range.start; i < range.end; i++ )
+        {
+            int vi = (*vars)[i];
+            int* subset = subsets + (size_t)i*ssize;
+            if( tree->varType[vi] == VAR_CATEGORICAL )
+            {
+                if( tree->_isClassifier )
+                    splits[i] = tree->findSplitCatClass(vi, *sidx, 0, subset, buf);
+                else
+                    splits[i] = tree->findSplitCatReg(vi, *sidx, 0, subset, buf);
+            }
+            else
+            {
+                if( tree->_isClassifier )
+                    splits[i] = tree->findSplitOrdClass(vi, *sidx, 0, buf);
+                else
+                    splits[i] = tree->findSplitOrdReg(vi, *sidx, 0, buf);
+            }
+        }
+    }
+
+    DTreesImpl* tree;
+    const vector<int>* vars;
+    const vector<int>* sidx;
+    DTreesImpl::WSplit* splits;
+    int* subsets;
+};
+
 int DTreesImpl::findBestSplit( const vector<int>& _sidx )
 {
     const vector<int>& activeVars = getActiveVars();
     int splitidx = -1;
-    int vi_, nv = (int)activeVars.size();
-    AutoBuffer<int> buf(w->maxSubsetSize*2);
-    int *subset = buf, *best_subset = subset + w->maxSubsetSize;
-    WSplit split, best_split;
+    int vi_, best_vi_ = -1, n = (int)_sidx.size(), nv = (int)activeVars.size();
+    WSplit best_split;
     best_split.quality = 0.;
 
+    // when all the variables are searched their histograms are computed at once, unless the
+    // parent has given them; otherwise findSplitOrd*() computes them one by one
+    if( !w->binValues.empty() && w->histRows > 0 && nv == (int)varIdx.size() && w->hist.empty() )
+    {
+        w->hist.resize((size_t)w->histRows*w->histStats);
+        calcNodeHist( this, _sidx, &w->hist[0] );
+    }
+
+    vector<WSplit> vsplits(nv);
+    vector<int> vsubsets((size_t)nv*w->maxSubsetSize);
+    FindSplitInvoker invoker(this, activeVars, _sidx, &vsplits[0], &vsubsets[0]);
+    if( nv > 1 && (int64)n*nv >= MIN_PARALLEL_SPLIT_SIZE )
+        parallel_for_(Range(0, nv), invoker);
+    else
+        invoker(Range(0, nv));
+
+    // the first best variable wins, as in a serial search
     for( vi_ = 0; vi_ < nv; vi_++ )
     {
-        int vi = activeVars[vi_];
-        if( varType[vi] == VAR_CATEGORICAL )
-        {
-            if( _isClassifier )
-                split = findSplitCatClass(vi, _sidx, 0, subset);
-            else
-                split = findSplitCatReg(vi, _sidx, 0, subset);
-        }
-        else
+        if( vsplits[vi_].quality > best_split.quality )
         {
-            if( _isClassifier )
-                split = findSplitOrdClass(vi, _sidx, 0);
-            else
-                split = findSplitOrdReg(vi, _sidx, 0);
-        }
-        if( split.quality > best_split.quality )
-        {
-            best_split = split;
-            std::swap(subset, best_subset);
+            best_split = vsplits[vi_];
+            best_vi_ = vi_;
         }
     }
 
@@ -478,6 +745,7 @@ int DTreesImpl::findBestSplit( const vector<int>& _sidx )
     {
         int best_vi = best_split.varIdx;
         CV_Assert( compVarIdx[best_split.varIdx] >= 0 && best_vi >= 0 );
+        const int* best_subset = &vsubsets[(size_t)best_vi_*w->maxSubsetSize];
         int i, prevsz = (int)w->wsubsets.size(), ssize = getSubsetSize(best_vi);
         w->wsubsets.resize(prevsz + ssize);
         for( i = 0; i < ssize; i++ )
@@ -665,17 +933,251 @@ void DTreesImpl::calcValue( int nidx, const vector<int>& _sidx )
     }
 }
 
-DTreesImpl::WSplit DTreesImpl::findSplitOrdClass( int vi, const vector<int>& _sidx, double initQuality )
+class SortedIdxInitInvoker : public ParallelLoopBody
+{
+public:
+    SortedIdxInitInvoker( DTreesImpl::WorkData* _w, const vector<int>& _varIdx, const vector<int>& _count )
+        : w(_w), varIdx(&_varIdx), count(&_count) {}
+
+    void operator()( const Range& range ) const
+    {
+        Mat presorted = w->data->getPresortedIdx();
+        int nall = presorted.cols, n = w->sortedCount;
+
+        for( int i = range.start; i < range.end; i++ )
+        {
+            int vi = (*varIdx)[i], row = w->sortedRow[vi];
+            if( row < 0 )
+                continue;
+            const int* src = presorted.ptr<int>(vi);
+            int* dst = &w->sortedIdx[(size_t)row*n];
+            // the bootstrap samples may contain a sample several times
+            for( int j = 0, k = 0; j < nall; j++ )
+                for( int c = (*count)[src[j]]; c > 0; c-- )
+                    dst[k++] = src[j];
+        }
+    }
+
+    DTreesImpl::WorkData* w;
+    const vector<int>* varIdx;
+    const vector<int>* count;
+};
+
+class SortedIdxPartitionInvoker : public ParallelLoopBody
+{
+public:
+    SortedIdxPartitionInvoker( DTreesImpl::WorkData* _w, const vector<int>& _varIdx, int _ofs, int _n, int _nleft )
+        : w(_w), varIdx(&_varIdx), ofs(_ofs), n(_n), nleft(_nleft) {}
+
+    void operator()( const Range& range ) const
+    {
+        AutoBuffer<int> buf(n - nleft + 1);
+        int* right = buf;
+        const uchar* dir = &w->sampleDir[0];
+
+        for( int i = range.start; i < range.end; i++ )
+        {
+            int row = w->sortedRow[(*varIdx)[i]];
+            if( row < 0 )
+                continue;
+            // stable partition, so that both children stay sorted
+            int* seg = &w->sortedIdx[(size_t)row*w->sortedCount + ofs];
+            int j, l = 0, r = 0;
+            for( j = 0; j < n; j++ )
+            {
+                int si = seg[j];
+                if( dir[si] )
+                    right[r++] = si;
+                else
+                    seg[l++] = si;
+            }
+            CV_Assert( l == nleft );
+            memcpy( seg + l, right, r*sizeof(right[0]) );
+        }
+    }
+
+    DTreesImpl::WorkData* w;
+    const vector<int>* varIdx;
+    int ofs, n, nleft;
+};
+
+void DTreesImpl::initSortedIdx( const vector<int>& _sidx )
+{
+    w->sortedIdx.clear();
+    w->sortedCount = w->sortedOfs = 0;
+    if( w->ordValues.empty() )
+        return;
+
+    int i, n = (int)_sidx.size(), nrows = 0, nvars = (int)varIdx.size();
+    vector<int> count(w->ordValues.cols, 0);
+    for( i = 0; i < n; i++ )
+        count[_sidx[i]]++;
+    for( i = 0; i < nvars; i++ )
+        nrows += w->sortedRow[varIdx[i]] >= 0;
+
+    w->sortedCount = n;
+    w->sortedIdx.resize((size_t)nrows*n);
+    parallel_for_(Range(0, nvars), SortedIdxInitInvoker(w, varIdx, count));
+}
+
+void DTreesImpl::partitionSortedIdx( int ofs, const vector<int>& _sleft, const vector<int>& _sright )
+{
+    int i, nleft = (int)_sleft.size(), nright = (int)_sright.size();
+    uchar* dir = &w->sampleDir[0];
+    for( i = 0; i < nleft; i++ )
+        dir[_sleft[i]] = 0;
+    for( i = 0; i < nright; i++ )
+        dir[_sright[i]] = 1;
+    parallel_for_(Range(0, (int)varIdx.size()),
+                  SortedIdxPartitionInvoker(w, varIdx, ofs, nleft + nright, nleft));
+}
+
+const int* DTreesImpl::sortValues( int vi, const vector<int>& _sidx, float* values, int* sorted_idx )
+{
+    int i, n = (int)_sidx.size();
+    int row = w->sortedIdx.empty() ? -1 : w->sortedRow[vi];
+
+    for( i = 0; i < n; i++ )
+        sorted_idx[i] = i;
+
+    if( row >= 0 )
+    {
+        const int* sorted = &w->sortedIdx[(size_t)row*w->sortedCount + w->sortedOfs];
+        const float* col = w->ordValues.ptr<float>(vi);
+        for( i = 0; i < n; i++ )
+            values[i] = col[sorted[i]];
+        return sorted;
+    }
+
+    w->data->getValues( vi, _sidx, values );
+    std::sort(sorted_idx, sorted_idx + n, cmp_lt_idx<float>(values));
+    return &_sidx[0];
+}
+
+DTreesImpl::WSplit DTreesImpl::findSplitBinClass( int vi, const double* hist, double initQuality )
 {
+    int m = (int)classLabels.size(), nbins = w->binCount[vi];
+    AutoBuffer<double> buf(m*2);
+    double* lcw = buf;
+    double* rcw = lcw + m;
+    int i, b, best_b = -1;
+    double best_val = initQuality;
+
+    for( i = 0; i < m; i++ )
+        lcw[i] = rcw[i] = 0.;
+    for( b = 0; b < nbins; b++ )
+        for( i = 0; i < m; i++ )
+            rcw[i] += hist[b*m + i];
+
+    double L = 0, R = 0, lsum2 = 0, rsum2 = 0;
+    for( i = 0; i < m; i++ )
+    {
+        double wval = rcw[i];
+        R += wval;
+        rsum2 += wval*wval;
+    }
+    // the empty bins, which may hold rounding errors after the histogram subtraction, are skipped
+    const double epsilon = R*DBL_EPSILON*1024;
+
+    for( b = 0; b < nbins - 1; b++ )
+    {
+        const double* h = hist + b*m;
+        double hw = 0;
+        for( i = 0; i < m; i++ )
+        {
+            double wval = h[i], w2 = wval*wval;
+            double lv = lcw[i], rv = rcw[i];
+            lsum2 += 2*lv*wval + w2;
+            rsum2 -= 2*rv*wval - w2;
+            lcw[i] = lv + wval; rcw[i] = rv - wval;
+            hw += wval;
+        }
+        L += hw; R -= hw;
+
+        if( hw > epsilon && L > epsilon && R > epsilon )
+        {
+            double val = (lsum2*R + rsum2*L)/(L*R);
+            if( best_val < val )
+            {
+                best_val = val;
+                best_b = b;
+            }
+        }
+    }
+
+    WSplit split;
+    if( best_b >= 0 )
+    {
+        split.varIdx = vi;
+        split.c = w->binThresholds.at<float>(vi, best_b);
+        split.inversed = false;
+        split.quality = (float)best_val;
+    }
+    return split;
+}
+
+DTreesImpl::WSplit DTreesImpl::findSplitBinReg( int vi, const double* hist, double initQuality )
+{
+    int b, best_b = -1, nbins = w->binCount[vi];
+    double L = 0, R = 0, lsum = 0, rsum = 0, best_val = initQuality;
+
+    for( b = 0; b < nbins; b++ )
+    {
+        R += hist[b*2];
+        rsum += hist[b*2+1];
+    }
+    const double epsilon = R*DBL_EPSILON*1024;
+
+    for( b = 0; b < nbins - 1; b++ )
+    {
+        double wval = hist[b*2], t = hist[b*2+1];
+        L += wval; R -= wval;
+        lsum += t; rsum -= t;
+
+        if( wval > epsilon && L > epsilon && R > epsilon )
+        {
+            double val = (lsum*lsum*R + rsum*rsum*L)/(L*R);
+            if( best_val < val )
+            {
+                best_val = val;
+                best_b = b;
+            }
+        }
+    }
+
+    WSplit split;
+    if( best_b >= 0 )
+    {
+        split.varIdx = vi;
+        split.c = w->binThresholds.at<float>(vi, best_b);
+        split.inversed = false;
+        split.quality = (float)best_val;
+    }
+    return split;
+}
+
+DTreesImpl::WSplit DTreesImpl::findSplitOrdClass( int vi, const vector<int>& _sidx, double initQuality,
+                                                  uchar* _buf )
+{
+    if( !w->binValues.empty() )
+    {
+        if( !w->hist.empty() )
+            return findSplitBinClass( vi, &w->hist[(size_t)w->binOfs[vi]*w->histStats], initQuality );
+        AutoBuffer<double> hbuf(w->binCount[vi]*w->histStats);
+        calcBinHist( vi, _sidx, hbuf );
+        return findSplitBinClass( vi, hbuf, initQuality );
+    }
+
     const double epsilon = FLT_EPSILON*2;
     int n = (int)_sidx.size();
     int m = (int)classLabels.size();
 
-    cv::AutoBuffer<uchar> buf(n*(sizeof(float) + sizeof(int)) + m*2*sizeof(double));
+    cv::AutoBuffer<uchar> abuf(_buf ? 0 : getSplitBufSize(vi, n));
+    uchar* buf = _buf ? _buf : (uchar*)abuf;
     const int* sidx = &_sidx[0];
     const int* responses = &w->cat_responses[0];
     const double* weights = &w->sample_weights[0];
-    double* lcw = (double*)(uchar*)buf;
+    double* lcw = (double*)buf;
     double* rcw = lcw + m;
     float* values = (float*)(rcw + m);
     int* sorted_idx = (int*)(values + n);
@@ -685,16 +1187,13 @@ DTreesImpl::WSplit DTreesImpl::findSplitOrdClass( int vi, const vector<int>& _si
     for( i = 0; i < m; i++ )
         lcw[i] = rcw[i] = 0.;
 
-    w->data->getValues( vi, _sidx, values );
-
     for( i = 0; i < n; i++ )
     {
-        sorted_idx[i] = i;
         int si = sidx[i];
         rcw[responses[si]] += weights[si];
     }
 
-    std::sort(sorted_idx, sorted_idx + n, cmp_lt_idx<float>(values));
+    sidx = sortValues( vi, _sidx, values, sorted_idx );
 
     double L = 0, R = 0, lsum2 = 0, rsum2 = 0;
     for( i = 0; i < m; i++ )
@@ -834,18 +1333,15 @@ void DTreesImpl::clusterCategories( const double* vectors, int n, int m, double*
 }
 
 DTreesImpl::WSplit DTreesImpl::findSplitCatClass( int vi, const vector<int>& _sidx,
-                                                  double initQuality, int* subset )
+                                                  double initQuality, int* subset, uchar* _buf )
 {
     int _mi = getCatCount(vi), mi = _mi;
     int n = (int)_sidx.size();
     int m = (int)classLabels.size();
 
-    int base_size = m*(3 + mi) + mi + 1;
-    if( m > 2 && mi > params.maxCategories )
-        base_size += m*std::min(params.maxCategories, n) + mi;
-    else
-        base_size += mi;
-    AutoBuffer<double> buf(base_size + n);
+    int base_size = catClassBufSize(m, mi, n, params.maxCategories);
+    AutoBuffer<double> abuf(_buf ? 0 : base_size + n);
+    double* buf = _buf ? (double*)_buf : (double*)abuf;
 
     double* lc = (double*)buf;
     double* rc = lc + m;
@@ -1012,17 +1508,27 @@ DTreesImpl::WSplit DTreesImpl::findSplitCatClass( int vi, const vector<int>& _si
     return split;
 }
 
-DTreesImpl::WSplit DTreesImpl::findSplitOrdReg( int vi, const vector<int>& _sidx, double initQuality )
+DTreesImpl::WSplit DTreesImpl::findSplitOrdReg( int vi, const vector<int>& _sidx, double initQuality,
+                                                uchar* _buf )
 {
+    if( !w->binValues.empty() )
+    {
+        if( !w->hist.empty() )
+            return findSplitBinReg( vi, &w->hist[(size_t)w->binOfs[vi]*2], initQuality );
+        AutoBuffer<double> hbuf(w->binCount[vi]*2);
+        calcBinHist( vi, _sidx, hbuf );
+        return findSplitBinReg( vi, hbuf, initQuality );
+    }
+
     const float epsilon = FLT_EPSILON*2;
     const double* weights = &w->sample_weights[0];
     int n = (int)_sidx.size();
 
-    AutoBuffer<uchar> buf(n*(sizeof(int) + sizeof(float)));
+    AutoBuffer<uchar> abuf(_buf ? 0 : n*(sizeof(int) + sizeof(float)));
+    uchar* buf = _buf ? _buf : (uchar*)abuf;
 
-    float* values = (float*)(uchar*)buf;
+    float* values = (float*)buf;
     int* sorted_idx = (int*)(values + n);
-    w->data->getValues(vi, _sidx, values);
     const double* responses = &w->ord_responses[0];
 
     int i, si, best_i = -1;
@@ -1031,20 +1537,19 @@ DTreesImpl::WSplit DTreesImpl::findSplitOrdReg( int vi, const vector<int>& _sidx
 
     for( i = 0; i < n; i++ )
     {
-        sorted_idx[i] = i;
         si = _sidx[i];
         R += weights[si];
         rsum += weights[si]*responses[si];
     }
 
-    std::sort(sorted_idx, sorted_idx + n, cmp_lt_idx<float>(values));
+    const int* sidx = sortValues( vi, _sidx, values, sorted_idx );
 
     // find the optimal split
     for( i = 0; i < n - 1; i++ )
     {
         int curr = sorted_idx[i];
         int next = sorted_idx[i+1];
-        si = _sidx[curr];
+        si = sidx[curr];
         double wval = weights[si];
         double t = responses[si]*wval;
         L += wval; R -= wval;
@@ -1073,15 +1578,16 @@ DTreesImpl::WSplit DTreesImpl::findSplitOrdReg( int vi, const vector<int>& _sidx
 }
 
 DTreesImpl::WSplit DTreesImpl::findSplitCatReg( int vi, const vector<int>& _sidx,
-                                                double initQuality, int* subset )
+                                                double initQuality, int* subset, uchar* _buf )
 {
     const double* weights = &w->sample_weights[0];
     const double* responses = &w->ord_responses[0];
     int n = (int)_sidx.size();
     int mi = getCatCount(vi);
 
-    AutoBuffer<double> buf(3*mi + 3 + n);
-    double* sum = (double*)buf + 1;
+    AutoBuffer<double> abuf(_buf ? 0 : 3*mi + 3 + n);
+    double* buf = _buf ? (double*)_buf : (double*)abuf;
+    double* sum = buf + 1;
     double* counts = sum + mi + 1;
     double** sum_ptr = (double**)(counts + mi);
     int* cat_labels = (int*)(sum_ptr + mi);
@@ -1220,6 +1726,154 @@ int DTreesImpl::calcDir( int splitidx, const vector<int>& _sidx,
     return wleft > wright ? -1 : 1;
 }
 
+void DTreesImpl::routeSamples( int nidx, const vector<int>& _sidx )
+{
+    const WNode& node = w->wnodes[nidx];
+    int i, n = (int)_sidx.size();
+
+    if( node.split < 0 )
+    {
+        for( i = 0; i < n; i++ )
+            w->sampleLeaf[_sidx[i]] = nidx;
+        return;
+    }
+
+    const WSplit& split = w->wsplits[node.split];
+    int vi = split.varIdx;
+    vector<int> sleft, sright;
+    AutoBuffer<float> buf(n);
+    sleft.reserve(n);
+    sright.reserve(n);
+
+    if( getCatCount(vi) <= 0 )
+    {
+        float* values = buf;
+        w->data->getValues(vi, _sidx, values);
+        for( i = 0; i < n; i++ )
+            (values[i] <= split.c ? sleft : sright).push_back(_sidx[i]);
+    }
+    else
+    {
+        const int* subset = &w->wsubsets[split.subsetOfs];
+        int* cat_labels = (int*)(float*)buf;
+        w->data->getNormCatValues(vi, _sidx, cat_labels);
+        for( i = 0; i < n; i++ )
+        {
+            unsigned u = cat_labels[i];
+            (CV_DTREE_CAT_DIR(u, subset) < 0 ? sleft : sright).push_back(_sidx[i]);
+        }
+    }
+
+    if( !sleft.empty() )
+        routeSamples(node.left, sleft);
+    if( !sright.empty() )
+        routeSamples(node.right, sright);
+}
+
+class TreeEvalInvoker : public ParallelLoopBody
+{
+public:
+    TreeEvalInvoker( const DTreesImpl* _tree, const TrainData::SampleView& _view,
+                     int _treeidx, double* _result )
+        : tree(_tree), view(&_view), treeidx(_treeidx), result(_result) {}
+
+    void operator()( const Range& range ) const
+    {
+        int nvars = view->getNVars();
+        AutoBuffer<float> buf(nvars + 1);
+        Mat sample(1, nvars, CV_32F, (float*)buf);
+
+        for( int i = range.start; i < range.end; i++ )
+        {
+            view->getSample(i, buf);
+            result[i] = tree->DTreesImpl::predictTrees(Range(treeidx, treeidx+1), sample,
+                                                      DTrees::PREDICT_SUM | StatModel::COMPRESSED_INPUT);
+        }
+    }
+
+    const DTreesImpl* tree;
+    const TrainData::SampleView* view;
+    int treeidx;
+    double* result;
+};
+
+/*
+ The samples the tree was grown on know their leaves (w->sampleLeaf); the other ones are sent
+ down the tree with routeSamples(). When w->sampleLeaf is not used, e.g. because the data has
+ missing values, that predictTrees() sends elsewhere than the training does, the samples are
+ evaluated one by one in parallel.
+*/
+void DTreesImpl::evalTree( int treeidx, const vector<int>& _sidx, double* result )
+{
+    int i, n = (int)_sidx.size();
+
+    if( w->sampleLeaf.empty() )
+    {
+        TrainData::SampleView view(w->data->getSamples(), w->data->getLayout(), Mat(_sidx), Mat(varIdx));
+        parallel_for_(Range(0, n), TreeEvalInvoker(this, view, treeidx, result));
+        return;
+    }
+
+    vector<int> rest;
+    for( i = 0; i < n; i++ )
+    {
+        int si = _sidx[i];
+        if( w->sampleLeaf[si] < 0 )
+            rest.push_back(si);
+    }
+    if( !rest.empty() )
+        routeSamples(0, rest);
+
+    for( i = 0; i < n; i++ )
+    {
+        int si = _sidx[i];
+        result[i] = (float)w->wnodes[w->sampleLeaf[si]].value;
+        w->sampleLeaf[si] = -1;
+    }
+}
+
+/*
+ Builds the tree sequence of the cross-validation fold <j> and stores the error of every tree
+ of the main sequence (alpha bounds <ab>) into the row j of <err_jk>. The folds work on their
+ own copies of the nodes, whose pruning statistics they overwrite, so they run in parallel.
+*/
+class PruneFoldInvoker : public ParallelLoopBody
+{
+public:
+    PruneFoldInvoker( DTreesImpl* _tree, int _root, const vector<double>& _ab, Mat& _err_jk )
+        : tree(_tree), root(_root), ab(&_ab), err_jk(&_err_jk) {}
+
+    void operator()( const Range& range ) const
+    {
+        int tree_count = (int)ab->size();
+        vector<DTreesImpl::WNode> wnodes;
+
+        for( int j = range.start; j < range.end; j++ )
+        {
+            wnodes = tree->w->wnodes;
+            int tj = 0, tk = 0;
+            for( ; tj < tree_count; tj++ )
+            {
+                double min_alpha = tree->updateTreeRNC(wnodes, root, tj, j);
+                if( tree->cutTree(wnodes, root, tj, j, min_alpha) )
+                    min_alpha = DBL_MAX;
+
+                for( ; tk < tree_count; tk++ )
+                {
+                    if( (*ab)[tk] > min_alpha )
+                        break;
+                    err_jk->at<double>(j, tk) = wnodes[root].tree_error;
+                }
+            }
+        }
+    }
+
+    DTreesImpl* tree;
+    int root;
+    const vector<double>* ab;
+    Mat* err_jk;
+};
+
 int DTreesImpl::pruneCV( int root )
 {
     vector<double> ab;
@@ -1234,11 +1888,14 @@ int DTreesImpl::pruneCV( int root )
     double min_err = 0, min_err_se = 0;
     int min_idx = -1;
 
+    if( cv_n <= 0 )
+        return -1;
+
     // build the main tree sequence, calculate alpha's
     for(;;tree_count++)
     {
-        double min_alpha = updateTreeRNC(root, tree_count, -1);
-        if( cutTree(root, tree_count, -1, min_alpha) )
+        double min_alpha = updateTreeRNC(w->wnodes, root, tree_count, -1);
+        if( cutTree(w->wnodes, root, tree_count, -1, min_alpha) )
             break;
 
         ab.push_back(min_alpha);
@@ -1253,24 +1910,7 @@ int DTreesImpl::pruneCV( int root )
         ab[tree_count-1] = DBL_MAX*0.5;
 
         Mat err_jk(cv_n, tree_count, CV_64F);
-
-        for( j = 0; j < cv_n; j++ )
-        {
-            int tj = 0, tk = 0;
-            for( ; tj < tree_count; tj++ )
-            {
-                double min_alpha = updateTreeRNC(root, tj, j);
-                if( cutTree(root, tj, j, min_alpha) )
-                    min_alpha = DBL_MAX;
-
-                for( ; tk < tree_count; tk++ )
-                {
-                    if( ab[tk] > min_alpha )
-                        break;
-                    err_jk.at<double>(j, tk) = w->wnodes[root].tree_error;
-                }
-            }
-        }
+        parallel_for_(Range(0, cv_n), PruneFoldInvoker(this, root, ab, err_jk));
 
         for( ti = 0; ti < tree_count; ti++ )
         {
@@ -1292,7 +1932,7 @@ int DTreesImpl::pruneCV( int root )
     return min_idx;
 }
 
-double DTreesImpl::updateTreeRNC( int root, double T, int fold )
+double DTreesImpl::updateTreeRNC( vector<WNode>& wnodes, int root, double T, int fold )
 {
     int nidx = root, pidx = -1, cv_n = params.CVFolds;
     double min_alpha = DBL_MAX;
@@ -1303,7 +1943,7 @@ double DTreesImpl::updateTreeRNC( int root, double T, int fold )
 
         for(;;)
         {
-            node = &w->wnodes[nidx];
+            node = &wnodes[nidx];
             double t = fold >= 0 ? w->cv_Tn[nidx*cv_n + fold] : node->Tn;
             if( t <= T || node->left < 0 )
             {
@@ -1320,11 +1960,11 @@ double DTreesImpl::updateTreeRNC( int root, double T, int fold )
             nidx = node->left;
         }
 
-        for( pidx = node->parent; pidx >= 0 && w->wnodes[pidx].right == nidx;
-             nidx = pidx, pidx = w->wnodes[pidx].parent )
+        for( pidx = node->parent; pidx >= 0 && wnodes[pidx].right == nidx;
+             nidx = pidx, pidx = wnodes[pidx].parent )
         {
-            node = &w->wnodes[nidx];
-            parent = &w->wnodes[pidx];
+            node = &wnodes[nidx];
+            parent = &wnodes[pidx];
             parent->complexity += node->complexity;
             parent->tree_risk += node->tree_risk;
             parent->tree_error += node->tree_error;
@@ -1337,8 +1977,8 @@ double DTreesImpl::updateTreeRNC( int root, double T, int fold )
         if( pidx < 0 )
             break;
 
-        node = &w->wnodes[nidx];
-        parent = &w->wnodes[pidx];
+        node = &wnodes[nidx];
+        parent = &wnodes[pidx];
         parent->complexity = node->complexity;
         parent->tree_risk = node->tree_risk;
         parent->tree_error = node->tree_error;
@@ -1348,10 +1988,10 @@ double DTreesImpl::updateTreeRNC( int root, double T, int fold )
     return min_alpha;
 }
 
-bool DTreesImpl::cutTree( int root, double T, int fold, double min_alpha )
+bool DTreesImpl::cutTree( vector<WNode>& wnodes, int root, double T, int fold, double min_alpha )
 {
     int cv_n = params.CVFolds, nidx = root, pidx = -1;
-    WNode* node = &w->wnodes[root];
+    WNode* node = &wnodes[root];
     if( node->left < 0 )
         return true;
 
@@ -1359,7 +1999,7 @@ bool DTreesImpl::cutTree( int root, double T, int fold, double min_alpha )
     {
         for(;;)
         {
-            node = &w->wnodes[nidx];
+            node = &wnodes[nidx];
             double t = fold >= 0 ? w->cv_Tn[nidx*cv_n + fold] : node->Tn;
             if( t <= T || node->left < 0 )
                 break;
@@ -1376,14 +2016,14 @@ bool DTreesImpl::cutTree( int root, double T, int fold, double min_alpha )
             nidx = node->left;
         }
 
-        for( pidx = node->parent; pidx >= 0 && w->wnodes[pidx].right == nidx;
-             nidx = pidx, pidx = w->wnodes[pidx].parent )
+        for( pidx = node->parent; pidx >= 0 && wnodes[pidx].right == nidx;
+             nidx = pidx, pidx = wnodes[pidx].parent )
             ;
 
         if( pidx < 0 )
             break;
 
-        nidx = w->wnodes[pidx].right;
+        nidx = wnodes[pidx].right;
     }
 
     return false;
@@ -1487,10 +2127,10 @@ float DTreesImpl::predictTrees( const Range& range, const Mat& sample, int flags
                         c -= cofs[vi][0];
                         catbuf[ci] = c;
                     }
-                    const int* subset = &subsets[split.subsetOfs];
-                    unsigned u = c;
-                    nidx = CV_DTREE_CAT_DIR(u, subset) < 0 ? node.left : node.right;
                 }
+                const int* subset = &subsets[split.subsetOfs];
+                unsigned u = c;
+                nidx = CV_DTREE_CAT_DIR(u, subset) < 0 ? node.left : node.right;
             }
         }
 
@@ -1520,6 +2160,401 @@ float DTreesImpl::predictTrees( const Range& range, const Mat& sample, int flags
 }
 
 
+Ptr<DTreesImpl::CompiledForest> DTreesImpl::compileForest() const
+{
+    AutoLock lock(cforestMutex);
+    if( !cforest.empty() && cforest->treeOfs.size() == roots.size() &&
+        cforest->nnodes == (int)nodes.size() && cforest->nsplits == (int)splits.size() )
+        return cforest;
+
+    Ptr<CompiledForest> cf = makePtr<CompiledForest>();
+    int i, ntrees = (int)roots.size(), nallnodes = (int)nodes.size();
+    vector<int> queue, varmap(varType.size(), -1);
+
+    cf->treeOfs.resize(ntrees);
+    cf->var.reserve(nallnodes);
+    cf->thresh.reserve(nallnodes);
+    cf->subsetOfs.reserve(nallnodes);
+    cf->child.reserve(nallnodes);
+    cf->defaultDir.reserve(nallnodes);
+    cf->value.reserve(nallnodes);
+    cf->classIdx.reserve(nallnodes);
+
+    for( int t = 0; t < ntrees; t++ )
+    {
+        int ofs = (int)cf->var.size();
+        cf->treeOfs[t] = ofs;
+        queue.clear();
+        queue.push_back(roots[t]);
+
+        // the node queue[i] goes to ofs + i; the children of a split are queued together
+        for( i = 0; i < (int)queue.size(); i++ )
+        {
+            const Node& node = nodes[queue[i]];
+            int vk = -1, sofs = -1, child = -1;
+            float thresh = 0.f;
+
+            if( node.split >= 0 )
+            {
+                const Split& split = splits[node.split];
+                int vi = split.varIdx;
+                if( varmap[vi] < 0 )
+                {
+                    varmap[vi] = (int)cf->vars.size();
+                    cf->vars.push_back(vi);
+                }
+                vk = varmap[vi];
+                if( varType[vi] == VAR_ORDERED )
+                    thresh = split.c;
+                else
+                {
+                    sofs = split.subsetOfs;
+                    cf->catSplits = true;
+                }
+                child = ofs + (int)queue.size();
+                queue.push_back(node.left);
+                queue.push_back(node.right);
+            }
+
+            cf->var.push_back(vk);
+            cf->thresh.push_back(thresh);
+            cf->subsetOfs.push_back(sofs);
+            cf->child.push_back(child);
+            cf->defaultDir.push_back((schar)(node.defaultDir < 0 ? -1 : node.defaultDir > 0 ? 1 : 0));
+            cf->value.push_back(node.value);
+            cf->classIdx.push_back(node.classIdx);
+        }
+    }
+
+    cf->nnodes = nallnodes;
+    cf->nsplits = (int)splits.size();
+    cforest = cf;
+    return cf;
+}
+
+// the samples are evaluated in blocks of at most PREDICT_BLOCK_SIZE rows, whose split
+// variables take at most PREDICT_BLOCK_MEMORY bytes, by running every tree over the block
+static const int PREDICT_BLOCK_SIZE = 64;
+static const size_t PREDICT_BLOCK_MEMORY = 1 << 15;
+
+static int predictBlockSize( int nvars )
+{
+    size_t rowsize = std::max(nvars, 1)*sizeof(float);
+    return std::max(std::min(PREDICT_BLOCK_SIZE, (int)(PREDICT_BLOCK_MEMORY/rowsize)), 1);
+}
+
+bool DTreesImpl::gatherSplitVars( const CompiledForest& cf, const float* sample, size_t vstep,
+                                  int flags, float* x ) const
+{
+    int k, nv = (int)cf.vars.size();
+    bool missing = false;
+    const int* cvidx = (flags & (COMPRESSED_INPUT|PREPROCESSED_INPUT)) == 0 && !varIdx.empty() ? &compVarIdx[0] : 0;
+    const uchar* vtype = &varType[0];
+    const Vec2i* cofs = !catOfs.empty() ? &catOfs[0] : 0;
+    const int* cmap = !catMap.empty() ? &catMap[0] : 0;
+    const float* missingSubstPtr = !missingSubst.empty() ? &missingSubst[0] : 0;
+    const float MISSED_VAL = TrainData::missingValue();
+
+    for( k = 0; k < nv; k++ )
+    {
+        int vi = cf.vars[k];
+        float val = sample[(cvidx ? cvidx[vi] : vi)*vstep];
+        if( val == MISSED_VAL )
+        {
+            if( !missingSubstPtr )
+            {
+                x[k] = val;
+                missing = true;
+                continue;
+            }
+            val = missingSubstPtr[vi];
+        }
+
+        if( vtype[vi] == VAR_CATEGORICAL && (flags & PREPROCESSED_INPUT) == 0 )
+        {
+            int a = cofs[vi][0], b = cofs[vi][1], c = a;
+            int ival = cvRound(val);
+            if( ival != val )
+                CV_Error( CV_StsBadArg,
+                         "one of input categorical variable is not an integer" );
+
+            while( a < b )
+            {
+                c = (a + b) >> 1;
+                if( ival < cmap[c] )
+                    b = c;
+                else if( ival > cmap[c] )
+                    a = c+1;
+                else
+                    break;
+            }
+
+            CV_Assert( c >= 0 && ival == cmap[c] );
+            val = (float)(c - cofs[vi][0]);
+        }
+        x[k] = val;
+    }
+    return missing;
+}
+
+int DTreesImpl::findLeaf( const CompiledForest& cf, int treeidx, const float* x, int vk0, float val0 ) const
+{
+    const int* var = &cf.var[0];
+    const float* thresh = &cf.thresh[0];
+    const int* subsetOfs = &cf.subsetOfs[0];
+    const int* child = &cf.child[0];
+    const schar* defaultDir = &cf.defaultDir[0];
+    const int* subsetPtr = !subsets.empty() ? &subsets[0] : 0;
+    const float MISSED_VAL = TrainData::missingValue();
+    int nidx = cf.treeOfs[treeidx], vk;
+
+    while( (vk = var[nidx]) >= 0 )
+    {
+        float val = vk != vk0 ? x[vk] : val0;
+        int dir;
+        if( val == MISSED_VAL )
+            dir = defaultDir[nidx];
+        else if( subsetOfs[nidx] < 0 )
+            dir = val <= thresh[nidx] ? -1 : 1;
+        else
+        {
+            const int* subset = subsetPtr + subsetOfs[nidx];
+            unsigned u = cvRound(val);
+            dir = CV_DTREE_CAT_DIR(u, subset);
+        }
+        nidx = child[nidx] + (dir >= 0);
+    }
+    return nidx;
+}
+
+/*
+ findLeaf() without the override, with the branches the forest or the block of samples does
+ not need compiled out: the subset test when the forest has no categorical split (CATEGORICAL
+ false) and the missing value test when no split variable of the block is missing (MISSING
+ false). Runs the trees <range> over the <count> gathered samples of <vbuf>.
+*/
+template<bool CATEGORICAL, bool MISSING> static void
+predictCompiledBlock( const DTreesImpl::CompiledForest& cf, const int* subsetPtr, const Range& range,
+                      const float* vbuf, int count, int nclasses, double* sums, int* votes, int* lastClassIdx )
+{
+    const int* var = &cf.var[0];
+    const float* thresh = &cf.thresh[0];
+    const int* subsetOfs = &cf.subsetOfs[0];
+    const int* child = &cf.child[0];
+    const schar* defaultDir = &cf.defaultDir[0];
+    const double* value = &cf.value[0];
+    const int* classIdx = &cf.classIdx[0];
+    const float MISSED_VAL = TrainData::missingValue();
+    int nv = (int)cf.vars.size();
+
+    for( int j = range.start; j < range.end; j++ )
+    {
+        int root = cf.treeOfs[j];
+        for( int i = 0; i < count; i++ )
+        {
+            const float* x = vbuf + i*nv;
+            int nidx = root, vk;
+
+            while( (vk = var[nidx]) >= 0 )
+            {
+                float val = x[vk];
+                int dir;
+                if( MISSING && val == MISSED_VAL )
+                    dir = defaultDir[nidx];
+                else if( !CATEGORICAL || subsetOfs[nidx] < 0 )
+                    dir = val <= thresh[nidx] ? -1 : 1;
+                else
+                {
+                    const int* subset = subsetPtr + subsetOfs[nidx];
+                    unsigned u = cvRound(val);
+                    dir = CV_DTREE_CAT_DIR(u, subset);
+                }
+                nidx = child[nidx] + (dir >= 0);
+            }
+
+            if( votes )
+            {
+                votes[i*nclasses + classIdx[nidx]]++;
+                lastClassIdx[i] = classIdx[nidx];
+            }
+            else
+                sums[i] += value[nidx];
+        }
+    }
+}
+
+typedef void (*PredictCompiledBlockFunc)( const DTreesImpl::CompiledForest& cf, const int* subsetPtr,
+                                          const Range& range, const float* vbuf, int count,
+                                          int nclasses, double* sums, int* votes, int* lastClassIdx );
+
+void DTreesImpl::predictSamples( const Mat& samples, const Range& rows, const Range& range,
+                                 int flags, float* results ) const
+{
+    CV_Assert( samples.type() == CV_32F );
+
+    if( (flags & PREDICT_OFFLOAD) && predictSamplesOnDevice(samples, rows, range, flags, results) )
+        return;
+
+    Ptr<CompiledForest> cf = compileForest();
+    int predictType = flags & PREDICT_MASK;
+    int i, k, nclasses = (int)classLabels.size();
+    int ntrees = range.end - range.start, nv = (int)cf->vars.size();
+    int bsize = predictBlockSize(nv);
+    const int* subsetPtr = !subsets.empty() ? &subsets[0] : 0;
+    // indexed by 2*CATEGORICAL + MISSING
+    static const PredictCompiledBlockFunc predictBlockTab[] =
+    {
+        predictCompiledBlock<false, false>, predictCompiledBlock<false, true>,
+        predictCompiledBlock<true, false>, predictCompiledBlock<true, true>
+    };
+
+    if( predictType == PREDICT_AUTO )
+    {
+        predictType = !_isClassifier || (classLabels.size() == 2 && (flags & RAW_OUTPUT) != 0) ?
+            PREDICT_SUM : PREDICT_MAX_VOTE;
+    }
+    bool vote = predictType == PREDICT_MAX_VOTE;
+
+    AutoBuffer<float> _vbuf((size_t)bsize*nv + 1);
+    AutoBuffer<double> _sums(bsize);
+    AutoBuffer<int> _votes(vote ? (size_t)bsize*(nclasses + 1) : 1);
+    float* vbuf = _vbuf;
+    double* sums = _sums;
+    int* votes = _votes;
+    int* lastClassIdx = votes + bsize*nclasses;
+
+    for( int start = rows.start; start < rows.end; start += bsize )
+    {
+        int count = std::min(bsize, rows.end - start);
+
+        // gather the split variables of the block, with the missing values substituted and
+        // the categories replaced by their indices, as predictTrees() does on the way
+        bool missing = false;
+        for( i = 0; i < count; i++ )
+        {
+            missing |= gatherSplitVars( *cf, samples.ptr<float>(start + i), 1, flags, vbuf + i*nv );
+            sums[i] = 0.;
+        }
+
+        if( vote )
+            memset(votes, 0, count*nclasses*sizeof(votes[0]));
+
+        // every tree is run over the whole block while its nodes are in the cache
+        predictBlockTab[(cf->catSplits ? 2 : 0) + (missing ? 1 : 0)]( *cf, subsetPtr, range,
+            vbuf, count, nclasses, sums, vote ? votes : 0, lastClassIdx );
+
+        for( i = 0; i < count; i++ )
+        {
+            float val = (float)sums[i];
+            if( vote )
+            {
+                int best_idx = lastClassIdx[i];
+                if( ntrees > 1 )
+                {
+                    const int* v = votes + i*nclasses;
+                    best_idx = 0;
+                    for( k = 1; k < nclasses; k++ )
+                        if( v[best_idx] < v[k] )
+                            best_idx = k;
+                }
+                val = (flags & RAW_OUTPUT) ? (float)best_idx : (float)classLabels[best_idx];
+            }
+            results[start - rows.start + i] = val;
+        }
+    }
+}
+
+// the samples are sent to the offload device in batches of at most this many rows
+static const int OFFLOAD_BATCH_SIZE = 1 << 12;
+
+bool DTreesImpl::predictSamplesOnDevice( const Mat& samples, const Range& rows, const Range& range,
+                                         int flags, float* results ) const
+{
+    if( !haveForestDevice() )
+        return false;
+
+    Ptr<CompiledForest> cf = compileForest();
+    int predictType = flags & PREDICT_MASK;
+    int i, k, nclasses = (int)classLabels.size(), nv = (int)cf->vars.size();
+
+    if( predictType == PREDICT_AUTO )
+    {
+        predictType = !_isClassifier || (classLabels.size() == 2 && (flags & RAW_OUTPUT) != 0) ?
+            PREDICT_SUM : PREDICT_MAX_VOTE;
+    }
+    bool vote = predictType == PREDICT_MAX_VOTE;
+    int nout = vote ? nclasses : 1;
+    vector<float> xbuf, outbuf;
+
+    for( int start = rows.start; start < rows.end; start += OFFLOAD_BATCH_SIZE )
+    {
+        int count = std::min(OFFLOAD_BATCH_SIZE, rows.end - start);
+        xbuf.resize((size_t)count*nv + 1);
+        outbuf.resize((size_t)count*nout);
+        for( i = 0; i < count; i++ )
+            gatherSplitVars( *cf, samples.ptr<float>(start + i), 1, flags, &xbuf[(size_t)i*nv] );
+
+        if( !predictForestOnDevice( *cf, subsets, range, &xbuf[0], count, vote ? nclasses : 0, &outbuf[0] ) )
+            return false;
+
+        for( i = 0; i < count; i++ )
+        {
+            float val = outbuf[i];
+            if( vote )
+            {
+                const float* v = &outbuf[(size_t)i*nclasses];
+                int best_idx = 0;
+                for( k = 1; k < nclasses; k++ )
+                    if( v[best_idx] < v[k] )
+                        best_idx = k;
+                val = (flags & RAW_OUTPUT) ? (float)best_idx : (float)classLabels[best_idx];
+            }
+            results[start - rows.start + i] = val;
+        }
+    }
+    return true;
+}
+
+class PredictSamplesInvoker : public ParallelLoopBody
+{
+public:
+    PredictSamplesInvoker( const DTreesImpl* _tree, const Mat& _samples, int _flags,
+                           int _bsize, float* _results )
+        : tree(_tree), samples(&_samples), flags(_flags), bsize(_bsize), results(_results) {}
+
+    void operator()( const Range& range ) const
+    {
+        Range rows(range.start*bsize, std::min(range.end*bsize, samples->rows));
+        tree->predictSamples(*samples, rows, Range(0, (int)tree->roots.size()), flags, results + rows.start);
+    }
+
+    const DTreesImpl* tree;
+    const Mat* samples;
+    int flags;
+    int bsize;
+    float* results;
+};
+
+void DTreesImpl::predictBatch( const Mat& samples, int flags, float* results ) const
+{
+    int nsamples = samples.rows;
+    // the device takes the whole batch; predictSamples() falls back to the host itself
+    if( (flags & PREDICT_OFFLOAD) && haveForestDevice() )
+    {
+        predictSamples( samples, Range(0, nsamples), Range(0, (int)roots.size()), flags, results );
+        return;
+    }
+
+    int bsize = predictBlockSize((int)compileForest()->vars.size());
+    int nblocks = (nsamples + bsize - 1)/bsize;
+    PredictSamplesInvoker invoker(this, samples, flags, bsize, results);
+
+    if( nblocks > 1 )
+        parallel_for_(Range(0, nblocks), invoker);
+    else if( nblocks == 1 )
+        invoker(Range(0, 1));
+}
+
 float DTreesImpl::predict( InputArray _samples, OutputArray _results, int flags ) const
 {
     CV_Assert( !roots.empty() );
@@ -1542,9 +2577,13 @@ float DTreesImpl::predict( InputArray _samples, OutputArray _results, int flags
     else
         nsamples = std::min(nsamples, 1);
 
+    AutoBuffer<float> _vals(nsamples + 1);
+    float* vals = _vals;
+    predictBatch( samples.rowRange(0, nsamples), flags, vals );
+
     for( i = 0; i < nsamples; i++ )
     {
-        float val = predictTrees( Range(0, (int)roots.size()), samples.row(i), flags )*scale;
+        float val = vals[i]*scale;
         if( needresults )
         {
             if( rtype == CV_32F )